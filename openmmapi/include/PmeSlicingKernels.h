@@ -37,6 +37,7 @@
 #include "openmm/Platform.h"
 #include "openmm/System.h"
 #include <string>
+#include <vector>
 
 using namespace OpenMM;
 
@@ -60,16 +61,17 @@ public:
      */
     virtual void initialize(const System& system, const SlicedPmeForce& force) = 0;
     /**
-     * Execute the kernel to calculate the forces and/or energy.
+     * Execute the kernel to calculate the forces and/or energy.  Slice[I,J], with I <= J, is
+     * stored at index J*(J+1)/2+I of includeDirect and includeReciprocal.
      *
      * @param context        the context in which to execute this kernel
      * @param includeForces  true if forces should be calculated
      * @param includeEnergy  true if the energy should be calculated
-     * @param includeDirect  true if direct space interactions should be included
-     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param includeDirect  for each slice, whether its direct space interactions should be included
+     * @param includeReciprocal  for each slice, whether its reciprocal space interactions should be included
      * @return the potential energy due to the force
      */
-    virtual double execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) = 0;
+    virtual double execute(ContextImpl& context, bool includeForces, bool includeEnergy, const std::vector<bool>& includeDirect, const std::vector<bool>& includeReciprocal) = 0;
     /**
      * Copy changed parameters over to a context.
      *
@@ -86,6 +88,27 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     virtual void getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const = 0;
+    /**
+     * Get the name of the FFT backend used for reciprocal space calculations.
+     */
+    virtual std::string getFFTBackend() const = 0;
+    /**
+     * Set whether subsequent calls to execute() should record the energy of each slice.  This is
+     * only needed by getSliceEnergies(), so platforms that record them at no extra cost may ignore it.
+     *
+     * @param record   true if slice energies should be recorded
+     */
+    virtual void setRecordSliceEnergies(bool record) {
+    }
+    /**
+     * Get the unscaled energies of all slices computed in the most recent call to execute()
+     * in which the energy was requested and slice energies were being recorded.  They are not
+     * multiplied by the slice scaling parameters.
+     *
+     * @param energies   on exit, a symmetric numSubsets x numSubsets matrix whose element [I][J]
+     *                   is the energy of slice[I,J]
+     */
+    virtual void getSliceEnergies(std::vector<std::vector<double> >& energies) = 0;
 };
 
 /**
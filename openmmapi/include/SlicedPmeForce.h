@@ -42,6 +42,8 @@
 #include "internal/windowsExportPmeSlicing.h"
 
 #define DEFALT_USE_CUDA_FFT false
+#define DEFAULT_USE_NATIVE_OPENCL_FFT false
+#define DEFAULT_AUTOTUNE_FFT false
 
 using namespace OpenMM;
 
@@ -159,6 +161,13 @@ public:
     int getNumExceptionParameterOffsets() const {
         return exceptionOffsets.size();
     }
+    /**
+     * Get the number of global parameters with respect to which the derivative of the energy
+     * should be computed.
+     */
+    int getNumEnergyParameterDerivatives() const {
+        return energyParameterDerivatives.size();
+    }
     /**
      * Get the cutoff distance (in nm) being used for nonbonded interactions.
      *
@@ -215,6 +224,40 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     void setPMEParameters(double alpha, int nx, int ny, int nz);
+    /**
+     * Get the order of the B-splines used to interpolate charges and forces between particles and
+     * the PME grids.
+     */
+    int getPMEInterpolationOrder() const;
+    /**
+     * Set the order of the B-splines used to interpolate charges and forces between particles and
+     * the PME grids.  It must be between 4 and 8, and the default is 5.  A higher order makes
+     * charge spreading and force interpolation more expensive, but reaches the same accuracy with
+     * a coarser grid.  Since there is one grid per subset, this often reduces both the memory and
+     * the FFT cost.  When the grid dimensions are chosen from the Ewald error tolerance, they
+     * account for the order.
+     *
+     * @param order   the interpolation order
+     */
+    void setPMEInterpolationOrder(int order);
+    /**
+     * Get the maximum amount of device memory, in megabytes, that the CUDA and OpenCL platforms may
+     * use for the PME grids.  A value of 0 means there is no limit.
+     */
+    double getPMEGridMemoryLimit() const;
+    /**
+     * Set the maximum amount of device memory, in megabytes, that the CUDA and OpenCL platforms may
+     * use for the PME grids.  The default is 0, meaning there is no limit.  Normally there are two
+     * grids per subset, which can exhaust the device memory when there are many subsets.  If they
+     * would exceed the limit, the subsets are processed in chunks that fit in it, at the cost of
+     * interpolating every particle once per chunk.  At least one subset is always processed at a
+     * time.  On the OpenCL platform, processing in chunks requires a device that supports 64 bit
+     * atomics; on other devices an exception is thrown if the grids would exceed the limit.
+     * This choice has no effect on the Reference and CPU platforms.
+     *
+     * @param limit   the memory limit in megabytes
+     */
+    void setPMEGridMemoryLimit(double limit);
     /**
      * Get the parameters being used for PME in a particular Context.  Because some platforms have
      * restrictions on the allowed grid sizes, the values that are actually used may be slightly
@@ -228,6 +271,37 @@ public:
      * @param[out] nz      the number of grid points along the Z axis
      */
     void getPMEParametersInContext(const Context& context, double& alpha, int& nx, int& ny, int& nz) const;
+    /**
+     * Tune the cutoff distance and PME parameters for speed on the platform of a particular
+     * Context, keeping the accuracy given by the Ewald error tolerance.
+     *
+     * A longer cutoff makes the direct space calculation more expensive, but allows a smaller
+     * alpha and a coarser grid.  Since there is one grid per subset, the best balance between the
+     * direct and reciprocal space calculations depends on the number of subsets, and usually lies
+     * at a longer cutoff than the one that is optimal for a NonbondedForce.  This method creates
+     * a temporary Context containing only this force for each of several cutoff distances around
+     * the current one, each with alpha and the grid chosen from the error tolerance.  It times
+     * the direct and reciprocal space calculations separately, using force groups of the
+     * temporary Context, with the current positions, box vectors, and parameters of the Context.
+     * Each force calculation is timed separately, and the time of a calculation is the fastest
+     * of numEvaluations, so that occasional slow calculations do not decide the result.  The cost
+     * of a candidate is the sum of the direct and reciprocal space times, which ignores any
+     * overlap between them on platforms that compute reciprocal space concurrently.  Every
+     * candidate is timed before the fastest is chosen.  It then sets the cutoff distance and PME
+     * parameters of this force to those of the fastest candidate.  Finally, it reinitializes the
+     * Context, preserving its state, so that the new values take effect.
+     *
+     * Tuning happens only when this method is called.  The values are not revised later as the
+     * system changes, and since the Context is reinitialized, which discards any compiled kernels
+     * and cached data, this should be called once before a simulation rather than during it.
+     * Any values previously passed to setPMEParameters() are replaced.  Cutoff distances longer
+     * than half the smallest periodic box width are not considered.
+     *
+     * @param context          a Context whose System contains this force
+     * @param numEvaluations   the number of times the direct and reciprocal space calculations
+     *                         are each timed for every candidate
+     */
+    void tunePMEParameters(Context& context, int numEvaluations=10);
     /**
      * Add the charges and (optionally) the subset for a particle.  This should be called once
      * for each particle in the System.  When it is called for the i'th time, it specifies the
@@ -366,6 +440,25 @@ public:
      * @param defaultValue   the default value of the parameter
      */
     void setGlobalParameterDefaultValue(int index, double defaultValue);
+    /**
+     * Request that this Force compute the derivative of its energy with respect to a global parameter.
+     * The parameter must have already been added with addGlobalParameter().  It is meant to be used
+     * as the scaling parameter of one or more slices (see setSliceScalingParameter()).  Since the
+     * energy is linear in the scaling parameters, the derivative is the sum of the unscaled energies
+     * of the slices bound to the parameter, and it is obtained in the same evaluation as the forces.
+     * Parameters used in particle or exception parameter offsets are not supported.
+     *
+     * @param name             the name of the parameter
+     */
+    void addEnergyParameterDerivative(const std::string& name);
+    /**
+     * Get the name of a global parameter with respect to which this Force should compute the
+     * derivative of the energy.
+     *
+     * @param index     the index of the parameter derivative, between 0 and getNumEnergyParameterDerivatives()
+     * @return the parameter name
+     */
+    const std::string& getEnergyParameterDerivativeName(int index) const;
     /**
      * Add an offset to the charge of a particular particle, based on a global parameter.
      * 
@@ -446,14 +539,16 @@ public:
      * Get the force group that reciprocal space interactions for Ewald or PME are included in.  This allows multiple
      * time step integrators to evaluate direct and reciprocal space interactions at different intervals: getForceGroup()
      * specifies the group for direct space, and getReciprocalSpaceForceGroup() specifies the group for reciprocal space.
-     * If this is -1 (the default value), the same force group is used for reciprocal space as for direct space.
+     * If this is -1 (the default value), the reciprocal space part of each slice is included in the same force group
+     * as its direct space part (see getSliceForceGroup()).
      */
     int getReciprocalSpaceForceGroup() const;
     /**
      * Set the force group that reciprocal space interactions for Ewald or PME are included in.  This allows multiple
      * time step integrators to evaluate direct and reciprocal space interactions at different intervals: setForceGroup()
      * specifies the group for direct space, and setReciprocalSpaceForceGroup() specifies the group for reciprocal space.
-     * If this is -1 (the default value), the same force group is used for reciprocal space as for direct space.
+     * If this is -1 (the default value), the reciprocal space part of each slice is included in the same force group
+     * as its direct space part (see setSliceForceGroup()).
      *
      * @param group    the group index.  Legal values are between 0 and 31 (inclusive), or -1 to use the same force group
      *                 that is specified for direct space.
@@ -520,7 +615,11 @@ public:
     int getSliceForceGroup(int subset1, int subset2) const;
  	/**
      * Set the force group of a particular nonbonded slice, concerning the interactions between
-     * particles of a subset with those of another (or the same) subset.
+     * particles of a subset with those of another (or the same) subset.  This group applies to
+     * the direct space interactions, exceptions, and exclusions of the slice.  It also applies to
+     * its reciprocal space interactions, unless a group has been specified for those via
+     * setReciprocalSpaceForceGroup().  When none of the slices involving a subset is included in
+     * a calculation, the charges of that subset are not spread onto the PME grid.
      * 
      * @param subset1  the index of a particle subset.  Legal values are between 0 and numSubsets.
      * @param subset2  the index of a particle subset.  Legal values are between 0 and numSubsets.
@@ -528,6 +627,56 @@ public:
      *                 use the same force group that is specified via setForceGroup.
      */
     void setSliceForceGroup(int subset1, int subset2, int group);
+    /**
+     * Get the name of the global parameter that scales a particular nonbonded slice.  If this is
+     * an empty string (the default value), the slice is not scaled.
+     * 
+     * @param subset1  the index of a particle subset.  Legal values are between 0 and numSubsets.
+     * @param subset2  the index of a particle subset.  Legal values are between 0 and numSubsets.
+     */
+    const std::string& getSliceScalingParameter(int subset1, int subset2) const;
+    /**
+     * Set a global parameter to scale a particular nonbonded slice.  The direct space
+     * interactions, exceptions, exclusions, self energy, and reciprocal space interactions of
+     * the slice are all multiplied by the current value of this parameter.  Changing the value
+     * of the parameter in a Context (e.g. with Context::setParameter) does not require calling
+     * updateParametersInContext().
+     * 
+     * @param subset1    the index of a particle subset.  Legal values are between 0 and numSubsets.
+     * @param subset2    the index of a particle subset.  Legal values are between 0 and numSubsets.
+     * @param parameter  the name of a global parameter.  It must have already been added with
+     *                   addGlobalParameter().  Pass an empty string to remove the scaling.
+     */
+    void setSliceScalingParameter(int subset1, int subset2, const std::string& parameter);
+    /**
+     * Compute the potential energy of every slice in a particular Context.  All slices are
+     * obtained from a single evaluation of this force, in which the reciprocal space part of
+     * each slice is computed from the structure factors of the particle subsets involved.
+     *
+     * The result is a symmetric matrix with numSubsets rows and numSubsets columns.  Element
+     * [I][J] is the energy of slice[I,J], including its direct space, exception, exclusion,
+     * self, and reciprocal space contributions.  Summing the upper triangle of this matrix
+     * (diagonal included) gives the total energy of the force.
+     *
+     * @param context    the Context for which to compute the slice energies
+     * @return the energies of all slices, measured in kJ/mol
+     */
+    std::vector<std::vector<double> > getSliceEnergies(Context& context);
+    /**
+     * Compute the potential energy of this force for several states, each of which assigns
+     * values to some of the global parameters.  Parameters that a state does not assign keep
+     * their current values in the Context.
+     *
+     * Since the energy is linear in the slice scaling parameters, all states are obtained from
+     * a single evaluation of this force: the positions are processed and the structure factors
+     * are computed only once.  For this reason, a state cannot change the value of a parameter
+     * used in particle or exception parameter offsets.  The Context itself is not modified.
+     *
+     * @param context    the Context for which to compute the state energies
+     * @param states     the values of global parameters that define each state
+     * @return the energy of each state, measured in kJ/mol
+     */
+    std::vector<double> getStateEnergies(Context& context, const std::vector<std::map<std::string, double> >& states);
  	/**
      * Get whether CUDA Toolkit's cuFFT library is used to compute fast Fourier transform when
      * executing in the CUDA platform.
@@ -544,6 +693,89 @@ public:
     void setUseCuFFT(bool use) {
         useCudaFFT = use;
     };
+    /**
+     * Get whether the native FFT implementation, rather than VkFFT, is used to compute fast Fourier
+     * transforms when executing in the OpenCL platform.
+     */
+    bool getUseNativeOpenCLFFT() const {
+        return useNativeOpenCLFFT;
+    };
+    /**
+     * Set whether to use the native FFT implementation, rather than VkFFT, to compute fast Fourier
+     * transforms when executing in the OpenCL platform.  The default value is
+     * 'DEFAULT_USE_NATIVE_OPENCL_FFT'.  The native implementation avoids the run time code generation
+     * of VkFFT and may be faster on some devices, such as CPUs.  This choice has no effect when using
+     * platforms other than OpenCL.
+     */
+    void setUseNativeOpenCLFFT(bool use) {
+        useNativeOpenCLFFT = use;
+    };
+    /**
+     * Get whether the FFT backend is chosen automatically when a Context is created.
+     */
+    bool getAutotuneFFT() const {
+        return autotuneFFT;
+    };
+    /**
+     * Set whether to choose the FFT backend automatically when a Context is created.  If enabled,
+     * the CUDA and OpenCL platforms time every available backend on the actual PME grids and keep
+     * the fastest one, ignoring the choices made with setUseCuFFT() and setUseNativeOpenCLFFT().
+     * The default value is 'DEFAULT_AUTOTUNE_FFT'.  Call getFFTBackendInContext() to find out
+     * which backend was chosen.
+     */
+    void setAutotuneFFT(bool autotune) {
+        autotuneFFT = autotune;
+    };
+    /**
+     * Get the name of the FFT backend used for reciprocal space calculations in a particular
+     * Context.  It is "VkFFT", "cuFFT", or "native" on the CUDA and OpenCL platforms, "FFTPACK" on
+     * the Reference and CPU platforms, and "CPU" if a GPU platform delegates the reciprocal space
+     * calculations to the CPU PME plugin.
+     *
+     * @param context      the Context for which to get the FFT backend
+     */
+    std::string getFFTBackendInContext(const Context& context) const;
+    /**
+     * Get the directory in which the compiled VkFFT binaries are cached between runs.  An empty
+     * string means that they are not cached on disk.
+     */
+    const std::string& getVkFFTCacheDirectory() const {
+        return vkfftCacheDirectory;
+    };
+    /**
+     * Set the directory in which the compiled VkFFT binaries are cached between runs.  When a
+     * Context is created on the CUDA or OpenCL platform, VkFFT loads the binaries saved for the
+     * same device, precision, grid dimensions, and number of subsets instead of generating and
+     * compiling them again.  The directory must already exist.  An empty string (the default)
+     * disables the cache on disk.  Within a process, Contexts always share the binaries of
+     * identical VkFFT configurations, whether or not a directory is set.
+     *
+     * @param directory    the path of the cache directory
+     */
+    void setVkFFTCacheDirectory(const std::string& directory) {
+        vkfftCacheDirectory = directory;
+    };
+    /**
+     * Get the directory in which the compiled OpenCL programs are cached between runs.  An empty
+     * string means that they are not cached on disk.
+     */
+    const std::string& getOpenCLProgramCacheDirectory() const {
+        return openclProgramCacheDirectory;
+    };
+    /**
+     * Set the directory in which the compiled OpenCL programs are cached between runs.  When a
+     * Context is created on the OpenCL platform, the program binaries saved for the same device,
+     * precision, source code, and compilation definitions are loaded instead of invoking the
+     * OpenCL compiler.  This applies to the reciprocal space and parameter update programs of
+     * this force.  The directory must already exist.  An empty string (the default) disables
+     * the cache on disk.  Within a process, Contexts always share the binaries of identical
+     * programs, whether or not a directory is set.
+     *
+     * @param directory    the path of the cache directory
+     */
+    void setOpenCLProgramCacheDirectory(const std::string& directory) {
+        openclProgramCacheDirectory = directory;
+    };
 protected:
     ForceImpl* createImpl() const;
     bool usesPeriodicBoundaryConditions() const {return true;}
@@ -554,10 +786,11 @@ private:
     class ParticleOffsetInfo;
     class ExceptionOffsetInfo;
     int numSubsets;
-    double cutoffDistance, ewaldErrorTol, alpha, dalpha;
+    double cutoffDistance, ewaldErrorTol, alpha, dalpha, pmeGridMemoryLimit;
     bool exceptionsUsePeriodic, includeDirectSpace;
-    int recipForceGroup, nx, ny, nz, dnx, dny, dnz;
-    bool useCudaFFT;
+    int recipForceGroup, nx, ny, nz, dnx, dny, dnz, pmeOrder;
+    bool useCudaFFT, useNativeOpenCLFFT, autotuneFFT;
+    std::string vkfftCacheDirectory, openclProgramCacheDirectory;
     void addExclusionsToSet(const std::vector<std::set<int> >& bonded12, std::set<int>& exclusions, int baseParticle, int fromParticle, int currentLevel) const;
     int getGlobalParameterIndex(const std::string& parameter) const;
     std::vector<ParticleInfo> particles;
@@ -565,8 +798,10 @@ private:
     std::vector<GlobalParameterInfo> globalParameters;
     std::vector<ParticleOffsetInfo> particleOffsets;
     std::vector<ExceptionOffsetInfo> exceptionOffsets;
+    std::vector<int> energyParameterDerivatives;
     std::map<std::pair<int, int>, int> exceptionMap;
     std::vector<std::vector<int>> sliceForceGroup;
+    std::vector<std::vector<std::string>> sliceScalingParameter;
 };
 
 /**
@@ -36,6 +36,7 @@
 #include "openmm/internal/ForceImpl.h"
 #include "openmm/Kernel.h"
 #include "openmm/System.h"
+#include <map>
 #include <utility>
 #include <set>
 #include <string>
@@ -64,6 +65,9 @@ public:
     std::vector<std::string> getKernelNames();
     void updateParametersInContext(ContextImpl& context);
     void getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
+    std::string getFFTBackend() const;
+    std::vector<std::vector<double> > getSliceEnergies(ContextImpl& context);
+    std::vector<double> getStateEnergies(ContextImpl& context, const std::vector<std::map<std::string, double> >& states);
     /**
      * This is a utility routine that calculates the values to use for alpha and kmax when using
      * Ewald summation.
@@ -74,10 +78,22 @@ public:
      * Particle Mesh Ewald.
      */
     static void calcPMEParameters(const System& system, const SlicedPmeForce& force, double& alpha, int& xsize, int& ysize, int& zsize, bool lj);
+    /**
+     * This is a utility routine that returns the force group in which the direct space
+     * interactions of slice[subset1,subset2] are computed.
+     */
+    static int getDirectSpaceSliceGroup(const SlicedPmeForce& force, int subset1, int subset2);
+    /**
+     * This is a utility routine that returns the force group in which the reciprocal space
+     * interactions of slice[subset1,subset2] are computed.
+     */
+    static int getReciprocalSpaceSliceGroup(const SlicedPmeForce& force, int subset1, int subset2);
 private:
     class ErrorFunction;
     class EwaldErrorFunction;
     static int findZero(const ErrorFunction& f, int initialGuess);
+    std::vector<std::vector<double> > computeUnscaledSliceEnergies(ContextImpl& context);
+    std::set<std::string> getOffsetParameters() const;
     const SlicedPmeForce& owner;
     Kernel kernel;
 };
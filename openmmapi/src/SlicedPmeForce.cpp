@@ -34,6 +34,11 @@
 #include "openmm/Force.h"
 #include "openmm/OpenMMException.h"
 #include "openmm/internal/AssertionUtilities.h"
+#include "openmm/State.h"
+#include "openmm/System.h"
+#include "openmm/VerletIntegrator.h"
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <map>
 #include <sstream>
@@ -52,17 +57,29 @@ using std::vector;
 
 SlicedPmeForce::SlicedPmeForce(int numSubsets) : numSubsets(numSubsets),
         cutoffDistance(1.0),
-        ewaldErrorTol(5e-4), alpha(0.0), dalpha(0.0), exceptionsUsePeriodic(false), recipForceGroup(-1),
-        includeDirectSpace(true), nx(0), ny(0), nz(0), dnx(0), dny(0), dnz(0), useCudaFFT(DEFALT_USE_CUDA_FFT) {
+        ewaldErrorTol(5e-4), alpha(0.0), dalpha(0.0), pmeGridMemoryLimit(0.0), exceptionsUsePeriodic(false), recipForceGroup(-1),
+        includeDirectSpace(true), nx(0), ny(0), nz(0), dnx(0), dny(0), dnz(0), pmeOrder(5), useCudaFFT(DEFALT_USE_CUDA_FFT),
+        useNativeOpenCLFFT(DEFAULT_USE_NATIVE_OPENCL_FFT), autotuneFFT(DEFAULT_AUTOTUNE_FFT) {
     vector<int> row(numSubsets, -1);
-    for (int i = 0; i < numSubsets; i++)
+    vector<string> parameterRow(numSubsets, "");
+    for (int i = 0; i < numSubsets; i++) {
         sliceForceGroup.push_back(row);
+        sliceScalingParameter.push_back(parameterRow);
+    }
 }
 
-SlicedPmeForce::SlicedPmeForce(const NonbondedForce& force, int numSubsets) : numSubsets(numSubsets), useCudaFFT(DEFALT_USE_CUDA_FFT) {
+SlicedPmeForce::SlicedPmeForce(const NonbondedForce& force, int numSubsets) : numSubsets(numSubsets),
+        dalpha(0.0), pmeGridMemoryLimit(0.0), dnx(0), dny(0), dnz(0), pmeOrder(5), useCudaFFT(DEFALT_USE_CUDA_FFT),
+        useNativeOpenCLFFT(DEFAULT_USE_NATIVE_OPENCL_FFT), autotuneFFT(DEFAULT_AUTOTUNE_FFT) {
     NonbondedForce::NonbondedMethod method = force.getNonbondedMethod();
     if (method == NonbondedForce::NoCutoff || method == NonbondedForce::CutoffNonPeriodic)
         throw OpenMMException("SlicedPmeForce: cannot instantiate from a non-periodic NonbondedForce");
+    vector<int> row(numSubsets, -1);
+    vector<string> parameterRow(numSubsets, "");
+    for (int i = 0; i < numSubsets; i++) {
+        sliceForceGroup.push_back(row);
+        sliceScalingParameter.push_back(parameterRow);
+    }
     cutoffDistance = force.getCutoffDistance();
     ewaldErrorTol = force.getEwaldErrorTolerance();
     force.getPMEParameters(alpha, nx, ny, nz);
@@ -134,10 +151,114 @@ void SlicedPmeForce::setPMEParameters(double alpha, int nx, int ny, int nz) {
     this->nz = nz;
 }
 
+int SlicedPmeForce::getPMEInterpolationOrder() const {
+    return pmeOrder;
+}
+
+void SlicedPmeForce::setPMEInterpolationOrder(int order) {
+    if (order < 4 || order > 8)
+        throw OpenMMException("SlicedPmeForce: the PME interpolation order must be between 4 and 8");
+    pmeOrder = order;
+}
+
+double SlicedPmeForce::getPMEGridMemoryLimit() const {
+    return pmeGridMemoryLimit;
+}
+
+void SlicedPmeForce::setPMEGridMemoryLimit(double limit) {
+    if (limit < 0)
+        throw OpenMMException("SlicedPmeForce: the PME grid memory limit cannot be negative");
+    pmeGridMemoryLimit = limit;
+}
+
 void SlicedPmeForce::getPMEParametersInContext(const Context& context, double& alpha, int& nx, int& ny, int& nz) const {
     dynamic_cast<const SlicedPmeForceImpl&>(getImplInContext(context)).getPMEParameters(alpha, nx, ny, nz);
 }
 
+void SlicedPmeForce::tunePMEParameters(Context& context, int numEvaluations) {
+    const System& system = context.getSystem();
+    bool found = false;
+    for (int i = 0; i < system.getNumForces(); i++)
+        if (&system.getForce(i) == this)
+            found = true;
+    if (!found)
+        throw OpenMMException("tunePMEParameters: the force does not belong to the System of the Context");
+    if (numEvaluations < 1)
+        throw OpenMMException("tunePMEParameters: the number of evaluations must be positive");
+
+    // Build a System that contains only a copy of this force, so that nothing else is timed.
+
+    State state = context.getState(State::Positions | State::Parameters);
+    Vec3 a, b, c;
+    state.getPeriodicBoxVectors(a, b, c);
+    double maxCutoff = 0.5*std::min(std::min(a[0], b[1]), c[2]);
+    System trialSystem;
+    trialSystem.setDefaultPeriodicBoxVectors(a, b, c);
+    for (int i = 0; i < system.getNumParticles(); i++)
+        trialSystem.addParticle(system.getParticleMass(i));
+    SlicedPmeForce* trialForce = new SlicedPmeForce(*this);
+    trialSystem.addForce(trialForce);
+
+    // Put direct space in group 0 and reciprocal space in group 1, so they can be timed separately.
+
+    trialForce->setForceGroup(0);
+    trialForce->setReciprocalSpaceForceGroup(1);
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++)
+            trialForce->setSliceForceGroup(i, j, -1);
+    Platform& platform = context.getPlatform();
+    map<string, string> properties;
+    for (const string& name : platform.getPropertyNames())
+        properties[name] = platform.getPropertyValue(context, name);
+
+    // Time each candidate cutoff, with alpha and the grid chosen from the error tolerance.  Every
+    // evaluation is timed separately and the fastest one is used, since a single slow evaluation
+    // says more about the machine than about the candidate.  Even so, the timings are noisy enough
+    // that the cost need not look monotonic in the cutoff, so every candidate is timed.
+
+    auto timeGroups = [&] (Context& trialContext, int groups) {
+        double minTime = 0.0;
+        for (int i = 0; i < numEvaluations; i++) {
+            auto start = std::chrono::steady_clock::now();
+            trialContext.getState(State::Forces, false, groups);
+            double time = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+            if (i == 0 || time < minTime)
+                minTime = time;
+        }
+        return minTime;
+    };
+    const double cutoffScales[] = {0.8, 0.9, 1.0, 1.1, 1.2, 1.35, 1.5};
+    double bestTime = 0.0, bestCutoff = cutoffDistance, bestAlpha = alpha;
+    int bestNx = nx, bestNy = ny, bestNz = nz;
+    for (double scale : cutoffScales) {
+        double cutoff = scale*cutoffDistance;
+        if (cutoff > maxCutoff)
+            continue;
+        trialForce->setCutoffDistance(cutoff);
+        trialForce->setPMEParameters(0.0, 0, 0, 0);
+        VerletIntegrator integrator(0.001);
+        Context trialContext(trialSystem, integrator, platform, properties);
+        trialContext.setPeriodicBoxVectors(a, b, c);
+        trialContext.setPositions(state.getPositions());
+        for (auto& parameter : globalParameters)
+            trialContext.setParameter(parameter.name, state.getParameters().at(parameter.name));
+        trialContext.getState(State::Forces);
+        double time = timeGroups(trialContext, 1<<0)+timeGroups(trialContext, 1<<1);
+        if (bestTime == 0.0 || time < bestTime) {
+            bestTime = time;
+            bestCutoff = cutoff;
+            trialForce->getPMEParametersInContext(trialContext, bestAlpha, bestNx, bestNy, bestNz);
+        }
+    }
+    setCutoffDistance(bestCutoff);
+    setPMEParameters(bestAlpha, bestNx, bestNy, bestNz);
+    context.reinitialize(true);
+}
+
+std::string SlicedPmeForce::getFFTBackendInContext(const Context& context) const {
+    return dynamic_cast<const SlicedPmeForceImpl&>(getImplInContext(context)).getFFTBackend();
+}
+
 int SlicedPmeForce::addParticle(double charge, int subset) {
     ASSERT_VALID_SUBSET(subset);
     particles.push_back(ParticleInfo(charge, subset));
@@ -284,6 +405,19 @@ void SlicedPmeForce::setGlobalParameterDefaultValue(int index, double defaultVal
     globalParameters[index].defaultValue = defaultValue;
 }
 
+void SlicedPmeForce::addEnergyParameterDerivative(const string& name) {
+    int index = getGlobalParameterIndex(name);
+    for (int i : energyParameterDerivatives)
+        if (i == index)
+            return;
+    energyParameterDerivatives.push_back(index);
+}
+
+const string& SlicedPmeForce::getEnergyParameterDerivativeName(int index) const {
+    ASSERT_VALID_INDEX(index, energyParameterDerivatives);
+    return globalParameters[energyParameterDerivatives[index]].name;
+}
+
 int SlicedPmeForce::getGlobalParameterIndex(const std::string& parameter) const {
     for (int i = 0; i < globalParameters.size(); i++)
         if (globalParameters[i].name == parameter)
@@ -374,3 +508,25 @@ void SlicedPmeForce::setSliceForceGroup(int subset1, int subset2, int group) {
     int j = std::max(subset1, subset2);
     sliceForceGroup[i][j] = sliceForceGroup[j][i] = group;
 }
+
+const string& SlicedPmeForce::getSliceScalingParameter(int subset1, int subset2) const {
+    ASSERT_VALID_SUBSET(subset1);
+    ASSERT_VALID_SUBSET(subset2);
+    return sliceScalingParameter[subset1][subset2];
+}
+
+void SlicedPmeForce::setSliceScalingParameter(int subset1, int subset2, const string& parameter) {
+    ASSERT_VALID_SUBSET(subset1);
+    ASSERT_VALID_SUBSET(subset2);
+    if (parameter != "")
+        getGlobalParameterIndex(parameter);
+    sliceScalingParameter[subset1][subset2] = sliceScalingParameter[subset2][subset1] = parameter;
+}
+
+vector<vector<double> > SlicedPmeForce::getSliceEnergies(Context& context) {
+    return dynamic_cast<SlicedPmeForceImpl&>(getImplInContext(context)).getSliceEnergies(getContextImpl(context));
+}
+
+vector<double> SlicedPmeForce::getStateEnergies(Context& context, const vector<map<string, double> >& states) {
+    return dynamic_cast<SlicedPmeForceImpl&>(getImplInContext(context)).getStateEnergies(getContextImpl(context), states);
+}
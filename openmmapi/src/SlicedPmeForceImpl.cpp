@@ -108,6 +108,27 @@ void SlicedPmeForceImpl::initialize(ContextImpl& context) {
             throw OpenMMException(msg.str());
         }
     }
+    set<string> globalParameterNames;
+    for (int i = 0; i < owner.getNumGlobalParameters(); i++)
+        globalParameterNames.insert(owner.getGlobalParameterName(i));
+    for (int i = 0; i < owner.getNumSubsets(); i++)
+        for (int j = i; j < owner.getNumSubsets(); j++) {
+            const string& parameter = owner.getSliceScalingParameter(i, j);
+            if (parameter != "" && globalParameterNames.count(parameter) == 0) {
+                stringstream msg;
+                msg << "SlicedPmeForce: Unknown global parameter used to scale a slice: ";
+                msg << parameter;
+                throw OpenMMException(msg.str());
+            }
+        }
+    set<string> offsetParameters = getOffsetParameters();
+    for (int i = 0; i < owner.getNumEnergyParameterDerivatives(); i++)
+        if (offsetParameters.count(owner.getEnergyParameterDerivativeName(i)) > 0) {
+            stringstream msg;
+            msg << "SlicedPmeForce: Energy derivatives are not supported for parameters used in parameter offsets: ";
+            msg << owner.getEnergyParameterDerivativeName(i);
+            throw OpenMMException(msg.str());
+        }
     Vec3 boxVectors[3];
     system.getDefaultPeriodicBoxVectors(boxVectors[0], boxVectors[1], boxVectors[2]);
     double cutoff = owner.getCutoffDistance();
@@ -117,11 +138,15 @@ void SlicedPmeForceImpl::initialize(ContextImpl& context) {
 }
 
 double SlicedPmeForceImpl::calcForcesAndEnergy(ContextImpl& context, bool includeForces, bool includeEnergy, int groups) {
-    bool includeDirect = (owner.getIncludeDirectSpace() && (groups&(1<<owner.getForceGroup())) != 0);
-    int reciprocalGroup = owner.getReciprocalSpaceForceGroup();
-    if (reciprocalGroup < 0)
-        reciprocalGroup = owner.getForceGroup();
-    bool includeReciprocal = ((groups&(1<<reciprocalGroup)) != 0);
+    int numSubsets = owner.getNumSubsets();
+    int numSlices = numSubsets*(numSubsets+1)/2;
+    vector<bool> includeDirect(numSlices), includeReciprocal(numSlices);
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++) {
+            int slice = j*(j+1)/2+i;
+            includeDirect[slice] = (owner.getIncludeDirectSpace() && (groups&(1<<getDirectSpaceSliceGroup(owner, i, j))) != 0);
+            includeReciprocal[slice] = ((groups&(1<<getReciprocalSpaceSliceGroup(owner, i, j))) != 0);
+        }
     return kernel.getAs<CalcSlicedPmeForceKernel>().execute(context, includeForces, includeEnergy, includeDirect, includeReciprocal);
 }
 
@@ -178,22 +203,38 @@ void SlicedPmeForceImpl::calcPMEParameters(const System& system, const SlicedPme
         system.getDefaultPeriodicBoxVectors(boxVectors[0], boxVectors[1], boxVectors[2]);
         double tol = force.getEwaldErrorTolerance();
         alpha = (1.0/force.getCutoffDistance())*std::sqrt(-log(2.0*tol));
+
+        // The interpolation error decays as the grid spacing to the power of the order.
+
+        int order = force.getPMEInterpolationOrder();
+        double tolFactor = pow(tol, 1.0/order);
         if (lj) {
-            xsize = (int) ceil(alpha*boxVectors[0][0]/(3*pow(tol, 0.2)));
-            ysize = (int) ceil(alpha*boxVectors[1][1]/(3*pow(tol, 0.2)));
-            zsize = (int) ceil(alpha*boxVectors[2][2]/(3*pow(tol, 0.2)));
+            xsize = (int) ceil(alpha*boxVectors[0][0]/(3*tolFactor));
+            ysize = (int) ceil(alpha*boxVectors[1][1]/(3*tolFactor));
+            zsize = (int) ceil(alpha*boxVectors[2][2]/(3*tolFactor));
         }
         else {
-            xsize = (int) ceil(2*alpha*boxVectors[0][0]/(3*pow(tol, 0.2)));
-            ysize = (int) ceil(2*alpha*boxVectors[1][1]/(3*pow(tol, 0.2)));
-            zsize = (int) ceil(2*alpha*boxVectors[2][2]/(3*pow(tol, 0.2)));
+            xsize = (int) ceil(2*alpha*boxVectors[0][0]/(3*tolFactor));
+            ysize = (int) ceil(2*alpha*boxVectors[1][1]/(3*tolFactor));
+            zsize = (int) ceil(2*alpha*boxVectors[2][2]/(3*tolFactor));
         }
-        xsize = max(xsize, 6);
-        ysize = max(ysize, 6);
-        zsize = max(zsize, 6);
+        int minSize = max(6, order+1);
+        xsize = max(xsize, minSize);
+        ysize = max(ysize, minSize);
+        zsize = max(zsize, minSize);
     }
 }
 
+int SlicedPmeForceImpl::getDirectSpaceSliceGroup(const SlicedPmeForce& force, int subset1, int subset2) {
+    int group = force.getSliceForceGroup(subset1, subset2);
+    return (group < 0 ? force.getForceGroup() : group);
+}
+
+int SlicedPmeForceImpl::getReciprocalSpaceSliceGroup(const SlicedPmeForce& force, int subset1, int subset2) {
+    int group = force.getReciprocalSpaceForceGroup();
+    return (group < 0 ? getDirectSpaceSliceGroup(force, subset1, subset2) : group);
+}
+
 int SlicedPmeForceImpl::findZero(const SlicedPmeForceImpl::ErrorFunction& f, int initialGuess) {
     int arg = initialGuess;
     double value = f.getValue(arg);
@@ -215,3 +256,97 @@ void SlicedPmeForceImpl::updateParametersInContext(ContextImpl& context) {
 void SlicedPmeForceImpl::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     kernel.getAs<CalcSlicedPmeForceKernel>().getPMEParameters(alpha, nx, ny, nz);
 }
+
+string SlicedPmeForceImpl::getFFTBackend() const {
+    return kernel.getAs<CalcSlicedPmeForceKernel>().getFFTBackend();
+}
+
+vector<vector<double> > SlicedPmeForceImpl::getSliceEnergies(ContextImpl& context) {
+    vector<vector<double> > energies = computeUnscaledSliceEnergies(context);
+    int numSubsets = owner.getNumSubsets();
+    for (int i = 0; i < numSubsets; i++)
+        for (int j = 0; j < numSubsets; j++) {
+            const string& parameter = owner.getSliceScalingParameter(i, j);
+            if (parameter != "")
+                energies[i][j] *= context.getParameter(parameter);
+        }
+    return energies;
+}
+
+vector<double> SlicedPmeForceImpl::getStateEnergies(ContextImpl& context, const vector<map<string, double> >& states) {
+    set<string> globalParameterNames;
+    for (int i = 0; i < owner.getNumGlobalParameters(); i++)
+        globalParameterNames.insert(owner.getGlobalParameterName(i));
+    set<string> offsetParameters = getOffsetParameters();
+    for (auto& state : states)
+        for (auto& value : state) {
+            if (globalParameterNames.count(value.first) == 0)
+                throw OpenMMException("getStateEnergies: Unknown global parameter: "+value.first);
+            if (offsetParameters.count(value.first) > 0 && value.second != context.getParameter(value.first))
+                throw OpenMMException("getStateEnergies: Parameter "+value.first+" is used in parameter offsets and cannot vary between states");
+        }
+
+    // The energy is linear in the slice scaling parameters, so every state is a weighted sum of
+    // the unscaled slice energies obtained from a single evaluation.
+
+    vector<vector<double> > energies = computeUnscaledSliceEnergies(context);
+    vector<double> stateEnergies;
+    for (auto& state : states) {
+        double energy = 0.0;
+        for (int i = 0; i < owner.getNumSubsets(); i++)
+            for (int j = i; j < owner.getNumSubsets(); j++) {
+                const string& parameter = owner.getSliceScalingParameter(i, j);
+                double lambda = 1.0;
+                if (parameter != "") {
+                    auto value = state.find(parameter);
+                    lambda = (value == state.end() ? context.getParameter(parameter) : value->second);
+                }
+                energy += lambda*energies[i][j];
+            }
+        stateEnergies.push_back(energy);
+    }
+    return stateEnergies;
+}
+
+vector<vector<double> > SlicedPmeForceImpl::computeUnscaledSliceEnergies(ContextImpl& context) {
+    // Evaluate the energy of every group this force contributes to, so that the kernel
+    // records all the slices in a single pass.  Slice energies are only recorded during
+    // this evaluation, so ordinary energy evaluations do not pay for them.
+
+    int groups = 0;
+    for (int i = 0; i < owner.getNumSubsets(); i++)
+        for (int j = i; j < owner.getNumSubsets(); j++)
+            groups |= (1<<getDirectSpaceSliceGroup(owner, i, j)) | (1<<getReciprocalSpaceSliceGroup(owner, i, j));
+    CalcSlicedPmeForceKernel& sliceKernel = kernel.getAs<CalcSlicedPmeForceKernel>();
+    sliceKernel.setRecordSliceEnergies(true);
+    try {
+        context.calcForcesAndEnergy(false, true, groups);
+    }
+    catch (...) {
+        sliceKernel.setRecordSliceEnergies(false);
+        throw;
+    }
+    sliceKernel.setRecordSliceEnergies(false);
+    vector<vector<double> > energies;
+    sliceKernel.getSliceEnergies(energies);
+    return energies;
+}
+
+set<string> SlicedPmeForceImpl::getOffsetParameters() const {
+    set<string> offsetParameters;
+    for (int i = 0; i < owner.getNumParticleParameterOffsets(); i++) {
+        string parameter;
+        int particleIndex;
+        double chargeScale;
+        owner.getParticleParameterOffset(i, parameter, particleIndex, chargeScale);
+        offsetParameters.insert(parameter);
+    }
+    for (int i = 0; i < owner.getNumExceptionParameterOffsets(); i++) {
+        string parameter;
+        int exceptionIndex;
+        double chargeScale;
+        owner.getExceptionParameterOffset(i, parameter, exceptionIndex, chargeScale);
+        offsetParameters.insert(parameter);
+    }
+    return offsetParameters;
+}
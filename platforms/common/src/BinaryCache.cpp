@@ -0,0 +1,124 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2014-2021 Stanford University and the Authors.      *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "BinaryCache.h"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+using namespace PmeSlicing;
+using namespace std;
+
+string BinaryCache::getFileName(const string& directory, const string& prefix, const string& key) {
+    stringstream name;
+    name<<directory;
+    if (!directory.empty() && directory.back() != '/' && directory.back() != '\\')
+        name<<'/';
+    name<<prefix<<"-"<<hex<<hash<string>()(key)<<".bin";
+    return name.str();
+}
+
+// The in memory cache only holds weak references, so entries disappear once no object uses them.
+
+static mutex sharedEntriesLock;
+static map<string, weak_ptr<const vector<char> > > sharedEntries;
+
+shared_ptr<const vector<char> > BinaryCache::findShared(const string& prefix, const string& key) {
+    lock_guard<mutex> guard(sharedEntriesLock);
+    auto entry = sharedEntries.find(prefix+";"+key);
+    if (entry == sharedEntries.end())
+        return shared_ptr<const vector<char> >();
+    return entry->second.lock();
+}
+
+shared_ptr<const vector<char> > BinaryCache::share(const string& prefix, const string& key, vector<char>& data) {
+    shared_ptr<const vector<char> > binaries = make_shared<const vector<char> >(move(data));
+    lock_guard<mutex> guard(sharedEntriesLock);
+    for (auto entry = sharedEntries.begin(); entry != sharedEntries.end(); )
+        if (entry->second.expired())
+            entry = sharedEntries.erase(entry);
+        else
+            ++entry;
+    sharedEntries[prefix+";"+key] = binaries;
+    return binaries;
+}
+
+shared_ptr<const vector<char> > BinaryCache::load(const string& directory, const string& prefix, const string& key) {
+    shared_ptr<const vector<char> > binaries = findShared(prefix, key);
+    if (binaries || directory.empty())
+        return binaries;
+    ifstream file(getFileName(directory, prefix, key), ios::binary);
+    if (!file.is_open())
+        return binaries;
+    string storedKey;
+    getline(file, storedKey);
+    if (!file.good() || storedKey != key)
+        return binaries;
+    vector<char> data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    if (data.empty())
+        return binaries;
+    return share(prefix, key, data);
+}
+
+shared_ptr<const vector<char> > BinaryCache::save(const string& directory, const string& prefix, const string& key, const void* data, size_t size) {
+    vector<char> copy((const char*) data, (const char*) data+size);
+    shared_ptr<const vector<char> > binaries = share(prefix, key, copy);
+    if (!directory.empty())
+        writeFile(directory, prefix, key, data, size);
+    return binaries;
+}
+
+void BinaryCache::writeFile(const string& directory, const string& prefix, const string& key, const void* data, size_t size) {
+    // Write to a temporary file and then rename it, so that other processes never see a partially
+    // written entry.
+
+    string fileName = getFileName(directory, prefix, key);
+    string tempFileName = fileName+"."+to_string(chrono::steady_clock::now().time_since_epoch().count());
+    {
+        ofstream file(tempFileName, ios::binary);
+        if (!file.is_open())
+            return;
+        file<<key<<'\n';
+        file.write((const char*) data, size);
+        if (!file.good()) {
+            file.close();
+            remove(tempFileName.c_str());
+            return;
+        }
+    }
+    if (rename(tempFileName.c_str(), fileName.c_str()) != 0)
+        remove(tempFileName.c_str());
+}
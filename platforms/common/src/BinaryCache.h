@@ -0,0 +1,98 @@
+#ifndef BINARY_CACHE_H_
+#define BINARY_CACHE_H_
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2014-2021 Stanford University and the Authors.      *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace PmeSlicing {
+
+/**
+ * This class stores compiled binaries, so that contexts created later with the same device and
+ * configuration can skip the run time code generation and compilation.  It is used for VkFFT
+ * applications and for OpenCL programs.
+ *
+ * The cache has two levels.  Within a process, binaries are shared in memory between all objects
+ * that use the same key, which benefits programs that create many Contexts for the same System.
+ * Only the binaries themselves are shared: the modules, programs, and plans created from them
+ * belong to a single device context, so every Context still creates its own.  Callers always
+ * use the in memory level, and the directory only controls the level on disk.
+ * Each object holds a reference to the binaries it uses, and an entry is released when the last
+ * reference to it is destroyed.  Optionally, binaries are also stored on disk so that later runs
+ * can reuse them.  Each entry on disk is a file whose name is derived from a hash of the key, and
+ * which begins with the full key so that hash collisions are detected.  Keys must not contain
+ * line breaks.
+ *
+ * The cache is only an optimization: errors while reading or writing files are ignored.  All
+ * methods are thread safe.
+ */
+
+class BinaryCache {
+public:
+    /**
+     * Load binaries from the cache.  Binaries shared by another object in this process are
+     * returned if there are any.  Otherwise they are read from disk and shared from then on.
+     *
+     * @param directory   the directory containing the cache on disk, or an empty string to only
+     *                    look for binaries shared within this process
+     * @param prefix      the prefix of the file names of this kind of entry
+     * @param key         a string that identifies the device and the configuration
+     * @return a reference to the binaries saved for the key, or NULL if there are none.  The
+     * caller should keep it for as long as it uses objects created from the binaries.
+     */
+    static std::shared_ptr<const std::vector<char> > load(const std::string& directory, const std::string& prefix, const std::string& key);
+    /**
+     * Save binaries to the cache, sharing them with other objects in this process and writing
+     * them to disk if a directory is specified.  The directory must already exist.
+     *
+     * @param directory   the directory containing the cache on disk, or an empty string to only
+     *                    share the binaries within this process
+     * @param prefix      the prefix of the file names of this kind of entry
+     * @param key         a string that identifies the device and the configuration
+     * @param data        the binaries to save
+     * @param size        the size of the binaries in bytes
+     * @return a reference to the shared binaries, which the caller should keep for as long as it
+     * uses objects created from them
+     */
+    static std::shared_ptr<const std::vector<char> > save(const std::string& directory, const std::string& prefix, const std::string& key, const void* data, size_t size);
+private:
+    static std::shared_ptr<const std::vector<char> > findShared(const std::string& prefix, const std::string& key);
+    static std::shared_ptr<const std::vector<char> > share(const std::string& prefix, const std::string& key, std::vector<char>& data);
+    static void writeFile(const std::string& directory, const std::string& prefix, const std::string& key, const void* data, size_t size);
+    static std::string getFileName(const std::string& directory, const std::string& prefix, const std::string& key);
+};
+
+} // namespace PmeSlicing
+
+#endif /*BINARY_CACHE_H_*/
@@ -0,0 +1,179 @@
+#ifndef FFT_DIMENSIONS_H_
+#define FFT_DIMENSIONS_H_
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2014-2021 Stanford University and the Authors.      *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include <algorithm>
+#include <vector>
+
+namespace PmeSlicing {
+
+/**
+ * This class chooses the dimensions of PME grids for the FFT implementations of the CUDA and
+ * OpenCL platforms, which share the same model of the cost of the reciprocal space calculation.
+ */
+
+class FFTDimensions {
+public:
+    /**
+     * Get the smallest legal size for a dimension of the grid (that is, a size with no prime
+     * factors other than 2, 3, 5, ..., maxPrimeFactor).
+     *
+     * @param minimum   the minimum size the return value must be greater than or equal to
+     * @param maxPrimeFactor  the maximum supported prime number factor (default=7)
+     */
+    static int findLegalDimension(int minimum, int maxPrimeFactor=7) {  // VkFFT allows maxPrimeFactor up to 13
+        if (minimum < 1)
+            return 1;
+        while (true) {
+            // Attempt to factor the current value.
+
+            int unfactored = minimum;
+            for (int factor = 2; factor <= maxPrimeFactor; factor++) {
+                while (unfactored > 1 && unfactored%factor == 0)
+                    unfactored /= factor;
+            }
+            if (unfactored == 1)
+                return minimum;
+            minimum++;
+        }
+    }
+    /**
+     * Get the number of subset grids that are processed at once under a memory limit.  At least
+     * one subset is always processed at a time.
+     *
+     * @param xsize          the first dimension of the grid
+     * @param ysize          the second dimension of the grid
+     * @param zsize          the third dimension of the grid
+     * @param numSubsets     the number of subsets, each of which has its own grid
+     * @param pmeOrder       the interpolation order, to which the third dimension is padded
+     * @param bytesPerPoint  the device memory used by each grid point of a subset
+     * @param memoryLimit    the maximum memory in bytes for the grids, or 0 for no limit
+     */
+    static int findSubsetChunkSize(int xsize, int ysize, int zsize, int numSubsets, int pmeOrder, double bytesPerPoint, double memoryLimit) {
+        if (memoryLimit <= 0)
+            return numSubsets;
+        int roundedZSize = pmeOrder*((zsize+pmeOrder-1)/pmeOrder);
+        double subsetGridMemory = bytesPerPoint*xsize*ysize*roundedZSize;
+        return std::max(1, std::min(numSubsets, (int) (memoryLimit/subsetGridMemory)));
+    }
+    /**
+     * Select the dimensions of a grid that is at least as large as a minimum size along each axis,
+     * minimizing an estimate of the cost of the reciprocal space calculation.  A slightly larger
+     * grid whose dimensions factor into small primes is often faster than the smallest legal one,
+     * unless it needs more passes over the atoms to stay within the memory limit.
+     *
+     * @param[in,out] xsize   on entry, the minimum first dimension; on exit, the selected one
+     * @param[in,out] ysize   on entry, the minimum second dimension; on exit, the selected one
+     * @param[in,out] zsize   on entry, the minimum third dimension; on exit, the selected one
+     * @param numSubsets      the number of subsets, each of which has its own grid
+     * @param numAtoms        the number of atoms spread onto the grids
+     * @param pmeOrder        the interpolation order
+     * @param bytesPerPoint   the device memory used by each grid point of a subset
+     * @param memoryLimit     the maximum memory in bytes for the grids, or 0 for no limit
+     * @param maxPrimeFactor  the maximum supported prime number factor (default=7)
+     */
+    static void findFastestDimensions(int& xsize, int& ysize, int& zsize, int numSubsets, int numAtoms, int pmeOrder,
+            double bytesPerPoint, double memoryLimit, int maxPrimeFactor=7) {
+        // Consider every legal size up to 25% above the smallest one along each axis.
+
+        std::vector<int> candidates[3];
+        int minimum[] = {xsize, ysize, zsize};
+        for (int axis = 0; axis < 3; axis++) {
+            int smallest = findLegalDimension(minimum[axis], maxPrimeFactor);
+            for (int size = smallest; size <= smallest+smallest/4; size = findLegalDimension(size+1, maxPrimeFactor))
+                candidates[axis].push_back(size);
+        }
+        double bestCost = 0.0;
+        for (int x : candidates[0])
+            for (int y : candidates[1])
+                for (int z : candidates[2]) {
+                    double cost = estimateCost(x, y, z, numSubsets, numAtoms, pmeOrder, bytesPerPoint, memoryLimit);
+                    if (bestCost == 0.0 || cost < bestCost) {
+                        bestCost = cost;
+                        xsize = x;
+                        ysize = y;
+                        zsize = z;
+                    }
+                }
+    }
+    /**
+     * Estimate the relative cost of the reciprocal space calculation on grids of a given size.
+     *
+     * The unit of cost is the time to stream one complex grid value through device memory, which
+     * is also roughly the time of one radix 2 FFT pass per point, since the passes are bandwidth
+     * bound on GPUs.  The constants come from counting memory accesses and operations rather than
+     * from benchmarks; they only need to rank grids whose sizes differ by a few percent.
+     *
+     * Each subset has its own grid.  Apart from the FFT passes, every point of it is streamed
+     * through memory about eight times: clearing and finishing the spread charges, reading and
+     * writing it in the convolution, and loading and storing it around the forward and backward
+     * transforms.  The passes of both transforms are added to that.  Under a memory limit the
+     * subsets are processed in chunks, and every chunk spreads and interpolates all the atoms.
+     * That touches pmeOrder^3 points per atom twice: once with an atomic add, costing about one
+     * unit, and once with a read, costing about half a unit.
+     */
+    static double estimateCost(int xsize, int ysize, int zsize, int numSubsets, int numAtoms, int pmeOrder, double bytesPerPoint, double memoryLimit) {
+        const double memoryCostPerPoint = 8.0;
+        const double atomCostPerPoint = 1.5;
+        double transformCost = 2*(estimateTransformCost(xsize)+estimateTransformCost(ysize)+estimateTransformCost(zsize));
+        double gridCost = (double) numSubsets*xsize*ysize*zsize*(memoryCostPerPoint+transformCost);
+        int chunkSize = findSubsetChunkSize(xsize, ysize, zsize, numSubsets, pmeOrder, bytesPerPoint, memoryLimit);
+        int numChunks = (numSubsets+chunkSize-1)/chunkSize;
+        double atomCost = (double) numChunks*numAtoms*pmeOrder*pmeOrder*pmeOrder*atomCostPerPoint;
+        return gridCost+atomCost;
+    }
+private:
+    /**
+     * Estimate the arithmetic cost per point of transforming along an axis of a given size, in
+     * units of the cost of a radix 2 pass.  Pairs of factors of 2 are done as radix 4 passes, which
+     * do the work of two radix 2 passes for about 1.5 times the cost of one.  The costs of the
+     * other radices are in proportion to the operations per point of the usual small prime
+     * butterflies, including one twiddle factor multiplication.  A prime factor too large for a
+     * butterfly is charged its size, as for a direct transform.
+     */
+    static double estimateTransformCost(int size) {
+        const int radices[] = {4, 2, 3, 5, 7, 11, 13};
+        const double radixCosts[] = {1.5, 1.0, 1.6, 2.6, 3.8, 6.5, 7.8};
+        double cost = 0.0;
+        for (int i = 0; i < 7; i++)
+            while (size%radices[i] == 0) {
+                cost += radixCosts[i];
+                size /= radices[i];
+            }
+        return cost+(size > 1 ? size : 0);
+    }
+};
+
+} // namespace PmeSlicing
+
+#endif /*FFT_DIMENSIONS_H_*/
@@ -1,7 +1,9 @@
 KERNEL void findAtomGridIndex(GLOBAL const real4* RESTRICT posq, GLOBAL const int* RESTRICT subsets, GLOBAL int2* RESTRICT pmeAtomGridIndex,
         real4 periodicBoxSize, real4 invPeriodicBoxSize, real4 periodicBoxVecX, real4 periodicBoxVecY, real4 periodicBoxVecZ,
         real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ
-#ifndef SUPPORTS_64_BIT_ATOMICS
+#ifdef SUPPORTS_64_BIT_ATOMICS
+        , GLOBAL const int* RESTRICT sortedAtomCells, GLOBAL int* RESTRICT numMovedAtoms
+#else
         , GLOBAL real4* RESTRICT pmeBsplineTheta, LOCAL real4* RESTRICT bsplinesCache,
         GLOBAL const real* RESTRICT charges
 #endif
@@ -22,7 +24,12 @@ KERNEL void findAtomGridIndex(GLOBAL const real4* RESTRICT posq, GLOBAL const in
                                    ((int) t.z) % GRID_SIZE_Z);
         int subset = subsets[atom];
         pmeAtomGridIndex[atom] = make_int2(atom, ((subset*GRID_SIZE_X+gridIndex.x)*GRID_SIZE_Y+gridIndex.y)*GRID_SIZE_Z+gridIndex.z);
-#ifndef SUPPORTS_64_BIT_ATOMICS
+#ifdef SUPPORTS_64_BIT_ATOMICS
+        // Count the atoms that have left the cell they were in when the atoms were last sorted.
+
+        if (sortedAtomCells[atom] != (subset*GRID_SIZE_X+gridIndex.x)*GRID_SIZE_Y+gridIndex.y)
+            ATOMIC_ADD(&numMovedAtoms[0], 1);
+#else
         // Compute B-splines here for use in the charge spreading kernel.
         const real4 scale = 1/(real) (PME_ORDER-1);
         LOCAL real4* data = &bsplinesCache[LOCAL_ID*PME_ORDER];
@@ -50,6 +57,139 @@ KERNEL void findAtomGridIndex(GLOBAL const real4* RESTRICT posq, GLOBAL const in
     }
 }
 
+#ifdef SUPPORTS_64_BIT_ATOMICS
+/**
+ * The charge spreading kernel only needs atoms to be roughly ordered in space, so they are sorted
+ * by a counting sort over cells, each made of the grid points of one subset that share their x and
+ * y indices.  Between consecutive steps few atoms change cell, so the previous order is kept until
+ * the number of atoms that left the cell they were sorted into exceeds MAX_MOVED_ATOMS.  Any order
+ * gives correct results, as long as the grid indices stored with the atoms are up to date.
+ */
+#define NUM_CELLS (NUM_SUBSETS*GRID_SIZE_X*GRID_SIZE_Y)
+#define CELL_INDEX(gridIndex) ((gridIndex)/GRID_SIZE_Z)
+#define MAX_MOVED_ATOMS (NUM_ATOMS/8)
+#else
+/**
+ * Without 64 bit atomics, each grid point gathers the charges of the atoms associated with the
+ * grid points near it, so every grid point is a cell of its own and the atoms are sorted again on
+ * every step.  After the sort, cellStart holds the index of the first atom of every grid point.
+ */
+#define NUM_CELLS (NUM_SUBSETS*GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z)
+#define CELL_INDEX(gridIndex) (gridIndex)
+#define MAX_MOVED_ATOMS (-1)
+#endif
+
+/**
+ * Count the atoms in each cell and record the rank of each atom within its cell, if the atoms
+ * need to be sorted again.
+ */
+KERNEL void countAtomsInCells(GLOBAL const int2* RESTRICT unsortedAtomGridIndex, GLOBAL const int* RESTRICT numMovedAtoms,
+        GLOBAL int* RESTRICT cellCounts, GLOBAL int* RESTRICT cellRanks
+#ifdef SUPPORTS_64_BIT_ATOMICS
+        , GLOBAL int* RESTRICT sortedAtomCells
+#endif
+    ) {
+    if (numMovedAtoms[0] <= MAX_MOVED_ATOMS)
+        return;
+    for (int atom = GLOBAL_ID; atom < NUM_ATOMS; atom += GLOBAL_SIZE) {
+        int cell = CELL_INDEX(unsortedAtomGridIndex[atom].y);
+        cellRanks[atom] = ATOMIC_ADD(&cellCounts[cell], 1);
+#ifdef SUPPORTS_64_BIT_ATOMICS
+        sortedAtomCells[atom] = cell;
+#endif
+    }
+}
+
+/**
+ * The first pass of the scan that converts the number of atoms in each cell into the index of
+ * the first sorted atom of the cell.  Each thread block scans CELL_SCAN_SIZE consecutive cells,
+ * storing the offsets of the cells relative to the first cell of the block, and records the total
+ * number of atoms in the block.  This must be executed by NUM_CELL_BLOCKS thread blocks of
+ * CELL_SCAN_SIZE threads.
+ */
+KERNEL void scanCellBlocks(GLOBAL const int* RESTRICT numMovedAtoms, GLOBAL int* RESTRICT cellStart, GLOBAL int* RESTRICT cellBlockOffsets) {
+    if (numMovedAtoms[0] <= MAX_MOVED_ATOMS)
+        return;
+    LOCAL int threadSum[CELL_SCAN_SIZE];
+    const int numCells = NUM_CELLS;
+    const int cell = GROUP_ID*CELL_SCAN_SIZE+LOCAL_ID;
+    int count = (cell < numCells ? cellStart[cell] : 0);
+    threadSum[LOCAL_ID] = count;
+    SYNC_THREADS;
+    for (int offset = 1; offset < CELL_SCAN_SIZE; offset *= 2) {
+        int add = (LOCAL_ID >= offset ? threadSum[LOCAL_ID-offset] : 0);
+        SYNC_THREADS;
+        threadSum[LOCAL_ID] += add;
+        SYNC_THREADS;
+    }
+    if (cell < numCells)
+        cellStart[cell] = threadSum[LOCAL_ID]-count;
+    if (LOCAL_ID == CELL_SCAN_SIZE-1)
+        cellBlockOffsets[GROUP_ID] = threadSum[LOCAL_ID];
+}
+
+/**
+ * The second pass of the scan.  Replace the number of atoms in each block of cells by the index
+ * of the first sorted atom of the block, and set the final element of cellStart to the total
+ * number of atoms.  This must be executed by a single thread block of CELL_SCAN_SIZE threads.
+ */
+KERNEL void computeCellOffsets(GLOBAL const int* RESTRICT numMovedAtoms, GLOBAL int* RESTRICT cellStart, GLOBAL int* RESTRICT cellBlockOffsets) {
+    if (numMovedAtoms[0] <= MAX_MOVED_ATOMS)
+        return;
+    LOCAL int threadSum[CELL_SCAN_SIZE];
+    const int numCells = NUM_CELLS;
+    const int blocksPerThread = (NUM_CELL_BLOCKS+CELL_SCAN_SIZE-1)/CELL_SCAN_SIZE;
+    const int first = min((int) LOCAL_ID*blocksPerThread, NUM_CELL_BLOCKS);
+    const int last = min(first+blocksPerThread, NUM_CELL_BLOCKS);
+    int sum = 0;
+    for (int block = first; block < last; block++)
+        sum += cellBlockOffsets[block];
+    threadSum[LOCAL_ID] = sum;
+    SYNC_THREADS;
+    for (int offset = 1; offset < CELL_SCAN_SIZE; offset *= 2) {
+        int add = (LOCAL_ID >= offset ? threadSum[LOCAL_ID-offset] : 0);
+        SYNC_THREADS;
+        threadSum[LOCAL_ID] += add;
+        SYNC_THREADS;
+    }
+    int start = (LOCAL_ID == 0 ? 0 : threadSum[LOCAL_ID-1]);
+    for (int block = first; block < last; block++) {
+        int count = cellBlockOffsets[block];
+        cellBlockOffsets[block] = start;
+        start += count;
+    }
+    if (LOCAL_ID == CELL_SCAN_SIZE-1)
+        cellStart[numCells] = threadSum[LOCAL_ID];
+}
+
+/**
+ * The final pass of the scan, which adds the offset of each block of cells to the offsets of its
+ * cells.
+ */
+KERNEL void addCellBlockOffsets(GLOBAL const int* RESTRICT numMovedAtoms, GLOBAL int* RESTRICT cellStart, GLOBAL const int* RESTRICT cellBlockOffsets) {
+    if (numMovedAtoms[0] <= MAX_MOVED_ATOMS)
+        return;
+    const int numCells = NUM_CELLS;
+    for (int cell = GLOBAL_ID; cell < numCells; cell += GLOBAL_SIZE)
+        cellStart[cell] += cellBlockOffsets[cell/CELL_SCAN_SIZE];
+}
+
+/**
+ * Move every atom to its position in cell order if the atoms need to be sorted again.  Otherwise
+ * keep the previous order and only update the grid indices.
+ */
+KERNEL void sortAtomsByCell(GLOBAL const int2* RESTRICT unsortedAtomGridIndex, GLOBAL const int* RESTRICT numMovedAtoms,
+        GLOBAL const int* RESTRICT cellStart, GLOBAL const int* RESTRICT cellRanks, GLOBAL int2* RESTRICT pmeAtomGridIndex) {
+    if (numMovedAtoms[0] > MAX_MOVED_ATOMS)
+        for (int atom = GLOBAL_ID; atom < NUM_ATOMS; atom += GLOBAL_SIZE) {
+            int2 atomData = unsortedAtomGridIndex[atom];
+            pmeAtomGridIndex[cellStart[CELL_INDEX(atomData.y)]+cellRanks[atom]] = atomData;
+        }
+    else
+        for (int i = GLOBAL_ID; i < NUM_ATOMS; i += GLOBAL_SIZE)
+            pmeAtomGridIndex[i] = unsortedAtomGridIndex[pmeAtomGridIndex[i].x];
+}
+
 #ifdef SUPPORTS_64_BIT_ATOMICS
 #pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
 
@@ -61,12 +201,18 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
 #endif
         real4 periodicBoxSize, real4 invPeriodicBoxSize, real4 periodicBoxVecX, real4 periodicBoxVecY, real4 periodicBoxVecZ,
         real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ, GLOBAL const int2* RESTRICT pmeAtomGridIndex,
-        GLOBAL const real* RESTRICT charges
+        GLOBAL const real* RESTRICT charges, GLOBAL const int* RESTRICT subsetFlags, int firstSubset
+#ifdef CACHE_BSPLINES
+        , GLOBAL real4* RESTRICT cachedTheta, GLOBAL real4* RESTRICT cachedDTheta, GLOBAL int4* RESTRICT cachedGridIndex
+#endif
         ) {
+#ifdef USE_FIXED_POINT_CHARGE_SPREADING
     // To improve memory efficiency, we divide indices along the z axis into
     // PME_ORDER blocks, where the data for each block is stored together.  We
     // can ensure that all threads write to the same block at the same time,
-    // which leads to better coalescing of writes.
+    // which leads to better coalescing of writes.  The grid must be converted
+    // to floating point before the FFT anyway, so finishSpreadCharge restores
+    // the natural order at the same time.
 
     LOCAL int zindexTable[GRID_SIZE_Z+PME_ORDER];
     int blockSize = (int) ceil(GRID_SIZE_Z/(real) PME_ORDER);
@@ -76,17 +222,28 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
         zindexTable[i] = zindex/PME_ORDER + block*GRID_SIZE_X*GRID_SIZE_Y*blockSize;
     }
     SYNC_THREADS;
+    const unsigned int subsetGridSize = GRID_SIZE_X*GRID_SIZE_Y*ROUNDED_Z_SIZE;
+#else
+    // Floating point values are spread in natural order straight into the grid
+    // that is passed to the FFT, so no separate pass is needed to prepare it.
+
+    const int blockSize = GRID_SIZE_Z;
+    const unsigned int subsetGridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
+#endif
 
     // Process the atoms in spatially sorted order.  This improves efficiency when writing
-    // the grid values.
+    // the grid values.  Only the subsets firstSubset to firstSubset+SUBSET_CHUNK_SIZE-1 are
+    // spread, each onto its own grid.
 
     real3 data[PME_ORDER];
     const real scale = RECIP((real) (PME_ORDER-1));
     const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
-    const unsigned int extendedSize = GRID_SIZE_X*GRID_SIZE_Y*ROUNDED_Z_SIZE;
     for (int i = GLOBAL_ID; i < NUM_ATOMS; i += GLOBAL_SIZE) {
         int atom = pmeAtomGridIndex[i].x;
-        int offset = extendedSize*(pmeAtomGridIndex[i].y/gridSize);
+        int subset = pmeAtomGridIndex[i].y/gridSize;
+        if (!subsetFlags[subset] || subset < firstSubset || subset >= firstSubset+SUBSET_CHUNK_SIZE)
+            continue;
+        int offset = subsetGridSize*(subset-firstSubset);
         real4 pos = posq[atom];
         const real charge = (CHARGE)*EPSILON_FACTOR;
         APPLY_PERIODIC_TO_POS(pos)
@@ -117,11 +274,24 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
                                    (make_real3(j-k)-dr)*data[j-k-1]);
             data[0] = div*(make_real3(1)-dr)*data[0];
         }
+#ifdef CACHE_BSPLINES
+        cachedDTheta[i] = make_real4(-data[0].x, -data[0].y, -data[0].z, 0);
+        for (int j = 1; j < PME_ORDER; j++)
+            cachedDTheta[i+j*NUM_ATOMS] = make_real4(data[j-1].x-data[j].x, data[j-1].y-data[j].y, data[j-1].z-data[j].z, 0);
+#endif
         data[PME_ORDER-1] = scale*dr*data[PME_ORDER-2];
         for (int j = 1; j < (PME_ORDER-1); j++)
             data[PME_ORDER-j-1] = scale*((make_real3(j)+dr)*data[PME_ORDER-j-2] +
                                          (make_real3(PME_ORDER-j)-dr)*data[PME_ORDER-j-1]);
         data[0] = scale*(make_real3(1)-dr)*data[0];
+#ifdef CACHE_BSPLINES
+        // Store the B-splines and the grid index so that gridInterpolateForce does not need to compute
+        // them again.  The atoms are processed in the same order there.
+
+        for (int j = 0; j < PME_ORDER; j++)
+            cachedTheta[i+j*NUM_ATOMS] = make_real4(data[j].x, data[j].y, data[j].z, 0);
+        cachedGridIndex[i] = make_int4(gridIndex.x, gridIndex.y, gridIndex.z, 0);
+#endif
 
         // Spread the charge from this atom onto each grid point.
 
@@ -139,7 +309,11 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
                 for (int i = 0; i < PME_ORDER; i++) {
         		    int iz = (i+izoffset) % PME_ORDER;
                     int zindex = gridIndex.z+iz;
+#ifdef USE_FIXED_POINT_CHARGE_SPREADING
                     int index = ybase + zindexTable[zindex];
+#else
+                    int index = ybase + zindex - (zindex >= GRID_SIZE_Z ? GRID_SIZE_Z : 0);
+#endif
                     real add = dxdy*data[iz].z;
 #ifdef USE_FIXED_POINT_CHARGE_SPREADING
                     ATOMIC_ADD(&pmeGrid[offset+index], (mm_ulong) realToFixedPoint(add));
@@ -152,17 +326,11 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq,
     }
 }
 
-KERNEL void finishSpreadCharge(
 #ifdef USE_FIXED_POINT_CHARGE_SPREADING
-        GLOBAL const mm_long* RESTRICT grid1,
-#else
-        GLOBAL const real* RESTRICT grid1,
-#endif
-        GLOBAL real* RESTRICT grid2) {
+KERNEL void finishSpreadCharge(GLOBAL const mm_long* RESTRICT grid1, GLOBAL real* RESTRICT grid2) {
     // During charge spreading, we shuffled the order of indices along the z
     // axis to make memory access more efficient.  We now need to unshuffle
-    // them.  If the values were accumulated as fixed point, we also need to
-    // convert them to floating point.
+    // them and convert the fixed point values to floating point.
 
     LOCAL int zindexTable[GRID_SIZE_Z];
     int blockSize = (int) ceil(GRID_SIZE_Z/(real) PME_ORDER);
@@ -173,28 +341,23 @@ KERNEL void finishSpreadCharge(
     SYNC_THREADS;
     const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
     const unsigned int extendedSize = GRID_SIZE_X*GRID_SIZE_Y*ROUNDED_Z_SIZE;
-#ifdef USE_FIXED_POINT_CHARGE_SPREADING
     real scale = 1/(real) 0x100000000;
-#endif
-    // TODO: Optimize by including the inner loop in the GPU parallelization
-    for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
-        int zindex = index%GRID_SIZE_Z;
-        int loadIndex = zindexTable[zindex] + blockSize*(int) (index/GRID_SIZE_Z);
-        for (int j = 0; j < NUM_SUBSETS; j++)
-#ifdef USE_FIXED_POINT_CHARGE_SPREADING
-            grid2[j*gridSize+index] = scale*grid1[j*extendedSize+loadIndex];
-#else
-            grid2[j*gridSize+index] = grid1[j*extendedSize+loadIndex];
-#endif
+    for (int index = GLOBAL_ID; index < SUBSET_CHUNK_SIZE*gridSize; index += GLOBAL_SIZE) {
+        int subset = index/gridSize;
+        int gridIndex = index-subset*gridSize;
+        int zindex = gridIndex%GRID_SIZE_Z;
+        int loadIndex = zindexTable[zindex] + blockSize*(int) (gridIndex/GRID_SIZE_Z);
+        grid2[index] = scale*grid1[subset*extendedSize+loadIndex];
     }
 }
+#endif
 
 #elif defined(DEVICE_IS_CPU)
 
 KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq, GLOBAL real* RESTRICT pmeGrid,
         real4 periodicBoxSize, real4 invPeriodicBoxSize, real4 periodicBoxVecX, real4 periodicBoxVecY, real4 periodicBoxVecZ,
         real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ,
-        GLOBAL const real* RESTRICT charges, GLOBAL const int* RESTRICT subsets
+        GLOBAL const real* RESTRICT charges, GLOBAL const int* RESTRICT subsets, GLOBAL const int* RESTRICT subsetFlags
     ) {
     const int firstx = GLOBAL_ID*GRID_SIZE_X/GLOBAL_SIZE;
     const int lastx = (GLOBAL_ID+1)*GRID_SIZE_X/GLOBAL_SIZE;
@@ -208,6 +371,8 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq, GLOBAL real* RES
     const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
     for (int i = 0; i < NUM_ATOMS; i++) {
         int atom = i;
+        if (!subsetFlags[subsets[atom]])
+            continue;
         int offset = subsets[atom]*gridSize;
         real4 pos = posq[atom];
         APPLY_PERIODIC_TO_POS(pos)
@@ -270,32 +435,6 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq, GLOBAL real* RES
 
 #else
 
-/**
- * For each grid point, find the range of sorted atoms associated with that point.
- */
-KERNEL void findAtomRangeForGrid(GLOBAL int2* RESTRICT pmeAtomGridIndex, GLOBAL int* RESTRICT pmeAtomRange, GLOBAL const real4* RESTRICT posq) {
-    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
-    int start = (NUM_ATOMS*GLOBAL_ID)/GLOBAL_SIZE;
-    int end = (NUM_ATOMS*(GLOBAL_ID+1))/GLOBAL_SIZE;
-    int last = (start == 0 ? -1 : pmeAtomGridIndex[start-1].y);
-    for (int i = start; i < end; ++i) {
-        int2 atomData = pmeAtomGridIndex[i];
-        int gridIndex = atomData.y;
-        if (gridIndex != last) {
-            int firstInSubset = (gridIndex/gridSize)*gridSize;
-            for (int j = last+1; j <= gridIndex; ++j)
-                pmeAtomRange[j] = j < firstInSubset ? NUM_ATOMS : i;
-            last = gridIndex;
-        }
-    }
-
-    // Fill in values beyond the last atom.
-
-    if (GLOBAL_ID == GLOBAL_SIZE-1)
-        for (int j = last+1; j <= NUM_SUBSETS*gridSize; ++j)
-            pmeAtomRange[j] = NUM_ATOMS;
-}
-
 /**
  * The grid index won't be needed again.  Reuse that component to hold the z index, thus saving
  * some work in the charge spreading kernel.
@@ -313,15 +452,20 @@ KERNEL void recordZIndex(GLOBAL int2* RESTRICT pmeAtomGridIndex, GLOBAL const re
 
 KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq, GLOBAL real* RESTRICT pmeGrid,
         GLOBAL const int2* RESTRICT pmeAtomGridIndex, GLOBAL const int* RESTRICT pmeAtomRange,
-        GLOBAL const real4* RESTRICT pmeBsplineTheta
-        , GLOBAL const real* RESTRICT charges
+        GLOBAL const real4* RESTRICT pmeBsplineTheta, GLOBAL const real* RESTRICT charges,
+        GLOBAL const int* RESTRICT subsetFlags
     ) {
     const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
+    const unsigned int numGridPoints = NUM_SUBSETS*gridSize;
     for (int gridIndex = GLOBAL_ID; gridIndex < numGridPoints; gridIndex += GLOBAL_SIZE) {
         // Compute the charge on a grid point.
 
         int4 gridPoint;
         gridPoint.w = gridIndex/gridSize;
+        if (!subsetFlags[gridPoint.w]) {
+            pmeGrid[gridIndex] = 0.0f;
+            continue;
+        }
         int remainder = gridIndex-gridPoint.w*gridSize;
         gridPoint.x = remainder/(GRID_SIZE_Y*GRID_SIZE_Z);
         remainder -= gridPoint.x*GRID_SIZE_Y*GRID_SIZE_Z;
@@ -351,7 +495,7 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq, GLOBAL real* RES
                     result += atomCharge*pmeBsplineTheta[atomIndex+ix*NUM_ATOMS].x*pmeBsplineTheta[atomIndex+iy*NUM_ATOMS].y*pmeBsplineTheta[atomIndex+iz*NUM_ATOMS].z;
                 }
                 if (z1 > gridPoint.z) {
-                    gridIndex1 = (gridPoint.w*GRID_SIZE_X+x)*GRID_SIZE_Y+y)*GRID_SIZE_Z;
+                    gridIndex1 = ((gridPoint.w*GRID_SIZE_X+x)*GRID_SIZE_Y+y)*GRID_SIZE_Z;
                     gridIndex2 = gridIndex1+gridPoint.z;
                     firstAtom = pmeAtomRange[gridIndex1];
                     lastAtom = pmeAtomRange[gridIndex2+1];
@@ -371,98 +515,203 @@ KERNEL void gridSpreadCharge(GLOBAL const real4* RESTRICT posq, GLOBAL real* RES
 }
 #endif
 
-KERNEL void collapseGrid(GLOBAL real2* RESTRICT pmeGrid) {
-    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
-    for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
-        for (int j = 1; j < NUM_SUBSETS; j++) {
-            pmeGrid[index] += pmeGrid[j*gridSize+index];
-            pmeGrid[j*gridSize+index] = make_real2(0, 0);
-        }
-    }
+/**
+ * Compute the reciprocal space kernel at point index of the half complex grid, which must not be
+ * the origin.
+ */
+DEVICE real reciprocalEnergyTerm(int index, real recipScaleFactor,
+        GLOBAL const real* RESTRICT pmeBsplineModuliX, GLOBAL const real* RESTRICT pmeBsplineModuliY, GLOBAL const real* RESTRICT pmeBsplineModuliZ,
+        real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
+    int kx = index/(GRID_SIZE_Y*(GRID_SIZE_Z/2+1));
+    int remainder = index-kx*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
+    int ky = remainder/(GRID_SIZE_Z/2+1);
+    int kz = remainder-ky*(GRID_SIZE_Z/2+1);
+    int mx = (kx < (GRID_SIZE_X+1)/2) ? kx : (kx-GRID_SIZE_X);
+    int my = (ky < (GRID_SIZE_Y+1)/2) ? ky : (ky-GRID_SIZE_Y);
+    int mz = (kz < (GRID_SIZE_Z+1)/2) ? kz : (kz-GRID_SIZE_Z);
+    real mhx = mx*recipBoxVecX.x;
+    real mhy = mx*recipBoxVecY.x+my*recipBoxVecY.y;
+    real mhz = mx*recipBoxVecZ.x+my*recipBoxVecZ.y+mz*recipBoxVecZ.z;
+    real bx = pmeBsplineModuliX[kx];
+    real by = pmeBsplineModuliY[ky];
+    real bz = pmeBsplineModuliZ[kz];
+    real m2 = mhx*mhx+mhy*mhy+mhz*mhz;
+    real denom = m2*bx*by*bz;
+    return recipScaleFactor*EXP(-RECIP_EXP_FACTOR*m2)/denom;
 }
 
-KERNEL void reciprocalConvolution(GLOBAL real2* RESTRICT pmeGrid, GLOBAL const real* RESTRICT pmeBsplineModuliX,
-        GLOBAL const real* RESTRICT pmeBsplineModuliY, GLOBAL const real* RESTRICT pmeBsplineModuliZ,
-        real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
+/**
+ * Compute the reciprocal space energy from the structure factors of the particle subsets and,
+ * if forces are requested, replace the structure factor S_I of each subset I by the sum of
+ * w_IJ*S_J over all subsets J, multiplied by the reciprocal space kernel, where w_IJ is the
+ * weight of slice[I,J].  After the backward FFT, the grid of subset I then holds the potential
+ * felt by its particles.  Each point of the half complex grid is read once and stands for itself
+ * and its Hermitian conjugate, except for the planes kz = 0 and kz = GRID_SIZE_Z/2 (when
+ * GRID_SIZE_Z is even), which are their own conjugates.
+ *
+ * The weighted energy is the sum over subsets of S_I times its combined structure factor, so it
+ * needs no per-slice accumulators.  The energies of individual slices are only computed for the
+ * slices whose parameter derivative was requested and, if recordSliceEnergies is set, for the
+ * slices flagged as included.  They are accumulated in registers in the same pass over the grid,
+ * from the structure factors already staged for it, and only when there are more than
+ * MAX_TRACKED_SLICES of them is the grid read again for each further batch.  The unscaled
+ * contribution of each thread to slice[I,J] is then stored in sliceEnergyBuffer at position
+ * SLICE_BUFFER_SIZE*slice+GLOBAL_ID, with slice = J*(J+1)/2+I for I <= J.
+ *
+ * The structure factors of the point handled by each thread are staged in local memory, since
+ * the combined values overwrite them.  The kernel must be launched with CONVOLUTION_BLOCK_SIZE
+ * threads per block.
+ */
+#define MAX_TRACKED_SLICES (NUM_SLICES < 8 ? NUM_SLICES : 8)
+
+KERNEL void reciprocalConvolution(GLOBAL real2* RESTRICT pmeGrid, GLOBAL mixed* RESTRICT energyBuffer, GLOBAL mixed* RESTRICT sliceEnergyBuffer,
+                      GLOBAL const real* RESTRICT sliceWeights,
+                      GLOBAL const real* RESTRICT pmeBsplineModuliX, GLOBAL const real* RESTRICT pmeBsplineModuliY, GLOBAL const real* RESTRICT pmeBsplineModuliZ,
+                      real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ, GLOBAL const int* RESTRICT sliceFlags,
+                      int includeEnergy, int includeForces, int recordSliceEnergies
+#ifdef HAS_DERIVATIVES
+                      , GLOBAL mixed* RESTRICT energyParamDerivs, int numDerivs, GLOBAL const int* RESTRICT sliceDerivIndices
+#endif
+                      ) {
     // R2C stores into a half complex matrix where the last dimension is cut by half
     const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
     const real recipScaleFactor = RECIP(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
+#ifdef STREAM_SUBSET_CHUNKS
+    // Each grid holds the structure factor of a single subset.  The energy and the
+    // combination of subsets are computed by gridInterpolateChunk instead.
 
     for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
-        // real indices
-        int kx = index/(GRID_SIZE_Y*(GRID_SIZE_Z/2+1));
-        int remainder = index-kx*GRID_SIZE_Y*(GRID_SIZE_Z/2+1);
-        int ky = remainder/(GRID_SIZE_Z/2+1);
-        int kz = remainder-ky*(GRID_SIZE_Z/2+1);
-        int mx = (kx < (GRID_SIZE_X+1)/2) ? kx : (kx-GRID_SIZE_X);
-        int my = (ky < (GRID_SIZE_Y+1)/2) ? ky : (ky-GRID_SIZE_Y);
-        int mz = (kz < (GRID_SIZE_Z+1)/2) ? kz : (kz-GRID_SIZE_Z);
-        real mhx = mx*recipBoxVecX.x;
-        real mhy = mx*recipBoxVecY.x+my*recipBoxVecY.y;
-        real mhz = mx*recipBoxVecZ.x+my*recipBoxVecZ.y+mz*recipBoxVecZ.z;
-        real bx = pmeBsplineModuliX[kx];
-        real by = pmeBsplineModuliY[ky];
-        real bz = pmeBsplineModuliZ[kz];
-        real2 grid = pmeGrid[index];
-        real m2 = mhx*mhx+mhy*mhy+mhz*mhz;
-        real denom = m2*bx*by*bz;
-        real eterm = recipScaleFactor*EXP(-RECIP_EXP_FACTOR*m2)/denom;
-        if (kx != 0 || ky != 0 || kz != 0) {
-            pmeGrid[index] = make_real2(grid.x*eterm, grid.y*eterm);
+        if (index == 0) {
+            // The energy is computed from the interpolated potential, so the constant term must be removed.
+
+            for (int j = 0; j < SUBSET_CHUNK_SIZE; j++)
+                pmeGrid[j*gridSize] = make_real2(0, 0);
+            continue;
+        }
+        real eterm = reciprocalEnergyTerm(index, recipScaleFactor, pmeBsplineModuliX, pmeBsplineModuliY, pmeBsplineModuliZ, recipBoxVecX, recipBoxVecY, recipBoxVecZ);
+        for (int j = 0; j < SUBSET_CHUNK_SIZE; j++) {
+            real2 grid = pmeGrid[j*gridSize+index];
+            pmeGrid[j*gridSize+index] = make_real2(grid.x*eterm, grid.y*eterm);
         }
     }
-}
+#else
+    LOCAL real2 subsetGrid[NUM_SUBSETS*CONVOLUTION_BLOCK_SIZE];
+    LOCAL int2 trackedSlices[NUM_SLICES];
+    LOCAL int numTrackedSlices;
+    mixed trackedEnergy[MAX_TRACKED_SLICES];
+
+    // List the slices whose energies are needed individually.  The list is the same for all
+    // threads.
+
+    if (LOCAL_ID == 0) {
+        int count = 0;
+        if (includeEnergy)
+            for (int j = 0; j < NUM_SUBSETS; j++)
+                for (int i = 0; i <= j; i++) {
+                    int slice = j*(j+1)/2+i;
+                    int needed = (recordSliceEnergies && sliceFlags[slice]);
+#ifdef HAS_DERIVATIVES
+                    needed = needed || (sliceDerivIndices[slice] >= 0);
+#endif
+                    if (needed)
+                        trackedSlices[count++] = make_int2(i, j);
+                }
+        numTrackedSlices = count;
+    }
+    SYNC_THREADS;
+    if (includeEnergy && recordSliceEnergies)
+        for (int slice = 0; slice < NUM_SLICES; slice++)
+            if (!sliceFlags[slice])
+                sliceEnergyBuffer[slice*SLICE_BUFFER_SIZE+GLOBAL_ID] = 0;
 
-KERNEL void gridEvaluateEnergy(GLOBAL real2* RESTRICT pmeGrid, GLOBAL mixed* RESTRICT energyBuffer,
-                      GLOBAL const real* RESTRICT pmeBsplineModuliX, GLOBAL const real* RESTRICT pmeBsplineModuliY, GLOBAL const real* RESTRICT pmeBsplineModuliZ,
-                      real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ) {
-    // R2C stores into a half complex matrix where the last dimension is cut by half
-    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
-    const real recipScaleFactor = RECIP(M_PI)*recipBoxVecX.x*recipBoxVecY.y*recipBoxVecZ.z;
+    // Only MAX_TRACKED_SLICES slice energies are accumulated per pass over the grid.  Additional
+    // batches of slices, if any, are done first, since the final pass replaces the structure
+    // factors while it computes the total energy and the combined structure factors.
 
     mixed energy = 0;
-    for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
-        // real indices
-        int kx = index/(GRID_SIZE_Y*(GRID_SIZE_Z));
-        int remainder = index-kx*GRID_SIZE_Y*(GRID_SIZE_Z);
-        int ky = remainder/(GRID_SIZE_Z);
-        int kz = remainder-ky*(GRID_SIZE_Z);
-        int mx = (kx < (GRID_SIZE_X+1)/2) ? kx : (kx-GRID_SIZE_X);
-        int my = (ky < (GRID_SIZE_Y+1)/2) ? ky : (ky-GRID_SIZE_Y);
-        int mz = (kz < (GRID_SIZE_Z+1)/2) ? kz : (kz-GRID_SIZE_Z);
-        real mhx = mx*recipBoxVecX.x;
-        real mhy = mx*recipBoxVecY.x+my*recipBoxVecY.y;
-        real mhz = mx*recipBoxVecZ.x+my*recipBoxVecZ.y+mz*recipBoxVecZ.z;
-        real m2 = mhx*mhx+mhy*mhy+mhz*mhz;
-        real bx = pmeBsplineModuliX[kx];
-        real by = pmeBsplineModuliY[ky];
-        real bz = pmeBsplineModuliZ[kz];
-        real denom = m2*bx*by*bz;
-        real eterm = recipScaleFactor*EXP(-RECIP_EXP_FACTOR*m2)/denom;
-        if (kz >= (GRID_SIZE_Z/2+1)) {
-            kx = ((kx == 0) ? kx : GRID_SIZE_X-kx);
-            ky = ((ky == 0) ? ky : GRID_SIZE_Y-ky);
-            kz = GRID_SIZE_Z-kz;
-        } 
-        int indexInHalfComplexGrid = kz + ky*(GRID_SIZE_Z/2+1)+kx*(GRID_SIZE_Y*(GRID_SIZE_Z/2+1));
-        real2 grid = pmeGrid[indexInHalfComplexGrid];
-        if (kx != 0 || ky != 0 || kz != 0)
-            energy += eterm*(grid.x*grid.x + grid.y*grid.y);
+    for (int first = (numTrackedSlices > 0 ? (numTrackedSlices-1)/MAX_TRACKED_SLICES*MAX_TRACKED_SLICES : 0); first >= 0; first -= MAX_TRACKED_SLICES) {
+        const int numInBatch = min(numTrackedSlices-first, MAX_TRACKED_SLICES);
+        for (int k = 0; k < MAX_TRACKED_SLICES; k++)
+            trackedEnergy[k] = 0;
+        for (int index = GLOBAL_ID; index < gridSize; index += GLOBAL_SIZE) {
+            if (index == 0)
+                continue;
+            int kz = index%(GRID_SIZE_Z/2+1);
+            real eterm = reciprocalEnergyTerm(index, recipScaleFactor, pmeBsplineModuliX, pmeBsplineModuliY, pmeBsplineModuliZ, recipBoxVecX, recipBoxVecY, recipBoxVecZ);
+            real energyTerm = 0.5f*(kz == 0 || 2*kz == GRID_SIZE_Z ? 1.0f : 2.0f)*eterm;
+            for (int j = 0; j < NUM_SUBSETS; j++)
+                subsetGrid[j*CONVOLUTION_BLOCK_SIZE+LOCAL_ID] = pmeGrid[j*gridSize+index];
+            for (int k = 0; k < MAX_TRACKED_SLICES; k++) {
+                if (k >= numInBatch)
+                    break;
+                int2 pair = trackedSlices[first+k];
+                real2 gridI = subsetGrid[pair.x*CONVOLUTION_BLOCK_SIZE+LOCAL_ID];
+                real2 gridJ = subsetGrid[pair.y*CONVOLUTION_BLOCK_SIZE+LOCAL_ID];
+                trackedEnergy[k] += (pair.x == pair.y ? energyTerm : 2*energyTerm)*(gridI.x*gridJ.x + gridI.y*gridJ.y);
+            }
+            if (first != 0)
+                continue;
+            for (int i = 0; i < NUM_SUBSETS; i++) {
+                real2 sum = make_real2(0, 0);
+                for (int j = 0; j < NUM_SUBSETS; j++) {
+                    real weight = sliceWeights[i < j ? j*(j+1)/2+i : i*(i+1)/2+j];
+                    real2 grid = subsetGrid[j*CONVOLUTION_BLOCK_SIZE+LOCAL_ID];
+                    sum.x += weight*grid.x;
+                    sum.y += weight*grid.y;
+                }
+                if (includeEnergy) {
+                    real2 grid = subsetGrid[i*CONVOLUTION_BLOCK_SIZE+LOCAL_ID];
+                    energy += energyTerm*(grid.x*sum.x + grid.y*sum.y);
+                }
+                if (includeForces)
+                    pmeGrid[i*gridSize+index] = make_real2(sum.x*eterm, sum.y*eterm);
+            }
+        }
+        for (int k = 0; k < MAX_TRACKED_SLICES; k++) {
+            if (k >= numInBatch)
+                break;
+            int2 pair = trackedSlices[first+k];
+            int slice = pair.y*(pair.y+1)/2+pair.x;
+            if (recordSliceEnergies && sliceFlags[slice])
+                sliceEnergyBuffer[slice*SLICE_BUFFER_SIZE+GLOBAL_ID] = trackedEnergy[k];
+#ifdef HAS_DERIVATIVES
+            if (sliceDerivIndices[slice] >= 0)
+                energyParamDerivs[GLOBAL_ID*numDerivs+sliceDerivIndices[slice]] += trackedEnergy[k];
+#endif
+        }
     }
+    if (!includeEnergy)
+        return;
+
+    // Clear any buffer elements that no thread of this launch owns.
+
+    for (int index = GLOBAL_ID+GLOBAL_SIZE; index < SLICE_BUFFER_SIZE; index += GLOBAL_SIZE) {
+        if (recordSliceEnergies)
+            for (int slice = 0; slice < NUM_SLICES; slice++)
+                sliceEnergyBuffer[slice*SLICE_BUFFER_SIZE+index] = 0;
 #if defined(USE_PME_STREAM)
-    energyBuffer[GLOBAL_ID] = 0.5f*energy;
+        energyBuffer[index] = 0;
+#endif
+    }
+#if defined(USE_PME_STREAM)
+    energyBuffer[GLOBAL_ID] = energy;
 #else
-    energyBuffer[GLOBAL_ID] += 0.5f*energy;
+    energyBuffer[GLOBAL_ID] += energy;
+#endif
 #endif
 }
 
 KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ulong* RESTRICT forceBuffers, GLOBAL const real* RESTRICT pmeGrid,
         real4 periodicBoxSize, real4 invPeriodicBoxSize, real4 periodicBoxVecX, real4 periodicBoxVecY, real4 periodicBoxVecZ,
         real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ, GLOBAL const int2* RESTRICT pmeAtomGridIndex,
-        GLOBAL const real* RESTRICT charges
+        GLOBAL const real* RESTRICT charges, GLOBAL const int* RESTRICT subsets, GLOBAL const int* RESTRICT subsetFlags
+#ifdef CACHE_BSPLINES
+        , GLOBAL const real4* RESTRICT cachedTheta, GLOBAL const real4* RESTRICT cachedDTheta, GLOBAL const int4* RESTRICT cachedGridIndex
+#endif
         ) {
     real3 data[PME_ORDER];
     real3 ddata[PME_ORDER];
+    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
     const real scale = RECIP((real) (PME_ORDER-1));
     
     // Process the atoms in spatially sorted order.  This improves cache performance when loading
@@ -470,8 +719,27 @@ KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ul
     
     for (int i = GLOBAL_ID; i < NUM_ATOMS; i += GLOBAL_SIZE) {
         int atom = pmeAtomGridIndex[i].x;
+        int subset = subsets[atom];
+        if (!subsetFlags[subset])
+            continue;
+        GLOBAL const real* RESTRICT grid = &pmeGrid[subset*gridSize];
         real3 force = make_real3(0);
         real4 pos = posq[atom];
+        real q = CHARGE*EPSILON_FACTOR;
+#ifdef CACHE_BSPLINES
+        // Load the values stored by gridSpreadCharge, which skipped uncharged atoms.
+
+        if (q == 0)
+            continue;
+        int4 cachedIndex = cachedGridIndex[i];
+        int3 gridIndex = make_int3(cachedIndex.x, cachedIndex.y, cachedIndex.z);
+        for (int j = 0; j < PME_ORDER; j++) {
+            real4 theta = cachedTheta[i+j*NUM_ATOMS];
+            real4 dtheta = cachedDTheta[i+j*NUM_ATOMS];
+            data[j] = make_real3(theta.x, theta.y, theta.z);
+            ddata[j] = make_real3(dtheta.x, dtheta.y, dtheta.z);
+        }
+#else
         APPLY_PERIODIC_TO_POS(pos)
         real3 t = make_real3(pos.x*recipBoxVecX.x+pos.y*recipBoxVecY.x+pos.z*recipBoxVecZ.x,
                              pos.y*recipBoxVecY.y+pos.z*recipBoxVecZ.y,
@@ -504,6 +772,7 @@ KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ul
         for (int j = 1; j < (PME_ORDER-1); j++)
             data[PME_ORDER-j-1] = scale*((dr+make_real3(j))*data[PME_ORDER-j-2] + (make_real3(PME_ORDER-j)-dr)*data[PME_ORDER-j-1]);
         data[0] = scale*(make_real3(1)-dr)*data[0];
+#endif
 
         // Compute the force on this atom.
 
@@ -525,14 +794,146 @@ KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ul
                     int zindex = gridIndex.z+iz;
                     zindex -= (zindex >= GRID_SIZE_Z ? GRID_SIZE_Z : 0);
                     int index = ybase + zindex;
-                    real gridvalue = pmeGrid[index];
+                    real gridvalue = grid[index];
                     force.x += ddx*dy*data[iz].z*gridvalue;
                     force.y += dx*ddy*data[iz].z*gridvalue;
                     force.z += dx*dy*ddata[iz].z*gridvalue;
                 }
             }
         }
+        real forceX = -q*(force.x*GRID_SIZE_X*recipBoxVecX.x);
+        real forceY = -q*(force.x*GRID_SIZE_X*recipBoxVecY.x+force.y*GRID_SIZE_Y*recipBoxVecY.y);
+        real forceZ = -q*(force.x*GRID_SIZE_X*recipBoxVecZ.x+force.y*GRID_SIZE_Y*recipBoxVecZ.y+force.z*GRID_SIZE_Z*recipBoxVecZ.z);
+#ifdef USE_PME_STREAM
+        ATOMIC_ADD(&forceBuffers[atom], (mm_ulong) realToFixedPoint(forceX));
+        ATOMIC_ADD(&forceBuffers[atom+PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(forceY));
+        ATOMIC_ADD(&forceBuffers[atom+2*PADDED_NUM_ATOMS], (mm_ulong) realToFixedPoint(forceZ));
+#else
+        forceBuffers[atom] += (mm_ulong) realToFixedPoint(forceX);
+        forceBuffers[atom+PADDED_NUM_ATOMS] += (mm_ulong) realToFixedPoint(forceY);
+        forceBuffers[atom+2*PADDED_NUM_ATOMS] += (mm_ulong) realToFixedPoint(forceZ);
+#endif
+    }
+}
+
+#ifdef STREAM_SUBSET_CHUNKS
+/**
+ * When the subset grids are processed in chunks, each grid holds the potential created by
+ * a single subset j.  Interpolating it at the position of an atom of subset i gives the
+ * contribution of slice[i,j] to the force on that atom, and half of that atom's share of
+ * the slice energy.  Summed over all chunks, this reproduces what reciprocalConvolution
+ * and gridInterpolateForce compute when all grids are available at once.  The energy buffer,
+ * and the slice energy buffer if recordSliceEnergies is set, are initialized on the first chunk
+ * and accumulated afterward.  Like the total energy, the energies of individual slices are added
+ * to the buffers atom by atom, and only for the slices that need them.
+ */
+KERNEL void gridInterpolateChunk(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ulong* RESTRICT forceBuffers, GLOBAL const real* RESTRICT pmeGrid,
+        real4 periodicBoxSize, real4 invPeriodicBoxSize, real4 periodicBoxVecX, real4 periodicBoxVecY, real4 periodicBoxVecZ,
+        real4 recipBoxVecX, real4 recipBoxVecY, real4 recipBoxVecZ, GLOBAL const int2* RESTRICT pmeAtomGridIndex,
+        GLOBAL const real* RESTRICT charges, GLOBAL const int* RESTRICT subsets, GLOBAL const int* RESTRICT subsetFlags,
+        GLOBAL mixed* RESTRICT energyBuffer, GLOBAL mixed* RESTRICT sliceEnergyBuffer, GLOBAL const real* RESTRICT sliceWeights,
+        GLOBAL const int* RESTRICT sliceFlags, int firstSubset, int accumulate, int includeEnergy, int includeForces, int recordSliceEnergies
+#ifdef HAS_DERIVATIVES
+        , GLOBAL mixed* RESTRICT energyParamDerivs, int numDerivs, GLOBAL const int* RESTRICT sliceDerivIndices
+#endif
+        ) {
+    real3 data[PME_ORDER];
+    real3 ddata[PME_ORDER];
+    const unsigned int gridSize = GRID_SIZE_X*GRID_SIZE_Y*GRID_SIZE_Z;
+    const real scale = RECIP((real) (PME_ORDER-1));
+    if (includeEnergy && recordSliceEnergies && !accumulate) {
+        // On the first chunk, clear the slice energies of this thread and any buffer elements
+        // that no thread of this launch owns.
+
+        for (int index = GLOBAL_ID; index < SLICE_BUFFER_SIZE; index += GLOBAL_SIZE)
+            for (int slice = 0; slice < NUM_SLICES; slice++)
+                sliceEnergyBuffer[slice*SLICE_BUFFER_SIZE+index] = 0;
+    }
+    mixed energy = 0;
+    for (int i = GLOBAL_ID; i < NUM_ATOMS; i += GLOBAL_SIZE) {
+        int atom = pmeAtomGridIndex[i].x;
+        int subset = subsets[atom];
+        if (!subsetFlags[subset])
+            continue;
         real q = CHARGE*EPSILON_FACTOR;
+        if (q == 0)
+            continue;
+        real4 pos = posq[atom];
+        APPLY_PERIODIC_TO_POS(pos)
+        real3 t = make_real3(pos.x*recipBoxVecX.x+pos.y*recipBoxVecY.x+pos.z*recipBoxVecZ.x,
+                             pos.y*recipBoxVecY.y+pos.z*recipBoxVecZ.y,
+                             pos.z*recipBoxVecZ.z);
+        t.x = (t.x-floor(t.x))*GRID_SIZE_X;
+        t.y = (t.y-floor(t.y))*GRID_SIZE_Y;
+        t.z = (t.z-floor(t.z))*GRID_SIZE_Z;
+        int3 gridIndex = make_int3(((int) t.x) % GRID_SIZE_X,
+                                   ((int) t.y) % GRID_SIZE_Y,
+                                   ((int) t.z) % GRID_SIZE_Z);
+        real3 dr = make_real3(t.x-(int) t.x, t.y-(int) t.y, t.z-(int) t.z);
+        data[PME_ORDER-1] = make_real3(0);
+        data[1] = dr;
+        data[0] = make_real3(1)-dr;
+        for (int j = 3; j < PME_ORDER; j++) {
+            real div = RECIP((real) (j-1));
+            data[j-1] = div*dr*data[j-2];
+            for (int k = 1; k < (j-1); k++)
+                data[j-k-1] = div*((dr+make_real3(k))*data[j-k-2] + (make_real3(j-k)-dr)*data[j-k-1]);
+            data[0] = div*(make_real3(1)-dr)*data[0];
+        }
+        ddata[0] = -data[0];
+        for (int j = 1; j < PME_ORDER; j++)
+            ddata[j] = data[j-1]-data[j];
+        data[PME_ORDER-1] = scale*dr*data[PME_ORDER-2];
+        for (int j = 1; j < (PME_ORDER-1); j++)
+            data[PME_ORDER-j-1] = scale*((dr+make_real3(j))*data[PME_ORDER-j-2] + (make_real3(PME_ORDER-j)-dr)*data[PME_ORDER-j-1]);
+        data[0] = scale*(make_real3(1)-dr)*data[0];
+
+        // Interpolate the potential and its gradient from each grid in the chunk.
+
+        real3 force = make_real3(0);
+        for (int jj = 0; jj < SUBSET_CHUNK_SIZE && firstSubset+jj < NUM_SUBSETS; jj++) {
+            int j = firstSubset+jj;
+            int slice = (subset < j ? j*(j+1)/2+subset : subset*(subset+1)/2+j);
+            GLOBAL const real* RESTRICT grid = &pmeGrid[jj*gridSize];
+            real phi = 0;
+            real3 grad = make_real3(0);
+            for (int ix = 0; ix < PME_ORDER; ix++) {
+                int xbase = gridIndex.x+ix;
+                xbase -= (xbase >= GRID_SIZE_X ? GRID_SIZE_X : 0);
+                xbase = xbase*GRID_SIZE_Y*GRID_SIZE_Z;
+                real dx = data[ix].x;
+                real ddx = ddata[ix].x;
+                for (int iy = 0; iy < PME_ORDER; iy++) {
+                    int ybase = gridIndex.y+iy;
+                    ybase -= (ybase >= GRID_SIZE_Y ? GRID_SIZE_Y : 0);
+                    ybase = xbase + ybase*GRID_SIZE_Z;
+                    real dy = data[iy].y;
+                    real ddy = ddata[iy].y;
+                    for (int iz = 0; iz < PME_ORDER; iz++) {
+                        int zindex = gridIndex.z+iz;
+                        zindex -= (zindex >= GRID_SIZE_Z ? GRID_SIZE_Z : 0);
+                        real gridvalue = grid[ybase+zindex];
+                        phi += dx*dy*data[iz].z*gridvalue;
+                        grad.x += ddx*dy*data[iz].z*gridvalue;
+                        grad.y += dx*ddy*data[iz].z*gridvalue;
+                        grad.z += dx*dy*ddata[iz].z*gridvalue;
+                    }
+                }
+            }
+            if (includeEnergy) {
+                real sliceEnergy = 0.5f*q*phi;
+                energy += sliceWeights[slice]*sliceEnergy;
+                if (recordSliceEnergies && sliceFlags[slice])
+                    sliceEnergyBuffer[slice*SLICE_BUFFER_SIZE+GLOBAL_ID] += sliceEnergy;
+#ifdef HAS_DERIVATIVES
+                if (sliceDerivIndices[slice] >= 0)
+                    energyParamDerivs[GLOBAL_ID*numDerivs+sliceDerivIndices[slice]] += sliceEnergy;
+#endif
+            }
+            force += sliceWeights[slice]*grad;
+        }
+        if (!includeForces)
+            continue;
         real forceX = -q*(force.x*GRID_SIZE_X*recipBoxVecX.x);
         real forceY = -q*(force.x*GRID_SIZE_X*recipBoxVecY.x+force.y*GRID_SIZE_Y*recipBoxVecY.y);
         real forceZ = -q*(force.x*GRID_SIZE_X*recipBoxVecZ.x+force.y*GRID_SIZE_Y*recipBoxVecZ.y+force.z*GRID_SIZE_Z*recipBoxVecZ.z);
@@ -546,7 +947,24 @@ KERNEL void gridInterpolateForce(GLOBAL const real4* RESTRICT posq, GLOBAL mm_ul
         forceBuffers[atom+2*PADDED_NUM_ATOMS] += (mm_ulong) realToFixedPoint(forceZ);
 #endif
     }
+    if (!includeEnergy)
+        return;
+
+#if defined(USE_PME_STREAM)
+    // On the first chunk, clear any buffer elements that no thread of this launch owns.
+
+    if (!accumulate)
+        for (int index = GLOBAL_ID+GLOBAL_SIZE; index < SLICE_BUFFER_SIZE; index += GLOBAL_SIZE)
+            energyBuffer[index] = 0;
+    if (accumulate)
+        energyBuffer[GLOBAL_ID] += energy;
+    else
+        energyBuffer[GLOBAL_ID] = energy;
+#else
+    energyBuffer[GLOBAL_ID] += energy;
+#endif
 }
+#endif
 
 KERNEL void addForces(GLOBAL const real4* RESTRICT forces, GLOBAL mm_long* RESTRICT forceBuffers) {
     for (int atom = GLOBAL_ID; atom < NUM_ATOMS; atom += GLOBAL_SIZE) {
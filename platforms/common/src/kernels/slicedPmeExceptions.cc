@@ -1,13 +1,25 @@
-float exceptionChargeProds = PARAMS[index];
-real3 delta = make_real3(pos2.x-pos1.x, pos2.y-pos1.y, pos2.z-pos1.z);
+// Every force group that contains slices registers this code, but only the first group
+// included in the current evaluation computes the exception, for all included slices.
+
+int slice = SLICES[index];
+real3 force1 = make_real3(0, 0, 0);
+real3 force2 = make_real3(0, 0, 0);
+if (IS_DIRECT_LEADER && INCLUDE_SLICE) {
+    float exceptionChargeProds = PARAMS[index];
+    real3 delta = make_real3(pos2.x-pos1.x, pos2.y-pos1.y, pos2.z-pos1.z);
 #if APPLY_PERIODIC
-APPLY_PERIODIC_TO_DELTA(delta)
+    APPLY_PERIODIC_TO_DELTA(delta)
 #endif
-real r2 = delta.x*delta.x + delta.y*delta.y + delta.z*delta.z;
-real invR = RSQRT(r2);
-real tempEnergy = exceptionChargeProds*invR;
-real dEdR = tempEnergy*invR*invR;
-energy += tempEnergy;
-delta *= dEdR;
-real3 force1 = -delta;
-real3 force2 = delta;
+    real r2 = delta.x*delta.x + delta.y*delta.y + delta.z*delta.z;
+    real invR = RSQRT(r2);
+    real unscaledEnergy = exceptionChargeProds*invR;
+    COMPUTE_DERIVATIVES
+    real tempEnergy = SLICE_LAMBDA[slice]*unscaledEnergy;
+    real dEdR = tempEnergy*invR*invR;
+    energy += tempEnergy;
+    if (RECORD_SLICE_ENERGIES[0])
+        SLICE_ENERGY[slice*SLICE_BUFFER_SIZE+GLOBAL_ID] += unscaledEnergy;
+    delta *= dEdR;
+    force1 = -delta;
+    force2 = delta;
+}
@@ -1,24 +1,40 @@
-const float exclusionChargeProds = PARAMS[index];
-real3 delta = make_real3(pos2.x-pos1.x, pos2.y-pos1.y, pos2.z-pos1.z);
+// Every force group that contains slices registers this code, but only the first group
+// included in the current evaluation computes the exclusion, for all included slices.
+
+const int slice = SLICES[index];
+real3 force1 = make_real3(0, 0, 0);
+real3 force2 = make_real3(0, 0, 0);
+if (IS_DIRECT_LEADER && INCLUDE_SLICE) {
+    const float exclusionChargeProds = PARAMS[index];
+    real3 delta = make_real3(pos2.x-pos1.x, pos2.y-pos1.y, pos2.z-pos1.z);
 #if USE_PERIODIC
     APPLY_PERIODIC_TO_DELTA(delta)
 #endif
-const real r2 = delta.x*delta.x + delta.y*delta.y + delta.z*delta.z;
-const real r = SQRT(r2);
-const real invR = RECIP(r);
-const real alphaR = EWALD_ALPHA*r;
-const real expAlphaRSqr = EXP(-alphaR*alphaR);
-real tempForce = 0.0f;
-if (alphaR > 1e-6f) {
-    const real erfAlphaR = ERF(alphaR);
-    const real prefactor = exclusionChargeProds*invR;
-    tempForce = -prefactor*(erfAlphaR-alphaR*expAlphaRSqr*TWO_OVER_SQRT_PI);
-    energy -= prefactor*erfAlphaR;
+    const real r2 = delta.x*delta.x + delta.y*delta.y + delta.z*delta.z;
+    const real r = SQRT(r2);
+    const real invR = RECIP(r);
+    const real alphaR = EWALD_ALPHA*r;
+    const real expAlphaRSqr = EXP(-alphaR*alphaR);
+    real tempForce = 0.0f;
+    real tempEnergy;
+    if (alphaR > 1e-6f) {
+        const real erfAlphaR = ERF(alphaR);
+        const real prefactor = exclusionChargeProds*invR;
+        tempForce = -prefactor*(erfAlphaR-alphaR*expAlphaRSqr*TWO_OVER_SQRT_PI);
+        tempEnergy = -prefactor*erfAlphaR;
+    }
+    else {
+        tempEnergy = -TWO_OVER_SQRT_PI*EWALD_ALPHA*exclusionChargeProds;
+    }
+    const real unscaledEnergy = tempEnergy;
+    COMPUTE_DERIVATIVES
+    tempForce *= SLICE_LAMBDA[slice];
+    tempEnergy *= SLICE_LAMBDA[slice];
+    energy += tempEnergy;
+    if (RECORD_SLICE_ENERGIES[0])
+        SLICE_ENERGY[slice*SLICE_BUFFER_SIZE+GLOBAL_ID] += unscaledEnergy;
+    if (r > 0)
+        delta *= tempForce*invR*invR;
+    force1 = -delta;
+    force2 = delta;
 }
-else {
-    energy -= TWO_OVER_SQRT_PI*EWALD_ALPHA*exclusionChargeProds;
-}
-if (r > 0)
-    delta *= tempForce*invR*invR;
-real3 force1 = -delta;
-real3 force2 = delta;
@@ -3,10 +3,15 @@
  */
 KERNEL void computeParameters(GLOBAL mixed* RESTRICT energyBuffer, int includeSelfEnergy, GLOBAL real* RESTRICT globalParams,
         int numAtoms, GLOBAL const float* RESTRICT baseParticleCharges, GLOBAL real4* RESTRICT posq, GLOBAL real* RESTRICT charge,
-        GLOBAL float2* RESTRICT particleParamOffsets, GLOBAL int* RESTRICT particleOffsetIndices
+        GLOBAL float2* RESTRICT particleParamOffsets, GLOBAL int* RESTRICT particleOffsetIndices,
+        GLOBAL const int* RESTRICT subsets, GLOBAL const real* RESTRICT sliceWeights, GLOBAL const int* RESTRICT sliceFlags,
+        GLOBAL mixed* RESTRICT sliceEnergyBuffer, int recordSliceEnergies
 #ifdef HAS_EXCEPTIONS
         , int numExceptions, GLOBAL const float* RESTRICT baseExceptionChargeProds, GLOBAL float* RESTRICT exceptionChargeProds,
         GLOBAL float2* RESTRICT exceptionParamOffsets, GLOBAL int* RESTRICT exceptionOffsetIndices
+#endif
+#ifdef HAS_DERIVATIVES
+        , GLOBAL mixed* RESTRICT energyParamDerivs, int numDerivs, GLOBAL const int* RESTRICT sliceDerivIndices
 #endif
         ) {
     mixed energy = 0;
@@ -29,7 +34,15 @@ KERNEL void computeParameters(GLOBAL mixed* RESTRICT energyBuffer, int includeSe
 #endif
 #ifdef HAS_OFFSETS
     #ifdef INCLUDE_EWALD
-        energy -= EWALD_SELF_ENERGY_SCALE*q*q;
+        int diagonal = subsets[i]*(subsets[i]+3)/2;
+        mixed unscaledSelfEnergy = -EWALD_SELF_ENERGY_SCALE*q*q;
+        energy += sliceWeights[diagonal]*unscaledSelfEnergy;
+        if (includeSelfEnergy && recordSliceEnergies && sliceFlags[diagonal])
+            sliceEnergyBuffer[diagonal*SLICE_BUFFER_SIZE+GLOBAL_ID] += unscaledSelfEnergy;
+        #ifdef HAS_DERIVATIVES
+        if (sliceDerivIndices[diagonal] >= 0)
+            energyParamDerivs[GLOBAL_ID*numDerivs+sliceDerivIndices[diagonal]] += unscaledSelfEnergy;
+        #endif
     #endif
 #endif
     }
@@ -67,4 +80,26 @@ KERNEL void computeExclusionParameters(GLOBAL real4* RESTRICT posq, GLOBAL real*
 #endif
         exclusionChargeProds[i] = (float) (ONE_4PI_EPS0*chargeProd);
     }
-}
\ No newline at end of file
+}
+
+/**
+ * Sum the contributions of all threads to the energy of each slice.  Each slice owns
+ * bufferSize consecutive elements of sliceEnergyBuffer.
+ */
+KERNEL void reduceSliceEnergies(GLOBAL const mixed* RESTRICT sliceEnergyBuffer, GLOBAL mixed* RESTRICT sliceEnergies, int bufferSize) {
+    LOCAL mixed tempBuffer[WORK_GROUP_SIZE];
+    for (int slice = GROUP_ID; slice < NUM_SLICES; slice += NUM_GROUPS) {
+        mixed sum = 0;
+        for (int index = LOCAL_ID; index < bufferSize; index += LOCAL_SIZE)
+            sum += sliceEnergyBuffer[slice*bufferSize+index];
+        tempBuffer[LOCAL_ID] = sum;
+        for (int i = 1; i < WORK_GROUP_SIZE; i *= 2) {
+            SYNC_THREADS;
+            if (LOCAL_ID%(i*2) == 0 && LOCAL_ID+i < WORK_GROUP_SIZE)
+                tempBuffer[LOCAL_ID] += tempBuffer[LOCAL_ID+i];
+        }
+        if (LOCAL_ID == 0)
+            sliceEnergies[slice] += tempBuffer[0];
+        SYNC_THREADS;
+    }
+}
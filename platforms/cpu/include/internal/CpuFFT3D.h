@@ -0,0 +1,105 @@
+#ifndef __OPENMM_CPUFFT3D_H__
+#define __OPENMM_CPUFFT3D_H__
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2014 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/internal/ThreadPool.h"
+#include "openmm/reference/fftpack.h"
+#include <memory>
+#include <vector>
+
+namespace PmeSlicing {
+
+/**
+ * This class performs batched three dimensional real-to-complex Fast Fourier Transforms on the
+ * host, distributing the work over a thread pool.  Each transform is decomposed into passes of
+ * one dimensional transforms along z, y, and x, and the lines of every pass are split among the
+ * threads across all members of the batch.
+ *
+ * The one dimensional plans are immutable and kept in a process-wide cache keyed by the grid
+ * dimensions, batch size, and precision, so objects for the same grid share them.  Every transform
+ * allocates its own scratch lines, so independent objects may perform transforms at the same time
+ * without locking.  The z pass transforms two real lines with each complex transform.
+ *
+ * Note that this class performs an unnormalized transform.  That means that if you perform
+ * a forward transform followed immediately by an inverse transform, the effect is to
+ * multiply every value of the original data set by the total number of data points.
+ */
+
+class CpuFFT3D {
+public:
+    class Plan;
+    /**
+     * Create a CpuFFT3D object for performing transforms of a particular size.
+     *
+     * The real data is of size batch*xsize*ysize*zsize, ordered such that
+     * real[((b*xsize + x)*ysize + y)*zsize + z] contains element (x, y, z) of member b.  The complex data
+     * is of size batch*xsize*ysize*(zsize/2+1) and contains only the non-redundant elements.  Both
+     * vectors are resized by the constructor and must not be reallocated afterward.
+     *
+     * @param threads  the thread pool used to perform the transforms
+     * @param xsize    the first dimension of the data sets on which FFTs will be performed
+     * @param ysize    the second dimension of the data sets on which FFTs will be performed
+     * @param zsize    the third dimension of the data sets on which FFTs will be performed
+     * @param batch    the number of FFTs
+     * @param real     the real data
+     * @param complex  the complex data
+     */
+    CpuFFT3D(OpenMM::ThreadPool& threads, int xsize, int ysize, int zsize, int batch, std::vector<double>& real, std::vector<t_complex>& complex);
+    /**
+     * Perform a Fourier transform.  A forward transform reads the real data and writes the
+     * complex data.  An inverse transform reads the complex data, which is destroyed, and writes
+     * the real data.
+     *
+     * @param forward  true to perform a forward transform, false to perform an inverse transform
+     */
+    void execFFT(bool forward);
+    /**
+     * Get the plans used by this object.  Every object that transforms grids of the same shape
+     * returns the same plans.
+     */
+    const Plan* getPlan() const;
+private:
+    static std::shared_ptr<const Plan> getCachedPlan(int xsize, int ysize, int zsize, int batch);
+    void transformX(bool forward);
+    void transformY(bool forward);
+    void transformZ(bool forward);
+    OpenMM::ThreadPool& threads;
+    int xsize, ysize, zsize, batch;
+    std::vector<double>& real;
+    std::vector<t_complex>& complex;
+    std::shared_ptr<const Plan> plan;
+};
+
+} // namespace PmeSlicing
+
+#endif // __OPENMM_CPUFFT3D_H__
@@ -0,0 +1,307 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2014 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/CpuFFT3D.h"
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+using namespace PmeSlicing;
+using namespace OpenMM;
+using namespace std;
+
+static inline t_complex multiply(const t_complex& a, const t_complex& b) {
+    return t_complex(a.re*b.re-a.im*b.im, a.re*b.im+a.im*b.re);
+}
+
+namespace {
+
+/**
+ * A plan for one dimensional complex transforms of a particular length.  It performs a mixed
+ * radix Stockham transform, which needs a scratch line of the same length but no other working
+ * storage.  The plan is never modified after it is created, so any number of threads may use it
+ * at once.
+ */
+class LinePlan {
+public:
+    LinePlan(int size) : size(size), twiddles(size) {
+        for (int i = 0; i < size; i++) {
+            double angle = 2*M_PI*i/size;
+            twiddles[i] = t_complex(cos(angle), -sin(angle));
+        }
+        int remaining = size;
+        while (remaining%4 == 0) {
+            factors.push_back(4);
+            remaining /= 4;
+        }
+        for (int factor = 2; remaining > 1; factor++)
+            while (remaining%factor == 0) {
+                factors.push_back(factor);
+                remaining /= factor;
+            }
+    }
+    /**
+     * Transform a line in place.  The scratch line must hold at least as many elements as the data.
+     */
+    void exec(t_complex* data, t_complex* scratch, bool forward) const {
+        // Each stage splits every transform of length n into p interleaved transforms of length
+        // m=n/p.  The s transforms left by the previous stages are stored with stride s, so the
+        // output of the last stage is in natural order.
+
+        t_complex* x = data;
+        t_complex* y = scratch;
+        int n = size, s = 1;
+        for (int p : factors) {
+            int m = n/p;
+            for (int q = 0; q < m; q++) {
+                if (p == 2) {
+                    t_complex w = twiddle(q*s, forward);
+                    for (int k = 0; k < s; k++) {
+                        const t_complex& a = x[k+s*q];
+                        const t_complex& b = x[k+s*(q+m)];
+                        y[k+s*2*q] = t_complex(a.re+b.re, a.im+b.im);
+                        y[k+s*(2*q+1)] = multiply(t_complex(a.re-b.re, a.im-b.im), w);
+                    }
+                }
+                else if (p == 4) {
+                    t_complex w1 = twiddle(q*s, forward);
+                    t_complex w2 = twiddle(2*q*s, forward);
+                    t_complex w3 = twiddle(3*q*s, forward);
+                    double sign = (forward ? 1.0 : -1.0);
+                    for (int k = 0; k < s; k++) {
+                        const t_complex& a0 = x[k+s*q];
+                        const t_complex& a1 = x[k+s*(q+m)];
+                        const t_complex& a2 = x[k+s*(q+2*m)];
+                        const t_complex& a3 = x[k+s*(q+3*m)];
+                        t_complex t0(a0.re+a2.re, a0.im+a2.im);
+                        t_complex t1(a0.re-a2.re, a0.im-a2.im);
+                        t_complex t2(a1.re+a3.re, a1.im+a3.im);
+                        t_complex t3(sign*(a1.im-a3.im), sign*(a3.re-a1.re));
+                        y[k+s*4*q] = t_complex(t0.re+t2.re, t0.im+t2.im);
+                        y[k+s*(4*q+1)] = multiply(t_complex(t1.re+t3.re, t1.im+t3.im), w1);
+                        y[k+s*(4*q+2)] = multiply(t_complex(t0.re-t2.re, t0.im-t2.im), w2);
+                        y[k+s*(4*q+3)] = multiply(t_complex(t1.re-t3.re, t1.im-t3.im), w3);
+                    }
+                }
+                else {
+                    for (int t = 0; t < p; t++) {
+                        t_complex w = twiddle(q*t*s, forward);
+                        for (int k = 0; k < s; k++) {
+                            t_complex sum(0.0, 0.0);
+                            for (int r = 0; r < p; r++) {
+                                t_complex term = multiply(x[k+s*(q+r*m)], twiddle((r*t)%p*m*s, forward));
+                                sum.re += term.re;
+                                sum.im += term.im;
+                            }
+                            y[k+s*(p*q+t)] = multiply(sum, w);
+                        }
+                    }
+                }
+            }
+            swap(x, y);
+            n = m;
+            s *= p;
+        }
+        if (x != data)
+            for (int i = 0; i < size; i++)
+                data[i] = x[i];
+    }
+private:
+    t_complex twiddle(int power, bool forward) const {
+        const t_complex& w = twiddles[power];
+        return (forward ? w : t_complex(w.re, -w.im));
+    }
+    int size;
+    vector<int> factors;
+    vector<t_complex> twiddles;
+};
+
+}
+
+/**
+ * The one dimensional plans for transforming a grid.  They hold no scratch space, so every
+ * object transforming a grid of the same shape can share them without locking.
+ */
+class CpuFFT3D::Plan {
+public:
+    Plan(int xsize, int ysize, int zsize) : xPlan(xsize), yPlan(ysize), zPlan(zsize) {
+    }
+    const LinePlan xPlan, yPlan, zPlan;
+};
+
+CpuFFT3D::CpuFFT3D(ThreadPool& threads, int xsize, int ysize, int zsize, int batch, vector<double>& real, vector<t_complex>& complex) :
+        threads(threads), xsize(xsize), ysize(ysize), zsize(zsize), batch(batch), real(real), complex(complex) {
+    real.resize(batch*xsize*ysize*zsize);
+    complex.resize(batch*xsize*ysize*(zsize/2+1));
+    plan = getCachedPlan(xsize, ysize, zsize, batch);
+}
+
+shared_ptr<const CpuFFT3D::Plan> CpuFFT3D::getCachedPlan(int xsize, int ysize, int zsize, int batch) {
+    // Plans stay in the cache while any object uses them.  At most maxUnusedPlans others are kept
+    // for Contexts created later, so a process that uses many grid shapes does not accumulate them.
+    // The host transforms always work in double precision, but the precision is part of the key
+    // so plans for different data types can never be confused.
+
+    const int maxUnusedPlans = 4;
+    static mutex cacheLock;
+    static map<tuple<int, int, int, int, int>, shared_ptr<const Plan> > cache;
+    lock_guard<mutex> guard(cacheLock);
+    shared_ptr<const Plan>& cached = cache[make_tuple(xsize, ysize, zsize, batch, (int) sizeof(double))];
+    if (!cached)
+        cached = make_shared<const Plan>(xsize, ysize, zsize);
+    shared_ptr<const Plan> result = cached;
+    int numUnused = 0;
+    for (auto iter = cache.begin(); iter != cache.end(); ) {
+        if (iter->second.use_count() == 1 && ++numUnused > maxUnusedPlans)
+            iter = cache.erase(iter);
+        else
+            ++iter;
+    }
+    return result;
+}
+
+const CpuFFT3D::Plan* CpuFFT3D::getPlan() const {
+    return plan.get();
+}
+
+void CpuFFT3D::execFFT(bool forward) {
+    if (forward) {
+        transformZ(true);
+        transformY(true);
+        transformX(true);
+    }
+    else {
+        transformX(false);
+        transformY(false);
+        transformZ(false);
+    }
+}
+
+void CpuFFT3D::transformZ(bool forward) {
+    // Each task is a plane of constant x in one member of the batch.  Only the non-redundant half
+    // of every line is stored.  Two real lines a and b are transformed together as the complex
+    // line a+ib, and their spectra are separated using the Hermitian symmetry of each one:
+    // A[k] = (Z[k]+conj(Z[N-k]))/2 and B[k] = (Z[k]-conj(Z[N-k]))/2i.
+
+    int zcomplex = zsize/2+1;
+    atomic<int> counter(0);
+    threads.execute([&] (ThreadPool& pool, int threadIndex) {
+        const LinePlan& zPlan = plan->zPlan;
+        vector<t_complex> line(zsize), scratch(zsize);
+        for (int p = counter++; p < batch*xsize; p = counter++)
+            for (int y = 0; y < ysize; y += 2) {
+                bool paired = (y+1 < ysize);
+                double* realLine1 = &real[((size_t) p*ysize+y)*zsize];
+                double* realLine2 = realLine1+zsize;
+                t_complex* complexLine1 = &complex[((size_t) p*ysize+y)*zcomplex];
+                t_complex* complexLine2 = complexLine1+zcomplex;
+                if (forward) {
+                    for (int z = 0; z < zsize; z++)
+                        line[z] = t_complex(realLine1[z], paired ? realLine2[z] : 0.0);
+                    zPlan.exec(&line[0], &scratch[0], true);
+                    for (int z = 0; z < zcomplex; z++) {
+                        const t_complex& z1 = line[z];
+                        const t_complex& z2 = line[z == 0 ? 0 : zsize-z];
+                        complexLine1[z] = t_complex(0.5*(z1.re+z2.re), 0.5*(z1.im-z2.im));
+                        if (paired)
+                            complexLine2[z] = t_complex(0.5*(z1.im+z2.im), 0.5*(z2.re-z1.re));
+                    }
+                }
+                else {
+                    for (int z = 0; z < zcomplex; z++) {
+                        const t_complex& a = complexLine1[z];
+                        t_complex b = (paired ? complexLine2[z] : t_complex(0.0, 0.0));
+                        line[z] = t_complex(a.re-b.im, a.im+b.re);
+                    }
+                    for (int z = zcomplex; z < zsize; z++) {
+                        const t_complex& a = complexLine1[zsize-z];
+                        t_complex b = (paired ? complexLine2[zsize-z] : t_complex(0.0, 0.0));
+                        line[z] = t_complex(a.re+b.im, b.re-a.im);
+                    }
+                    zPlan.exec(&line[0], &scratch[0], false);
+                    for (int z = 0; z < zsize; z++)
+                        realLine1[z] = line[z].re;
+                    if (paired)
+                        for (int z = 0; z < zsize; z++)
+                            realLine2[z] = line[z].im;
+                }
+            }
+    });
+    threads.waitForThreads();
+}
+
+void CpuFFT3D::transformY(bool forward) {
+    // Each task is a plane of constant x in one member of the batch.
+
+    int zcomplex = zsize/2+1;
+    atomic<int> counter(0);
+    threads.execute([&] (ThreadPool& pool, int threadIndex) {
+        const LinePlan& yPlan = plan->yPlan;
+        vector<t_complex> line(ysize), scratch(ysize);
+        for (int p = counter++; p < batch*xsize; p = counter++)
+            for (int z = 0; z < zcomplex; z++) {
+                t_complex* data = &complex[(size_t) p*ysize*zcomplex+z];
+                for (int y = 0; y < ysize; y++)
+                    line[y] = data[y*zcomplex];
+                yPlan.exec(&line[0], &scratch[0], forward);
+                for (int y = 0; y < ysize; y++)
+                    data[y*zcomplex] = line[y];
+            }
+    });
+    threads.waitForThreads();
+}
+
+void CpuFFT3D::transformX(bool forward) {
+    // Each task is a plane of constant y in one member of the batch.
+
+    int zcomplex = zsize/2+1;
+    int stride = ysize*zcomplex;
+    atomic<int> counter(0);
+    threads.execute([&] (ThreadPool& pool, int threadIndex) {
+        const LinePlan& xPlan = plan->xPlan;
+        vector<t_complex> line(xsize), scratch(xsize);
+        for (int p = counter++; p < batch*ysize; p = counter++) {
+            int b = p/ysize;
+            int y = p-b*ysize;
+            for (int z = 0; z < zcomplex; z++) {
+                t_complex* data = &complex[((size_t) b*xsize*ysize+y)*zcomplex+z];
+                for (int x = 0; x < xsize; x++)
+                    line[x] = data[(size_t) x*stride];
+                xPlan.exec(&line[0], &scratch[0], forward);
+                for (int x = 0; x < xsize; x++)
+                    data[(size_t) x*stride] = line[x];
+            }
+        }
+    });
+    threads.waitForThreads();
+}
@@ -0,0 +1,504 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2014 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#ifdef WIN32
+  #define _USE_MATH_DEFINES // Needed to get M_PI
+#endif
+#include "CpuPmeSlicingKernels.h"
+#include "SlicedPmeForce.h"
+#include "openmm/OpenMMException.h"
+#include "openmm/reference/ReferenceForce.h"
+#include "openmm/reference/SimTKOpenMMRealType.h"
+#include "openmm/reference/ReferenceNeighborList.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace PmeSlicing;
+using namespace OpenMM;
+using namespace std;
+
+/**
+ * Get the index of slice[I,J] in the triangular layout used for slice flags.
+ */
+static int getSliceIndex(int subset1, int subset2) {
+    int i = min(subset1, subset2);
+    int j = max(subset1, subset2);
+    return j*(j+1)/2+i;
+}
+
+/**
+ * Compute the B-spline coefficients (and their derivatives) of the given order at a
+ * fractional grid offset dr.
+ */
+static void computeBSplines(int order, double dr, double* data, double* ddata) {
+    data[order-1] = 0.0;
+    data[1] = dr;
+    data[0] = 1.0-dr;
+    for (int i = 3; i < order; i++) {
+        double div = 1.0/(i-1.0);
+        data[i-1] = div*dr*data[i-2];
+        for (int j = 1; j < i-1; j++)
+            data[i-j-1] = div*((dr+j)*data[i-j-2]+(i-j-dr)*data[i-j-1]);
+        data[0] = div*(1.0-dr)*data[0];
+    }
+    ddata[0] = -data[0];
+    for (int i = 1; i < order; i++)
+        ddata[i] = data[i-1]-data[i];
+    double div = 1.0/(order-1);
+    data[order-1] = div*dr*data[order-2];
+    for (int j = 1; j < order-1; j++)
+        data[order-j-1] = div*((dr+j)*data[order-j-2]+(order-j-dr)*data[order-j-1]);
+    data[0] = div*(1.0-dr)*data[0];
+}
+
+CpuCalcSlicedPmeForceKernel::~CpuCalcSlicedPmeForceKernel() {
+    if (subsetFFT != NULL)
+        delete subsetFFT;
+}
+
+void CpuCalcSlicedPmeForceKernel::initialize(const System& system, const SlicedPmeForce& force) {
+    ReferenceCalcSlicedPmeForceKernel::initialize(system, force);
+
+    int numThreads = threads.getNumThreads();
+    subsetFFT = new CpuFFT3D(threads, gridSize[0], gridSize[1], gridSize[2], numSubsets, realGrids, complexGrids);
+    threadForce.resize(numThreads);
+    threadEnergies.resize(numThreads);
+    threadGrids.resize(numThreads);
+
+    // Tabulate erfc(alpha*r) and its first two derivatives for the direct space pair loop, which
+    // evaluates both erfc(alpha*r) and the force factor erfc(alpha*r)-r*d/dr erfc(alpha*r) with
+    // cubic Hermite interpolation.  The spacing is fixed in units of alpha*r, which bounds the
+    // absolute error of both functions by 1e-12 for any alpha.
+
+    const double pointsPerUnit = 512;
+    int numTablePoints = (int) ceil(pointsPerUnit*ewaldAlpha*nonbondedCutoff)+2;
+    ewaldTableSpacing = 1.0/(pointsPerUnit*ewaldAlpha);
+    ewaldTable.resize(3*numTablePoints);
+    for (int i = 0; i < numTablePoints; i++) {
+        double r = i*ewaldTableSpacing;
+        double expTerm = 2.0/sqrt(M_PI)*exp(-ewaldAlpha*ewaldAlpha*r*r);
+        ewaldTable[3*i] = erfc(ewaldAlpha*r);
+        ewaldTable[3*i+1] = -ewaldAlpha*expTerm;
+        ewaldTable[3*i+2] = 2*ewaldAlpha*ewaldAlpha*ewaldAlpha*r*expTerm;
+    }
+}
+
+void CpuCalcSlicedPmeForceKernel::computeDirect(const vector<Vec3>& posData, vector<Vec3>& forceData, const Vec3* boxVectors, const vector<bool>& includeSlice, vector<vector<double> >& energies) {
+    updateNeighborList(posData, boxVectors);
+    threads.execute([&] (ThreadPool& pool, int threadIndex) {
+        computeDirectInThread(threadIndex, posData, boxVectors, includeSlice);
+    });
+    threads.waitForThreads();
+    reduceThreadForces(forceData);
+    reduceThreadEnergies(energies);
+}
+
+void CpuCalcSlicedPmeForceKernel::computeDirectInThread(int threadIndex, const vector<Vec3>& posData, const Vec3* boxVectors, const vector<bool>& includeSlice) {
+    const double twoOverSqrtPi = 2.0/sqrt(M_PI);
+    const double cutoffSquared = nonbondedCutoff*nonbondedCutoff;
+    double deltaR[ReferenceForce::LastDeltaRIndex];
+    int numThreads = threads.getNumThreads();
+    vector<Vec3>& forces = threadForce[threadIndex];
+    vector<vector<double> >& energies = threadEnergies[threadIndex];
+    forces.assign(numParticles, Vec3());
+    energies.assign(numSubsets, vector<double>(numSubsets, 0.0));
+
+    // Compute the interactions between pairs of particles within the cutoff.  Each thread
+    // processes a contiguous block of the neighbor list, blockSize pairs at a time.  The
+    // displacements, charges, and table entries of a block are gathered lane by lane, and the pair
+    // terms are then evaluated by loops over the lanes that contain only arithmetic, so the compiler
+    // can evaluate them with double precision SIMD instructions.  Pairs that are beyond the cutoff,
+    // belong to an excluded slice, or only pad the last block get a zero charge product, so the
+    // slice scaling and the accumulation into per-slice energies need no branches.
+
+    const int blockSize = 8;
+    const double tableScale = 1.0/ewaldTableSpacing;
+    int numPairs = neighborList->size();
+    int start = (long long) threadIndex*numPairs/numThreads;
+    int end = (long long) (threadIndex+1)*numPairs/numThreads;
+    vector<double> sliceEnergies(numSubsets*(numSubsets+1)/2, 0.0);
+    for (int first = start; first < end; first += blockSize) {
+        int atom1[blockSize], atom2[blockSize], slice[blockSize];
+        double dx[blockSize], dy[blockSize], dz[blockSize], r2[blockSize], chargeProd[blockSize], lambda[blockSize];
+        for (int lane = 0; lane < blockSize; lane++) {
+            int pair = min(first+lane, end-1);
+            int i = (*neighborList)[pair].first;
+            int j = (*neighborList)[pair].second;
+            atom1[lane] = i;
+            atom2[lane] = j;
+            slice[lane] = getSliceIndex(subsets[i], subsets[j]);
+            ReferenceForce::getDeltaRPeriodic(posData[j], posData[i], boxVectors, deltaR);
+            bool active = (first+lane < end && includeSlice[slice[lane]] && deltaR[ReferenceForce::R2Index] < cutoffSquared);
+            dx[lane] = deltaR[ReferenceForce::XIndex];
+            dy[lane] = deltaR[ReferenceForce::YIndex];
+            dz[lane] = deltaR[ReferenceForce::ZIndex];
+            r2[lane] = (active ? deltaR[ReferenceForce::R2Index] : cutoffSquared);
+            chargeProd[lane] = (active ? ONE_4PI_EPS0*charges[i]*charges[j] : 0.0);
+            lambda[lane] = sliceLambdas[slice[lane]];
+        }
+        double r[blockSize], invR[blockSize], t[blockSize];
+        for (int lane = 0; lane < blockSize; lane++) {
+            r[lane] = sqrt(r2[lane]);
+            invR[lane] = 1.0/r[lane];
+            t[lane] = r[lane]*tableScale;
+        }
+
+        // Gather the table entries on either side of each distance.
+
+        double e0[blockSize], d0[blockSize], dd0[blockSize], e1[blockSize], d1[blockSize], dd1[blockSize];
+        for (int lane = 0; lane < blockSize; lane++) {
+            int index = (int) t[lane];
+            const double* entry = &ewaldTable[3*index];
+            e0[lane] = entry[0];
+            d0[lane] = entry[1];
+            dd0[lane] = entry[2];
+            e1[lane] = entry[3];
+            d1[lane] = entry[4];
+            dd1[lane] = entry[5];
+            t[lane] -= index;
+        }
+        double fx[blockSize], fy[blockSize], fz[blockSize], energy[blockSize];
+        for (int lane = 0; lane < blockSize; lane++) {
+            double u = t[lane];
+            double u2 = u*u;
+            double u3 = u2*u;
+            double h00 = 2*u3-3*u2+1;
+            double h10 = ewaldTableSpacing*(u3-2*u2+u);
+            double h01 = 3*u2-2*u3;
+            double h11 = ewaldTableSpacing*(u3-u2);
+            double erfcAlphaR = h00*e0[lane]+h10*d0[lane]+h01*e1[lane]+h11*d1[lane];
+            double dErfcdR = h00*d0[lane]+h10*dd0[lane]+h01*d1[lane]+h11*dd1[lane];
+            double prefactor = chargeProd[lane]*invR[lane];
+            double dEdR = lambda[lane]*prefactor*(erfcAlphaR-r[lane]*dErfcdR)*invR[lane]*invR[lane];
+            fx[lane] = dEdR*dx[lane];
+            fy[lane] = dEdR*dy[lane];
+            fz[lane] = dEdR*dz[lane];
+            energy[lane] = prefactor*erfcAlphaR;
+        }
+        for (int lane = 0; lane < blockSize; lane++) {
+            Vec3 force(fx[lane], fy[lane], fz[lane]);
+            forces[atom1[lane]] += force;
+            forces[atom2[lane]] -= force;
+            sliceEnergies[slice[lane]] += energy[lane];
+        }
+    }
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++)
+            energies[i][j] += sliceEnergies[getSliceIndex(i, j)];
+
+    // Subtract off the reciprocal space part of excluded interactions.
+
+    start = threadIndex*numParticles/numThreads;
+    end = (threadIndex+1)*numParticles/numThreads;
+    for (int i = start; i < end; i++)
+        for (int j : exclusions[i]) {
+            if (j < i || !includeSlice[getSliceIndex(subsets[i], subsets[j])])
+                continue;
+            ReferenceForce::getDeltaRPeriodic(posData[j], posData[i], boxVectors, deltaR);
+            double r = deltaR[ReferenceForce::RIndex];
+            double alphaR = ewaldAlpha*r;
+            double chargeProd = ONE_4PI_EPS0*charges[i]*charges[j];
+            double lambda = sliceLambdas[getSliceIndex(subsets[i], subsets[j])];
+            double energy;
+            if (alphaR > 1e-6) {
+                double erfAlphaR = erf(alphaR);
+                double dEdR = -lambda*chargeProd*(erfAlphaR-alphaR*exp(-alphaR*alphaR)*twoOverSqrtPi)/(r*r*r);
+                for (int k = 0; k < 3; k++) {
+                    double force = dEdR*deltaR[k];
+                    forces[i][k] += force;
+                    forces[j][k] -= force;
+                }
+                energy = -chargeProd*erfAlphaR/r;
+            }
+            else
+                energy = -chargeProd*ewaldAlpha*twoOverSqrtPi;
+            energies[min(subsets[i], subsets[j])][max(subsets[i], subsets[j])] += energy;
+        }
+
+    // Compute the exceptions.
+
+    start = threadIndex*num14/numThreads;
+    end = (threadIndex+1)*num14/numThreads;
+    for (int i = start; i < end; i++) {
+        int particle1 = bonded14IndexArray[i][0];
+        int particle2 = bonded14IndexArray[i][1];
+        int subset1 = subsets[particle1];
+        int subset2 = subsets[particle2];
+        int slice = getSliceIndex(subset1, subset2);
+        if (!includeSlice[slice])
+            continue;
+        if (exceptionsArePeriodic)
+            ReferenceForce::getDeltaRPeriodic(posData[particle2], posData[particle1], boxVectors, deltaR);
+        else
+            ReferenceForce::getDeltaR(posData[particle2], posData[particle1], deltaR);
+        double r = deltaR[ReferenceForce::RIndex];
+        double energy = ONE_4PI_EPS0*chargeProds[i]/r;
+        double dEdR = sliceLambdas[slice]*energy/(r*r);
+        for (int k = 0; k < 3; k++) {
+            double force = dEdR*deltaR[k];
+            forces[particle1][k] += force;
+            forces[particle2][k] -= force;
+        }
+        energies[min(subset1, subset2)][max(subset1, subset2)] += energy;
+    }
+}
+
+void CpuCalcSlicedPmeForceKernel::computeReciprocal(const vector<Vec3>& posData, vector<Vec3>& forceData, const Vec3* boxVectors, bool includeForces, const vector<bool>& includeSlice, vector<vector<double> >& energies) {
+    int numThreads = threads.getNumThreads();
+
+    // A subset only needs to be placed on the grid if at least one of its slices is included.
+
+    vector<bool> includeSubset(numSubsets, false);
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++)
+            if (includeSlice[getSliceIndex(i, j)])
+                includeSubset[i] = includeSubset[j] = true;
+
+    // The self energy of each particle belongs to the diagonal slice of its subset.
+
+    for (int i = 0; i < numParticles; i++)
+        if (includeSlice[getSliceIndex(subsets[i], subsets[i])])
+            energies[subsets[i]][subsets[i]] -= ONE_4PI_EPS0*ewaldAlpha/sqrt(M_PI)*charges[i]*charges[i];
+
+    // Compute the reciprocal box vectors.
+
+    double determinant = boxVectors[0][0]*boxVectors[1][1]*boxVectors[2][2];
+    double scale = 1.0/determinant;
+    Vec3 recipBoxVectors[3];
+    recipBoxVectors[0] = Vec3(boxVectors[1][1]*boxVectors[2][2], 0, 0)*scale;
+    recipBoxVectors[1] = Vec3(-boxVectors[1][0]*boxVectors[2][2], boxVectors[0][0]*boxVectors[2][2], 0)*scale;
+    recipBoxVectors[2] = Vec3(boxVectors[1][0]*boxVectors[2][1]-boxVectors[1][1]*boxVectors[2][0], -boxVectors[0][0]*boxVectors[2][1], boxVectors[0][0]*boxVectors[1][1])*scale;
+
+    // Each thread spreads the charges of a block of particles onto its own private grids, one
+    // per subset, so no synchronization is needed while spreading.  The grids of subsets that
+    // are not included are neither cleared nor reduced, since no included slice reads them.
+
+    int gridPoints = gridSize[0]*gridSize[1]*gridSize[2];
+    gridIndex.resize(3*numParticles);
+    theta.resize(3*pmeOrder*numParticles);
+    dtheta.resize(3*pmeOrder*numParticles);
+    const double epsilonFactor = sqrt(ONE_4PI_EPS0);
+    threads.execute([&] (ThreadPool& pool, int threadIndex) {
+        vector<double>& threadGrid = threadGrids[threadIndex];
+        threadGrid.resize(numSubsets*gridPoints);
+        for (int subset = 0; subset < numSubsets; subset++)
+            if (includeSubset[subset])
+                fill(threadGrid.begin()+subset*gridPoints, threadGrid.begin()+(subset+1)*gridPoints, 0.0);
+        int start = threadIndex*numParticles/numThreads;
+        int end = (threadIndex+1)*numParticles/numThreads;
+        for (int i = start; i < end; i++) {
+            if (!includeSubset[subsets[i]])
+                continue;
+            Vec3 pos = posData[i];
+            double t[3];
+            t[0] = pos[0]*recipBoxVectors[0][0]+pos[1]*recipBoxVectors[1][0]+pos[2]*recipBoxVectors[2][0];
+            t[1] = pos[1]*recipBoxVectors[1][1]+pos[2]*recipBoxVectors[2][1];
+            t[2] = pos[2]*recipBoxVectors[2][2];
+            for (int dim = 0; dim < 3; dim++) {
+                t[dim] = (t[dim]-floor(t[dim]))*gridSize[dim];
+                int ti = (int) t[dim];
+                gridIndex[3*i+dim] = ti;
+                computeBSplines(pmeOrder, t[dim]-ti, &theta[(3*i+dim)*pmeOrder], &dtheta[(3*i+dim)*pmeOrder]);
+            }
+            double q = epsilonFactor*charges[i];
+            if (q == 0.0)
+                continue;
+            double* grid = &threadGrid[subsets[i]*gridPoints];
+            const double* thetaX = &theta[(3*i)*pmeOrder];
+            const double* thetaY = &theta[(3*i+1)*pmeOrder];
+            const double* thetaZ = &theta[(3*i+2)*pmeOrder];
+            for (int ix = 0; ix < pmeOrder; ix++) {
+                int xindex = (gridIndex[3*i]+ix) % gridSize[0];
+                for (int iy = 0; iy < pmeOrder; iy++) {
+                    int yindex = (gridIndex[3*i+1]+iy) % gridSize[1];
+                    double dxdy = q*thetaX[ix]*thetaY[iy];
+                    for (int iz = 0; iz < pmeOrder; iz++) {
+                        int zindex = (gridIndex[3*i+2]+iz) % gridSize[2];
+                        grid[(xindex*gridSize[1]+yindex)*gridSize[2]+zindex] += dxdy*thetaZ[iz];
+                    }
+                }
+            }
+        }
+    });
+    threads.waitForThreads();
+
+    // Sum the private grids, with each thread handling a block of grid points, and then
+    // transform the grids of all subsets in a single batch.
+
+    threads.execute([&] (ThreadPool& pool, int threadIndex) {
+        int start = (long long) threadIndex*gridPoints/numThreads;
+        int end = (long long) (threadIndex+1)*gridPoints/numThreads;
+        for (int subset = 0; subset < numSubsets; subset++) {
+            if (!includeSubset[subset])
+                continue;
+            double* grid = &realGrids[subset*gridPoints];
+            for (int index = start; index < end; index++) {
+                double sum = 0.0;
+                for (int i = 0; i < numThreads; i++)
+                    sum += threadGrids[i][subset*gridPoints+index];
+                grid[index] = sum;
+            }
+        }
+    });
+    threads.waitForThreads();
+    subsetFFT->execFFT(true);
+
+    // Compute the energy of every included slice from the structure factors of its two subsets,
+    // and convolve the potential felt by each subset in place.  Only the non-redundant half of
+    // the spectrum is stored, so every element with 0 < kz < zsize/2 stands for two wave vectors.
+    // The threads take interleaved planes of constant kx and accumulate their energies separately.
+
+    const double recipScaleFactor = 1.0/(M_PI*determinant);
+    const double recipExpFactor = M_PI*M_PI/(ewaldAlpha*ewaldAlpha);
+    const int zcomplex = gridSize[2]/2+1;
+    const int complexPoints = gridSize[0]*gridSize[1]*zcomplex;
+    threads.execute([&] (ThreadPool& pool, int threadIndex) {
+        vector<vector<double> >& threadEnergy = threadEnergies[threadIndex];
+        threadEnergy.assign(numSubsets, vector<double>(numSubsets, 0.0));
+        vector<t_complex> structureFactors(numSubsets);
+        for (int kx = threadIndex; kx < gridSize[0]; kx += numThreads) {
+            int mx = (kx < (gridSize[0]+1)/2) ? kx : (kx-gridSize[0]);
+            double mhx = mx*recipBoxVectors[0][0];
+            double bx = bsplineModuli[0][kx];
+            for (int ky = 0; ky < gridSize[1]; ky++) {
+                int my = (ky < (gridSize[1]+1)/2) ? ky : (ky-gridSize[1]);
+                double mhy = mx*recipBoxVectors[1][0]+my*recipBoxVectors[1][1];
+                double by = bsplineModuli[1][ky];
+                for (int kz = 0; kz < zcomplex; kz++) {
+                    int index = (kx*gridSize[1]+ky)*zcomplex+kz;
+                    for (int subset = 0; subset < numSubsets; subset++) {
+                        structureFactors[subset] = complexGrids[subset*complexPoints+index];
+                        complexGrids[subset*complexPoints+index] = t_complex(0.0, 0.0);
+                    }
+                    if (kx == 0 && ky == 0 && kz == 0)
+                        continue;
+                    int mz = (kz < (gridSize[2]+1)/2) ? kz : (kz-gridSize[2]);
+                    double mhz = mx*recipBoxVectors[2][0]+my*recipBoxVectors[2][1]+mz*recipBoxVectors[2][2];
+                    double bz = bsplineModuli[2][kz];
+                    double m2 = mhx*mhx+mhy*mhy+mhz*mhz;
+                    double denom = m2*bx*by*bz;
+                    double eterm = recipScaleFactor*exp(-recipExpFactor*m2)/denom;
+                    double multiplicity = (kz == 0 || 2*kz == gridSize[2]) ? 1.0 : 2.0;
+                    for (int j = 0; j < numSubsets; j++) {
+                        const t_complex& gridj = structureFactors[j];
+                        t_complex& convolvedj = complexGrids[j*complexPoints+index];
+                        for (int i = 0; i < j; i++) {
+                            if (!includeSlice[getSliceIndex(i, j)])
+                                continue;
+                            const t_complex& gridi = structureFactors[i];
+                            t_complex& convolvedi = complexGrids[i*complexPoints+index];
+                            double weight = sliceLambdas[getSliceIndex(i, j)]*eterm;
+                            threadEnergy[i][j] += multiplicity*eterm*(gridi.re*gridj.re+gridi.im*gridj.im);
+                            convolvedi.re += weight*gridj.re;
+                            convolvedi.im += weight*gridj.im;
+                            convolvedj.re += weight*gridi.re;
+                            convolvedj.im += weight*gridi.im;
+                        }
+                        if (includeSlice[getSliceIndex(j, j)]) {
+                            double weight = sliceLambdas[getSliceIndex(j, j)]*eterm;
+                            threadEnergy[j][j] += 0.5*multiplicity*eterm*(gridj.re*gridj.re+gridj.im*gridj.im);
+                            convolvedj.re += weight*gridj.re;
+                            convolvedj.im += weight*gridj.im;
+                        }
+                    }
+                }
+            }
+        }
+    });
+    threads.waitForThreads();
+    reduceThreadEnergies(energies);
+
+    // The remaining steps only contribute to the forces.
+
+    if (!includeForces)
+        return;
+    subsetFFT->execFFT(false);
+
+    // Interpolate the forces from the grid.  Every particle is handled by a single thread, so
+    // the forces can be written directly.
+
+    threads.execute([&] (ThreadPool& pool, int threadIndex) {
+        int start = threadIndex*numParticles/numThreads;
+        int end = (threadIndex+1)*numParticles/numThreads;
+        for (int i = start; i < end; i++) {
+            double q = epsilonFactor*charges[i];
+            if (q == 0.0 || !includeSubset[subsets[i]])
+                continue;
+            const double* grid = &realGrids[subsets[i]*gridPoints];
+            const double* thetaX = &theta[(3*i)*pmeOrder];
+            const double* thetaY = &theta[(3*i+1)*pmeOrder];
+            const double* thetaZ = &theta[(3*i+2)*pmeOrder];
+            const double* dthetaX = &dtheta[(3*i)*pmeOrder];
+            const double* dthetaY = &dtheta[(3*i+1)*pmeOrder];
+            const double* dthetaZ = &dtheta[(3*i+2)*pmeOrder];
+            double force[3] = {0.0, 0.0, 0.0};
+            for (int ix = 0; ix < pmeOrder; ix++) {
+                int xindex = (gridIndex[3*i]+ix) % gridSize[0];
+                for (int iy = 0; iy < pmeOrder; iy++) {
+                    int yindex = (gridIndex[3*i+1]+iy) % gridSize[1];
+                    for (int iz = 0; iz < pmeOrder; iz++) {
+                        int zindex = (gridIndex[3*i+2]+iz) % gridSize[2];
+                        double value = grid[(xindex*gridSize[1]+yindex)*gridSize[2]+zindex];
+                        force[0] += dthetaX[ix]*thetaY[iy]*thetaZ[iz]*value;
+                        force[1] += thetaX[ix]*dthetaY[iy]*thetaZ[iz]*value;
+                        force[2] += thetaX[ix]*thetaY[iy]*dthetaZ[iz]*value;
+                    }
+                }
+            }
+            force[0] *= gridSize[0];
+            force[1] *= gridSize[1];
+            force[2] *= gridSize[2];
+            forceData[i][0] -= q*(force[0]*recipBoxVectors[0][0]);
+            forceData[i][1] -= q*(force[0]*recipBoxVectors[1][0]+force[1]*recipBoxVectors[1][1]);
+            forceData[i][2] -= q*(force[0]*recipBoxVectors[2][0]+force[1]*recipBoxVectors[2][1]+force[2]*recipBoxVectors[2][2]);
+        }
+    });
+    threads.waitForThreads();
+}
+
+void CpuCalcSlicedPmeForceKernel::reduceThreadForces(vector<Vec3>& forceData) {
+    threads.execute([&] (ThreadPool& pool, int threadIndex) {
+        int numThreads = threads.getNumThreads();
+        int start = threadIndex*numParticles/numThreads;
+        int end = (threadIndex+1)*numParticles/numThreads;
+        for (int i = 0; i < numThreads; i++)
+            for (int j = start; j < end; j++)
+                forceData[j] += threadForce[i][j];
+    });
+    threads.waitForThreads();
+}
+
+void CpuCalcSlicedPmeForceKernel::reduceThreadEnergies(vector<vector<double> >& energies) {
+    for (auto& threadEnergy : threadEnergies)
+        for (int i = 0; i < numSubsets; i++)
+            for (int j = i; j < numSubsets; j++)
+                energies[i][j] += threadEnergy[i][j];
+}
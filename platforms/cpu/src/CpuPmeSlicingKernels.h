@@ -0,0 +1,83 @@
+#ifndef CPU_PMESLICING_KERNELS_H_
+#define CPU_PMESLICING_KERNELS_H_
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2014 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "ReferencePmeSlicingKernels.h"
+#include "internal/CpuFFT3D.h"
+#include "openmm/internal/ThreadPool.h"
+#include <vector>
+
+namespace PmeSlicing {
+
+/**
+ * This kernel is invoked by SlicedPmeForce to calculate the forces acting on the system and the energy of the system
+ * on the CPU platform.  It shares the setup and bookkeeping of the reference implementation, but distributes the
+ * direct space interactions, the charge spreading, the batched subset FFTs, and the force interpolation over the
+ * thread pool of the platform.
+ */
+class CpuCalcSlicedPmeForceKernel : public ReferenceCalcSlicedPmeForceKernel {
+public:
+    CpuCalcSlicedPmeForceKernel(std::string name, const OpenMM::Platform& platform, OpenMM::ThreadPool& threads) : ReferenceCalcSlicedPmeForceKernel(name, platform),
+            threads(threads), subsetFFT(NULL) {
+    }
+    ~CpuCalcSlicedPmeForceKernel();
+    /**
+     * Initialize the kernel.
+     * 
+     * @param system     the System this kernel will be applied to
+     * @param force      the SlicedPmeForce this kernel will be used for
+     */
+    void initialize(const OpenMM::System& system, const SlicedPmeForce& force);
+protected:
+    void computeDirect(const std::vector<OpenMM::Vec3>& posData, std::vector<OpenMM::Vec3>& forceData, const OpenMM::Vec3* boxVectors, const std::vector<bool>& includeSlice, std::vector<std::vector<double> >& energies);
+    void computeReciprocal(const std::vector<OpenMM::Vec3>& posData, std::vector<OpenMM::Vec3>& forceData, const OpenMM::Vec3* boxVectors, bool includeForces, const std::vector<bool>& includeSlice, std::vector<std::vector<double> >& energies);
+private:
+    void computeDirectInThread(int threadIndex, const std::vector<OpenMM::Vec3>& posData, const OpenMM::Vec3* boxVectors, const std::vector<bool>& includeSlice);
+    void reduceThreadForces(std::vector<OpenMM::Vec3>& forceData);
+    void reduceThreadEnergies(std::vector<std::vector<double> >& energies);
+    OpenMM::ThreadPool& threads;
+    CpuFFT3D* subsetFFT;
+    std::vector<std::vector<OpenMM::Vec3> > threadForce;
+    std::vector<std::vector<std::vector<double> > > threadEnergies;
+    std::vector<std::vector<double> > threadGrids;
+    std::vector<double> realGrids;
+    std::vector<t_complex> complexGrids;
+    std::vector<int> gridIndex;
+    std::vector<double> theta, dtheta;
+    std::vector<double> ewaldTable;
+    double ewaldTableSpacing;
+};
+
+} // namespace PmeSlicing
+
+#endif /*CPU_PMESLICING_KERNELS_H_*/
@@ -0,0 +1,127 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2014 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+/**
+ * This tests the CPU implementation of FFT3D.
+ */
+
+#include "internal/CpuFFT3D.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "openmm/reference/fftpack.h"
+#include "sfmt/SFMT.h"
+#include <cstdlib>
+#include <iostream>
+
+using namespace PmeSlicing;
+using namespace OpenMM;
+using namespace std;
+
+void testTransform(ThreadPool& threads, int xsize, int ysize, int zsize, int batch) {
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    int gridSize = xsize*ysize*zsize;
+    int outputZSize = zsize/2+1;
+    vector<double> real;
+    vector<t_complex> complex;
+    CpuFFT3D fft(threads, xsize, ysize, zsize, batch, real, complex);
+    vector<vector<t_complex> > reference(batch, vector<t_complex>(gridSize));
+    for (int j = 0; j < batch; j++)
+        for (int i = 0; i < gridSize; i++) {
+            real[j*gridSize+i] = genrand_real2(sfmt);
+            reference[j][i] = t_complex(real[j*gridSize+i], 0.0);
+        }
+    vector<double> original = real;
+
+    // Perform a forward FFT, then verify the result is correct.
+
+    fft.execFFT(true);
+    fftpack_t plan;
+    fftpack_init_3d(&plan, xsize, ysize, zsize);
+    for (int j = 0; j < batch; j++) {
+        fftpack_exec_3d(plan, FFTPACK_FORWARD, &reference[j][0], &reference[j][0]);
+        for (int x = 0; x < xsize; x++)
+            for (int y = 0; y < ysize; y++)
+                for (int z = 0; z < outputZSize; z++) {
+                    int index1 = x*ysize*zsize + y*zsize + z;
+                    int index2 = ((j*xsize + x)*ysize + y)*outputZSize + z;
+                    ASSERT_EQUAL_TOL(reference[j][index1].re, complex[index2].re, 1e-10);
+                    ASSERT_EQUAL_TOL(reference[j][index1].im, complex[index2].im, 1e-10);
+                }
+    }
+    fftpack_destroy(plan);
+
+    // Perform a backward transform and see if we get the original values.
+
+    fft.execFFT(false);
+    double scale = 1.0/(xsize*ysize*zsize);
+    for (int i = 0; i < original.size(); i++)
+        ASSERT_EQUAL_TOL(original[i], scale*real[i], 1e-10);
+}
+
+void testSharedPlans(ThreadPool& threads) {
+    // Objects for the same grid must share one plan, and objects for different grids must not.
+
+    vector<double> real1, real2, real3;
+    vector<t_complex> complex1, complex2, complex3;
+    CpuFFT3D fft1(threads, 20, 24, 25, 2, real1, complex1);
+    CpuFFT3D fft2(threads, 20, 24, 25, 2, real2, complex2);
+    CpuFFT3D fft3(threads, 20, 24, 27, 2, real3, complex3);
+    ASSERT(fft1.getPlan() == fft2.getPlan());
+    ASSERT(fft1.getPlan() != fft3.getPlan());
+}
+
+void executeTests(ThreadPool& threads, int batch) {
+    testTransform(threads, 28, 25, 25, batch);
+    testTransform(threads, 25, 28, 25, batch);
+    testTransform(threads, 25, 25, 28, batch);
+    testTransform(threads, 21, 25, 27, batch);
+    testTransform(threads, 32, 22, 26, batch);
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        ThreadPool threads(argc > 1 ? atoi(argv[1]) : 0);
+        executeTests(threads, 1);
+        executeTests(threads, 2);
+        executeTests(threads, 3);
+
+        // Creating a new object for a size that was already used must give the same results.
+
+        executeTests(threads, 3);
+        testSharedPlans(threads);
+    }
+    catch(const exception& e) {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
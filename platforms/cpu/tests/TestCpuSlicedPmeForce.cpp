@@ -0,0 +1,91 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2014 Stanford University and the Authors.           *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * Permission is hereby granted, free of charge, to any person obtaining a    *
+ * copy of this software and associated documentation files (the "Software"), *
+ * to deal in the Software without restriction, including without limitation  *
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,   *
+ * and/or sell copies of the Software, and to permit persons to whom the      *
+ * Software is furnished to do so, subject to the following conditions:       *
+ *                                                                            *
+ * The above copyright notice and this permission notice shall be included in *
+ * all copies or substantial portions of the Software.                        *
+ *                                                                            *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR *
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,   *
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL    *
+ * THE AUTHORS, CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,    *
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR      *
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE  *
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuPmeSlicingTests.h"
+#include "TestSlicedPmeForce.h"
+
+void testCompareToReference() {
+    // Build a system with several subsets, scaled slices, exclusions and exceptions.
+
+    const int numSubsets = 3;
+    const int numMolecules = 300;
+    const int numParticles = 3*numMolecules;
+    const double L = 4.0;
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedPmeForce* force = new SlicedPmeForce(numSubsets);
+    force->setCutoffDistance(1.0);
+    force->addGlobalParameter("lambda", 0.4);
+    force->setSliceScalingParameter(0, 1, "lambda");
+    force->setSliceScalingParameter(2, 2, "lambda");
+    vector<Vec3> positions(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numMolecules; i++) {
+        int subset = i%numSubsets;
+        for (int j = 0; j < 3; j++)
+            system.addParticle(1.0);
+        force->addParticle(-0.8, subset);
+        force->addParticle(0.4, subset);
+        force->addParticle(0.4, (subset+1)%numSubsets);
+        force->addException(3*i, 3*i+1, 0.0);
+        force->addException(3*i, 3*i+2, 0.0);
+        force->addException(3*i+1, 3*i+2, 0.1);
+        positions[3*i] = L*Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+        positions[3*i+1] = positions[3*i]+Vec3(0.1, 0, 0);
+        positions[3*i+2] = positions[3*i]+Vec3(0, 0.1, 0);
+    }
+    system.addForce(force);
+
+    // Compute the forces, energy and slice energies on both platforms.
+
+    registerPmeSlicingReferenceKernelFactories();
+    VerletIntegrator integrator1(0.001);
+    VerletIntegrator integrator2(0.001);
+    Context context(system, integrator1, platform);
+    Context referenceContext(system, integrator2, Platform::getPlatformByName("Reference"));
+    context.setPositions(positions);
+    referenceContext.setPositions(positions);
+    State state = context.getState(State::Forces | State::Energy);
+    State referenceState = referenceContext.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(referenceState.getPotentialEnergy(), state.getPotentialEnergy(), 1e-5);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(referenceState.getForces()[i], state.getForces()[i], 1e-5);
+    vector<vector<double> > energies = force->getSliceEnergies(context);
+    vector<vector<double> > referenceEnergies = force->getSliceEnergies(referenceContext);
+    for (int i = 0; i < numSubsets; i++)
+        for (int j = 0; j < numSubsets; j++)
+            ASSERT_EQUAL_TOL(referenceEnergies[i][j], energies[i][j], 1e-5);
+}
+
+void runPlatformTests() {
+    testCompareToReference();
+}
@@ -29,6 +29,8 @@
 
 #include "openmm/cuda/CudaArray.h"
 #include "openmm/cuda/CudaContext.h"
+#include "FFTDimensions.h"
+#include <vector>
 
 using namespace OpenMM;
 
@@ -84,20 +86,7 @@ public:
      * @param maxPrimeFactor  the maximum supported prime number factor (default=7)
      */
     static int findLegalDimension(int minimum, int maxPrimeFactor=7) {  // VkFFT allows maxPrimeFactor up to 13
-        if (minimum < 1)
-            return 1;
-        while (true) {
-            // Attempt to factor the current value.
-
-            int unfactored = minimum;
-            for (int factor = 2; factor <= maxPrimeFactor; factor++) {
-                while (unfactored > 1 && unfactored%factor == 0)
-                    unfactored /= factor;
-            }
-            if (unfactored == 1)
-                return minimum;
-            minimum++;
-        }
+        return FFTDimensions::findLegalDimension(minimum, maxPrimeFactor);
     }
 protected:
     CUdeviceptr inputBuffer;
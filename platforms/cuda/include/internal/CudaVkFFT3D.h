@@ -31,6 +31,9 @@
 #include "openmm/cuda/CudaArray.h"
 #define VKFFT_BACKEND 1 // CUDA
 #include "internal/vkFFT.h"
+#include <memory>
+#include <string>
+#include <vector>
 
 using namespace OpenMM;
 
@@ -67,8 +70,11 @@ public:
      * @param realToComplex  if true, a real-to-complex transform will be done.  Otherwise, it is complex-to-complex.
      * @param in      the data to transform, ordered such that in[x*ysize*zsize + y*zsize + z] contains element (x, y, z)
      * @param out     on exit, this contains the transformed data
+     * @param cacheDirectory  a directory in which the compiled VkFFT binaries are cached between runs.  If it is
+     *                        empty (the default), the binaries are only shared with other objects in this process.
      */
-    CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out);
+    CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out,
+            const std::string& cacheDirectory="");
     ~CudaVkFFT3D();
     /**
      * Perform a Fourier transform.
@@ -80,6 +86,7 @@ private:
     int device;
     uint64_t inputBufferSize;
     uint64_t outputBufferSize;
+    std::shared_ptr<const std::vector<char> > binaries;
     VkFFTApplication* app;
 };
 
@@ -35,7 +35,7 @@ using namespace std;
 class CudaParallelCalcSlicedPmeForceKernel::Task : public CudaContext::WorkTask {
 public:
     Task(ContextImpl& context, CudaCalcSlicedPmeForceKernel& kernel, bool includeForce,
-            bool includeEnergy, bool includeDirect, bool includeReciprocal, double& energy) : context(context), kernel(kernel),
+            bool includeEnergy, const vector<bool>& includeDirect, const vector<bool>& includeReciprocal, double& energy) : context(context), kernel(kernel),
             includeForce(includeForce), includeEnergy(includeEnergy), includeDirect(includeDirect), includeReciprocal(includeReciprocal), energy(energy) {
     }
     void execute() {
@@ -44,7 +44,8 @@ public:
 private:
     ContextImpl& context;
     CudaCalcSlicedPmeForceKernel& kernel;
-    bool includeForce, includeEnergy, includeDirect, includeReciprocal;
+    bool includeForce, includeEnergy;
+    vector<bool> includeDirect, includeReciprocal;
     double& energy;
 };
 
@@ -59,7 +60,7 @@ void CudaParallelCalcSlicedPmeForceKernel::initialize(const System& system, cons
         getKernel(i).initialize(system, force);
 }
 
-double CudaParallelCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
+double CudaParallelCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, const vector<bool>& includeDirect, const vector<bool>& includeReciprocal) {
     for (int i = 0; i < (int) data.contexts.size(); i++) {
         CudaContext& cu = *data.contexts[i];
         ComputeContext::WorkThread& thread = cu.getWorkThread();
@@ -76,3 +77,23 @@ void CudaParallelCalcSlicedPmeForceKernel::copyParametersToContext(ContextImpl&
 void CudaParallelCalcSlicedPmeForceKernel::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     dynamic_cast<const CudaCalcSlicedPmeForceKernel&>(kernels[0].getImpl()).getPMEParameters(alpha, nx, ny, nz);
 }
+
+string CudaParallelCalcSlicedPmeForceKernel::getFFTBackend() const {
+    return dynamic_cast<const CudaCalcSlicedPmeForceKernel&>(kernels[0].getImpl()).getFFTBackend();
+}
+
+void CudaParallelCalcSlicedPmeForceKernel::setRecordSliceEnergies(bool record) {
+    for (int i = 0; i < (int) kernels.size(); i++)
+        getKernel(i).setRecordSliceEnergies(record);
+}
+
+void CudaParallelCalcSlicedPmeForceKernel::getSliceEnergies(vector<vector<double> >& energies) {
+    getKernel(0).getSliceEnergies(energies);
+    for (int k = 1; k < (int) kernels.size(); k++) {
+        vector<vector<double> > contextEnergies;
+        getKernel(k).getSliceEnergies(contextEnergies);
+        for (int i = 0; i < (int) energies.size(); i++)
+            for (int j = 0; j < (int) energies[i].size(); j++)
+                energies[i][j] += contextEnergies[i][j];
+    }
+}
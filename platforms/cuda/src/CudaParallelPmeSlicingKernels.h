@@ -56,11 +56,11 @@ public:
      * @param context        the context in which to execute this kernel
      * @param includeForces  true if forces should be calculated
      * @param includeEnergy  true if the energy should be calculated
-     * @param includeReciprocal  true if reciprocal space interactions should be included
-     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param includeDirect  for each slice, whether its direct space interactions should be included
+     * @param includeReciprocal  for each slice, whether its reciprocal space interactions should be included
      * @return the potential energy due to the force
      */
-    double execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal);
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy, const std::vector<bool>& includeDirect, const std::vector<bool>& includeReciprocal);
     /**
      * Copy changed parameters over to a context.
      *
@@ -77,6 +77,25 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     void getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
+    /**
+     * Get the name of the FFT backend used for reciprocal space calculations.
+     */
+    std::string getFFTBackend() const;
+    /**
+     * Set whether subsequent calls to execute() should record the energy of each slice.
+     *
+     * @param record   true if slice energies should be recorded
+     */
+    void setRecordSliceEnergies(bool record);
+    /**
+     * Get the unscaled energies of all slices computed in the most recent call to execute()
+     * in which the energy was requested and slice energies were being recorded.  They are not
+     * multiplied by the slice scaling parameters.
+     *
+     * @param energies   on exit, a symmetric numSubsets x numSubsets matrix whose element [I][J]
+     *                   is the energy of slice[I,J]
+     */
+    void getSliceEnergies(std::vector<std::vector<double> >& energies);
 private:
     class Task;
     CudaPlatform::PlatformData& data;
@@ -40,6 +40,8 @@
 #include "openmm/common/ContextSelector.h"
 #include <cstring>
 #include <algorithm>
+#include <chrono>
+#include <sstream>
 
 #define CHECK_RESULT(result, prefix) \
     if (result != CUDA_SUCCESS) { \
@@ -51,6 +53,71 @@ using namespace PmeSlicing;
 using namespace OpenMM;
 using namespace std;
 
+/**
+ * Get the index of slice[I,J] in the triangular layout used by the kernels.
+ */
+static int getSliceIndex(int subset1, int subset2) {
+    int i = min(subset1, subset2);
+    int j = max(subset1, subset2);
+    return j*(j+1)/2+i;
+}
+
+/**
+ * Group the slices by the force group in which their direct space interactions are computed.
+ */
+static map<int, vector<int> > getDirectSpaceSlicesByGroup(const SlicedPmeForce& force) {
+    map<int, vector<int> > slicesByGroup;
+    for (int j = 0; j < force.getNumSubsets(); j++)
+        for (int i = 0; i <= j; i++)
+            slicesByGroup[SlicedPmeForceImpl::getDirectSpaceSliceGroup(force, i, j)].push_back(getSliceIndex(i, j));
+    return slicesByGroup;
+}
+
+/**
+ * Build a condition on the variable "slice" that is true only for the specified slices.
+ */
+static string getSliceCondition(const vector<int>& slices, int numSlices) {
+    if (slices.size() == numSlices)
+        return "1";
+    stringstream condition;
+    condition << "(";
+    for (int k = 0; k < slices.size(); k++)
+        condition << (k == 0 ? "" : " || ") << "slice == " << slices[k];
+    condition << ")";
+    return condition.str();
+}
+
+/**
+ * Build a condition that is true only when the specified force group is the first one whose direct
+ * space slices are included in the current evaluation.  That group is stored after the flags of the
+ * slices in the array called flags.
+ */
+static string getLeaderCondition(const string& flags, int group, int numSlices) {
+    stringstream condition;
+    condition << "(" << flags << "[" << numSlices << "] == " << group << ")";
+    return condition.str();
+}
+
+/**
+ * Build the code that adds a value to the derivative of the energy with respect to each requested
+ * parameter, restricted to the slices that the parameter scales.
+ */
+static string getDerivativeCode(const SlicedPmeForce& force, const vector<string>& derivVariables, const string& value) {
+    int numSubsets = force.getNumSubsets();
+    int numSlices = numSubsets*(numSubsets+1)/2;
+    stringstream code;
+    for (int k = 0; k < force.getNumEnergyParameterDerivatives(); k++) {
+        vector<int> slices;
+        for (int j = 0; j < numSubsets; j++)
+            for (int i = 0; i <= j; i++)
+                if (force.getSliceScalingParameter(i, j) == force.getEnergyParameterDerivativeName(k))
+                    slices.push_back(getSliceIndex(i, j));
+        if (slices.size() > 0)
+            code << derivVariables[k] << " += (" << getSliceCondition(slices, numSlices) << " ? " << value << " : 0);\n";
+    }
+    return code.str();
+}
+
 class CudaCalcSlicedPmeForceKernel::ForceInfo : public CudaForceInfo {
 public:
     ForceInfo(const SlicedPmeForce& force) : force(force) {
@@ -58,7 +125,7 @@ public:
     bool areParticlesIdentical(int particle1, int particle2) {
         double charge1 = force.getParticleCharge(particle1);
         double charge2 = force.getParticleCharge(particle2);
-        return (charge1 == charge2);
+        return (charge1 == charge2 && force.getParticleSubset(particle1) == force.getParticleSubset(particle2));
     }
     int getNumParticleGroups() {
         return force.getNumExceptions();
@@ -106,36 +173,42 @@ private:
 
 class CudaCalcSlicedPmeForceKernel::PmePreComputation : public CudaContext::ForcePreComputation {
 public:
-    PmePreComputation(CudaContext& cu, Kernel& pme, CalcPmeReciprocalForceKernel::IO& io) : cu(cu), pme(pme), io(io) {
+    PmePreComputation(CudaContext& cu, Kernel& pme, CalcPmeReciprocalForceKernel::IO& io, int recipGroups) : cu(cu), pme(pme), io(io), recipGroups(recipGroups) {
     }
     void computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        Vec3 boxVectors[3] = {Vec3(cu.getPeriodicBoxSize().x, 0, 0), Vec3(0, cu.getPeriodicBoxSize().y, 0), Vec3(0, 0, cu.getPeriodicBoxSize().z)};
-        pme.getAs<CalcPmeReciprocalForceKernel>().beginComputation(io, boxVectors, includeEnergy);
+        if ((groups&recipGroups) != 0) {
+            Vec3 boxVectors[3] = {Vec3(cu.getPeriodicBoxSize().x, 0, 0), Vec3(0, cu.getPeriodicBoxSize().y, 0), Vec3(0, 0, cu.getPeriodicBoxSize().z)};
+            pme.getAs<CalcPmeReciprocalForceKernel>().beginComputation(io, boxVectors, includeEnergy);
+        }
     }
 private:
     CudaContext& cu;
     Kernel pme;
     CalcPmeReciprocalForceKernel::IO& io;
+    int recipGroups;
 };
 
 class CudaCalcSlicedPmeForceKernel::PmePostComputation : public CudaContext::ForcePostComputation {
 public:
-    PmePostComputation(Kernel& pme, CalcPmeReciprocalForceKernel::IO& io) : pme(pme), io(io) {
+    PmePostComputation(Kernel& pme, CalcPmeReciprocalForceKernel::IO& io, int recipGroups) : pme(pme), io(io), recipGroups(recipGroups) {
     }
     double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        return pme.getAs<CalcPmeReciprocalForceKernel>().finishComputation(io);
+        if ((groups&recipGroups) != 0)
+            return pme.getAs<CalcPmeReciprocalForceKernel>().finishComputation(io);
+        return 0.0;
     }
 private:
     Kernel pme;
     CalcPmeReciprocalForceKernel::IO& io;
+    int recipGroups;
 };
 
 class CudaCalcSlicedPmeForceKernel::SyncStreamPreComputation : public CudaContext::ForcePreComputation {
 public:
-    SyncStreamPreComputation(CudaContext& cu, CUstream stream, CUevent event, int forceGroup) : cu(cu), stream(stream), event(event), forceGroup(forceGroup) {
+    SyncStreamPreComputation(CudaContext& cu, CUstream stream, CUevent event, int recipGroups) : cu(cu), stream(stream), event(event), recipGroups(recipGroups) {
     }
     void computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        if ((groups&(1<<forceGroup)) != 0) {
+        if ((groups&recipGroups) != 0) {
             cuEventRecord(event, cu.getCurrentStream());
             cuStreamWaitEvent(stream, event, 0);
         }
@@ -144,16 +217,16 @@ private:
     CudaContext& cu;
     CUstream stream;
     CUevent event;
-    int forceGroup;
+    int recipGroups;
 };
 
 class CudaCalcSlicedPmeForceKernel::SyncStreamPostComputation : public CudaContext::ForcePostComputation {
 public:
-    SyncStreamPostComputation(CudaContext& cu, CUevent event, CUfunction addEnergyKernel, CudaArray& pmeEnergyBuffer, int forceGroup) : cu(cu), event(event),
-            addEnergyKernel(addEnergyKernel), pmeEnergyBuffer(pmeEnergyBuffer), forceGroup(forceGroup) {
+    SyncStreamPostComputation(CudaContext& cu, CUevent event, CUfunction addEnergyKernel, CudaArray& pmeEnergyBuffer, int recipGroups) : cu(cu), event(event),
+            addEnergyKernel(addEnergyKernel), pmeEnergyBuffer(pmeEnergyBuffer), recipGroups(recipGroups) {
     }
     double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        if ((groups&(1<<forceGroup)) != 0) {
+        if ((groups&recipGroups) != 0) {
             cuStreamWaitEvent(cu.getCurrentStream(), event, 0);
             if (includeEnergy) {
                 int bufferSize = pmeEnergyBuffer.getSize();
@@ -168,13 +241,11 @@ private:
     CUevent event;
     CUfunction addEnergyKernel;
     CudaArray& pmeEnergyBuffer;
-    int forceGroup;
+    int recipGroups;
 };
 
 CudaCalcSlicedPmeForceKernel::~CudaCalcSlicedPmeForceKernel() {
     ContextSelector selector(cu);
-    if (sort != NULL)
-        delete sort;
     if (fft != NULL)
         delete fft;
     if (pmeio != NULL)
@@ -223,6 +294,12 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
 
     int numParticles = force.getNumParticles();
     numSubsets = force.getNumSubsets();
+    numSlices = numSubsets*(numSubsets+1)/2;
+    map<int, vector<int> > directSlicesByGroup = getDirectSpaceSlicesByGroup(force);
+    int recipGroups = 0;
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++)
+            recipGroups |= 1<<SlicedPmeForceImpl::getReciprocalSpaceSliceGroup(force, i, j);
     vector<float> baseParticleChargeVec(cu.getPaddedNumAtoms(), 0.0);
     vector<int> subsetVec(cu.getPaddedNumAtoms(), 0);
     vector<vector<int> > exclusionList(numParticles);
@@ -241,7 +318,6 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
     defines["HAS_COULOMB"] = "1";
     defines["HAS_LENNARD_JONES"] = "0";
     alpha = 0;
-    ewaldSelfEnergy = 0.0;
     map<string, string> paramsDefines;
     paramsDefines["ONE_4PI_EPS0"] = cu.doubleToString(ONE_4PI_EPS0);
     hasOffsets = (force.getNumParticleParameterOffsets() > 0 || force.getNumExceptionParameterOffsets() > 0);
@@ -251,21 +327,91 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
         paramsDefines["HAS_PARTICLE_OFFSETS"] = "1";
     if (force.getNumExceptionParameterOffsets() > 0)
         paramsDefines["HAS_EXCEPTION_OFFSETS"] = "1";
+    hasDerivatives = (force.getNumEnergyParameterDerivatives() > 0);
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
+        derivParams.push_back(force.getEnergyParameterDerivativeName(i));
+    if (hasDerivatives)
+        paramsDefines["HAS_DERIVATIVES"] = "1";
     if (usePosqCharges)
         paramsDefines["USE_POSQ_CHARGES"] = "1";
 
+    // Every thread that computes part of the energy owns one element of the slice energy
+    // buffer for each slice, so the contributions can be accumulated without atomics.  They
+    // are only accumulated while recordSliceEnergiesFlag is set, which getSliceEnergies()
+    // requests for the one evaluation it needs.
+
+    int energyElementSize = (cu.getUseDoublePrecision() || cu.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
+    int sliceBufferSize = max(cu.getNumThreadBlocks()*CudaContext::ThreadBlockSize, cu.getNonbondedUtilities().getNumEnergyBuffers());
+    sliceEnergyBuffer.initialize(cu, numSlices*sliceBufferSize, energyElementSize, "sliceEnergyBuffer");
+    cu.clearBuffer(sliceEnergyBuffer);
+    sliceEnergies.initialize(cu, numSlices, energyElementSize, "sliceEnergies");
+    recordSliceEnergiesFlag.initialize<int>(cu, 1, "recordSliceEnergiesFlag");
+    recordSliceEnergiesFlag.upload(vector<int>(1, 0));
+
+    // The direct space interactions are registered once for each force group that contains
+    // slices.  directSliceFlags tells them which slices are included in the current evaluation,
+    // followed by the group that computes them.
+
+    directSliceGroups.resize(numSlices);
+    for (auto& group : directSlicesByGroup)
+        for (int slice : group.second)
+            directSliceGroups[slice] = group.first;
+    directSliceFlagsVec.assign(numSlices+1, 0);
+    directSliceFlagsVec[numSlices] = -1;
+    directSliceFlags.initialize<int>(cu, numSlices+1, "directSliceFlags");
+    directSliceFlags.upload(directSliceFlagsVec);
+    paramsDefines["NUM_SLICES"] = cu.intToString(numSlices);
+    paramsDefines["SLICE_BUFFER_SIZE"] = cu.intToString(sliceBufferSize);
+    paramsDefines["WORK_GROUP_SIZE"] = cu.intToString(CudaContext::ThreadBlockSize);
+
+    // Each slice has a weight equal to its scale factor if its reciprocal space interactions
+    // are included and 0 otherwise.  Subsets not involved in any included slice are skipped by the PME kernels.
+
+    int realElementSize = (cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
+    recipSliceWeights.initialize(cu, numSlices, realElementSize, "recipSliceWeights");
+    recipSubsetFlags.initialize<int>(cu, numSubsets, "recipSubsetFlags");
+    recipSliceFlags.initialize<int>(cu, numSlices, "recipSliceFlags");
+    subsetSelfEnergy.resize(numSubsets, 0.0);
+
+    // Slices bound to a global parameter are scaled by its value.  The scale factors are stored
+    // on the device, so changing a parameter only requires uploading the new values.
+
+    sliceScalingParams.resize(numSlices);
+    sliceLambdaValues.resize(numSlices, 1.0);
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++)
+            sliceScalingParams[getSliceIndex(i, j)] = force.getSliceScalingParameter(i, j);
+    sliceLambdas.initialize(cu, numSlices, realElementSize, "sliceLambdas");
+    sliceLambdas.upload(sliceLambdaValues, true);
+    recipSliceDerivIndices.initialize<int>(cu, numSlices, "recipSliceDerivIndices");
+
     // Compute the PME parameters.
 
     int cufftVersion;
     cufftGetVersion(&cufftVersion);
     useCudaFFT = force.getUseCudaFFT() && (cufftVersion >= 7050); // There was a critical bug in version 7.0
+    vkfftCacheDirectory = force.getVkFFTCacheDirectory();
 
     SlicedPmeForceImpl::calcPMEParameters(system, force, alpha, gridSizeX, gridSizeY, gridSizeZ, false);
+    pmeOrder = force.getPMEInterpolationOrder();
 
-    gridSizeX = CudaFFT3D::findLegalDimension(gridSizeX);
-    gridSizeY = CudaFFT3D::findLegalDimension(gridSizeY);
-    gridSizeZ = CudaFFT3D::findLegalDimension(gridSizeZ);
-    int roundedZSize = PmeOrder*(int) ceil(gridSizeZ/(double) PmeOrder);
+    // Grid sizes derived from the error tolerance are only minimums, so they may be enlarged to
+    // whatever is fastest.  Sizes set explicitly are only rounded up to legal ones.
+
+    int maxPrimeFactor = (useCudaFFT || force.getAutotuneFFT() ? 7 : 13); // Only VkFFT handles factors of 11 and 13 efficiently
+    double forceAlpha;
+    int forceGridX, forceGridY, forceGridZ;
+    force.getPMEParameters(forceAlpha, forceGridX, forceGridY, forceGridZ);
+    double gridBytesPerPoint = 4.0*(cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float)); // Two complex grids
+    double gridMemoryLimit = force.getPMEGridMemoryLimit()*1024*1024;
+    if (forceAlpha == 0.0)
+        FFTDimensions::findFastestDimensions(gridSizeX, gridSizeY, gridSizeZ, numSubsets, numParticles, pmeOrder, gridBytesPerPoint, gridMemoryLimit, maxPrimeFactor);
+    else {
+        gridSizeX = CudaFFT3D::findLegalDimension(gridSizeX, maxPrimeFactor);
+        gridSizeY = CudaFFT3D::findLegalDimension(gridSizeY, maxPrimeFactor);
+        gridSizeZ = CudaFFT3D::findLegalDimension(gridSizeZ, maxPrimeFactor);
+    }
+    int roundedZSize = pmeOrder*(int) ceil(gridSizeZ/(double) pmeOrder);
 
     defines["EWALD_ALPHA"] = cu.doubleToString(alpha);
     defines["TWO_OVER_SQRT_PI"] = cu.doubleToString(2.0/sqrt(M_PI));
@@ -275,32 +421,67 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
         paramsDefines["INCLUDE_EWALD"] = "1";
         paramsDefines["EWALD_SELF_ENERGY_SCALE"] = cu.doubleToString(ONE_4PI_EPS0*alpha/sqrt(M_PI));
         for (int i = 0; i < numParticles; i++)
-            ewaldSelfEnergy -= baseParticleChargeVec[i]*baseParticleChargeVec[i]*ONE_4PI_EPS0*alpha/sqrt(M_PI);
+            subsetSelfEnergy[subsetVec[i]] -= baseParticleChargeVec[i]*baseParticleChargeVec[i]*ONE_4PI_EPS0*alpha/sqrt(M_PI);
         char deviceName[100];
         cuDeviceGetName(deviceName, 100, cu.getDevice());
         usePmeStream = (!cu.getPlatformData().disablePmeStream && !cu.getPlatformData().useCpuPme && string(deviceName) != "GeForce GTX 980"); // Using a separate stream is slower on GTX 980
+        usePmeStream &= !hasDerivatives; // The parameter derivatives are accumulated in a buffer shared with the default stream
         map<string, string> pmeDefines;
-        pmeDefines["PME_ORDER"] = cu.intToString(PmeOrder);
+        pmeDefines["PME_ORDER"] = cu.intToString(pmeOrder);
         pmeDefines["NUM_ATOMS"] = cu.intToString(numParticles);
         pmeDefines["NUM_SUBSETS"] = cu.intToString(numSubsets);
+        pmeDefines["NUM_SLICES"] = cu.intToString(numSlices);
+        if (hasDerivatives)
+            pmeDefines["HAS_DERIVATIVES"] = "1";
+        pmeDefines["SLICE_BUFFER_SIZE"] = cu.intToString(cu.getNumThreadBlocks()*CudaContext::ThreadBlockSize);
         pmeDefines["PADDED_NUM_ATOMS"] = cu.intToString(cu.getPaddedNumAtoms());
         pmeDefines["RECIP_EXP_FACTOR"] = cu.doubleToString(M_PI*M_PI/(alpha*alpha));
         pmeDefines["GRID_SIZE_X"] = cu.intToString(gridSizeX);
         pmeDefines["GRID_SIZE_Y"] = cu.intToString(gridSizeY);
         pmeDefines["GRID_SIZE_Z"] = cu.intToString(gridSizeZ);
         pmeDefines["ROUNDED_Z_SIZE"] = cu.intToString(roundedZSize);
+        pmeDefines["CELL_SCAN_SIZE"] = cu.intToString(CellScanSize);
+        pmeDefines["NUM_CELL_BLOCKS"] = cu.intToString((numSubsets*gridSizeX*gridSizeY+CellScanSize-1)/CellScanSize);
         pmeDefines["EPSILON_FACTOR"] = cu.doubleToString(sqrt(ONE_4PI_EPS0));
         pmeDefines["M_PI"] = cu.doubleToString(M_PI);
-        if (cu.getUseDoublePrecision() || cu.getPlatformData().deterministicForces)
+        useFixedPointChargeSpreading = (cu.getUseDoublePrecision() || cu.getPlatformData().deterministicForces);
+        if (useFixedPointChargeSpreading)
             pmeDefines["USE_FIXED_POINT_CHARGE_SPREADING"] = "1";
         if (usePmeStream)
             pmeDefines["USE_PME_STREAM"] = "1";
+
+        // If the subset grids would exceed the memory limit, process them a few at a time.
+
+        int realSize = (cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
+        subsetChunkSize = FFTDimensions::findSubsetChunkSize(gridSizeX, gridSizeY, gridSizeZ, numSubsets, pmeOrder, gridBytesPerPoint, gridMemoryLimit);
+        streamSubsetChunks = (subsetChunkSize < numSubsets);
+        pmeDefines["SUBSET_CHUNK_SIZE"] = cu.intToString(subsetChunkSize);
+        if (streamSubsetChunks)
+            pmeDefines["STREAM_SUBSET_CHUNKS"] = "1";
+
+        // The convolution stages the structure factors of every subset in local memory, so its
+        // block size is reduced when there are many subsets.
+
+        convolutionBlockSize = max(1, min((int) CudaContext::ThreadBlockSize, 16384/(numSubsets*2*realSize)));
+        if (convolutionBlockSize >= 32)
+            convolutionBlockSize -= convolutionBlockSize%32;
+        pmeDefines["CONVOLUTION_BLOCK_SIZE"] = cu.intToString(convolutionBlockSize);
+
+        // Store the B-splines computed during charge spreading for use in force interpolation,
+        // unless they would take a noticeable fraction of the device memory.
+
+        size_t totalMemory;
+        cuDeviceTotalMem(&totalMemory, cu.getDevice());
+        size_t bsplineCacheSize = (size_t) numParticles*(2*pmeOrder*4*realSize+4*sizeof(int));
+        cacheBsplines = (!streamSubsetChunks && bsplineCacheSize <= totalMemory/32);
+        if (cacheBsplines)
+            pmeDefines["CACHE_BSPLINES"] = "1";
         map<string, string> replacements;
         replacements["CHARGE"] = (usePosqCharges ? "pos.w" : "charges[atom]");
         CUmodule module = cu.createModule(CudaPmeSlicingKernelSources::vectorOps+
                                             CommonPmeSlicingKernelSources::realtofixedpoint+
                                             cu.replaceStrings(CommonPmeSlicingKernelSources::slicedPme, replacements), pmeDefines);
-        if (cu.getPlatformData().useCpuPme && usePosqCharges) {
+        if (cu.getPlatformData().useCpuPme && usePosqCharges && pmeOrder == 5) { // The CPU PME plugin only supports fifth order B-splines
             // Create the CPU PME kernel.
 
             try {
@@ -308,8 +489,8 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
                 cpuPme.getAs<CalcPmeReciprocalForceKernel>().initialize(gridSizeX, gridSizeY, gridSizeZ, numParticles, alpha, cu.getPlatformData().deterministicForces);
                 CUfunction addForcesKernel = cu.getKernel(module, "addForces");
                 pmeio = new PmeIO(cu, addForcesKernel);
-                cu.addPreComputation(new PmePreComputation(cu, cpuPme, *pmeio));
-                cu.addPostComputation(new PmePostComputation(cpuPme, *pmeio));
+                cu.addPreComputation(new PmePreComputation(cu, cpuPme, *pmeio, recipGroups));
+                cu.addPostComputation(new PmePostComputation(cpuPme, *pmeio, recipGroups));
             }
             catch (OpenMMException& ex) {
                 // The CPU PME plugin isn't available.
@@ -317,30 +498,50 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
         }
         if (pmeio == NULL) {
             pmeGridIndexKernel = cu.getKernel(module, "findAtomGridIndex");
+            pmeCountAtomsKernel = cu.getKernel(module, "countAtomsInCells");
+            pmeScanCellBlocksKernel = cu.getKernel(module, "scanCellBlocks");
+            pmeCellOffsetsKernel = cu.getKernel(module, "computeCellOffsets");
+            pmeAddCellOffsetsKernel = cu.getKernel(module, "addCellBlockOffsets");
+            pmeSortAtomsKernel = cu.getKernel(module, "sortAtomsByCell");
             pmeSpreadChargeKernel = cu.getKernel(module, "gridSpreadCharge");
             pmeConvolutionKernel = cu.getKernel(module, "reciprocalConvolution");
             pmeInterpolateForceKernel = cu.getKernel(module, "gridInterpolateForce");
-            pmeEvalEnergyKernel = cu.getKernel(module, "gridEvaluateEnergy");
-            pmeFinishSpreadChargeKernel = cu.getKernel(module, "finishSpreadCharge");
-            pmeCollapseGridKernel = cu.getKernel(module, "collapseGrid");
+            if (useFixedPointChargeSpreading)
+                pmeFinishSpreadChargeKernel = cu.getKernel(module, "finishSpreadCharge");
+            if (streamSubsetChunks)
+                pmeInterpolateChunkKernel = cu.getKernel(module, "gridInterpolateChunk");
             cuFuncSetCacheConfig(pmeSpreadChargeKernel, CU_FUNC_CACHE_PREFER_SHARED);
             cuFuncSetCacheConfig(pmeInterpolateForceKernel, CU_FUNC_CACHE_PREFER_L1);
 
             // Create required data structures.
 
             int elementSize = (cu.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
-            int gridElements = gridSizeX*gridSizeY*roundedZSize*numSubsets;
+            int gridElements = gridSizeX*gridSizeY*roundedZSize*subsetChunkSize;
             pmeGrid1.initialize(cu, gridElements, 2*elementSize, "pmeGrid1");
             pmeGrid2.initialize(cu, gridElements, 2*elementSize, "pmeGrid2");
-            cu.addAutoclearBuffer(pmeGrid2);
+            cu.addAutoclearBuffer(useFixedPointChargeSpreading ? pmeGrid2 : pmeGrid1);
             pmeBsplineModuliX.initialize(cu, gridSizeX, elementSize, "pmeBsplineModuliX");
             pmeBsplineModuliY.initialize(cu, gridSizeY, elementSize, "pmeBsplineModuliY");
             pmeBsplineModuliZ.initialize(cu, gridSizeZ, elementSize, "pmeBsplineModuliZ");
             pmeAtomGridIndex.initialize<int2>(cu, numParticles, "pmeAtomGridIndex");
-            int energyElementSize = (cu.getUseDoublePrecision() || cu.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
+            pmeUnsortedAtomGridIndex.initialize<int2>(cu, numParticles, "pmeUnsortedAtomGridIndex");
+            pmeCellStart.initialize<int>(cu, numSubsets*gridSizeX*gridSizeY+1, "pmeCellStart");
+            pmeCellBlockOffsets.initialize<int>(cu, (numSubsets*gridSizeX*gridSizeY+CellScanSize-1)/CellScanSize, "pmeCellBlockOffsets");
+            pmeCellRank.initialize<int>(cu, numParticles, "pmeCellRank");
+            pmeSortedAtomCell.initialize<int>(cu, numParticles, "pmeSortedAtomCell");
+            pmeSortedAtomCell.upload(vector<int>(numParticles, -1));
+            pmeNumMovedAtoms.initialize<int>(cu, 1, "pmeNumMovedAtoms");
+            cu.addAutoclearBuffer(pmeCellStart);
+            cu.addAutoclearBuffer(pmeNumMovedAtoms);
+            if (cacheBsplines) {
+                pmeCachedTheta.initialize(cu, pmeOrder*numParticles, 4*elementSize, "pmeCachedTheta");
+                pmeCachedDTheta.initialize(cu, pmeOrder*numParticles, 4*elementSize, "pmeCachedDTheta");
+                pmeCachedGridIndex.initialize<int4>(cu, numParticles, "pmeCachedGridIndex");
+            }
             pmeEnergyBuffer.initialize(cu, cu.getNumThreadBlocks()*CudaContext::ThreadBlockSize, energyElementSize, "pmeEnergyBuffer");
             cu.clearBuffer(pmeEnergyBuffer);
-            sort = new CudaSort(cu, new SortTrait(), cu.getNumAtoms());
+            pmeSliceEnergyBuffer.initialize(cu, numSlices*cu.getNumThreadBlocks()*CudaContext::ThreadBlockSize, energyElementSize, "pmeSliceEnergyBuffer");
+            cu.clearBuffer(pmeSliceEnergyBuffer);
 
             // Prepare for doing PME on its own stream.
 
@@ -348,19 +549,22 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
                 cuStreamCreate(&pmeStream, CU_STREAM_NON_BLOCKING);
                 CHECK_RESULT(cuEventCreate(&pmeSyncEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for NonbondedForce");
                 CHECK_RESULT(cuEventCreate(&paramsSyncEvent, CU_EVENT_DISABLE_TIMING), "Error creating event for NonbondedForce");
-                int recipForceGroup = force.getReciprocalSpaceForceGroup();
-                if (recipForceGroup < 0)
-                    recipForceGroup = force.getForceGroup();
-                cu.addPreComputation(new SyncStreamPreComputation(cu, pmeStream, pmeSyncEvent, recipForceGroup));
-                cu.addPostComputation(new SyncStreamPostComputation(cu, pmeSyncEvent, cu.getKernel(module, "addEnergy"), pmeEnergyBuffer, recipForceGroup));
+                cu.addPreComputation(new SyncStreamPreComputation(cu, pmeStream, pmeSyncEvent, recipGroups));
+                cu.addPostComputation(new SyncStreamPostComputation(cu, pmeSyncEvent, cu.getKernel(module, "addEnergy"), pmeEnergyBuffer, recipGroups));
             }
             else
                 pmeStream = cu.getCurrentStream();
 
-            if (useCudaFFT)
-                fft = (CudaFFT3D*) new CudaCuFFT3D(cu, pmeStream, gridSizeX, gridSizeY, gridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
-            else
-                fft = (CudaFFT3D*) new CudaVkFFT3D(cu, pmeStream, gridSizeX, gridSizeY, gridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
+            if (force.getAutotuneFFT())
+                fft = createFastestFFT();
+            else if (useCudaFFT) {
+                fft = (CudaFFT3D*) new CudaCuFFT3D(cu, pmeStream, gridSizeX, gridSizeY, gridSizeZ, subsetChunkSize, true, pmeGrid1, pmeGrid2);
+                fftBackend = "cuFFT";
+            }
+            else {
+                fft = (CudaFFT3D*) new CudaVkFFT3D(cu, pmeStream, gridSizeX, gridSizeY, gridSizeZ, subsetChunkSize, true, pmeGrid1, pmeGrid2, vkfftCacheDirectory);
+                fftBackend = "VkFFT";
+            }
             hasInitializedFFT = true;
 
             // Initialize the b-spline moduli.
@@ -376,13 +580,13 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
             zmoduli = &pmeBsplineModuliZ;
 
             int maxSize = max(max(xsize, ysize), zsize);
-            vector<double> data(PmeOrder);
-            vector<double> ddata(PmeOrder);
+            vector<double> data(pmeOrder);
+            vector<double> ddata(pmeOrder);
             vector<double> bsplines_data(maxSize);
-            data[PmeOrder-1] = 0.0;
+            data[pmeOrder-1] = 0.0;
             data[1] = 0.0;
             data[0] = 1.0;
-            for (int i = 3; i < PmeOrder; i++) {
+            for (int i = 3; i < pmeOrder; i++) {
                 double div = 1.0/(i-1.0);
                 data[i-1] = 0.0;
                 for (int j = 1; j < (i-1); j++)
@@ -393,16 +597,16 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
             // Differentiate.
 
             ddata[0] = -data[0];
-            for (int i = 1; i < PmeOrder; i++)
+            for (int i = 1; i < pmeOrder; i++)
                 ddata[i] = data[i-1]-data[i];
-            double div = 1.0/(PmeOrder-1);
-            data[PmeOrder-1] = 0.0;
-            for (int i = 1; i < (PmeOrder-1); i++)
-                data[PmeOrder-i-1] = div*(i*data[PmeOrder-i-2]+(PmeOrder-i)*data[PmeOrder-i-1]);
+            double div = 1.0/(pmeOrder-1);
+            data[pmeOrder-1] = 0.0;
+            for (int i = 1; i < (pmeOrder-1); i++)
+                data[pmeOrder-i-1] = div*(i*data[pmeOrder-i-2]+(pmeOrder-i)*data[pmeOrder-i-1]);
             data[0] = div*data[0];
             for (int i = 0; i < maxSize; i++)
                 bsplines_data[i] = 0.0;
-            for (int i = 1; i <= PmeOrder; i++)
+            for (int i = 1; i <= pmeOrder; i++)
                 bsplines_data[i] = data[i-1];
 
             // Evaluate the actual bspline moduli for X/Y/Z.
@@ -433,6 +637,19 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
         }
     }
 
+    // Register the parameter derivatives.  The direct space kernels add the unscaled energy of
+    // each slice to the derivative of the parameter that scales it.
+
+    vector<string> nonbondedDerivVariables, bondedDerivVariables;
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++) {
+        string param = force.getEnergyParameterDerivativeName(i);
+        cu.getNonbondedUtilities().addEnergyParameterDerivative(param);
+        bondedDerivVariables.push_back(cu.getBondedUtilities().addEnergyParameterDerivative(param));
+        const vector<string>& allDerivNames = cu.getEnergyParamDerivNames();
+        int index = find(allDerivNames.begin(), allDerivNames.end(), param)-allDerivNames.begin();
+        nonbondedDerivVariables.push_back("energyParamDeriv"+cu.intToString(index));
+    }
+
     // Add code to subtract off the reciprocal part of excluded interactions.
 
     if (pmeio == NULL) {
@@ -445,22 +662,39 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
             vector<vector<int> > atoms(numExclusions, vector<int>(2));
             exclusionAtoms.initialize<int2>(cu, numExclusions, "exclusionAtoms");
             exclusionChargeProds.initialize<float>(cu, numExclusions, "exclusionChargeProds");
+            exclusionSlices.initialize<int>(cu, numExclusions, "exclusionSlices");
             vector<int2> exclusionAtomsVec(numExclusions);
+            vector<int> exclusionSlicesVec(numExclusions);
+            exclusionAtomPairs.resize(numExclusions);
             for (int i = 0; i < numExclusions; i++) {
                 int j = i+startIndex;
                 exclusionAtomsVec[i] = make_int2(exclusions[j].first, exclusions[j].second);
+                exclusionSlicesVec[i] = getSliceIndex(subsetVec[exclusions[j].first], subsetVec[exclusions[j].second]);
+                exclusionAtomPairs[i] = exclusions[j];
                 atoms[i][0] = exclusions[j].first;
                 atoms[i][1] = exclusions[j].second;
             }
             exclusionAtoms.upload(exclusionAtomsVec);
+            exclusionSlices.upload(exclusionSlicesVec);
             map<string, string> replacements;
             replacements["PARAMS"] = cu.getBondedUtilities().addArgument(exclusionChargeProds.getDevicePointer(), "float");
+            replacements["SLICES"] = cu.getBondedUtilities().addArgument(exclusionSlices.getDevicePointer(), "int");
+            replacements["SLICE_ENERGY"] = cu.getBondedUtilities().addArgument(sliceEnergyBuffer.getDevicePointer(), "mixed");
+            replacements["RECORD_SLICE_ENERGIES"] = cu.getBondedUtilities().addArgument(recordSliceEnergiesFlag.getDevicePointer(), "int");
+            string flags = cu.getBondedUtilities().addArgument(directSliceFlags.getDevicePointer(), "int");
+            replacements["INCLUDE_SLICE"] = flags+"[slice]";
+            replacements["SLICE_LAMBDA"] = cu.getBondedUtilities().addArgument(sliceLambdas.getDevicePointer(), "real");
+            replacements["COMPUTE_DERIVATIVES"] = getDerivativeCode(force, bondedDerivVariables, "unscaledEnergy");
+            replacements["SLICE_BUFFER_SIZE"] = cu.intToString(sliceBufferSize);
             replacements["EWALD_ALPHA"] = cu.doubleToString(alpha);
             replacements["TWO_OVER_SQRT_PI"] = cu.doubleToString(2.0/sqrt(M_PI));
             replacements["DO_LJPME"] = "0";
             replacements["USE_PERIODIC"] = force.getExceptionsUsePeriodicBoundaryConditions() ? "1" : "0";
             if (force.getIncludeDirectSpace())
-                cu.getBondedUtilities().addInteraction(atoms, cu.replaceStrings(CommonPmeSlicingKernelSources::slicedPmeExclusions, replacements), force.getForceGroup());
+                for (auto& group : directSlicesByGroup) {
+                    replacements["IS_DIRECT_LEADER"] = getLeaderCondition(flags, group.first, numSlices);
+                    cu.getBondedUtilities().addInteraction(atoms, cu.replaceStrings(CommonPmeSlicingKernelSources::slicedPmeExclusions, replacements), group.first);
+                }
         }
     }
 
@@ -474,6 +708,14 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
     subsets.upload(subsetVec);
     map<string, string> replacements;
     replacements["ONE_4PI_EPS0"] = cu.doubleToString(ONE_4PI_EPS0);
+    replacements["SUBSET1"] = prefix+"subset1";
+    replacements["SUBSET2"] = prefix+"subset2";
+    replacements["SLICE_ENERGY"] = prefix+"sliceEnergy";
+    replacements["RECORD_SLICE_ENERGIES"] = prefix+"recordSliceEnergies";
+    replacements["INCLUDE_SLICE"] = prefix+"directSliceFlags[slice]";
+    replacements["SLICE_LAMBDA"] = prefix+"sliceLambda";
+    replacements["COMPUTE_DERIVATIVES"] = getDerivativeCode(force, nonbondedDerivVariables, "interactionScale*prefactor*erfcAlphaR");
+    replacements["SLICE_BUFFER_SIZE"] = cu.intToString(sliceBufferSize);
     if (usePosqCharges) {
         replacements["CHARGE1"] = "posq1.w";
         replacements["CHARGE2"] = "posq2.w";
@@ -484,9 +726,18 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
     }
     if (!usePosqCharges)
         cu.getNonbondedUtilities().addParameter(CudaNonbondedUtilities::ParameterInfo(prefix+"charge", "real", 1, charges.getElementSize(), charges.getDevicePointer()));
+    cu.getNonbondedUtilities().addParameter(CudaNonbondedUtilities::ParameterInfo(prefix+"subset", "int", 1, sizeof(int), subsets.getDevicePointer()));
+    cu.getNonbondedUtilities().addArgument(CudaNonbondedUtilities::ParameterInfo(prefix+"sliceEnergy", "mixed", 1, energyElementSize, sliceEnergyBuffer.getDevicePointer(), false));
+    cu.getNonbondedUtilities().addArgument(CudaNonbondedUtilities::ParameterInfo(prefix+"recordSliceEnergies", "int", 1, sizeof(int), recordSliceEnergiesFlag.getDevicePointer()));
+    cu.getNonbondedUtilities().addArgument(CudaNonbondedUtilities::ParameterInfo(prefix+"directSliceFlags", "int", 1, sizeof(int), directSliceFlags.getDevicePointer()));
+    cu.getNonbondedUtilities().addArgument(CudaNonbondedUtilities::ParameterInfo(prefix+"sliceLambda", "real", 1, realElementSize, sliceLambdas.getDevicePointer()));
     source = cu.replaceStrings(source, replacements);
     if (force.getIncludeDirectSpace())
-        cu.getNonbondedUtilities().addInteraction(true, true, true, force.getCutoffDistance(), exclusionList, source, force.getForceGroup(), true);
+        for (auto& group : directSlicesByGroup) {
+            map<string, string> sliceReplacements;
+            sliceReplacements["IS_DIRECT_LEADER"] = getLeaderCondition(prefix+"directSliceFlags", group.first, numSlices);
+            cu.getNonbondedUtilities().addInteraction(true, true, true, force.getCutoffDistance(), exclusionList, cu.replaceStrings(source, sliceReplacements), group.first, true);
+        }
 
     // Initialize the exceptions.
 
@@ -500,19 +751,34 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
         vector<vector<int> > atoms(numExceptions, vector<int>(2));
         exceptionChargeProds.initialize<float>(cu, numExceptions, "exceptionChargeProds");
         baseExceptionChargeProds.initialize<float>(cu, numExceptions, "baseExceptionChargeProds");
+        exceptionSlices.initialize<int>(cu, numExceptions, "exceptionSlices");
         vector<float> baseExceptionChargeProdsVec(numExceptions);
+        vector<int> exceptionSlicesVec(numExceptions);
         for (int i = 0; i < numExceptions; i++) {
             double chargeProd;
             force.getExceptionParameters(exceptions[startIndex+i], atoms[i][0], atoms[i][1], chargeProd);
             baseExceptionChargeProdsVec[i] = chargeProd;
+            exceptionSlicesVec[i] = getSliceIndex(subsetVec[atoms[i][0]], subsetVec[atoms[i][1]]);
             exceptionAtoms[i] = make_pair(atoms[i][0], atoms[i][1]);
         }
         baseExceptionChargeProds.upload(baseExceptionChargeProdsVec);
+        exceptionSlices.upload(exceptionSlicesVec);
         map<string, string> replacements;
         replacements["APPLY_PERIODIC"] = (force.getExceptionsUsePeriodicBoundaryConditions() ? "1" : "0");
         replacements["PARAMS"] = cu.getBondedUtilities().addArgument(exceptionChargeProds.getDevicePointer(), "float");
+        replacements["SLICES"] = cu.getBondedUtilities().addArgument(exceptionSlices.getDevicePointer(), "int");
+        replacements["SLICE_ENERGY"] = cu.getBondedUtilities().addArgument(sliceEnergyBuffer.getDevicePointer(), "mixed");
+        replacements["RECORD_SLICE_ENERGIES"] = cu.getBondedUtilities().addArgument(recordSliceEnergiesFlag.getDevicePointer(), "int");
+        string flags = cu.getBondedUtilities().addArgument(directSliceFlags.getDevicePointer(), "int");
+        replacements["INCLUDE_SLICE"] = flags+"[slice]";
+        replacements["SLICE_LAMBDA"] = cu.getBondedUtilities().addArgument(sliceLambdas.getDevicePointer(), "real");
+        replacements["COMPUTE_DERIVATIVES"] = getDerivativeCode(force, bondedDerivVariables, "unscaledEnergy");
+        replacements["SLICE_BUFFER_SIZE"] = cu.intToString(sliceBufferSize);
         if (force.getIncludeDirectSpace())
-            cu.getBondedUtilities().addInteraction(atoms, cu.replaceStrings(CommonPmeSlicingKernelSources::slicedPmeExceptions, replacements), force.getForceGroup());
+            for (auto& group : directSlicesByGroup) {
+                replacements["IS_DIRECT_LEADER"] = getLeaderCondition(flags, group.first, numSlices);
+                cu.getBondedUtilities().addInteraction(atoms, cu.replaceStrings(CommonPmeSlicingKernelSources::slicedPmeExceptions, replacements), group.first);
+            }
     }
     
     // Initialize parameter offsets.
@@ -590,11 +856,12 @@ void CudaCalcSlicedPmeForceKernel::initialize(const System& system, const Sliced
     CUmodule module = cu.createModule(CommonPmeSlicingKernelSources::slicedPmeParameters, paramsDefines);
     computeParamsKernel = cu.getKernel(module, "computeParameters");
     computeExclusionParamsKernel = cu.getKernel(module, "computeExclusionParameters");
+    reduceSliceEnergiesKernel = cu.getKernel(module, "reduceSliceEnergies");
     info = new ForceInfo(force);
     cu.addForce(info);
 }
 
-double CudaCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
+double CudaCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, const vector<bool>& includeDirect, const vector<bool>& includeReciprocal) {
     // Update particle and exception parameters.
 
     ContextSelector selector(cu);
@@ -610,13 +877,91 @@ double CudaCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeF
         recomputeParams = true;
         globalParams.upload(paramValues, true);
     }
-    double energy = (includeReciprocal ? ewaldSelfEnergy : 0.0);
+    bool lambdaChanged = false;
+    for (int slice = 0; slice < numSlices; slice++)
+        if (sliceScalingParams[slice] != "") {
+            double value = context.getParameter(sliceScalingParams[slice]);
+            if (value != sliceLambdaValues[slice]) {
+                sliceLambdaValues[slice] = value;
+                lambdaChanged = true;
+            }
+        }
+    if (lambdaChanged)
+        sliceLambdas.upload(sliceLambdaValues, true);
+    bool anyReciprocal = (find(includeReciprocal.begin(), includeReciprocal.end(), true) != includeReciprocal.end());
+    if (includeReciprocal != includedRecipSlices || lambdaChanged) {
+        if (pmeio != NULL && anyReciprocal && find(includeReciprocal.begin(), includeReciprocal.end(), false) != includeReciprocal.end())
+            throw OpenMMException("SlicedPmeForce: Slices cannot be assigned to different reciprocal space force groups when reciprocal space is computed on the CPU");
+        if (pmeio != NULL && anyReciprocal && find_if(sliceLambdaValues.begin(), sliceLambdaValues.end(), [](double x) {return x != 1.0;}) != sliceLambdaValues.end())
+            throw OpenMMException("SlicedPmeForce: Slices cannot be scaled when reciprocal space is computed on the CPU");
+        if (pmeio != NULL && anyReciprocal && hasDerivatives)
+            throw OpenMMException("SlicedPmeForce: Energy derivatives are not available when reciprocal space is computed on the CPU");
+        vector<double> weights(numSlices);
+        vector<int> subsetFlags(numSubsets, 0);
+        vector<int> sliceFlags(numSlices, 0);
+        vector<int> derivIndices(numSlices, -1);
+        const vector<string>& allDerivNames = cu.getEnergyParamDerivNames();
+        for (int j = 0; j < numSubsets; j++)
+            for (int i = 0; i <= j; i++) {
+                int slice = getSliceIndex(i, j);
+                if (includeReciprocal[slice]) {
+                    weights[slice] = sliceLambdaValues[slice];
+                    sliceFlags[slice] = 1;
+                    subsetFlags[i] = subsetFlags[j] = 1;
+                    if (find(derivParams.begin(), derivParams.end(), sliceScalingParams[slice]) != derivParams.end())
+                        derivIndices[slice] = find(allDerivNames.begin(), allDerivNames.end(), sliceScalingParams[slice])-allDerivNames.begin();
+                }
+            }
+        recipSliceWeights.upload(weights, true);
+        recipSubsetFlags.upload(subsetFlags);
+        recipSliceFlags.upload(sliceFlags);
+        recipSliceDerivIndices.upload(derivIndices);
+        includedRecipSlices = includeReciprocal;
+    }
+    double energy = 0.0;
+    for (int i = 0; i < numSubsets; i++)
+        if (includeReciprocal[getSliceIndex(i, i)])
+            energy += sliceLambdaValues[getSliceIndex(i, i)]*subsetSelfEnergy[i];
+    if (hasDerivatives && !hasOffsets) {
+        map<string, double>& energyParamDerivs = cu.getEnergyParamDerivWorkspace();
+        for (int i = 0; i < numSubsets; i++) {
+            const string& param = sliceScalingParams[getSliceIndex(i, i)];
+            if (includeReciprocal[getSliceIndex(i, i)] && find(derivParams.begin(), derivParams.end(), param) != derivParams.end())
+                energyParamDerivs[param] += subsetSelfEnergy[i];
+        }
+    }
+
+    // Flag the included direct space slices, and let the first group containing one of them
+    // compute all of them.
+
+    vector<int> directFlags(numSlices+1, 0);
+    directFlags[numSlices] = -1;
+    for (int i = 0; i < numSlices; i++)
+        if (includeDirect[i]) {
+            directFlags[i] = 1;
+            if (directFlags[numSlices] == -1 || directSliceGroups[i] < directFlags[numSlices])
+                directFlags[numSlices] = directSliceGroups[i];
+        }
+    if (directFlags != directSliceFlagsVec) {
+        directSliceFlags.upload(directFlags);
+        directSliceFlagsVec = directFlags;
+    }
+    if (recordSliceEnergies != deviceRecordSliceEnergies) {
+        recordSliceEnergiesFlag.upload(vector<int>(1, recordSliceEnergies ? 1 : 0));
+        deviceRecordSliceEnergies = recordSliceEnergies;
+    }
+    int recordSlices = (includeEnergy && recordSliceEnergies);
+    if (recordSlices) {
+        cu.clearBuffer(sliceEnergyBuffer);
+        sliceEnergyRecipSlices = includeReciprocal;
+    }
     if (recomputeParams || hasOffsets) {
-        int computeSelfEnergy = (includeEnergy && includeReciprocal);
+        int computeSelfEnergy = (includeEnergy && anyReciprocal);
         int numAtoms = cu.getPaddedNumAtoms();
         vector<void*> paramsArgs = {&cu.getEnergyBuffer().getDevicePointer(), &computeSelfEnergy, &globalParams.getDevicePointer(), &numAtoms,
                 &baseParticleCharges.getDevicePointer(), &cu.getPosq().getDevicePointer(), &charges.getDevicePointer(),
-                &particleParamOffsets.getDevicePointer(), &particleOffsetIndices.getDevicePointer()};
+                &particleParamOffsets.getDevicePointer(), &particleOffsetIndices.getDevicePointer(), &subsets.getDevicePointer(),
+                &recipSliceWeights.getDevicePointer(), &recipSliceFlags.getDevicePointer(), &sliceEnergyBuffer.getDevicePointer(), &recordSlices};
         int numExceptions;
         if (exceptionChargeProds.isInitialized()) {
             numExceptions = exceptionChargeProds.getSize();
@@ -626,6 +971,12 @@ double CudaCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeF
             paramsArgs.push_back(&exceptionParamOffsets.getDevicePointer());
             paramsArgs.push_back(&exceptionOffsetIndices.getDevicePointer());
         }
+        int numDerivs = cu.getEnergyParamDerivNames().size();
+        if (hasDerivatives) {
+            paramsArgs.push_back(&cu.getEnergyParamDerivBuffer().getDevicePointer());
+            paramsArgs.push_back(&numDerivs);
+            paramsArgs.push_back(&recipSliceDerivIndices.getDevicePointer());
+        }
         cu.executeKernel(computeParamsKernel, &paramsArgs[0], cu.getPaddedNumAtoms());
         if (exclusionChargeProds.isInitialized()) {
             int numExclusions = exclusionChargeProds.getSize();
@@ -644,7 +995,7 @@ double CudaCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeF
     
     // Do reciprocal space calculations.
     
-    if (pmeGrid1.isInitialized() && includeReciprocal) {
+    if (pmeGrid1.isInitialized() && anyReciprocal) {
         if (usePmeStream)
             cu.setCurrentStream(pmeStream);
 
@@ -676,46 +1027,132 @@ double CudaCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeF
 
         // Execute the reciprocal space kernels.
 
-        void* gridIndexArgs[] = {&cu.getPosq().getDevicePointer(), &subsets.getDevicePointer(), &pmeAtomGridIndex.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+        void* gridIndexArgs[] = {&cu.getPosq().getDevicePointer(), &subsets.getDevicePointer(), &pmeUnsortedAtomGridIndex.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
                 cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
+                recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeSortedAtomCell.getDevicePointer(), &pmeNumMovedAtoms.getDevicePointer()};
         cu.executeKernel(pmeGridIndexKernel, gridIndexArgs, cu.getNumAtoms());
 
-        sort->sort(pmeAtomGridIndex);
+        // The atoms are sorted again only if enough of them have changed cell.  The kernels
+        // decide this on the device, so the host never waits for the count.
+
+        void* countAtomsArgs[] = {&pmeUnsortedAtomGridIndex.getDevicePointer(), &pmeNumMovedAtoms.getDevicePointer(),
+                &pmeCellStart.getDevicePointer(), &pmeCellRank.getDevicePointer(), &pmeSortedAtomCell.getDevicePointer()};
+        cu.executeKernel(pmeCountAtomsKernel, countAtomsArgs, cu.getNumAtoms());
+
+        // The cell offsets are computed by a scan over blocks of cells, a scan over the block
+        // totals, and a pass that adds the offsets of the blocks to their cells.
+
+        int numCells = numSubsets*gridSizeX*gridSizeY;
+        void* cellOffsetsArgs[] = {&pmeNumMovedAtoms.getDevicePointer(), &pmeCellStart.getDevicePointer(), &pmeCellBlockOffsets.getDevicePointer()};
+        cu.executeKernel(pmeScanCellBlocksKernel, cellOffsetsArgs, pmeCellBlockOffsets.getSize()*CellScanSize, CellScanSize);
+        cu.executeKernel(pmeCellOffsetsKernel, cellOffsetsArgs, CellScanSize, CellScanSize);
+        cu.executeKernel(pmeAddCellOffsetsKernel, cellOffsetsArgs, numCells);
 
-        void* spreadArgs[] = {&cu.getPosq().getDevicePointer(), &pmeGrid2.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+        void* sortAtomsArgs[] = {&pmeUnsortedAtomGridIndex.getDevicePointer(), &pmeNumMovedAtoms.getDevicePointer(), &pmeCellStart.getDevicePointer(),
+                &pmeCellRank.getDevicePointer(), &pmeAtomGridIndex.getDevicePointer()};
+        cu.executeKernel(pmeSortAtomsKernel, sortAtomsArgs, cu.getNumAtoms());
+
+        // Fixed point charges are accumulated in pmeGrid2 and then converted into pmeGrid1.  Floating
+        // point charges are spread directly into pmeGrid1, which is the input of the FFT.
+
+        CUdeviceptr& spreadGrid = (useFixedPointChargeSpreading ? pmeGrid2.getDevicePointer() : pmeGrid1.getDevicePointer());
+        int firstSubset = 0;
+        vector<void*> spreadArgs = {&cu.getPosq().getDevicePointer(), &spreadGrid, cu.getPeriodicBoxSizePointer(),
                 cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
                 recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
-                &charges.getDevicePointer()};
-        cu.executeKernel(pmeSpreadChargeKernel, spreadArgs, cu.getNumAtoms(), 128);
+                &charges.getDevicePointer(), &recipSubsetFlags.getDevicePointer(), &firstSubset};
+        if (cacheBsplines) {
+            spreadArgs.push_back(&pmeCachedTheta.getDevicePointer());
+            spreadArgs.push_back(&pmeCachedDTheta.getDevicePointer());
+            spreadArgs.push_back(&pmeCachedGridIndex.getDevicePointer());
+        }
+        int computeEnergy = (includeEnergy || hasDerivatives);
+        int computeForces = includeForces;
+        if (streamSubsetChunks) {
+            // Only subsetChunkSize grids fit in memory, so the subsets are processed in chunks.  Each
+            // grid is convolved on its own, and gridInterpolateChunk computes the energy and forces
+            // of every slice involving a subset of the chunk.
 
-        void* finishSpreadArgs[] = {&pmeGrid2.getDevicePointer(), &pmeGrid1.getDevicePointer()};
-        cu.executeKernel(pmeFinishSpreadChargeKernel, finishSpreadArgs, gridSizeX*gridSizeY*gridSizeZ, 256);
+            int noEnergy = 0;
+            vector<void*> convolutionArgs = {&pmeGrid2.getDevicePointer(), &pmeEnergyBuffer.getDevicePointer(),
+                    &pmeSliceEnergyBuffer.getDevicePointer(), &recipSliceWeights.getDevicePointer(), &pmeBsplineModuliX.getDevicePointer(), &pmeBsplineModuliY.getDevicePointer(),
+                    &pmeBsplineModuliZ.getDevicePointer(), recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2],
+                    &recipSliceFlags.getDevicePointer(), &noEnergy, &computeForces, &recordSlices};
+            int accumulate = 0;
+            vector<void*> interpolateArgs = {&cu.getPosq().getDevicePointer(), &cu.getForce().getDevicePointer(), &pmeGrid1.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+                    cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
+                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
+                    &charges.getDevicePointer(), &subsets.getDevicePointer(), &recipSubsetFlags.getDevicePointer(),
+                    usePmeStream ? &pmeEnergyBuffer.getDevicePointer() : &cu.getEnergyBuffer().getDevicePointer(), &pmeSliceEnergyBuffer.getDevicePointer(),
+                    &recipSliceWeights.getDevicePointer(), &recipSliceFlags.getDevicePointer(), &firstSubset, &accumulate, &computeEnergy, &computeForces, &recordSlices};
+            int numDerivs = cu.getEnergyParamDerivNames().size();
+            if (hasDerivatives) {
+                convolutionArgs.push_back(&cu.getEnergyParamDerivBuffer().getDevicePointer());
+                convolutionArgs.push_back(&numDerivs);
+                convolutionArgs.push_back(&recipSliceDerivIndices.getDevicePointer());
+                interpolateArgs.push_back(&cu.getEnergyParamDerivBuffer().getDevicePointer());
+                interpolateArgs.push_back(&numDerivs);
+                interpolateArgs.push_back(&recipSliceDerivIndices.getDevicePointer());
+            }
+            if (computeEnergy || computeForces)
+                for (firstSubset = 0; firstSubset < numSubsets; firstSubset += subsetChunkSize) {
+                    accumulate = (firstSubset > 0);
+                    if (accumulate)
+                        cu.clearBuffer(useFixedPointChargeSpreading ? pmeGrid2 : pmeGrid1);
+                    cu.executeKernel(pmeSpreadChargeKernel, &spreadArgs[0], cu.getNumAtoms(), 128);
+                    if (useFixedPointChargeSpreading) {
+                        void* finishSpreadArgs[] = {&pmeGrid2.getDevicePointer(), &pmeGrid1.getDevicePointer()};
+                        cu.executeKernel(pmeFinishSpreadChargeKernel, finishSpreadArgs, gridSizeX*gridSizeY*gridSizeZ*subsetChunkSize, 256);
+                    }
+                    fft->execFFT(true);
+                    cu.executeKernel(pmeConvolutionKernel, &convolutionArgs[0], gridSizeX*gridSizeY*(gridSizeZ/2+1));
+                    fft->execFFT(false);
+                    cu.executeKernel(pmeInterpolateChunkKernel, &interpolateArgs[0], cu.getNumAtoms());
+                }
+        }
+        else {
+            cu.executeKernel(pmeSpreadChargeKernel, &spreadArgs[0], cu.getNumAtoms(), 128);
 
-        fft->execFFT(true);
+            if (useFixedPointChargeSpreading) {
+                void* finishSpreadArgs[] = {&pmeGrid2.getDevicePointer(), &pmeGrid1.getDevicePointer()};
+                cu.executeKernel(pmeFinishSpreadChargeKernel, finishSpreadArgs, gridSizeX*gridSizeY*gridSizeZ*numSubsets, 256);
+            }
 
-        void* collapseGridArgs[] = {&pmeGrid2.getDevicePointer()};
-        cu.executeKernel(pmeCollapseGridKernel, collapseGridArgs, gridSizeX*gridSizeY*gridSizeZ, 256);
+            fft->execFFT(true);
 
-        if (includeEnergy) {
-            void* computeEnergyArgs[] = {&pmeGrid2.getDevicePointer(), usePmeStream ? &pmeEnergyBuffer.getDevicePointer() : &cu.getEnergyBuffer().getDevicePointer(),
-                    &pmeBsplineModuliX.getDevicePointer(), &pmeBsplineModuliY.getDevicePointer(), &pmeBsplineModuliZ.getDevicePointer(),
-                    recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
-            cu.executeKernel(pmeEvalEnergyKernel, computeEnergyArgs, gridSizeX*gridSizeY*gridSizeZ);
-        }
+            // The energy only needs the structure factors, so the potential on the grid is computed
+            // only when forces are requested.  Both are obtained from a single pass over the half
+            // complex grid, which also combines the subset grids according to the slice weights.
 
-        void* convolutionArgs[] = {&pmeGrid2.getDevicePointer(), &pmeBsplineModuliX.getDevicePointer(),
-                &pmeBsplineModuliY.getDevicePointer(), &pmeBsplineModuliZ.getDevicePointer(),
-                recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2]};
-        cu.executeKernel(pmeConvolutionKernel, convolutionArgs, gridSizeX*gridSizeY*gridSizeZ, 256);
+            if (computeEnergy || computeForces) {
+                vector<void*> convolutionArgs = {&pmeGrid2.getDevicePointer(), usePmeStream ? &pmeEnergyBuffer.getDevicePointer() : &cu.getEnergyBuffer().getDevicePointer(),
+                        &pmeSliceEnergyBuffer.getDevicePointer(), &recipSliceWeights.getDevicePointer(), &pmeBsplineModuliX.getDevicePointer(), &pmeBsplineModuliY.getDevicePointer(),
+                        &pmeBsplineModuliZ.getDevicePointer(), recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2],
+                        &recipSliceFlags.getDevicePointer(), &computeEnergy, &computeForces, &recordSlices};
+                int numDerivs = cu.getEnergyParamDerivNames().size();
+                if (hasDerivatives) {
+                    convolutionArgs.push_back(&cu.getEnergyParamDerivBuffer().getDevicePointer());
+                    convolutionArgs.push_back(&numDerivs);
+                    convolutionArgs.push_back(&recipSliceDerivIndices.getDevicePointer());
+                }
+                cu.executeKernel(pmeConvolutionKernel, &convolutionArgs[0], gridSizeX*gridSizeY*(gridSizeZ/2+1), convolutionBlockSize);
+            }
 
-        fft->execFFT(false);
+            if (includeForces) {
+                fft->execFFT(false);
 
-        void* interpolateArgs[] = {&cu.getPosq().getDevicePointer(), &cu.getForce().getDevicePointer(), &pmeGrid1.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
-                cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
-                recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
-                &charges.getDevicePointer()};
-        cu.executeKernel(pmeInterpolateForceKernel, interpolateArgs, cu.getNumAtoms(), 128);
+                vector<void*> interpolateArgs = {&cu.getPosq().getDevicePointer(), &cu.getForce().getDevicePointer(), &pmeGrid1.getDevicePointer(), cu.getPeriodicBoxSizePointer(),
+                        cu.getInvPeriodicBoxSizePointer(), cu.getPeriodicBoxVecXPointer(), cu.getPeriodicBoxVecYPointer(), cu.getPeriodicBoxVecZPointer(),
+                        recipBoxVectorPointer[0], recipBoxVectorPointer[1], recipBoxVectorPointer[2], &pmeAtomGridIndex.getDevicePointer(),
+                        &charges.getDevicePointer(), &subsets.getDevicePointer(), &recipSubsetFlags.getDevicePointer()};
+                if (cacheBsplines) {
+                    interpolateArgs.push_back(&pmeCachedTheta.getDevicePointer());
+                    interpolateArgs.push_back(&pmeCachedDTheta.getDevicePointer());
+                    interpolateArgs.push_back(&pmeCachedGridIndex.getDevicePointer());
+                }
+                cu.executeKernel(pmeInterpolateForceKernel, &interpolateArgs[0], cu.getNumAtoms(), 128);
+            }
+        }
 
         if (usePmeStream) {
             cuEventRecord(pmeSyncEvent, pmeStream);
@@ -780,20 +1217,87 @@ void CudaCalcSlicedPmeForceKernel::copyParametersToContext(ContextImpl& context,
             baseExceptionChargeProdsVec[i] = chargeProd;
         }
         baseExceptionChargeProds.upload(baseExceptionChargeProdsVec);
+        vector<int> exceptionSlicesVec(numExceptions);
+        for (int i = 0; i < numExceptions; i++)
+            exceptionSlicesVec[i] = getSliceIndex(subsetVec[exceptionAtoms[i].first], subsetVec[exceptionAtoms[i].second]);
+        exceptionSlices.upload(exceptionSlicesVec);
+    }
+    if (exclusionSlices.isInitialized()) {
+        vector<int> exclusionSlicesVec(exclusionAtomPairs.size());
+        for (int i = 0; i < exclusionAtomPairs.size(); i++)
+            exclusionSlicesVec[i] = getSliceIndex(subsetVec[exclusionAtomPairs[i].first], subsetVec[exclusionAtomPairs[i].second]);
+        exclusionSlices.upload(exclusionSlicesVec);
     }
     
     // Compute other values.
     
-    ewaldSelfEnergy = 0.0;
-    if (cu.getContextIndex() == 0) {
-        for (int i = 0; i < force.getNumParticles(); i++) {
-            ewaldSelfEnergy -= baseParticleChargeVec[i]*baseParticleChargeVec[i]*ONE_4PI_EPS0*alpha/sqrt(M_PI);
-        }
-    }
+    subsetSelfEnergy.assign(numSubsets, 0.0);
+    if (cu.getContextIndex() == 0)
+        for (int i = 0; i < force.getNumParticles(); i++)
+            subsetSelfEnergy[subsetVec[i]] -= baseParticleChargeVec[i]*baseParticleChargeVec[i]*ONE_4PI_EPS0*alpha/sqrt(M_PI);
     cu.invalidateMolecules();
     recomputeParams = true;
 }
 
+CudaFFT3D* CudaCalcSlicedPmeForceKernel::createFastestFFT() {
+    vector<string> backends = {"VkFFT"};
+    int cufftVersion;
+    cufftGetVersion(&cufftVersion);
+    if (cufftVersion >= 7050)
+        backends.push_back("cuFFT");
+
+    // Start from empty grids so that repeated transforms cannot overflow.  The grids are cleared
+    // on the stream the transforms run on, so the clearing is not included in the timings.
+
+    cu.setCurrentStream(pmeStream);
+    cu.clearBuffer(pmeGrid1);
+    cu.clearBuffer(pmeGrid2);
+    cu.restoreDefaultStream();
+    const int numIterations = 5;
+    CudaFFT3D* fastest = NULL;
+    double fastestTime = 0.0;
+    for (string& backend : backends) {
+        CudaFFT3D* candidate;
+        if (backend == "cuFFT")
+            candidate = (CudaFFT3D*) new CudaCuFFT3D(cu, pmeStream, gridSizeX, gridSizeY, gridSizeZ, subsetChunkSize, true, pmeGrid1, pmeGrid2);
+        else
+            candidate = (CudaFFT3D*) new CudaVkFFT3D(cu, pmeStream, gridSizeX, gridSizeY, gridSizeZ, subsetChunkSize, true, pmeGrid1, pmeGrid2, vkfftCacheDirectory);
+
+        // Run one pair of transforms as a warm up, then time several more.
+
+        candidate->execFFT(true);
+        candidate->execFFT(false);
+        cuStreamSynchronize(pmeStream);
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < numIterations; i++) {
+            candidate->execFFT(true);
+            candidate->execFFT(false);
+        }
+        cuStreamSynchronize(pmeStream);
+        double time = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+        if (fastest == NULL || time < fastestTime) {
+            if (fastest != NULL)
+                delete fastest;
+            fastest = candidate;
+            fastestTime = time;
+            fftBackend = backend;
+        }
+        else
+            delete candidate;
+    }
+    return fastest;
+}
+
+void CudaCalcSlicedPmeForceKernel::setRecordSliceEnergies(bool record) {
+    recordSliceEnergies = record;
+}
+
+string CudaCalcSlicedPmeForceKernel::getFFTBackend() const {
+    if (pmeio != NULL)
+        return "CPU";
+    return fftBackend;
+}
+
 void CudaCalcSlicedPmeForceKernel::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     if (cu.getPlatformData().useCpuPme)
         cpuPme.getAs<CalcPmeReciprocalForceKernel>().getPMEParameters(alpha, nx, ny, nz);
@@ -805,3 +1309,38 @@ void CudaCalcSlicedPmeForceKernel::getPMEParameters(double& alpha, int& nx, int&
     }
 }
 
+
+void CudaCalcSlicedPmeForceKernel::getSliceEnergies(vector<vector<double> >& energies) {
+    if (pmeio != NULL)
+        throw OpenMMException("getSliceEnergies: Slice energies are not available when reciprocal space is computed on the CPU");
+    ContextSelector selector(cu);
+    cu.clearBuffer(sliceEnergies);
+    int bufferSize = sliceEnergyBuffer.getSize()/numSlices;
+    void* directArgs[] = {&sliceEnergyBuffer.getDevicePointer(), &sliceEnergies.getDevicePointer(), &bufferSize};
+    cu.executeKernel(reduceSliceEnergiesKernel, directArgs, numSlices*CudaContext::ThreadBlockSize, CudaContext::ThreadBlockSize);
+    bool anyReciprocal = (find(sliceEnergyRecipSlices.begin(), sliceEnergyRecipSlices.end(), true) != sliceEnergyRecipSlices.end());
+    if (anyReciprocal && pmeSliceEnergyBuffer.isInitialized()) {
+        int pmeBufferSize = pmeSliceEnergyBuffer.getSize()/numSlices;
+        void* reciprocalArgs[] = {&pmeSliceEnergyBuffer.getDevicePointer(), &sliceEnergies.getDevicePointer(), &pmeBufferSize};
+        cu.executeKernel(reduceSliceEnergiesKernel, reciprocalArgs, numSlices*CudaContext::ThreadBlockSize, CudaContext::ThreadBlockSize);
+    }
+    vector<double> sliceEnergyVec;
+    if (sliceEnergies.getElementSize() == sizeof(double))
+        sliceEnergies.download(sliceEnergyVec);
+    else {
+        vector<float> sliceEnergyVecFloat;
+        sliceEnergies.download(sliceEnergyVecFloat);
+        sliceEnergyVec.assign(sliceEnergyVecFloat.begin(), sliceEnergyVecFloat.end());
+    }
+
+    // When there are no parameter offsets, the self energy is computed on the host.
+
+    energies.assign(numSubsets, vector<double>(numSubsets, 0.0));
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++) {
+            double energy = sliceEnergyVec[getSliceIndex(i, j)];
+            if (i == j && anyReciprocal && sliceEnergyRecipSlices[getSliceIndex(i, i)] && !hasOffsets)
+                energy += subsetSelfEnergy[i];
+            energies[i][j] = energies[j][i] = energy;
+        }
+}
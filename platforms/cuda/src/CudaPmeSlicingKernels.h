@@ -39,7 +39,6 @@
 #include "openmm/internal/ContextImpl.h"
 #include "openmm/cuda/CudaContext.h"
 #include "openmm/cuda/CudaArray.h"
-#include "openmm/cuda/CudaSort.h"
 #include <vector>
 
 using namespace OpenMM;
@@ -53,7 +52,7 @@ namespace PmeSlicing {
 class CudaCalcSlicedPmeForceKernel : public CalcSlicedPmeForceKernel {
 public:
     CudaCalcSlicedPmeForceKernel(std::string name, const Platform& platform, CudaContext& cu, const System& system) : CalcSlicedPmeForceKernel(name, platform),
-            cu(cu), hasInitializedFFT(false), sort(NULL), fft(NULL), pmeio(NULL), usePmeStream(false) {
+            cu(cu), hasInitializedFFT(false), fft(NULL), pmeio(NULL), usePmeStream(false), recordSliceEnergies(false), deviceRecordSliceEnergies(false) {
     }
     ~CudaCalcSlicedPmeForceKernel();
     /**
@@ -69,11 +68,11 @@ public:
      * @param context        the context in which to execute this kernel
      * @param includeForces  true if forces should be calculated
      * @param includeEnergy  true if the energy should be calculated
-     * @param includeDirect  true if direct space interactions should be included
-     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param includeDirect  for each slice, whether its direct space interactions should be included
+     * @param includeReciprocal  for each slice, whether its reciprocal space interactions should be included
      * @return the potential energy due to the force
      */
-    double execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal);
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy, const std::vector<bool>& includeDirect, const std::vector<bool>& includeReciprocal);
     /**
      * Copy changed parameters over to a context.
      *
@@ -90,23 +89,36 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     void getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
+    /**
+     * Get the name of the FFT backend used for reciprocal space calculations.
+     */
+    std::string getFFTBackend() const;
+    /**
+     * Set whether subsequent calls to execute() should record the energy of each slice.
+     *
+     * @param record   true if slice energies should be recorded
+     */
+    void setRecordSliceEnergies(bool record);
+    /**
+     * Get the unscaled energies of all slices computed in the most recent call to execute()
+     * in which the energy was requested and slice energies were being recorded.  They are not
+     * multiplied by the slice scaling parameters.
+     *
+     * @param energies   on exit, a symmetric numSubsets x numSubsets matrix whose element [I][J]
+     *                   is the energy of slice[I,J]
+     */
+    void getSliceEnergies(std::vector<std::vector<double> >& energies);
 private:
-    class SortTrait : public CudaSort::SortTrait {
-        int getDataSize() const {return 8;}
-        int getKeySize() const {return 4;}
-        const char* getDataType() const {return "int2";}
-        const char* getKeyType() const {return "int";}
-        const char* getMinKey() const {return "(-2147483647-1)";}
-        const char* getMaxKey() const {return "2147483647";}
-        const char* getMaxValue() const {return "make_int2(2147483647, 2147483647)";}
-        const char* getSortKey() const {return "value.y";}
-    };
     class ForceInfo;
     class PmeIO;
     class PmePreComputation;
     class PmePostComputation;
     class SyncStreamPreComputation;
     class SyncStreamPostComputation;
+    /**
+     * Time each of the available FFT backends on the PME grids, and return the fastest one.
+     */
+    CudaFFT3D* createFastestFFT();
     CudaContext& cu;
     ForceInfo* info;
     bool hasInitializedFFT;
@@ -115,6 +127,8 @@ private:
     CudaArray exceptionChargeProds;
     CudaArray exclusionAtoms;
     CudaArray exclusionChargeProds;
+    CudaArray exceptionSlices;
+    CudaArray exclusionSlices;
     CudaArray baseParticleCharges;
     CudaArray baseExceptionChargeProds;
     CudaArray particleParamOffsets;
@@ -128,31 +142,61 @@ private:
     CudaArray pmeBsplineModuliY;
     CudaArray pmeBsplineModuliZ;
     CudaArray pmeAtomGridIndex;
+    CudaArray pmeUnsortedAtomGridIndex;
+    CudaArray pmeCellStart;
+    CudaArray pmeCellBlockOffsets;
+    CudaArray pmeCellRank;
+    CudaArray pmeSortedAtomCell;
+    CudaArray pmeNumMovedAtoms;
+    CudaArray pmeCachedTheta;
+    CudaArray pmeCachedDTheta;
+    CudaArray pmeCachedGridIndex;
     CudaArray pmeEnergyBuffer;
-    CudaSort* sort;
+    CudaArray sliceEnergyBuffer;
+    CudaArray pmeSliceEnergyBuffer;
+    CudaArray sliceEnergies;
+    CudaArray recordSliceEnergiesFlag;
+    CudaArray directSliceFlags;
+    CudaArray recipSliceWeights;
+    CudaArray recipSubsetFlags;
+    CudaArray recipSliceFlags;
+    CudaArray sliceLambdas;
+    CudaArray recipSliceDerivIndices;
     Kernel cpuPme;
     PmeIO* pmeio;
     CUstream pmeStream;
     CUevent pmeSyncEvent, paramsSyncEvent;
     CudaFFT3D* fft;
+    std::string fftBackend, vkfftCacheDirectory;
     CUfunction computeParamsKernel, computeExclusionParamsKernel;
     CUfunction ewaldSumsKernel;
     CUfunction ewaldForcesKernel;
     CUfunction pmeGridIndexKernel;
+    CUfunction pmeCountAtomsKernel;
+    CUfunction pmeScanCellBlocksKernel;
+    CUfunction pmeCellOffsetsKernel;
+    CUfunction pmeAddCellOffsetsKernel;
+    CUfunction pmeSortAtomsKernel;
     CUfunction pmeSpreadChargeKernel;
     CUfunction pmeFinishSpreadChargeKernel;
-    CUfunction pmeEvalEnergyKernel;
     CUfunction pmeConvolutionKernel;
     CUfunction pmeInterpolateForceKernel;
-    CUfunction pmeCollapseGridKernel;
-    std::vector<std::pair<int, int> > exceptionAtoms;
+    CUfunction pmeInterpolateChunkKernel;
+    CUfunction reduceSliceEnergiesKernel;
+    std::vector<std::pair<int, int> > exceptionAtoms, exclusionAtomPairs;
     std::vector<std::string> paramNames;
     std::vector<double> paramValues;
-    double ewaldSelfEnergy, alpha;
+    std::vector<double> subsetSelfEnergy;
+    std::vector<bool> includedRecipSlices, sliceEnergyRecipSlices;
+    std::vector<std::string> sliceScalingParams, derivParams;
+    std::vector<double> sliceLambdaValues;
+    std::vector<int> directSliceGroups, directSliceFlagsVec;
+    double alpha;
     int interpolateForceThreads;
-    int gridSizeX, gridSizeY, gridSizeZ, numSubsets;
-    bool usePmeStream, useCudaFFT, usePosqCharges, recomputeParams, hasOffsets;
-    static const int PmeOrder = 5;
+    int gridSizeX, gridSizeY, gridSizeZ, numSubsets, numSlices, pmeOrder, subsetChunkSize, convolutionBlockSize;
+    bool usePmeStream, useCudaFFT, usePosqCharges, recomputeParams, hasOffsets, hasDerivatives, useFixedPointChargeSpreading, cacheBsplines, streamSubsetChunks;
+    bool recordSliceEnergies, deviceRecordSliceEnergies;
+    static const int CellScanSize = 256;
 };
 
 } // namespace PmeSlicing
@@ -25,14 +25,18 @@
  * -------------------------------------------------------------------------- */
 
 #include "internal/CudaVkFFT3D.h"
+#include "BinaryCache.h"
 #include "openmm/cuda/CudaContext.h"
+#include <sstream>
 #include <string>
+#include <vector>
 
 using namespace PmeSlicing;
 using namespace OpenMM;
 using namespace std;
 
-CudaVkFFT3D::CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out) :
+CudaVkFFT3D::CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int ysize, int zsize, int batch, bool realToComplex, CudaArray& in, CudaArray& out,
+            const string& cacheDirectory) :
         CudaFFT3D(context, stream, xsize, ysize, zsize, batch, realToComplex, in, out) {
     int outputZSize = realToComplex ? (zsize/2+1) : zsize;
     size_t realTypeSize = doublePrecision ? sizeof(double) : sizeof(float);
@@ -68,10 +72,41 @@ CudaVkFFT3D::CudaVkFFT3D(CudaContext& context, CUstream& stream, int xsize, int
     config.bufferStride[1] = outputZSize*ysize;
     config.bufferStride[2] = outputZSize*ysize*xsize;
 
+    // Reuse the binaries compiled by another object in this process or by an earlier run with the
+    // same device and configuration if possible.
+
+    char deviceName[100];
+    cuDeviceGetName(deviceName, 100, context.getDevice());
+    int driverVersion;
+    cuDriverGetVersion(&driverVersion);
+    stringstream key;
+    key<<"CUDA;VkFFT "<<VkFFTGetVersion()<<";"<<deviceName<<";compute "<<context.getComputeCapability()<<";driver "<<driverVersion;
+    key<<";"<<(doublePrecision ? "double" : "single")<<";"<<(realToComplex ? "r2c" : "c2c")<<";"<<xsize<<"x"<<ysize<<"x"<<zsize<<";batch "<<batch;
+    string cacheKey = key.str();
+    binaries = BinaryCache::load(cacheDirectory, "vkfft", cacheKey);
+    if (binaries) {
+        config.loadApplicationFromString = 1;
+        config.loadApplicationString = (void*) binaries->data();
+    }
+    else
+        config.saveApplicationToString = 1;
     app = new VkFFTApplication();
     VkFFTResult result = initializeVkFFT(app, config);
-    if (result != VKFFT_SUCCESS)
+    if (result != VKFFT_SUCCESS && config.loadApplicationFromString) {
+        // The cached binaries could not be used, so generate them again and replace the cache entry.
+
+        *app = VkFFTApplication();
+        config.loadApplicationFromString = 0;
+        config.loadApplicationString = NULL;
+        config.saveApplicationToString = 1;
+        result = initializeVkFFT(app, config);
+    }
+    if (result != VKFFT_SUCCESS) {
+        delete app;
         throw OpenMMException("Error initializing VkFFT: "+to_string(result));
+    }
+    if (config.saveApplicationToString)
+        binaries = BinaryCache::save(cacheDirectory, "vkfft", cacheKey, app->saveApplicationString, app->applicationStringSize);
 }
 
 CudaVkFFT3D::~CudaVkFFT3D() {
@@ -0,0 +1,69 @@
+#ifndef __OPENMM_OPENCLFFT3D_H__
+#define __OPENMM_OPENCLFFT3D_H__
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2009-2015 Stanford University and the Authors.      *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU Lesser General Public License as published   *
+ * by the Free Software Foundation, either version 3 of the License, or       *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU Lesser General Public License for more details.                        *
+ *                                                                            *
+ * You should have received a copy of the GNU Lesser General Public License   *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/opencl/OpenCLContext.h"
+#include "FFTDimensions.h"
+#include <vector>
+
+namespace PmeSlicing {
+
+/**
+ * This is the abstract interface of the classes that perform batched three dimensional Fast
+ * Fourier Transforms on the OpenCL platform.
+ *
+ * Note that the transforms are unnormalized.  That means that if you perform a forward
+ * transform followed immediately by an inverse transform, the effect is to multiply every
+ * value of the original data set by the total number of data points.
+ */
+
+class OpenCLFFT3D {
+public:
+    virtual ~OpenCLFFT3D() {};
+    /**
+     * Perform a Fourier transform.
+     *
+     * @param forward  true to perform a forward transform, false to perform an inverse transform
+     * @param commandQueue   the OpenCL command queue doing the calculations
+     */
+    virtual void execFFT(bool forward, cl::CommandQueue queue) = 0;
+    /**
+     * Get the smallest legal size for a dimension of the grid (that is, a size with no prime
+     * factors other than 2, 3, 5, ..., maxPrimeFactor).
+     *
+     * @param minimum   the minimum size the return value must be greater than or equal to
+     * @param maxPrimeFactor  the maximum supported prime number factor (default=7)
+     */
+    static int findLegalDimension(int minimum, int maxPrimeFactor=7) {  // VkFFT allows maxPrimeFactor up to 13
+        return FFTDimensions::findLegalDimension(minimum, maxPrimeFactor);
+    }
+};
+
+} // namespace PmeSlicing
+
+#endif // __OPENMM_OPENCLFFT3D_H__
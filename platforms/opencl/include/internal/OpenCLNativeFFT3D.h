@@ -0,0 +1,106 @@
+#ifndef __OPENMM_OPENCLNATIVEFFT3D_H__
+#define __OPENMM_OPENCLNATIVEFFT3D_H__
+
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2009-2015 Stanford University and the Authors.      *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU Lesser General Public License as published   *
+ * by the Free Software Foundation, either version 3 of the License, or       *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU Lesser General Public License for more details.                        *
+ *                                                                            *
+ * You should have received a copy of the GNU Lesser General Public License   *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/OpenCLFFT3D.h"
+#include "openmm/opencl/OpenCLArray.h"
+#include <vector>
+
+using namespace OpenMM;
+
+namespace PmeSlicing {
+
+/**
+ * This class performs three dimensional Fast Fourier Transforms with kernels generated at
+ * run time from the sources in fft.cl and fftR2C.cl, without relying on any external library.
+ * Each transform is done as three passes of one dimensional transforms, each of which is
+ * computed in local memory by a sequence of radix 2, 3, 4, 5, and 7 stages.  When one of the
+ * dimensions is even, a real-to-complex transform packs the real values into a complex grid
+ * that is half as large.
+ *
+ * Note that this class performs an unnormalized transform.  That means that if you perform
+ * a forward transform followed immediately by an inverse transform, the effect is to
+ * multiply every value of the original data set by the total number of data points.
+ */
+
+class OpenCLNativeFFT3D : public OpenCLFFT3D {
+public:
+    /**
+     * Create an OpenCLNativeFFT3D object for performing transforms of a particular size.
+     *
+     * The transform cannot be done in-place: the input and output
+     * arrays must be different.  Also, the input array is used as workspace, so its contents
+     * are destroyed.  This also means that both arrays must be large enough to hold complex values,
+     * even when performing a real-to-complex transform.
+     *
+     * When performing a real-to-complex transform, the output data is of size xsize*ysize*(zsize/2+1)
+     * and contains only the non-redundant elements.
+     *
+     * @param context the context in which to perform calculations
+     * @param xsize   the first dimension of the data sets on which FFTs will be performed
+     * @param ysize   the second dimension of the data sets on which FFTs will be performed
+     * @param zsize   the third dimension of the data sets on which FFTs will be performed
+     * @param batch   the number of FFTs
+     * @param realToComplex  if true, a real-to-complex transform will be done.  Otherwise, it is complex-to-complex.
+     * @param in      the data to transform, ordered such that in[x*ysize*zsize + y*zsize + z] contains element (x, y, z)
+     * @param out     on exit, this contains the transformed data
+     */
+    OpenCLNativeFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out);
+    /**
+     * Perform a Fourier transform.
+     *
+     * @param forward  true to perform a forward transform, false to perform an inverse transform
+     * @param commandQueue   the OpenCL command queue doing the calculations
+     */
+    void execFFT(bool forward, cl::CommandQueue queue);
+private:
+    /**
+     * One pass of the transform: a kernel and the work group configuration to launch it with.
+     */
+    struct Pass {
+        cl::Kernel kernel;
+        int threads, groups;
+    };
+    /**
+     * Create a pass that transforms every row along the last axis of an (xsize, ysize, zsize)
+     * grid and stores the result with the axes rotated to (ysize, zsize, xsize).
+     */
+    Pass createPass(int xsize, int ysize, int zsize, bool forward, bool inputIsReal, bool inputIsPacked, bool outputIsPacked, bool outputIsReal,
+            OpenCLArray& input, OpenCLArray& output);
+    void enqueueKernel(cl::CommandQueue& queue, cl::Kernel& kernel, int threads, int groups);
+    OpenCLContext& context;
+    int batch;
+    bool packRealAsComplex;
+    int packedGridSize;
+    std::vector<Pass> forwardPasses, backwardPasses;
+    cl::Kernel packForwardKernel, unpackForwardKernel, packBackwardKernel, unpackBackwardKernel;
+};
+
+} // namespace PmeSlicing
+
+#endif // __OPENMM_OPENCLNATIVEFFT3D_H__
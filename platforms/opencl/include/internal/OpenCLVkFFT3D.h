@@ -27,9 +27,13 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
  * -------------------------------------------------------------------------- */
 
+#include "internal/OpenCLFFT3D.h"
 #include "openmm/opencl/OpenCLArray.h"
 #define VKFFT_BACKEND 3 // OpenCL
 #include "internal/vkFFT.h"
+#include <memory>
+#include <string>
+#include <vector>
 
 using namespace OpenMM;
 
@@ -44,7 +48,7 @@ namespace PmeSlicing {
  * multiply every value of the original data set by the total number of data points.
  */
 
-class OpenCLVkFFT3D {
+class OpenCLVkFFT3D : public OpenCLFFT3D {
 public:
     /**
      * Create an OpenCLVkFFT3D object for performing transforms of a particular size.
@@ -65,8 +69,11 @@ public:
      * @param realToComplex  if true, a real-to-complex transform will be done.  Otherwise, it is complex-to-complex.
      * @param in      the data to transform, ordered such that in[x*ysize*zsize + y*zsize + z] contains element (x, y, z)
      * @param out     on exit, this contains the transformed data
+     * @param cacheDirectory  a directory in which the compiled VkFFT binaries are cached between runs.  If it is
+     *                        empty (the default), the binaries are only shared with other objects in this process.
      */
-    OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out);
+    OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out,
+            const std::string& cacheDirectory="");
     ~OpenCLVkFFT3D();
     /**
      * Perform a Fourier transform.
@@ -75,29 +82,6 @@ public:
      * @param commandQueue   the OpenCL command queue doing the calculations
      */
     void execFFT(bool forward, cl::CommandQueue queue);
-    /**
-     * Get the smallest legal size for a dimension of the grid (that is, a size with no prime
-     * factors other than 2, 3, 5, ..., maxPrimeFactor).
-     *
-     * @param minimum   the minimum size the return value must be greater than or equal to
-     * @param maxPrimeFactor  the maximum supported prime number factor (default=7)
-     */
-    static int findLegalDimension(int minimum, int maxPrimeFactor=7) {  // VkFFT allows maxPrimeFactor up to 13
-        if (minimum < 1)
-            return 1;
-        while (true) {
-            // Attempt to factor the current value.
-
-            int unfactored = minimum;
-            for (int factor = 2; factor <= maxPrimeFactor; factor++) {
-                while (unfactored > 1 && unfactored%factor == 0)
-                    unfactored /= factor;
-            }
-            if (unfactored == 1)
-                return minimum;
-            minimum++;
-        }
-    }
 private:
     cl_mem inputBuffer;
     cl_mem outputBuffer;
@@ -105,6 +89,7 @@ private:
     cl_context cl;
     uint64_t inputBufferSize;
     uint64_t outputBufferSize;
+    std::shared_ptr<const std::vector<char> > binaries;
     VkFFTApplication app = {};
 };
 
@@ -0,0 +1,260 @@
+/* -------------------------------------------------------------------------- *
+ *                                   OpenMM                                   *
+ * -------------------------------------------------------------------------- *
+ * This is part of the OpenMM molecular simulation toolkit originating from   *
+ * Simbios, the NIH National Center for Physics-Based Simulation of           *
+ * Biological Structures at Stanford, funded under the NIH Roadmap for        *
+ * Medical Research, grant U54 GM072970. See https://simtk.org.               *
+ *                                                                            *
+ * Portions copyright (c) 2009-2015 Stanford University and the Authors.      *
+ * Authors: Peter Eastman                                                     *
+ * Contributors:                                                              *
+ *                                                                            *
+ * This program is free software: you can redistribute it and/or modify       *
+ * it under the terms of the GNU Lesser General Public License as published   *
+ * by the Free Software Foundation, either version 3 of the License, or       *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * This program is distributed in the hope that it will be useful,            *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU Lesser General Public License for more details.                        *
+ *                                                                            *
+ * You should have received a copy of the GNU Lesser General Public License   *
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.      *
+ * -------------------------------------------------------------------------- */
+
+#include "internal/OpenCLNativeFFT3D.h"
+#include "OpenCLPmeSlicingKernelSources.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <sstream>
+#include <string>
+
+using namespace PmeSlicing;
+using namespace OpenMM;
+using namespace std;
+
+OpenCLNativeFFT3D::OpenCLNativeFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out) :
+        context(context), batch(batch), packRealAsComplex(false) {
+    int elementSize = (context.getUseDoublePrecision() ? sizeof(mm_double2) : sizeof(mm_float2));
+    int packedXSize = xsize;
+    int packedYSize = ysize;
+    int packedZSize = zsize;
+    if (realToComplex) {
+        // If any axis size is even, we can pack the real values into a complex grid that is only half as large.
+        // Look for an appropriate axis.
+
+        int packedAxis, packedAxisSize;
+        packRealAsComplex = true;
+        if (zsize%2 == 0) {
+            packedAxis = 2;
+            packedZSize /= 2;
+            packedAxisSize = packedZSize;
+        }
+        else if (ysize%2 == 0) {
+            packedAxis = 1;
+            packedYSize /= 2;
+            packedAxisSize = packedYSize;
+        }
+        else if (xsize%2 == 0) {
+            packedAxis = 0;
+            packedXSize /= 2;
+            packedAxisSize = packedXSize;
+        }
+        else
+            packRealAsComplex = false;
+        if (packRealAsComplex) {
+            // Build the kernels for packing and unpacking the data.
+
+            map<string, string> defines;
+            defines["XSIZE"] = context.intToString(xsize);
+            defines["YSIZE"] = context.intToString(ysize);
+            defines["ZSIZE"] = context.intToString(zsize);
+            defines["BATCH"] = context.intToString(batch);
+            defines["PACKED_AXIS"] = context.intToString(packedAxis);
+            defines["PACKED_XSIZE"] = context.intToString(packedXSize);
+            defines["PACKED_YSIZE"] = context.intToString(packedYSize);
+            defines["PACKED_ZSIZE"] = context.intToString(packedZSize);
+            defines["M_PI"] = context.doubleToString(M_PI);
+            cl::Program program = context.createProgram(OpenCLPmeSlicingKernelSources::fftR2C, defines);
+            packForwardKernel = cl::Kernel(program, "packForwardData");
+            packForwardKernel.setArg<cl::Buffer>(0, in.getDeviceBuffer());
+            packForwardKernel.setArg<cl::Buffer>(1, out.getDeviceBuffer());
+            unpackForwardKernel = cl::Kernel(program, "unpackForwardData");
+            unpackForwardKernel.setArg<cl::Buffer>(0, in.getDeviceBuffer());
+            unpackForwardKernel.setArg<cl::Buffer>(1, out.getDeviceBuffer());
+            unpackForwardKernel.setArg(2, packedAxisSize*elementSize, NULL);
+            packBackwardKernel = cl::Kernel(program, "packBackwardData");
+            packBackwardKernel.setArg<cl::Buffer>(0, out.getDeviceBuffer());
+            packBackwardKernel.setArg<cl::Buffer>(1, in.getDeviceBuffer());
+            packBackwardKernel.setArg(2, packedAxisSize*elementSize, NULL);
+            unpackBackwardKernel = cl::Kernel(program, "unpackBackwardData");
+            unpackBackwardKernel.setArg<cl::Buffer>(0, out.getDeviceBuffer());
+            unpackBackwardKernel.setArg<cl::Buffer>(1, in.getDeviceBuffer());
+        }
+    }
+    packedGridSize = packedXSize*packedYSize*packedZSize;
+
+    // Each pass transforms along the last axis and rotates the axes, so after three passes the data is
+    // back in its original order.  The packed grid is transformed as complex data between the packing
+    // kernels.  Otherwise, the first forward pass reads real data and the last one writes only the
+    // non-redundant half, and the inverse passes do the opposite.
+
+    bool inputIsReal = (realToComplex && !packRealAsComplex);
+    OpenCLArray& forwardInput = (packRealAsComplex ? out : in);
+    OpenCLArray& forwardOutput = (packRealAsComplex ? in : out);
+    forwardPasses.push_back(createPass(packedXSize, packedYSize, packedZSize, true, inputIsReal, false, false, false, forwardInput, forwardOutput));
+    forwardPasses.push_back(createPass(packedYSize, packedZSize, packedXSize, true, false, false, false, false, forwardOutput, forwardInput));
+    forwardPasses.push_back(createPass(packedZSize, packedXSize, packedYSize, true, false, false, inputIsReal, false, forwardInput, forwardOutput));
+    backwardPasses.push_back(createPass(packedXSize, packedYSize, packedZSize, false, false, inputIsReal, false, false, forwardOutput, forwardInput));
+    backwardPasses.push_back(createPass(packedYSize, packedZSize, packedXSize, false, false, false, false, false, forwardInput, forwardOutput));
+    backwardPasses.push_back(createPass(packedZSize, packedXSize, packedYSize, false, false, false, false, inputIsReal, forwardOutput, forwardInput));
+}
+
+OpenCLNativeFFT3D::Pass OpenCLNativeFFT3D::createPass(int xsize, int ysize, int zsize, bool forward, bool inputIsReal, bool inputIsPacked, bool outputIsPacked, bool outputIsReal,
+            OpenCLArray& input, OpenCLArray& output) {
+    int maxThreads = min(256, (int) context.getDevice().getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+    bool isCPU = (context.getDevice().getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU);
+    while (true) {
+        bool loopRequired = (zsize > maxThreads || isCPU);
+        int blocksPerGroup = (loopRequired ? 1 : max(1, maxThreads/zsize));
+        stringstream source;
+        int stage = 0;
+        int L = zsize;
+        int m = 1;
+
+        // Factor zsize, generating a block of code for each factor.  Every stage splits the rows into
+        // radix interleaved subsequences, transforms them, and applies the twiddle factors.
+
+        while (L > 1) {
+            int input = stage%2;
+            int output = 1-input;
+            int radix;
+            if (L%7 == 0)
+                radix = 7;
+            else if (L%5 == 0)
+                radix = 5;
+            else if (L%4 == 0)
+                radix = 4;
+            else if (L%3 == 0)
+                radix = 3;
+            else if (L%2 == 0)
+                radix = 2;
+            else
+                throw OpenMMException("Illegal size for FFT: "+context.intToString(zsize));
+            L = L/radix;
+            source<<"{\n";
+            source<<"// Pass "<<(stage+1)<<" (radix "<<radix<<")\n";
+            if (loopRequired) {
+                source<<"for (int i = get_local_id(0); i < "<<(L*m)<<"; i += get_local_size(0)) {\n";
+                source<<"int base = i;\n";
+            }
+            else {
+                source<<"if (get_local_id(0) < "<<(blocksPerGroup*L*m)<<") {\n";
+                source<<"int block = get_local_id(0)/"<<(L*m)<<";\n";
+                source<<"int i = get_local_id(0)-block*"<<(L*m)<<";\n";
+                source<<"int base = i+block*"<<zsize<<";\n";
+            }
+            source<<"int j = i/"<<m<<";\n";
+            for (int k = 0; k < radix; k++)
+                source<<"real2 c"<<k<<" = data"<<input<<"[base+"<<(k*L*m)<<"];\n";
+            for (int q = 0; q < radix; q++) {
+                source<<"real2 b"<<q<<" = c0";
+                for (int k = 1; k < radix; k++) {
+                    int phase = (q*k)%radix;
+                    if (phase == 0)
+                        source<<"+c"<<k;
+                    else
+                        source<<"+multiplyComplex(c"<<k<<", (real2) ("<<context.doubleToString(cos(2*M_PI*phase/radix))<<", -(SIGN)*"<<context.doubleToString(sin(2*M_PI*phase/radix))<<"))";
+                }
+                source<<";\n";
+            }
+            for (int q = 0; q < radix; q++) {
+                source<<"data"<<output<<"[base+j*"<<(m*(radix-1))<<"+"<<(q*m)<<"] = ";
+                if (q == 0)
+                    source<<"b0;\n";
+                else
+                    source<<"multiplyComplex(w[j*"<<(q*m)<<"], b"<<q<<");\n";
+            }
+            source<<"}\n";
+            source<<"}\n";
+            source<<"barrier(CLK_LOCAL_MEM_FENCE);\n";
+            m = m*radix;
+            stage++;
+        }
+
+        // Write the transformed rows to the output with the axes rotated.
+
+        string outputIndex = (outputIsPacked ? "y*(ZSIZE*(XSIZE/2+1))+z*(XSIZE/2+1)+x" : "y*(ZSIZE*XSIZE)+z*XSIZE+x");
+        string outputValue = (outputIsReal ? ".x" : "");
+        if (loopRequired) {
+            source<<"for (int z = get_local_id(0); z < ZSIZE; z += get_local_size(0))\n";
+            if (outputIsPacked)
+                source<<"if (x < XSIZE/2+1)\n";
+            source<<"out[j*odist+"<<outputIndex<<"] = data"<<(stage%2)<<"[z]"<<outputValue<<";\n";
+        }
+        else {
+            source<<"if (index < XSIZE*YSIZE"<<(outputIsPacked ? " && x < XSIZE/2+1" : "")<<") {\n";
+            source<<"int z = get_local_id(0)%ZSIZE;\n";
+            source<<"out[j*odist+"<<outputIndex<<"] = data"<<(stage%2)<<"[get_local_id(0)]"<<outputValue<<";\n";
+            source<<"}\n";
+        }
+        source<<"barrier(CLK_LOCAL_MEM_FENCE);\n";
+
+        // Create the kernel.
+
+        map<string, string> replacements;
+        replacements["COMPUTE_FFT"] = source.str();
+        replacements["INPUT_TYPE"] = (inputIsReal ? "real" : "real2");
+        replacements["OUTPUT_TYPE"] = (outputIsReal ? "real" : "real2");
+        map<string, string> defines;
+        defines["XSIZE"] = context.intToString(xsize);
+        defines["YSIZE"] = context.intToString(ysize);
+        defines["ZSIZE"] = context.intToString(zsize);
+        defines["BATCH"] = context.intToString(batch);
+        defines["BLOCKS_PER_GROUP"] = context.intToString(blocksPerGroup);
+        defines["LOOP_REQUIRED"] = (loopRequired ? "1" : "0");
+        defines["SIGN"] = (forward ? "1" : "-1");
+        defines["INPUT_IS_REAL"] = (inputIsReal ? "1" : "0");
+        defines["INPUT_IS_PACKED"] = (inputIsPacked ? "1" : "0");
+        defines["OUTPUT_IS_PACKED"] = (outputIsPacked ? "1" : "0");
+        defines["M_PI"] = context.doubleToString(M_PI);
+        cl::Program program = context.createProgram(context.replaceStrings(OpenCLPmeSlicingKernelSources::fft, replacements), defines);
+        Pass pass;
+        pass.kernel = cl::Kernel(program, "execFFT");
+        pass.threads = (loopRequired ? min(maxThreads, zsize) : blocksPerGroup*zsize);
+        int kernelMaxThreads = pass.kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(context.getDevice());
+        if (pass.threads > kernelMaxThreads) {
+            // The device can't handle this block size, so reduce it.
+
+            maxThreads = kernelMaxThreads;
+            continue;
+        }
+        pass.groups = min(context.getNumThreadBlocks(), (xsize*ysize+blocksPerGroup-1)/blocksPerGroup);
+        int elementSize = (context.getUseDoublePrecision() ? sizeof(mm_double2) : sizeof(mm_float2));
+        pass.kernel.setArg<cl::Buffer>(0, input.getDeviceBuffer());
+        pass.kernel.setArg<cl::Buffer>(1, output.getDeviceBuffer());
+        pass.kernel.setArg(2, zsize*elementSize, NULL);
+        pass.kernel.setArg(3, blocksPerGroup*zsize*elementSize, NULL);
+        pass.kernel.setArg(4, blocksPerGroup*zsize*elementSize, NULL);
+        return pass;
+    }
+}
+
+void OpenCLNativeFFT3D::execFFT(bool forward, cl::CommandQueue queue) {
+    int packThreads = OpenCLContext::ThreadBlockSize;
+    int packGroups = min(context.getNumThreadBlocks(), (packedGridSize+packThreads-1)/packThreads);
+    if (packRealAsComplex)
+        enqueueKernel(queue, forward ? packForwardKernel : packBackwardKernel, packThreads, packGroups);
+    for (Pass& pass : (forward ? forwardPasses : backwardPasses))
+        enqueueKernel(queue, pass.kernel, pass.threads, pass.groups);
+    if (packRealAsComplex)
+        enqueueKernel(queue, forward ? unpackForwardKernel : unpackBackwardKernel, packThreads, packGroups);
+}
+
+void OpenCLNativeFFT3D::enqueueKernel(cl::CommandQueue& queue, cl::Kernel& kernel, int threads, int groups) {
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(threads*groups), cl::NDRange(threads));
+}
@@ -33,7 +33,7 @@ using namespace std;
 class OpenCLParallelCalcSlicedPmeForceKernel::Task : public OpenCLContext::WorkTask {
 public:
     Task(ContextImpl& context, OpenCLCalcSlicedPmeForceKernel& kernel, bool includeForce,
-            bool includeEnergy, bool includeDirect, bool includeReciprocal, double& energy) : context(context), kernel(kernel),
+            bool includeEnergy, const vector<bool>& includeDirect, const vector<bool>& includeReciprocal, double& energy) : context(context), kernel(kernel),
             includeForce(includeForce), includeEnergy(includeEnergy), includeDirect(includeDirect), includeReciprocal(includeReciprocal), energy(energy) {
     }
     void execute() {
@@ -42,7 +42,8 @@ public:
 private:
     ContextImpl& context;
     OpenCLCalcSlicedPmeForceKernel& kernel;
-    bool includeForce, includeEnergy, includeDirect, includeReciprocal;
+    bool includeForce, includeEnergy;
+    vector<bool> includeDirect, includeReciprocal;
     double& energy;
 };
 
@@ -57,7 +58,7 @@ void OpenCLParallelCalcSlicedPmeForceKernel::initialize(const System& system, co
         getKernel(i).initialize(system, force);
 }
 
-double OpenCLParallelCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
+double OpenCLParallelCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, const vector<bool>& includeDirect, const vector<bool>& includeReciprocal) {
     for (int i = 0; i < (int) data.contexts.size(); i++) {
         OpenCLContext& cl = *data.contexts[i];
         ComputeContext::WorkThread& thread = cl.getWorkThread();
@@ -74,3 +75,23 @@ void OpenCLParallelCalcSlicedPmeForceKernel::copyParametersToContext(ContextImpl
 void OpenCLParallelCalcSlicedPmeForceKernel::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     dynamic_cast<const OpenCLCalcSlicedPmeForceKernel&>(kernels[0].getImpl()).getPMEParameters(alpha, nx, ny, nz);
 }
+
+string OpenCLParallelCalcSlicedPmeForceKernel::getFFTBackend() const {
+    return dynamic_cast<const OpenCLCalcSlicedPmeForceKernel&>(kernels[0].getImpl()).getFFTBackend();
+}
+
+void OpenCLParallelCalcSlicedPmeForceKernel::setRecordSliceEnergies(bool record) {
+    for (int i = 0; i < (int) kernels.size(); i++)
+        getKernel(i).setRecordSliceEnergies(record);
+}
+
+void OpenCLParallelCalcSlicedPmeForceKernel::getSliceEnergies(vector<vector<double> >& energies) {
+    getKernel(0).getSliceEnergies(energies);
+    for (int k = 1; k < (int) kernels.size(); k++) {
+        vector<vector<double> > contextEnergies;
+        getKernel(k).getSliceEnergies(contextEnergies);
+        for (int i = 0; i < (int) energies.size(); i++)
+            for (int j = 0; j < (int) energies[i].size(); j++)
+                energies[i][j] += contextEnergies[i][j];
+    }
+}
@@ -32,6 +32,7 @@
 #include "OpenCLPmeSlicingKernels.h"
 #include "OpenCLPmeSlicingKernelSources.h"
 #include "CommonPmeSlicingKernelSources.h"
+#include "BinaryCache.h"
 #include "SlicedPmeForce.h"
 #include "internal/SlicedPmeForceImpl.h"
 #include "openmm/internal/ContextImpl.h"
@@ -40,7 +41,10 @@
 #include "openmm/reference/SimTKOpenMMRealType.h"
 #include <cstring>
 #include <map>
+#include <sstream>
 #include <algorithm>
+#include <chrono>
+#include <functional>
 
 using namespace PmeSlicing;
 using namespace OpenMM;
@@ -70,6 +74,71 @@ static void setPeriodicBoxArgs(OpenCLContext& cl, cl::Kernel& kernel, int index)
     }
 }
 
+/**
+ * Get the index of slice[I,J] in the triangular layout used by the kernels.
+ */
+static int getSliceIndex(int subset1, int subset2) {
+    int i = min(subset1, subset2);
+    int j = max(subset1, subset2);
+    return j*(j+1)/2+i;
+}
+
+/**
+ * Group the slices by the force group in which their direct space interactions are computed.
+ */
+static map<int, vector<int> > getDirectSpaceSlicesByGroup(const SlicedPmeForce& force) {
+    map<int, vector<int> > slicesByGroup;
+    for (int j = 0; j < force.getNumSubsets(); j++)
+        for (int i = 0; i <= j; i++)
+            slicesByGroup[SlicedPmeForceImpl::getDirectSpaceSliceGroup(force, i, j)].push_back(getSliceIndex(i, j));
+    return slicesByGroup;
+}
+
+/**
+ * Build a condition on the variable "slice" that is true only for the specified slices.
+ */
+static string getSliceCondition(const vector<int>& slices, int numSlices) {
+    if (slices.size() == numSlices)
+        return "1";
+    stringstream condition;
+    condition << "(";
+    for (int k = 0; k < slices.size(); k++)
+        condition << (k == 0 ? "" : " || ") << "slice == " << slices[k];
+    condition << ")";
+    return condition.str();
+}
+
+/**
+ * Build a condition that is true only when the specified force group is the first one whose direct
+ * space slices are included in the current evaluation.  That group is stored after the flags of the
+ * slices in the array called flags.
+ */
+static string getLeaderCondition(const string& flags, int group, int numSlices) {
+    stringstream condition;
+    condition << "(" << flags << "[" << numSlices << "] == " << group << ")";
+    return condition.str();
+}
+
+/**
+ * Build the code that adds a value to the derivative of the energy with respect to each requested
+ * parameter, restricted to the slices that the parameter scales.
+ */
+static string getDerivativeCode(const SlicedPmeForce& force, const vector<string>& derivVariables, const string& value) {
+    int numSubsets = force.getNumSubsets();
+    int numSlices = numSubsets*(numSubsets+1)/2;
+    stringstream code;
+    for (int k = 0; k < force.getNumEnergyParameterDerivatives(); k++) {
+        vector<int> slices;
+        for (int j = 0; j < numSubsets; j++)
+            for (int i = 0; i <= j; i++)
+                if (force.getSliceScalingParameter(i, j) == force.getEnergyParameterDerivativeName(k))
+                    slices.push_back(getSliceIndex(i, j));
+        if (slices.size() > 0)
+            code << derivVariables[k] << " += (" << getSliceCondition(slices, numSlices) << " ? " << value << " : 0);\n";
+    }
+    return code.str();
+}
+
 class OpenCLCalcSlicedPmeForceKernel::ForceInfo : public OpenCLForceInfo {
 public:
     ForceInfo(int requiredBuffers, const SlicedPmeForce& force) : OpenCLForceInfo(requiredBuffers), force(force) {
@@ -77,7 +146,7 @@ public:
     bool areParticlesIdentical(int particle1, int particle2) {
         double charge1 = force.getParticleCharge(particle1);
         double charge2 = force.getParticleCharge(particle2);
-        return (charge1 == charge2);
+        return (charge1 == charge2 && force.getParticleSubset(particle1) == force.getParticleSubset(particle2));
     }
     int getNumParticleGroups() {
         return force.getNumExceptions();
@@ -125,36 +194,42 @@ private:
 
 class OpenCLCalcSlicedPmeForceKernel::PmePreComputation : public OpenCLContext::ForcePreComputation {
 public:
-    PmePreComputation(OpenCLContext& cl, Kernel& pme, CalcPmeReciprocalForceKernel::IO& io) : cl(cl), pme(pme), io(io) {
+    PmePreComputation(OpenCLContext& cl, Kernel& pme, CalcPmeReciprocalForceKernel::IO& io, int recipGroups) : cl(cl), pme(pme), io(io), recipGroups(recipGroups) {
     }
     void computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        Vec3 boxVectors[3] = {Vec3(cl.getPeriodicBoxSize().x, 0, 0), Vec3(0, cl.getPeriodicBoxSize().y, 0), Vec3(0, 0, cl.getPeriodicBoxSize().z)};
-        pme.getAs<CalcPmeReciprocalForceKernel>().beginComputation(io, boxVectors, includeEnergy);
+        if ((groups&recipGroups) != 0) {
+            Vec3 boxVectors[3] = {Vec3(cl.getPeriodicBoxSize().x, 0, 0), Vec3(0, cl.getPeriodicBoxSize().y, 0), Vec3(0, 0, cl.getPeriodicBoxSize().z)};
+            pme.getAs<CalcPmeReciprocalForceKernel>().beginComputation(io, boxVectors, includeEnergy);
+        }
     }
 private:
     OpenCLContext& cl;
     Kernel pme;
     CalcPmeReciprocalForceKernel::IO& io;
+    int recipGroups;
 };
 
 class OpenCLCalcSlicedPmeForceKernel::PmePostComputation : public OpenCLContext::ForcePostComputation {
 public:
-    PmePostComputation(Kernel& pme, CalcPmeReciprocalForceKernel::IO& io) : pme(pme), io(io) {
+    PmePostComputation(Kernel& pme, CalcPmeReciprocalForceKernel::IO& io, int recipGroups) : pme(pme), io(io), recipGroups(recipGroups) {
     }
     double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        return pme.getAs<CalcPmeReciprocalForceKernel>().finishComputation(io);
+        if ((groups&recipGroups) != 0)
+            return pme.getAs<CalcPmeReciprocalForceKernel>().finishComputation(io);
+        return 0.0;
     }
 private:
     Kernel pme;
     CalcPmeReciprocalForceKernel::IO& io;
+    int recipGroups;
 };
 
 class OpenCLCalcSlicedPmeForceKernel::SyncQueuePreComputation : public OpenCLContext::ForcePreComputation {
 public:
-    SyncQueuePreComputation(OpenCLContext& cl, cl::CommandQueue queue, int forceGroup) : cl(cl), queue(queue), forceGroup(forceGroup) {
+    SyncQueuePreComputation(OpenCLContext& cl, cl::CommandQueue queue, int recipGroups) : cl(cl), queue(queue), recipGroups(recipGroups) {
     }
     void computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        if ((groups&(1<<forceGroup)) != 0) {
+        if ((groups&recipGroups) != 0) {
             vector<cl::Event> events(1);
             cl.getQueue().enqueueMarkerWithWaitList(NULL, &events[0]);
             queue.enqueueBarrierWithWaitList(&events);
@@ -163,13 +238,13 @@ public:
 private:
     OpenCLContext& cl;
     cl::CommandQueue queue;
-    int forceGroup;
+    int recipGroups;
 };
 
 class OpenCLCalcSlicedPmeForceKernel::SyncQueuePostComputation : public OpenCLContext::ForcePostComputation {
 public:
-    SyncQueuePostComputation(OpenCLContext& cl, cl::Event& event, OpenCLArray& pmeEnergyBuffer, int forceGroup) : cl(cl), event(event),
-            pmeEnergyBuffer(pmeEnergyBuffer), forceGroup(forceGroup) {
+    SyncQueuePostComputation(OpenCLContext& cl, cl::Event& event, OpenCLArray& pmeEnergyBuffer, int recipGroups) : cl(cl), event(event),
+            pmeEnergyBuffer(pmeEnergyBuffer), recipGroups(recipGroups) {
     }
     void setKernel(cl::Kernel kernel) {
         addEnergyKernel = kernel;
@@ -178,7 +253,7 @@ public:
         addEnergyKernel.setArg<cl_int>(2, pmeEnergyBuffer.getSize());
     }
     double computeForceAndEnergy(bool includeForces, bool includeEnergy, int groups) {
-        if ((groups&(1<<forceGroup)) != 0) {
+        if ((groups&recipGroups) != 0) {
             vector<cl::Event> events(1);
             events[0] = event;
             event = cl::Event();
@@ -193,12 +268,10 @@ private:
     cl::Event& event;
     cl::Kernel addEnergyKernel;
     OpenCLArray& pmeEnergyBuffer;
-    int forceGroup;
+    int recipGroups;
 };
 
 OpenCLCalcSlicedPmeForceKernel::~OpenCLCalcSlicedPmeForceKernel() {
-    if (sort != NULL)
-        delete sort;
     if (fft != NULL)
         delete fft;
     if (pmeio != NULL)
@@ -238,7 +311,13 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
     // Initialize nonbonded interactions.
 
     int numParticles = force.getNumParticles();
-    int numSubsets = force.getNumSubsets();
+    numSubsets = force.getNumSubsets();
+    numSlices = numSubsets*(numSubsets+1)/2;
+    map<int, vector<int> > directSlicesByGroup = getDirectSpaceSlicesByGroup(force);
+    int recipGroups = 0;
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++)
+            recipGroups |= 1<<SlicedPmeForceImpl::getReciprocalSpaceSliceGroup(force, i, j);
     vector<float> baseParticleChargeVec(cl.getPaddedNumAtoms(), 0.0);
     vector<int> subsetVec(cl.getPaddedNumAtoms(), 0);
     vector<vector<int> > exclusionList(numParticles);
@@ -256,7 +335,6 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
     defines["HAS_COULOMB"] = "1";
     defines["HAS_LENNARD_JONES"] = "0";
     alpha = 0;
-    ewaldSelfEnergy = 0.0;
     map<string, string> paramsDefines;
     paramsDefines["ONE_4PI_EPS0"] = cl.doubleToString(ONE_4PI_EPS0);
     hasOffsets = (force.getNumParticleParameterOffsets() > 0 || force.getNumExceptionParameterOffsets() > 0);
@@ -266,16 +344,88 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
         paramsDefines["HAS_PARTICLE_OFFSETS"] = "1";
     if (force.getNumExceptionParameterOffsets() > 0)
         paramsDefines["HAS_EXCEPTION_OFFSETS"] = "1";
+    hasDerivatives = (force.getNumEnergyParameterDerivatives() > 0);
+    vkfftCacheDirectory = force.getVkFFTCacheDirectory();
+    programCacheDirectory = force.getOpenCLProgramCacheDirectory();
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
+        derivParams.push_back(force.getEnergyParameterDerivativeName(i));
+    if (hasDerivatives)
+        paramsDefines["HAS_DERIVATIVES"] = "1";
     if (usePosqCharges)
         paramsDefines["USE_POSQ_CHARGES"] = "1";
 
+    // Every thread that computes part of the energy owns one element of the slice energy
+    // buffer for each slice, so the contributions can be accumulated without atomics.  They
+    // are only accumulated while recordSliceEnergiesFlag is set, which getSliceEnergies()
+    // requests for the one evaluation it needs.
+
+    int energyElementSize = (cl.getUseDoublePrecision() || cl.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
+    int sliceBufferSize = max(cl.getNumThreadBlocks()*OpenCLContext::ThreadBlockSize, cl.getNonbondedUtilities().getNumEnergyBuffers());
+    sliceEnergyBuffer.initialize(cl, numSlices*sliceBufferSize, energyElementSize, "sliceEnergyBuffer");
+    cl.clearBuffer(sliceEnergyBuffer);
+    sliceEnergies.initialize(cl, numSlices, energyElementSize, "sliceEnergies");
+    recordSliceEnergiesFlag.initialize<int>(cl, 1, "recordSliceEnergiesFlag");
+    recordSliceEnergiesFlag.upload(vector<int>(1, 0));
+
+    // The direct space interactions are registered once for each force group that contains
+    // slices.  directSliceFlags tells them which slices are included in the current evaluation,
+    // followed by the group that computes them.
+
+    directSliceGroups.resize(numSlices);
+    for (auto& group : directSlicesByGroup)
+        for (int slice : group.second)
+            directSliceGroups[slice] = group.first;
+    directSliceFlagsVec.assign(numSlices+1, 0);
+    directSliceFlagsVec[numSlices] = -1;
+    directSliceFlags.initialize<int>(cl, numSlices+1, "directSliceFlags");
+    directSliceFlags.upload(directSliceFlagsVec);
+    paramsDefines["NUM_SLICES"] = cl.intToString(numSlices);
+    paramsDefines["SLICE_BUFFER_SIZE"] = cl.intToString(sliceBufferSize);
+    paramsDefines["WORK_GROUP_SIZE"] = cl.intToString(OpenCLContext::ThreadBlockSize);
+
+    // Each slice has a weight equal to its scale factor if its reciprocal space interactions
+    // are included and 0 otherwise.  Subsets not involved in any included slice are skipped by the PME kernels.
+
+    int realElementSize = (cl.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
+    recipSliceWeights.initialize(cl, numSlices, realElementSize, "recipSliceWeights");
+    recipSubsetFlags.initialize<cl_int>(cl, numSubsets, "recipSubsetFlags");
+    recipSliceFlags.initialize<cl_int>(cl, numSlices, "recipSliceFlags");
+    subsetSelfEnergy.resize(numSubsets, 0.0);
+
+    // Slices bound to a global parameter are scaled by its value.  The scale factors are stored
+    // on the device, so changing a parameter only requires uploading the new values.
+
+    sliceScalingParams.resize(numSlices);
+    sliceLambdaValues.resize(numSlices, 1.0);
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++)
+            sliceScalingParams[getSliceIndex(i, j)] = force.getSliceScalingParameter(i, j);
+    sliceLambdas.initialize(cl, numSlices, realElementSize, "sliceLambdas");
+    sliceLambdas.upload(sliceLambdaValues, true);
+    recipSliceDerivIndices.initialize<cl_int>(cl, numSlices, "recipSliceDerivIndices");
+
     // Compute the PME parameters.
 
     SlicedPmeForceImpl::calcPMEParameters(system, force, alpha, gridSizeX, gridSizeY, gridSizeZ, false);
-    gridSizeX = OpenCLVkFFT3D::findLegalDimension(gridSizeX);
-    gridSizeY = OpenCLVkFFT3D::findLegalDimension(gridSizeY);
-    gridSizeZ = OpenCLVkFFT3D::findLegalDimension(gridSizeZ);
-    int roundedZSize = (int) ceil(gridSizeZ/(double) PmeOrder)*PmeOrder;
+    pmeOrder = force.getPMEInterpolationOrder();
+
+    // Grid sizes derived from the error tolerance are only minimums, so they may be enlarged to
+    // whatever is fastest.  Sizes set explicitly are only rounded up to legal ones.
+
+    int maxPrimeFactor = (force.getUseNativeOpenCLFFT() || force.getAutotuneFFT() ? 7 : 13); // The native FFT only supports factors up to 7
+    double forceAlpha;
+    int forceGridX, forceGridY, forceGridZ;
+    force.getPMEParameters(forceAlpha, forceGridX, forceGridY, forceGridZ);
+    double gridBytesPerPoint = 4.0*(cl.getUseDoublePrecision() ? sizeof(double) : sizeof(float)); // Two complex grids
+    double gridMemoryLimit = force.getPMEGridMemoryLimit()*1024*1024;
+    if (forceAlpha == 0.0)
+        FFTDimensions::findFastestDimensions(gridSizeX, gridSizeY, gridSizeZ, numSubsets, numParticles, pmeOrder, gridBytesPerPoint, gridMemoryLimit, maxPrimeFactor);
+    else {
+        gridSizeX = OpenCLFFT3D::findLegalDimension(gridSizeX, maxPrimeFactor);
+        gridSizeY = OpenCLFFT3D::findLegalDimension(gridSizeY, maxPrimeFactor);
+        gridSizeZ = OpenCLFFT3D::findLegalDimension(gridSizeZ, maxPrimeFactor);
+    }
+    int roundedZSize = (int) ceil(gridSizeZ/(double) pmeOrder)*pmeOrder;
 
     defines["EWALD_ALPHA"] = cl.doubleToString(alpha);
     defines["TWO_OVER_SQRT_PI"] = cl.doubleToString(2.0/sqrt(M_PI));
@@ -285,34 +435,70 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
         paramsDefines["INCLUDE_EWALD"] = "1";
         paramsDefines["EWALD_SELF_ENERGY_SCALE"] = cl.doubleToString(ONE_4PI_EPS0*alpha/sqrt(M_PI));
         for (int i = 0; i < numParticles; i++)
-            ewaldSelfEnergy -= baseParticleChargeVec[i]*baseParticleChargeVec[i]*ONE_4PI_EPS0*alpha/sqrt(M_PI);
-        pmeDefines["PME_ORDER"] = cl.intToString(PmeOrder);
+            subsetSelfEnergy[subsetVec[i]] -= baseParticleChargeVec[i]*baseParticleChargeVec[i]*ONE_4PI_EPS0*alpha/sqrt(M_PI);
+        pmeDefines["PME_ORDER"] = cl.intToString(pmeOrder);
         pmeDefines["NUM_ATOMS"] = cl.intToString(numParticles);
         pmeDefines["NUM_SUBSETS"] = cl.intToString(numSubsets);
+        pmeDefines["NUM_SLICES"] = cl.intToString(numSlices);
+        if (hasDerivatives)
+            pmeDefines["HAS_DERIVATIVES"] = "1";
+        pmeDefines["SLICE_BUFFER_SIZE"] = cl.intToString(cl.getNumThreadBlocks()*OpenCLContext::ThreadBlockSize);
         pmeDefines["PADDED_NUM_ATOMS"] = cl.intToString(cl.getPaddedNumAtoms());
         pmeDefines["RECIP_EXP_FACTOR"] = cl.doubleToString(M_PI*M_PI/(alpha*alpha));
         pmeDefines["GRID_SIZE_X"] = cl.intToString(gridSizeX);
         pmeDefines["GRID_SIZE_Y"] = cl.intToString(gridSizeY);
         pmeDefines["GRID_SIZE_Z"] = cl.intToString(gridSizeZ);
         pmeDefines["ROUNDED_Z_SIZE"] = cl.intToString(roundedZSize);
+        pmeDefines["CELL_SCAN_SIZE"] = cl.intToString(CellScanSize);
+        int numCells = numSubsets*gridSizeX*gridSizeY*(cl.getSupports64BitGlobalAtomics() ? 1 : gridSizeZ);
+        pmeDefines["NUM_CELL_BLOCKS"] = cl.intToString((numCells+CellScanSize-1)/CellScanSize);
         pmeDefines["EPSILON_FACTOR"] = cl.doubleToString(sqrt(ONE_4PI_EPS0));
         pmeDefines["M_PI"] = cl.doubleToString(M_PI);
         pmeDefines["USE_FIXED_POINT_CHARGE_SPREADING"] = "1";
         bool deviceIsCpu = (cl.getDevice().getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU);
         if (deviceIsCpu)
             pmeDefines["DEVICE_IS_CPU"] = "1";
-        if (cl.getPlatformData().useCpuPme && usePosqCharges) {
+
+        // If the subset grids would exceed the memory limit, process them a few at a time.  Only
+        // the kernels that use 64 bit atomics support this, so other devices must fit them all.
+
+        int realSize = (cl.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
+        subsetChunkSize = FFTDimensions::findSubsetChunkSize(gridSizeX, gridSizeY, gridSizeZ, numSubsets, pmeOrder, gridBytesPerPoint, gridMemoryLimit);
+        if (subsetChunkSize < numSubsets && !cl.getSupports64BitGlobalAtomics())
+            throw OpenMMException("SlicedPmeForce: The PME grids exceed the memory limit, and processing them in chunks requires 64 bit atomics, which this device does not support");
+        streamSubsetChunks = (subsetChunkSize < numSubsets);
+        pmeDefines["SUBSET_CHUNK_SIZE"] = cl.intToString(subsetChunkSize);
+        if (streamSubsetChunks)
+            pmeDefines["STREAM_SUBSET_CHUNKS"] = "1";
+
+        // The convolution stages the structure factors of every subset in local memory, so its
+        // block size is reduced when there are many subsets.
+
+        convolutionBlockSize = max(1, min((int) OpenCLContext::ThreadBlockSize, 16384/(numSubsets*2*realSize)));
+        if (convolutionBlockSize >= 32)
+            convolutionBlockSize -= convolutionBlockSize%32;
+        pmeDefines["CONVOLUTION_BLOCK_SIZE"] = cl.intToString(convolutionBlockSize);
+
+        // Store the B-splines computed during charge spreading for use in force interpolation,
+        // unless they would take a noticeable fraction of the device memory.  Only the kernels
+        // that use 64 bit atomics support this.
+
+        size_t bsplineCacheSize = (size_t) numParticles*(2*pmeOrder*4*realSize+4*sizeof(cl_int));
+        cacheBsplines = (!streamSubsetChunks && cl.getSupports64BitGlobalAtomics() && bsplineCacheSize <= cl.getDevice().getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>()/32);
+        if (cacheBsplines)
+            pmeDefines["CACHE_BSPLINES"] = "1";
+        if (cl.getPlatformData().useCpuPme && usePosqCharges && pmeOrder == 5) { // The CPU PME plugin only supports fifth order B-splines
             // Create the CPU PME kernel.
 
             try {
                 cpuPme = getPlatform().createKernel(CalcPmeReciprocalForceKernel::Name(), *cl.getPlatformData().context);
                 cpuPme.getAs<CalcPmeReciprocalForceKernel>().initialize(gridSizeX, gridSizeY, gridSizeZ, numParticles, alpha, false);
-                cl::Program program = cl.createProgram(CommonPmeSlicingKernelSources::realtofixedpoint+
-                                                        CommonPmeSlicingKernelSources::slicedPme, pmeDefines);
+                cl::Program program = createProgram(CommonPmeSlicingKernelSources::realtofixedpoint+
+                                                     CommonPmeSlicingKernelSources::slicedPme, pmeDefines);
                 cl::Kernel addForcesKernel = cl::Kernel(program, "addForces");
                 pmeio = new PmeIO(cl, addForcesKernel);
-                cl.addPreComputation(new PmePreComputation(cl, cpuPme, *pmeio));
-                cl.addPostComputation(new PmePostComputation(cpuPme, *pmeio));
+                cl.addPreComputation(new PmePreComputation(cl, cpuPme, *pmeio, recipGroups));
+                cl.addPostComputation(new PmePostComputation(cpuPme, *pmeio, recipGroups));
             }
             catch (OpenMMException& ex) {
                 // The CPU PME plugin isn't available.
@@ -322,7 +508,7 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
             // Create required data structures.
 
             int elementSize = (cl.getUseDoublePrecision() ? sizeof(double) : sizeof(float));
-            int gridElements = gridSizeX*gridSizeY*roundedZSize*numSubsets;
+            int gridElements = gridSizeX*gridSizeY*roundedZSize*subsetChunkSize;
             pmeGrid1.initialize(cl, gridElements, 2*elementSize, "pmeGrid1");
             pmeGrid2.initialize(cl, gridElements, 2*elementSize, "pmeGrid2");
             if (cl.getSupports64BitGlobalAtomics())
@@ -332,25 +518,47 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
             pmeBsplineModuliX.initialize(cl, gridSizeX, elementSize, "pmeBsplineModuliX");
             pmeBsplineModuliY.initialize(cl, gridSizeY, elementSize, "pmeBsplineModuliY");
             pmeBsplineModuliZ.initialize(cl, gridSizeZ, elementSize, "pmeBsplineModuliZ");
-            pmeBsplineTheta.initialize(cl, PmeOrder*numParticles, 4*elementSize, "pmeBsplineTheta");
-            pmeAtomRange.initialize<cl_int>(cl, gridSizeX*gridSizeY*gridSizeZ+1, "pmeAtomRange");
+            pmeBsplineTheta.initialize(cl, pmeOrder*numParticles, 4*elementSize, "pmeBsplineTheta");
             pmeAtomGridIndex.initialize<mm_int2>(cl, numParticles, "pmeAtomGridIndex");
-            int energyElementSize = (cl.getUseDoublePrecision() || cl.getUseMixedPrecision() ? sizeof(double) : sizeof(float));
+            pmeUnsortedAtomGridIndex.initialize<mm_int2>(cl, numParticles, "pmeUnsortedAtomGridIndex");
+            pmeCellStart.initialize<cl_int>(cl, numCells+1, "pmeCellStart");
+            pmeCellBlockOffsets.initialize<cl_int>(cl, (numCells+CellScanSize-1)/CellScanSize, "pmeCellBlockOffsets");
+            pmeCellRank.initialize<cl_int>(cl, numParticles, "pmeCellRank");
+            pmeNumMovedAtoms.initialize<cl_int>(cl, 1, "pmeNumMovedAtoms");
+            cl.addAutoclearBuffer(pmeCellStart);
+            cl.addAutoclearBuffer(pmeNumMovedAtoms);
+            if (cl.getSupports64BitGlobalAtomics()) {
+                pmeSortedAtomCell.initialize<cl_int>(cl, numParticles, "pmeSortedAtomCell");
+                pmeSortedAtomCell.upload(vector<cl_int>(numParticles, -1));
+                if (cacheBsplines) {
+                    pmeCachedTheta.initialize(cl, pmeOrder*numParticles, 4*elementSize, "pmeCachedTheta");
+                    pmeCachedDTheta.initialize(cl, pmeOrder*numParticles, 4*elementSize, "pmeCachedDTheta");
+                    pmeCachedGridIndex.initialize<mm_int4>(cl, numParticles, "pmeCachedGridIndex");
+                }
+            }
             pmeEnergyBuffer.initialize(cl, cl.getNumThreadBlocks()*OpenCLContext::ThreadBlockSize, energyElementSize, "pmeEnergyBuffer");
             cl.clearBuffer(pmeEnergyBuffer);
-            sort = new OpenCLSort(cl, new SortTrait(), cl.getNumAtoms());
-            fft = new OpenCLVkFFT3D(cl, gridSizeX, gridSizeY, gridSizeZ, numSubsets, true, pmeGrid1, pmeGrid2);
+            pmeSliceEnergyBuffer.initialize(cl, numSlices*cl.getNumThreadBlocks()*OpenCLContext::ThreadBlockSize, energyElementSize, "pmeSliceEnergyBuffer");
+            cl.clearBuffer(pmeSliceEnergyBuffer);
+            if (force.getAutotuneFFT())
+                fft = createFastestFFT();
+            else if (force.getUseNativeOpenCLFFT()) {
+                fft = new OpenCLNativeFFT3D(cl, gridSizeX, gridSizeY, gridSizeZ, subsetChunkSize, true, pmeGrid1, pmeGrid2);
+                fftBackend = "native";
+            }
+            else {
+                fft = new OpenCLVkFFT3D(cl, gridSizeX, gridSizeY, gridSizeZ, subsetChunkSize, true, pmeGrid1, pmeGrid2, vkfftCacheDirectory);
+                fftBackend = "VkFFT";
+            }
             string vendor = cl.getDevice().getInfo<CL_DEVICE_VENDOR>();
             bool isNvidia = (vendor.size() >= 6 && vendor.substr(0, 6) == "NVIDIA");
             usePmeQueue = (!cl.getPlatformData().disablePmeStream && !cl.getPlatformData().useCpuPme && cl.getSupports64BitGlobalAtomics() && isNvidia);
+            usePmeQueue &= !hasDerivatives; // The parameter derivatives are accumulated in a buffer shared with the default queue
             if (usePmeQueue) {
                 pmeDefines["USE_PME_STREAM"] = "1";
                 pmeQueue = cl::CommandQueue(cl.getContext(), cl.getDevice());
-                int recipForceGroup = force.getReciprocalSpaceForceGroup();
-                if (recipForceGroup < 0)
-                    recipForceGroup = force.getForceGroup();
-                cl.addPreComputation(new SyncQueuePreComputation(cl, pmeQueue, recipForceGroup));
-                cl.addPostComputation(syncQueue = new SyncQueuePostComputation(cl, pmeSyncEvent, pmeEnergyBuffer, recipForceGroup));
+                cl.addPreComputation(new SyncQueuePreComputation(cl, pmeQueue, recipGroups));
+                cl.addPostComputation(syncQueue = new SyncQueuePostComputation(cl, pmeSyncEvent, pmeEnergyBuffer, recipGroups));
             }
 
             // Initialize the b-spline moduli.
@@ -366,13 +574,13 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
             zmoduli = &pmeBsplineModuliZ;
 
             int maxSize = max(max(xsize, ysize), zsize);
-            vector<double> data(PmeOrder);
-            vector<double> ddata(PmeOrder);
+            vector<double> data(pmeOrder);
+            vector<double> ddata(pmeOrder);
             vector<double> bsplines_data(maxSize);
-            data[PmeOrder-1] = 0.0;
+            data[pmeOrder-1] = 0.0;
             data[1] = 0.0;
             data[0] = 1.0;
-            for (int i = 3; i < PmeOrder; i++) {
+            for (int i = 3; i < pmeOrder; i++) {
                 double div = 1.0/(i-1.0);
                 data[i-1] = 0.0;
                 for (int j = 1; j < (i-1); j++)
@@ -383,16 +591,16 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
             // Differentiate.
 
             ddata[0] = -data[0];
-            for (int i = 1; i < PmeOrder; i++)
+            for (int i = 1; i < pmeOrder; i++)
                 ddata[i] = data[i-1]-data[i];
-            double div = 1.0/(PmeOrder-1);
-            data[PmeOrder-1] = 0.0;
-            for (int i = 1; i < (PmeOrder-1); i++)
-                data[PmeOrder-i-1] = div*(i*data[PmeOrder-i-2]+(PmeOrder-i)*data[PmeOrder-i-1]);
+            double div = 1.0/(pmeOrder-1);
+            data[pmeOrder-1] = 0.0;
+            for (int i = 1; i < (pmeOrder-1); i++)
+                data[pmeOrder-i-1] = div*(i*data[pmeOrder-i-2]+(pmeOrder-i)*data[pmeOrder-i-1]);
             data[0] = div*data[0];
             for (int i = 0; i < maxSize; i++)
                 bsplines_data[i] = 0.0;
-            for (int i = 1; i <= PmeOrder; i++)
+            for (int i = 1; i <= pmeOrder; i++)
                 bsplines_data[i] = data[i-1];
 
             // Evaluate the actual bspline moduli for X/Y/Z.
@@ -425,6 +633,19 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
         }
     }
 
+    // Register the parameter derivatives.  The direct space kernels add the unscaled energy of
+    // each slice to the derivative of the parameter that scales it.
+
+    vector<string> nonbondedDerivVariables, bondedDerivVariables;
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++) {
+        string param = force.getEnergyParameterDerivativeName(i);
+        cl.getNonbondedUtilities().addEnergyParameterDerivative(param);
+        bondedDerivVariables.push_back(cl.getBondedUtilities().addEnergyParameterDerivative(param));
+        const vector<string>& allDerivNames = cl.getEnergyParamDerivNames();
+        int index = find(allDerivNames.begin(), allDerivNames.end(), param)-allDerivNames.begin();
+        nonbondedDerivVariables.push_back("energyParamDeriv"+cl.intToString(index));
+    }
+
     // Add code to subtract off the reciprocal part of excluded interactions.
 
     if (pmeio == NULL) {
@@ -437,22 +658,39 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
             vector<vector<int> > atoms(numExclusions, vector<int>(2));
             exclusionAtoms.initialize<mm_int2>(cl, numExclusions, "exclusionAtoms");
             exclusionChargeProds.initialize<float>(cl, numExclusions, "exclusionChargeProds");
+            exclusionSlices.initialize<cl_int>(cl, numExclusions, "exclusionSlices");
             vector<mm_int2> exclusionAtomsVec(numExclusions);
+            vector<cl_int> exclusionSlicesVec(numExclusions);
+            exclusionAtomPairs.resize(numExclusions);
             for (int i = 0; i < numExclusions; i++) {
                 int j = i+startIndex;
                 exclusionAtomsVec[i] = mm_int2(exclusions[j].first, exclusions[j].second);
+                exclusionSlicesVec[i] = getSliceIndex(subsetVec[exclusions[j].first], subsetVec[exclusions[j].second]);
+                exclusionAtomPairs[i] = exclusions[j];
                 atoms[i][0] = exclusions[j].first;
                 atoms[i][1] = exclusions[j].second;
             }
             exclusionAtoms.upload(exclusionAtomsVec);
+            exclusionSlices.upload(exclusionSlicesVec);
             map<string, string> replacements;
             replacements["PARAMS"] = cl.getBondedUtilities().addArgument(exclusionChargeProds.getDeviceBuffer(), "float");
+            replacements["SLICES"] = cl.getBondedUtilities().addArgument(exclusionSlices.getDeviceBuffer(), "int");
+            replacements["SLICE_ENERGY"] = cl.getBondedUtilities().addArgument(sliceEnergyBuffer.getDeviceBuffer(), "mixed");
+            replacements["RECORD_SLICE_ENERGIES"] = cl.getBondedUtilities().addArgument(recordSliceEnergiesFlag.getDeviceBuffer(), "int");
+            string flags = cl.getBondedUtilities().addArgument(directSliceFlags.getDeviceBuffer(), "int");
+            replacements["INCLUDE_SLICE"] = flags+"[slice]";
+            replacements["SLICE_LAMBDA"] = cl.getBondedUtilities().addArgument(sliceLambdas.getDeviceBuffer(), "real");
+            replacements["COMPUTE_DERIVATIVES"] = getDerivativeCode(force, bondedDerivVariables, "unscaledEnergy");
+            replacements["SLICE_BUFFER_SIZE"] = cl.intToString(sliceBufferSize);
             replacements["EWALD_ALPHA"] = cl.doubleToString(alpha);
             replacements["TWO_OVER_SQRT_PI"] = cl.doubleToString(2.0/sqrt(M_PI));
             replacements["DO_LJPME"] = "0";
             replacements["USE_PERIODIC"] = force.getExceptionsUsePeriodicBoundaryConditions() ? "1" : "0";
             if (force.getIncludeDirectSpace())
-                cl.getBondedUtilities().addInteraction(atoms, cl.replaceStrings(CommonPmeSlicingKernelSources::slicedPmeExclusions, replacements), force.getForceGroup());
+                for (auto& group : directSlicesByGroup) {
+                    replacements["IS_DIRECT_LEADER"] = getLeaderCondition(flags, group.first, numSlices);
+                    cl.getBondedUtilities().addInteraction(atoms, cl.replaceStrings(CommonPmeSlicingKernelSources::slicedPmeExclusions, replacements), group.first);
+                }
         }
     }
 
@@ -466,6 +704,14 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
     subsets.upload(subsetVec);
     map<string, string> replacements;
     replacements["ONE_4PI_EPS0"] = cl.doubleToString(ONE_4PI_EPS0);
+    replacements["SUBSET1"] = prefix+"subset1";
+    replacements["SUBSET2"] = prefix+"subset2";
+    replacements["SLICE_ENERGY"] = prefix+"sliceEnergy";
+    replacements["RECORD_SLICE_ENERGIES"] = prefix+"recordSliceEnergies";
+    replacements["INCLUDE_SLICE"] = prefix+"directSliceFlags[slice]";
+    replacements["SLICE_LAMBDA"] = prefix+"sliceLambda";
+    replacements["COMPUTE_DERIVATIVES"] = getDerivativeCode(force, nonbondedDerivVariables, "interactionScale*prefactor*erfcAlphaR");
+    replacements["SLICE_BUFFER_SIZE"] = cl.intToString(sliceBufferSize);
     if (usePosqCharges) {
         replacements["CHARGE1"] = "posq1.w";
         replacements["CHARGE2"] = "posq2.w";
@@ -476,9 +722,18 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
     }
     if (!usePosqCharges)
         cl.getNonbondedUtilities().addParameter(OpenCLNonbondedUtilities::ParameterInfo(prefix+"charge", "real", 1, charges.getElementSize(), charges.getDeviceBuffer()));
+    cl.getNonbondedUtilities().addParameter(OpenCLNonbondedUtilities::ParameterInfo(prefix+"subset", "int", 1, sizeof(cl_int), subsets.getDeviceBuffer()));
+    cl.getNonbondedUtilities().addArgument(OpenCLNonbondedUtilities::ParameterInfo(prefix+"sliceEnergy", "mixed", 1, energyElementSize, sliceEnergyBuffer.getDeviceBuffer(), false));
+    cl.getNonbondedUtilities().addArgument(OpenCLNonbondedUtilities::ParameterInfo(prefix+"recordSliceEnergies", "int", 1, sizeof(int), recordSliceEnergiesFlag.getDeviceBuffer()));
+    cl.getNonbondedUtilities().addArgument(OpenCLNonbondedUtilities::ParameterInfo(prefix+"directSliceFlags", "int", 1, sizeof(int), directSliceFlags.getDeviceBuffer()));
+    cl.getNonbondedUtilities().addArgument(OpenCLNonbondedUtilities::ParameterInfo(prefix+"sliceLambda", "real", 1, realElementSize, sliceLambdas.getDeviceBuffer()));
     source = cl.replaceStrings(source, replacements);
     if (force.getIncludeDirectSpace())
-        cl.getNonbondedUtilities().addInteraction(true, true, true, force.getCutoffDistance(), exclusionList, source, force.getForceGroup());
+        for (auto& group : directSlicesByGroup) {
+            map<string, string> sliceReplacements;
+            sliceReplacements["IS_DIRECT_LEADER"] = getLeaderCondition(prefix+"directSliceFlags", group.first, numSlices);
+            cl.getNonbondedUtilities().addInteraction(true, true, true, force.getCutoffDistance(), exclusionList, cl.replaceStrings(source, sliceReplacements), group.first);
+        }
 
     // Initialize the exceptions.
 
@@ -492,19 +747,34 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
         vector<vector<int> > atoms(numExceptions, vector<int>(2));
         exceptionChargeProds.initialize<float>(cl, numExceptions, "exceptionChargeProds");
         baseExceptionChargeProds.initialize<float>(cl, numExceptions, "baseExceptionChargeProds");
+        exceptionSlices.initialize<cl_int>(cl, numExceptions, "exceptionSlices");
         vector<float> baseExceptionChargeProdsVec(numExceptions);
+        vector<cl_int> exceptionSlicesVec(numExceptions);
         for (int i = 0; i < numExceptions; i++) {
             double chargeProd;
             force.getExceptionParameters(exceptions[startIndex+i], atoms[i][0], atoms[i][1], chargeProd);
             baseExceptionChargeProdsVec[i] = chargeProd;
+            exceptionSlicesVec[i] = getSliceIndex(subsetVec[atoms[i][0]], subsetVec[atoms[i][1]]);
             exceptionAtoms[i] = make_pair(atoms[i][0], atoms[i][1]);
         }
         baseExceptionChargeProds.upload(baseExceptionChargeProdsVec);
+        exceptionSlices.upload(exceptionSlicesVec);
         map<string, string> replacements;
         replacements["APPLY_PERIODIC"] = (force.getExceptionsUsePeriodicBoundaryConditions() ? "1" : "0");
         replacements["PARAMS"] = cl.getBondedUtilities().addArgument(exceptionChargeProds.getDeviceBuffer(), "float");
+        replacements["SLICES"] = cl.getBondedUtilities().addArgument(exceptionSlices.getDeviceBuffer(), "int");
+        replacements["SLICE_ENERGY"] = cl.getBondedUtilities().addArgument(sliceEnergyBuffer.getDeviceBuffer(), "mixed");
+        replacements["RECORD_SLICE_ENERGIES"] = cl.getBondedUtilities().addArgument(recordSliceEnergiesFlag.getDeviceBuffer(), "int");
+        string flags = cl.getBondedUtilities().addArgument(directSliceFlags.getDeviceBuffer(), "int");
+        replacements["INCLUDE_SLICE"] = flags+"[slice]";
+        replacements["SLICE_LAMBDA"] = cl.getBondedUtilities().addArgument(sliceLambdas.getDeviceBuffer(), "real");
+        replacements["COMPUTE_DERIVATIVES"] = getDerivativeCode(force, bondedDerivVariables, "unscaledEnergy");
+        replacements["SLICE_BUFFER_SIZE"] = cl.intToString(sliceBufferSize);
         if (force.getIncludeDirectSpace())
-            cl.getBondedUtilities().addInteraction(atoms, cl.replaceStrings(CommonPmeSlicingKernelSources::slicedPmeExceptions, replacements), force.getForceGroup());
+            for (auto& group : directSlicesByGroup) {
+                replacements["IS_DIRECT_LEADER"] = getLeaderCondition(flags, group.first, numSlices);
+                cl.getBondedUtilities().addInteraction(atoms, cl.replaceStrings(CommonPmeSlicingKernelSources::slicedPmeExceptions, replacements), group.first);
+            }
     }
     
     // Initialize parameter offsets.
@@ -579,14 +849,15 @@ void OpenCLCalcSlicedPmeForceKernel::initialize(const System& system, const Slic
     
     // Initialize the kernel for updating parameters.
     
-    cl::Program program = cl.createProgram(CommonPmeSlicingKernelSources::slicedPmeParameters, paramsDefines);
+    cl::Program program = createProgram(CommonPmeSlicingKernelSources::slicedPmeParameters, paramsDefines);
     computeParamsKernel = cl::Kernel(program, "computeParameters");
     computeExclusionParamsKernel = cl::Kernel(program, "computeExclusionParameters");
+    reduceSliceEnergiesKernel = cl::Kernel(program, "reduceSliceEnergies");
     info = new ForceInfo(cl.getNonbondedUtilities().getNumForceBuffers(), force);
     cl.addForce(info);
 }
 
-double OpenCLCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
+double OpenCLCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, const vector<bool>& includeDirect, const vector<bool>& includeReciprocal) {
     bool deviceIsCpu = (cl.getDevice().getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU);
     if (!hasInitializedKernel) {
         hasInitializedKernel = true;
@@ -600,6 +871,11 @@ double OpenCLCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includ
         computeParamsKernel.setArg<cl::Buffer>(index++, charges.getDeviceBuffer());
         computeParamsKernel.setArg<cl::Buffer>(index++, particleParamOffsets.getDeviceBuffer());
         computeParamsKernel.setArg<cl::Buffer>(index++, particleOffsetIndices.getDeviceBuffer());
+        computeParamsKernel.setArg<cl::Buffer>(index++, subsets.getDeviceBuffer());
+        computeParamsKernel.setArg<cl::Buffer>(index++, recipSliceWeights.getDeviceBuffer());
+        computeParamsKernel.setArg<cl::Buffer>(index++, recipSliceFlags.getDeviceBuffer());
+        computeParamsKernel.setArg<cl::Buffer>(index++, sliceEnergyBuffer.getDeviceBuffer());
+        index++;
         if (exceptionChargeProds.isInitialized()) {
             computeParamsKernel.setArg<cl_int>(index++, exceptionChargeProds.getSize());
             computeParamsKernel.setArg<cl::Buffer>(index++, baseExceptionChargeProds.getDeviceBuffer());
@@ -607,6 +883,11 @@ double OpenCLCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includ
             computeParamsKernel.setArg<cl::Buffer>(index++, exceptionParamOffsets.getDeviceBuffer());
             computeParamsKernel.setArg<cl::Buffer>(index++, exceptionOffsetIndices.getDeviceBuffer());
         }
+        if (hasDerivatives) {
+            computeParamsKernel.setArg<cl::Buffer>(index++, cl.getEnergyParamDerivBuffer().getDeviceBuffer());
+            computeParamsKernel.setArg<cl_int>(index++, cl.getEnergyParamDerivNames().size());
+            computeParamsKernel.setArg<cl::Buffer>(index++, recipSliceDerivIndices.getDeviceBuffer());
+        }
         if (exclusionChargeProds.isInitialized()) {
             computeExclusionParamsKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
             computeExclusionParamsKernel.setArg<cl::Buffer>(1, charges.getDeviceBuffer());
@@ -619,27 +900,49 @@ double OpenCLCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includ
             
             map<string, string> replacements;
             replacements["CHARGE"] = (usePosqCharges ? "pos.w" : "charges[atom]");
-            cl::Program program = cl.createProgram(CommonPmeSlicingKernelSources::realtofixedpoint+
-                                                   cl.replaceStrings(CommonPmeSlicingKernelSources::slicedPme, replacements), pmeDefines);
+            cl::Program program = createProgram(CommonPmeSlicingKernelSources::realtofixedpoint+
+                                                cl.replaceStrings(CommonPmeSlicingKernelSources::slicedPme, replacements), pmeDefines);
             pmeGridIndexKernel = cl::Kernel(program, "findAtomGridIndex");
             pmeSpreadChargeKernel = cl::Kernel(program, "gridSpreadCharge");
-            pmeCollapseGridKernel = cl::Kernel(program, "collapseGrid");
             pmeConvolutionKernel = cl::Kernel(program, "reciprocalConvolution");
-            pmeEvalEnergyKernel = cl::Kernel(program, "gridEvaluateEnergy");
             pmeInterpolateForceKernel = cl::Kernel(program, "gridInterpolateForce");
             int elementSize = (cl.getUseDoublePrecision() ? sizeof(mm_double4) : sizeof(mm_float4));
             pmeGridIndexKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
             pmeGridIndexKernel.setArg<cl::Buffer>(1, subsets.getDeviceBuffer());
-            pmeGridIndexKernel.setArg<cl::Buffer>(2, pmeAtomGridIndex.getDeviceBuffer());
-            if (!cl.getSupports64BitGlobalAtomics()) {
+            pmeGridIndexKernel.setArg<cl::Buffer>(2, pmeUnsortedAtomGridIndex.getDeviceBuffer());
+            pmeCountAtomsKernel = cl::Kernel(program, "countAtomsInCells");
+            pmeScanCellBlocksKernel = cl::Kernel(program, "scanCellBlocks");
+            pmeCellOffsetsKernel = cl::Kernel(program, "computeCellOffsets");
+            pmeAddCellOffsetsKernel = cl::Kernel(program, "addCellBlockOffsets");
+            pmeSortAtomsKernel = cl::Kernel(program, "sortAtomsByCell");
+            pmeCountAtomsKernel.setArg<cl::Buffer>(0, pmeUnsortedAtomGridIndex.getDeviceBuffer());
+            pmeCountAtomsKernel.setArg<cl::Buffer>(1, pmeNumMovedAtoms.getDeviceBuffer());
+            pmeCountAtomsKernel.setArg<cl::Buffer>(2, pmeCellStart.getDeviceBuffer());
+            pmeCountAtomsKernel.setArg<cl::Buffer>(3, pmeCellRank.getDeviceBuffer());
+            pmeScanCellBlocksKernel.setArg<cl::Buffer>(0, pmeNumMovedAtoms.getDeviceBuffer());
+            pmeScanCellBlocksKernel.setArg<cl::Buffer>(1, pmeCellStart.getDeviceBuffer());
+            pmeScanCellBlocksKernel.setArg<cl::Buffer>(2, pmeCellBlockOffsets.getDeviceBuffer());
+            pmeCellOffsetsKernel.setArg<cl::Buffer>(0, pmeNumMovedAtoms.getDeviceBuffer());
+            pmeCellOffsetsKernel.setArg<cl::Buffer>(1, pmeCellStart.getDeviceBuffer());
+            pmeCellOffsetsKernel.setArg<cl::Buffer>(2, pmeCellBlockOffsets.getDeviceBuffer());
+            pmeAddCellOffsetsKernel.setArg<cl::Buffer>(0, pmeNumMovedAtoms.getDeviceBuffer());
+            pmeAddCellOffsetsKernel.setArg<cl::Buffer>(1, pmeCellStart.getDeviceBuffer());
+            pmeAddCellOffsetsKernel.setArg<cl::Buffer>(2, pmeCellBlockOffsets.getDeviceBuffer());
+            pmeSortAtomsKernel.setArg<cl::Buffer>(0, pmeUnsortedAtomGridIndex.getDeviceBuffer());
+            pmeSortAtomsKernel.setArg<cl::Buffer>(1, pmeNumMovedAtoms.getDeviceBuffer());
+            pmeSortAtomsKernel.setArg<cl::Buffer>(2, pmeCellStart.getDeviceBuffer());
+            pmeSortAtomsKernel.setArg<cl::Buffer>(3, pmeCellRank.getDeviceBuffer());
+            pmeSortAtomsKernel.setArg<cl::Buffer>(4, pmeAtomGridIndex.getDeviceBuffer());
+            if (cl.getSupports64BitGlobalAtomics()) {
+                pmeGridIndexKernel.setArg<cl::Buffer>(11, pmeSortedAtomCell.getDeviceBuffer());
+                pmeGridIndexKernel.setArg<cl::Buffer>(12, pmeNumMovedAtoms.getDeviceBuffer());
+                pmeCountAtomsKernel.setArg<cl::Buffer>(4, pmeSortedAtomCell.getDeviceBuffer());
+            }
+            else {
                 pmeGridIndexKernel.setArg<cl::Buffer>(11, pmeBsplineTheta.getDeviceBuffer());
-                pmeGridIndexKernel.setArg(12, OpenCLContext::ThreadBlockSize*PmeOrder*elementSize, NULL);
+                pmeGridIndexKernel.setArg(12, OpenCLContext::ThreadBlockSize*pmeOrder*elementSize, NULL);
                 pmeGridIndexKernel.setArg<cl::Buffer>(13, charges.getDeviceBuffer());
-                pmeAtomRangeKernel = cl::Kernel(program, "findAtomRangeForGrid");
                 pmeZIndexKernel = cl::Kernel(program, "recordZIndex");
-                pmeAtomRangeKernel.setArg<cl::Buffer>(0, pmeAtomGridIndex.getDeviceBuffer());
-                pmeAtomRangeKernel.setArg<cl::Buffer>(1, pmeAtomRange.getDeviceBuffer());
-                pmeAtomRangeKernel.setArg<cl::Buffer>(2, cl.getPosq().getDeviceBuffer());
                 pmeZIndexKernel.setArg<cl::Buffer>(0, pmeAtomGridIndex.getDeviceBuffer());
                 pmeZIndexKernel.setArg<cl::Buffer>(1, cl.getPosq().getDeviceBuffer());
             }
@@ -651,36 +954,75 @@ double OpenCLCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includ
             if (cl.getSupports64BitGlobalAtomics()) {
                 pmeSpreadChargeKernel.setArg<cl::Buffer>(10, pmeAtomGridIndex.getDeviceBuffer());
                 pmeSpreadChargeKernel.setArg<cl::Buffer>(11, charges.getDeviceBuffer());
+                pmeSpreadChargeKernel.setArg<cl::Buffer>(12, recipSubsetFlags.getDeviceBuffer());
+                pmeSpreadChargeKernel.setArg<cl_int>(13, 0);
+                if (cacheBsplines) {
+                    pmeSpreadChargeKernel.setArg<cl::Buffer>(14, pmeCachedTheta.getDeviceBuffer());
+                    pmeSpreadChargeKernel.setArg<cl::Buffer>(15, pmeCachedDTheta.getDeviceBuffer());
+                    pmeSpreadChargeKernel.setArg<cl::Buffer>(16, pmeCachedGridIndex.getDeviceBuffer());
+                }
             }
             else if (deviceIsCpu) {
                 pmeSpreadChargeKernel.setArg<cl::Buffer>(10, charges.getDeviceBuffer());
-                pmeSpreadChargeKernel.setArg<cl::Buffer>(12, subsets.getDeviceBuffer());
+                pmeSpreadChargeKernel.setArg<cl::Buffer>(11, subsets.getDeviceBuffer());
+                pmeSpreadChargeKernel.setArg<cl::Buffer>(12, recipSubsetFlags.getDeviceBuffer());
             }
             else {
                 pmeSpreadChargeKernel.setArg<cl::Buffer>(2, pmeAtomGridIndex.getDeviceBuffer());
-                pmeSpreadChargeKernel.setArg<cl::Buffer>(3, pmeAtomRange.getDeviceBuffer());
+                pmeSpreadChargeKernel.setArg<cl::Buffer>(3, pmeCellStart.getDeviceBuffer());
                 pmeSpreadChargeKernel.setArg<cl::Buffer>(4, pmeBsplineTheta.getDeviceBuffer());
                 pmeSpreadChargeKernel.setArg<cl::Buffer>(5, charges.getDeviceBuffer());
+                pmeSpreadChargeKernel.setArg<cl::Buffer>(6, recipSubsetFlags.getDeviceBuffer());
             }
             pmeConvolutionKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
-            pmeConvolutionKernel.setArg<cl::Buffer>(1, pmeBsplineModuliX.getDeviceBuffer());
-            pmeConvolutionKernel.setArg<cl::Buffer>(2, pmeBsplineModuliY.getDeviceBuffer());
-            pmeConvolutionKernel.setArg<cl::Buffer>(3, pmeBsplineModuliZ.getDeviceBuffer());
-            pmeEvalEnergyKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
-            pmeEvalEnergyKernel.setArg<cl::Buffer>(1, usePmeQueue ? pmeEnergyBuffer.getDeviceBuffer() : cl.getEnergyBuffer().getDeviceBuffer());
-            pmeEvalEnergyKernel.setArg<cl::Buffer>(2, pmeBsplineModuliX.getDeviceBuffer());
-            pmeEvalEnergyKernel.setArg<cl::Buffer>(3, pmeBsplineModuliY.getDeviceBuffer());
-            pmeEvalEnergyKernel.setArg<cl::Buffer>(4, pmeBsplineModuliZ.getDeviceBuffer());
+            pmeConvolutionKernel.setArg<cl::Buffer>(1, usePmeQueue ? pmeEnergyBuffer.getDeviceBuffer() : cl.getEnergyBuffer().getDeviceBuffer());
+            pmeConvolutionKernel.setArg<cl::Buffer>(2, pmeSliceEnergyBuffer.getDeviceBuffer());
+            pmeConvolutionKernel.setArg<cl::Buffer>(3, recipSliceWeights.getDeviceBuffer());
+            pmeConvolutionKernel.setArg<cl::Buffer>(4, pmeBsplineModuliX.getDeviceBuffer());
+            pmeConvolutionKernel.setArg<cl::Buffer>(5, pmeBsplineModuliY.getDeviceBuffer());
+            pmeConvolutionKernel.setArg<cl::Buffer>(6, pmeBsplineModuliZ.getDeviceBuffer());
+            pmeConvolutionKernel.setArg<cl::Buffer>(10, recipSliceFlags.getDeviceBuffer());
+            if (hasDerivatives) {
+                pmeConvolutionKernel.setArg<cl::Buffer>(14, cl.getEnergyParamDerivBuffer().getDeviceBuffer());
+                pmeConvolutionKernel.setArg<cl_int>(15, cl.getEnergyParamDerivNames().size());
+                pmeConvolutionKernel.setArg<cl::Buffer>(16, recipSliceDerivIndices.getDeviceBuffer());
+            }
             pmeInterpolateForceKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
             pmeInterpolateForceKernel.setArg<cl::Buffer>(1, cl.getLongForceBuffer().getDeviceBuffer());
             pmeInterpolateForceKernel.setArg<cl::Buffer>(2, pmeGrid1.getDeviceBuffer());
             pmeInterpolateForceKernel.setArg<cl::Buffer>(11, pmeAtomGridIndex.getDeviceBuffer());
             pmeInterpolateForceKernel.setArg<cl::Buffer>(12, charges.getDeviceBuffer());
+            pmeInterpolateForceKernel.setArg<cl::Buffer>(13, subsets.getDeviceBuffer());
+            pmeInterpolateForceKernel.setArg<cl::Buffer>(14, recipSubsetFlags.getDeviceBuffer());
+            if (cacheBsplines) {
+                pmeInterpolateForceKernel.setArg<cl::Buffer>(15, pmeCachedTheta.getDeviceBuffer());
+                pmeInterpolateForceKernel.setArg<cl::Buffer>(16, pmeCachedDTheta.getDeviceBuffer());
+                pmeInterpolateForceKernel.setArg<cl::Buffer>(17, pmeCachedGridIndex.getDeviceBuffer());
+            }
             if (cl.getSupports64BitGlobalAtomics()) {
                 pmeFinishSpreadChargeKernel = cl::Kernel(program, "finishSpreadCharge");
                 pmeFinishSpreadChargeKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
                 pmeFinishSpreadChargeKernel.setArg<cl::Buffer>(1, pmeGrid1.getDeviceBuffer());
             }
+            if (streamSubsetChunks) {
+                pmeInterpolateChunkKernel = cl::Kernel(program, "gridInterpolateChunk");
+                pmeInterpolateChunkKernel.setArg<cl::Buffer>(0, cl.getPosq().getDeviceBuffer());
+                pmeInterpolateChunkKernel.setArg<cl::Buffer>(1, cl.getLongForceBuffer().getDeviceBuffer());
+                pmeInterpolateChunkKernel.setArg<cl::Buffer>(2, pmeGrid1.getDeviceBuffer());
+                pmeInterpolateChunkKernel.setArg<cl::Buffer>(11, pmeAtomGridIndex.getDeviceBuffer());
+                pmeInterpolateChunkKernel.setArg<cl::Buffer>(12, charges.getDeviceBuffer());
+                pmeInterpolateChunkKernel.setArg<cl::Buffer>(13, subsets.getDeviceBuffer());
+                pmeInterpolateChunkKernel.setArg<cl::Buffer>(14, recipSubsetFlags.getDeviceBuffer());
+                pmeInterpolateChunkKernel.setArg<cl::Buffer>(15, usePmeQueue ? pmeEnergyBuffer.getDeviceBuffer() : cl.getEnergyBuffer().getDeviceBuffer());
+                pmeInterpolateChunkKernel.setArg<cl::Buffer>(16, pmeSliceEnergyBuffer.getDeviceBuffer());
+                pmeInterpolateChunkKernel.setArg<cl::Buffer>(17, recipSliceWeights.getDeviceBuffer());
+                pmeInterpolateChunkKernel.setArg<cl::Buffer>(18, recipSliceFlags.getDeviceBuffer());
+                if (hasDerivatives) {
+                    pmeInterpolateChunkKernel.setArg<cl::Buffer>(24, cl.getEnergyParamDerivBuffer().getDeviceBuffer());
+                    pmeInterpolateChunkKernel.setArg<cl_int>(25, cl.getEnergyParamDerivNames().size());
+                    pmeInterpolateChunkKernel.setArg<cl::Buffer>(26, recipSliceDerivIndices.getDeviceBuffer());
+                }
+            }
             if (usePmeQueue)
                 syncQueue->setKernel(cl::Kernel(program, "addEnergy"));
        }
@@ -700,9 +1042,87 @@ double OpenCLCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includ
         recomputeParams = true;
         globalParams.upload(paramValues, true);
     }
-    double energy = (includeReciprocal ? ewaldSelfEnergy : 0.0);
+    bool lambdaChanged = false;
+    for (int slice = 0; slice < numSlices; slice++)
+        if (sliceScalingParams[slice] != "") {
+            double value = context.getParameter(sliceScalingParams[slice]);
+            if (value != sliceLambdaValues[slice]) {
+                sliceLambdaValues[slice] = value;
+                lambdaChanged = true;
+            }
+        }
+    if (lambdaChanged)
+        sliceLambdas.upload(sliceLambdaValues, true);
+    bool anyReciprocal = (find(includeReciprocal.begin(), includeReciprocal.end(), true) != includeReciprocal.end());
+    if (includeReciprocal != includedRecipSlices || lambdaChanged) {
+        if (pmeio != NULL && anyReciprocal && find(includeReciprocal.begin(), includeReciprocal.end(), false) != includeReciprocal.end())
+            throw OpenMMException("SlicedPmeForce: Slices cannot be assigned to different reciprocal space force groups when reciprocal space is computed on the CPU");
+        if (pmeio != NULL && anyReciprocal && find_if(sliceLambdaValues.begin(), sliceLambdaValues.end(), [](double x) {return x != 1.0;}) != sliceLambdaValues.end())
+            throw OpenMMException("SlicedPmeForce: Slices cannot be scaled when reciprocal space is computed on the CPU");
+        if (pmeio != NULL && anyReciprocal && hasDerivatives)
+            throw OpenMMException("SlicedPmeForce: Energy derivatives are not available when reciprocal space is computed on the CPU");
+        vector<double> weights(numSlices);
+        vector<cl_int> subsetFlags(numSubsets, 0);
+        vector<cl_int> sliceFlags(numSlices, 0);
+        vector<cl_int> derivIndices(numSlices, -1);
+        const vector<string>& allDerivNames = cl.getEnergyParamDerivNames();
+        for (int j = 0; j < numSubsets; j++)
+            for (int i = 0; i <= j; i++) {
+                int slice = getSliceIndex(i, j);
+                if (includeReciprocal[slice]) {
+                    weights[slice] = sliceLambdaValues[slice];
+                    sliceFlags[slice] = 1;
+                    subsetFlags[i] = subsetFlags[j] = 1;
+                    if (find(derivParams.begin(), derivParams.end(), sliceScalingParams[slice]) != derivParams.end())
+                        derivIndices[slice] = find(allDerivNames.begin(), allDerivNames.end(), sliceScalingParams[slice])-allDerivNames.begin();
+                }
+            }
+        recipSliceWeights.upload(weights, true);
+        recipSubsetFlags.upload(subsetFlags);
+        recipSliceFlags.upload(sliceFlags);
+        recipSliceDerivIndices.upload(derivIndices);
+        includedRecipSlices = includeReciprocal;
+    }
+    double energy = 0.0;
+    for (int i = 0; i < numSubsets; i++)
+        if (includeReciprocal[getSliceIndex(i, i)])
+            energy += sliceLambdaValues[getSliceIndex(i, i)]*subsetSelfEnergy[i];
+    if (hasDerivatives && !hasOffsets) {
+        map<string, double>& energyParamDerivs = cl.getEnergyParamDerivWorkspace();
+        for (int i = 0; i < numSubsets; i++) {
+            const string& param = sliceScalingParams[getSliceIndex(i, i)];
+            if (includeReciprocal[getSliceIndex(i, i)] && find(derivParams.begin(), derivParams.end(), param) != derivParams.end())
+                energyParamDerivs[param] += subsetSelfEnergy[i];
+        }
+    }
+
+    // Flag the included direct space slices, and let the first group containing one of them
+    // compute all of them.
+
+    vector<int> directFlags(numSlices+1, 0);
+    directFlags[numSlices] = -1;
+    for (int i = 0; i < numSlices; i++)
+        if (includeDirect[i]) {
+            directFlags[i] = 1;
+            if (directFlags[numSlices] == -1 || directSliceGroups[i] < directFlags[numSlices])
+                directFlags[numSlices] = directSliceGroups[i];
+        }
+    if (directFlags != directSliceFlagsVec) {
+        directSliceFlags.upload(directFlags);
+        directSliceFlagsVec = directFlags;
+    }
+    if (recordSliceEnergies != deviceRecordSliceEnergies) {
+        recordSliceEnergiesFlag.upload(vector<int>(1, recordSliceEnergies ? 1 : 0));
+        deviceRecordSliceEnergies = recordSliceEnergies;
+    }
+    bool recordSlices = (includeEnergy && recordSliceEnergies);
+    if (recordSlices) {
+        cl.clearBuffer(sliceEnergyBuffer);
+        sliceEnergyRecipSlices = includeReciprocal;
+    }
     if (recomputeParams || hasOffsets) {
-        computeParamsKernel.setArg<cl_int>(1, includeEnergy && includeReciprocal);
+        computeParamsKernel.setArg<cl_int>(1, includeEnergy && anyReciprocal);
+        computeParamsKernel.setArg<cl_int>(13, recordSlices);
         cl.executeKernel(computeParamsKernel, cl.getPaddedNumAtoms());
         if (exclusionChargeProds.isInitialized())
             cl.executeKernel(computeExclusionParamsKernel, exclusionChargeProds.getSize());
@@ -718,7 +1138,7 @@ double OpenCLCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includ
     
     // Do reciprocal space calculations.
     
-    if (pmeGrid1.isInitialized() && includeReciprocal) {
+    if (pmeGrid1.isInitialized() && anyReciprocal) {
         if (usePmeQueue && !includeEnergy)
             cl.setQueue(pmeQueue);
         
@@ -765,7 +1185,11 @@ double OpenCLCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includ
             cl.executeKernel(pmeSpreadChargeKernel, 2*cl.getDevice().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(), 1);
         }
         else {
-            sort->sort(pmeAtomGridIndex);
+            cl.executeKernel(pmeCountAtomsKernel, cl.getNumAtoms());
+            cl.executeKernel(pmeScanCellBlocksKernel, pmeCellBlockOffsets.getSize()*CellScanSize, CellScanSize);
+            cl.executeKernel(pmeCellOffsetsKernel, CellScanSize, CellScanSize);
+            cl.executeKernel(pmeAddCellOffsetsKernel, pmeCellStart.getSize()-1);
+            cl.executeKernel(pmeSortAtomsKernel, cl.getNumAtoms());
             if (cl.getSupports64BitGlobalAtomics()) {
                 setPeriodicBoxArgs(cl, pmeSpreadChargeKernel, 2);
                 if (cl.getUseDoublePrecision()) {
@@ -778,11 +1202,12 @@ double OpenCLCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includ
                     pmeSpreadChargeKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[1]);
                     pmeSpreadChargeKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[2]);
                 }
-                cl.executeKernel(pmeSpreadChargeKernel, cl.getNumAtoms());
-                cl.executeKernel(pmeFinishSpreadChargeKernel, gridSizeX*gridSizeY*gridSizeZ);
+                if (!streamSubsetChunks) {
+                    cl.executeKernel(pmeSpreadChargeKernel, cl.getNumAtoms());
+                    cl.executeKernel(pmeFinishSpreadChargeKernel, gridSizeX*gridSizeY*gridSizeZ*numSubsets);
+                }
             }
             else {
-                cl.executeKernel(pmeAtomRangeKernel, cl.getNumAtoms());
                 setPeriodicBoxSizeArg(cl, pmeZIndexKernel, 2);
                 if (cl.getUseDoublePrecision())
                     pmeZIndexKernel.setArg<mm_double4>(3, recipBoxVectors[2]);
@@ -792,47 +1217,90 @@ double OpenCLCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includ
                 cl.executeKernel(pmeSpreadChargeKernel, cl.getNumAtoms());
             }
         }
-        fft->execFFT(true, cl.getQueue());
-
-        pmeCollapseGridKernel.setArg<cl::Buffer>(0, pmeGrid2.getDeviceBuffer());
-        cl.executeKernel(pmeCollapseGridKernel, gridSizeX*gridSizeY*gridSizeZ);
 
         mm_double4 boxSize = cl.getPeriodicBoxSizeDouble();
         if (cl.getUseDoublePrecision()) {
-            pmeConvolutionKernel.setArg<mm_double4>(4, recipBoxVectors[0]);
-            pmeConvolutionKernel.setArg<mm_double4>(5, recipBoxVectors[1]);
-            pmeConvolutionKernel.setArg<mm_double4>(6, recipBoxVectors[2]);
-            pmeEvalEnergyKernel.setArg<mm_double4>(5, recipBoxVectors[0]);
-            pmeEvalEnergyKernel.setArg<mm_double4>(6, recipBoxVectors[1]);
-            pmeEvalEnergyKernel.setArg<mm_double4>(7, recipBoxVectors[2]);
+            pmeConvolutionKernel.setArg<mm_double4>(7, recipBoxVectors[0]);
+            pmeConvolutionKernel.setArg<mm_double4>(8, recipBoxVectors[1]);
+            pmeConvolutionKernel.setArg<mm_double4>(9, recipBoxVectors[2]);
         }
         else {
-            pmeConvolutionKernel.setArg<mm_float4>(4, recipBoxVectorsFloat[0]);
-            pmeConvolutionKernel.setArg<mm_float4>(5, recipBoxVectorsFloat[1]);
-            pmeConvolutionKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[2]);
-            pmeEvalEnergyKernel.setArg<mm_float4>(5, recipBoxVectorsFloat[0]);
-            pmeEvalEnergyKernel.setArg<mm_float4>(6, recipBoxVectorsFloat[1]);
-            pmeEvalEnergyKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[2]);
-        }
-        if (includeEnergy)
-            cl.executeKernel(pmeEvalEnergyKernel, gridSizeX*gridSizeY*gridSizeZ);
-        cl.executeKernel(pmeConvolutionKernel, gridSizeX*gridSizeY*gridSizeZ);
-        fft->execFFT(false, cl.getQueue());
-        setPeriodicBoxArgs(cl, pmeInterpolateForceKernel, 3);
-        if (cl.getUseDoublePrecision()) {
-            pmeInterpolateForceKernel.setArg<mm_double4>(8, recipBoxVectors[0]);
-            pmeInterpolateForceKernel.setArg<mm_double4>(9, recipBoxVectors[1]);
-            pmeInterpolateForceKernel.setArg<mm_double4>(10, recipBoxVectors[2]);
+            pmeConvolutionKernel.setArg<mm_float4>(7, recipBoxVectorsFloat[0]);
+            pmeConvolutionKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[1]);
+            pmeConvolutionKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[2]);
+        }
+
+        bool computeEnergy = (includeEnergy || hasDerivatives);
+        if (streamSubsetChunks) {
+            // Only subsetChunkSize grids fit in memory, so the subsets are processed in chunks.  Each
+            // grid is convolved on its own, and gridInterpolateChunk computes the energy and forces
+            // of every slice involving a subset of the chunk.
+
+            pmeConvolutionKernel.setArg<cl_int>(11, 0);
+            pmeConvolutionKernel.setArg<cl_int>(12, includeForces);
+            pmeConvolutionKernel.setArg<cl_int>(13, 0);
+            setPeriodicBoxArgs(cl, pmeInterpolateChunkKernel, 3);
+            if (cl.getUseDoublePrecision()) {
+                pmeInterpolateChunkKernel.setArg<mm_double4>(8, recipBoxVectors[0]);
+                pmeInterpolateChunkKernel.setArg<mm_double4>(9, recipBoxVectors[1]);
+                pmeInterpolateChunkKernel.setArg<mm_double4>(10, recipBoxVectors[2]);
+            }
+            else {
+                pmeInterpolateChunkKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[0]);
+                pmeInterpolateChunkKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[1]);
+                pmeInterpolateChunkKernel.setArg<mm_float4>(10, recipBoxVectorsFloat[2]);
+            }
+            pmeInterpolateChunkKernel.setArg<cl_int>(21, computeEnergy);
+            pmeInterpolateChunkKernel.setArg<cl_int>(22, includeForces);
+            pmeInterpolateChunkKernel.setArg<cl_int>(23, recordSlices);
+            if (computeEnergy || includeForces)
+                for (int firstSubset = 0; firstSubset < numSubsets; firstSubset += subsetChunkSize) {
+                    if (firstSubset > 0)
+                        cl.clearBuffer(pmeGrid2);
+                    pmeSpreadChargeKernel.setArg<cl_int>(13, firstSubset);
+                    cl.executeKernel(pmeSpreadChargeKernel, cl.getNumAtoms());
+                    cl.executeKernel(pmeFinishSpreadChargeKernel, gridSizeX*gridSizeY*gridSizeZ*subsetChunkSize);
+                    fft->execFFT(true, cl.getQueue());
+                    cl.executeKernel(pmeConvolutionKernel, gridSizeX*gridSizeY*(gridSizeZ/2+1));
+                    fft->execFFT(false, cl.getQueue());
+                    pmeInterpolateChunkKernel.setArg<cl_int>(19, firstSubset);
+                    pmeInterpolateChunkKernel.setArg<cl_int>(20, firstSubset > 0);
+                    cl.executeKernel(pmeInterpolateChunkKernel, cl.getNumAtoms());
+                }
         }
         else {
-            pmeInterpolateForceKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[0]);
-            pmeInterpolateForceKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[1]);
-            pmeInterpolateForceKernel.setArg<mm_float4>(10, recipBoxVectorsFloat[2]);
+            fft->execFFT(true, cl.getQueue());
+
+            // The energy only needs the structure factors, so the potential on the grid is computed
+            // only when forces are requested.  Both are obtained from a single pass over the half
+            // complex grid, which also combines the subset grids according to the slice weights.
+
+            if (computeEnergy || includeForces) {
+                pmeConvolutionKernel.setArg<cl_int>(11, computeEnergy);
+                pmeConvolutionKernel.setArg<cl_int>(12, includeForces);
+                pmeConvolutionKernel.setArg<cl_int>(13, recordSlices);
+                cl.executeKernel(pmeConvolutionKernel, gridSizeX*gridSizeY*(gridSizeZ/2+1), convolutionBlockSize);
+            }
+
+            if (includeForces) {
+                fft->execFFT(false, cl.getQueue());
+                setPeriodicBoxArgs(cl, pmeInterpolateForceKernel, 3);
+                if (cl.getUseDoublePrecision()) {
+                    pmeInterpolateForceKernel.setArg<mm_double4>(8, recipBoxVectors[0]);
+                    pmeInterpolateForceKernel.setArg<mm_double4>(9, recipBoxVectors[1]);
+                    pmeInterpolateForceKernel.setArg<mm_double4>(10, recipBoxVectors[2]);
+                }
+                else {
+                    pmeInterpolateForceKernel.setArg<mm_float4>(8, recipBoxVectorsFloat[0]);
+                    pmeInterpolateForceKernel.setArg<mm_float4>(9, recipBoxVectorsFloat[1]);
+                    pmeInterpolateForceKernel.setArg<mm_float4>(10, recipBoxVectorsFloat[2]);
+                }
+                if (deviceIsCpu)
+                    cl.executeKernel(pmeInterpolateForceKernel, 2*cl.getDevice().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(), 1);
+                else
+                    cl.executeKernel(pmeInterpolateForceKernel, cl.getNumAtoms());
+            }
         }
-        if (deviceIsCpu)
-            cl.executeKernel(pmeInterpolateForceKernel, 2*cl.getDevice().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(), 1);
-        else
-            cl.executeKernel(pmeInterpolateForceKernel, cl.getNumAtoms());
         if (usePmeQueue) {
             pmeQueue.enqueueMarkerWithWaitList(NULL, &pmeSyncEvent);
             cl.restoreDefaultQueue();
@@ -893,20 +1361,125 @@ void OpenCLCalcSlicedPmeForceKernel::copyParametersToContext(ContextImpl& contex
             baseExceptionChargeProdsVec[i] = chargeProd;
         }
         baseExceptionChargeProds.upload(baseExceptionChargeProdsVec);
+        vector<cl_int> exceptionSlicesVec(numExceptions);
+        for (int i = 0; i < numExceptions; i++)
+            exceptionSlicesVec[i] = getSliceIndex(subsetVec[exceptionAtoms[i].first], subsetVec[exceptionAtoms[i].second]);
+        exceptionSlices.upload(exceptionSlicesVec);
+    }
+    if (exclusionSlices.isInitialized()) {
+        vector<cl_int> exclusionSlicesVec(exclusionAtomPairs.size());
+        for (int i = 0; i < exclusionAtomPairs.size(); i++)
+            exclusionSlicesVec[i] = getSliceIndex(subsetVec[exclusionAtomPairs[i].first], subsetVec[exclusionAtomPairs[i].second]);
+        exclusionSlices.upload(exclusionSlicesVec);
     }
     
     // Compute other values.
     
-    ewaldSelfEnergy = 0.0;
-    if (cl.getContextIndex() == 0) {
-        for (int i = 0; i < force.getNumParticles(); i++) {
-            ewaldSelfEnergy -= baseParticleChargeVec[i]*baseParticleChargeVec[i]*ONE_4PI_EPS0*alpha/sqrt(M_PI);
-        }
-    }
+    subsetSelfEnergy.assign(numSubsets, 0.0);
+    if (cl.getContextIndex() == 0)
+        for (int i = 0; i < force.getNumParticles(); i++)
+            subsetSelfEnergy[subsetVec[i]] -= baseParticleChargeVec[i]*baseParticleChargeVec[i]*ONE_4PI_EPS0*alpha/sqrt(M_PI);
     cl.invalidateMolecules(info);
     recomputeParams = true;
 }
 
+OpenCLFFT3D* OpenCLCalcSlicedPmeForceKernel::createFastestFFT() {
+    vector<string> backends = {"VkFFT", "native"};
+
+    // Start from empty grids so that repeated transforms cannot overflow.
+
+    cl.clearBuffer(pmeGrid1);
+    cl.clearBuffer(pmeGrid2);
+    const int numIterations = 5;
+    OpenCLFFT3D* fastest = NULL;
+    double fastestTime = 0.0;
+    for (string& backend : backends) {
+        OpenCLFFT3D* candidate;
+        if (backend == "native")
+            candidate = new OpenCLNativeFFT3D(cl, gridSizeX, gridSizeY, gridSizeZ, subsetChunkSize, true, pmeGrid1, pmeGrid2);
+        else
+            candidate = new OpenCLVkFFT3D(cl, gridSizeX, gridSizeY, gridSizeZ, subsetChunkSize, true, pmeGrid1, pmeGrid2, vkfftCacheDirectory);
+
+        // Run one pair of transforms as a warm up, then time several more.
+
+        candidate->execFFT(true, cl.getQueue());
+        candidate->execFFT(false, cl.getQueue());
+        cl.getQueue().finish();
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < numIterations; i++) {
+            candidate->execFFT(true, cl.getQueue());
+            candidate->execFFT(false, cl.getQueue());
+        }
+        cl.getQueue().finish();
+        double time = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+        if (fastest == NULL || time < fastestTime) {
+            if (fastest != NULL)
+                delete fastest;
+            fastest = candidate;
+            fastestTime = time;
+            fftBackend = backend;
+        }
+        else
+            delete candidate;
+    }
+    return fastest;
+}
+
+cl::Program OpenCLCalcSlicedPmeForceKernel::createProgram(const string& source, const map<string, string>& defines) {
+    // The key identifies everything that affects the compiled code.  OpenCLContext prepends its own
+    // definitions to the source, but those depend only on the OpenMM version, the device, and the
+    // precision.
+
+    stringstream fullSource;
+    for (auto& define : defines)
+        fullSource<<"#define "<<define.first<<" "<<define.second<<endl;
+    fullSource<<source;
+    string sourceText = fullSource.str();
+    cl::Device device = cl.getDevice();
+    cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+    string precision = (cl.getUseDoublePrecision() ? "double" : (cl.getUseMixedPrecision() ? "mixed" : "single"));
+    stringstream key;
+    key<<"OpenCL program;OpenMM "<<Platform::getOpenMMVersion()<<";"<<platform.getInfo<CL_PLATFORM_NAME>()<<";"<<device.getInfo<CL_DEVICE_NAME>();
+    key<<";"<<device.getInfo<CL_DRIVER_VERSION>()<<";"<<precision<<";"<<sourceText.size()<<";"<<hex<<hash<string>()(sourceText);
+    string cacheKey = key.str();
+    shared_ptr<const vector<char> > binaries = BinaryCache::load(programCacheDirectory, "opencl", cacheKey);
+    if (binaries) {
+        const unsigned char* binaryData = (const unsigned char*) binaries->data();
+        size_t binarySize = binaries->size();
+        cl_device_id deviceId = device();
+        cl_int status;
+        cl_program program = clCreateProgramWithBinary(cl.getContext()(), 1, &deviceId, &binarySize, &binaryData, NULL, &status);
+        if (status == CL_SUCCESS) {
+            if (clBuildProgram(program, 1, &deviceId, NULL, NULL, NULL) == CL_SUCCESS) {
+                programBinaries.push_back(binaries);
+                return cl::Program(program);
+            }
+            clReleaseProgram(program);
+        }
+
+        // The cached binary could not be used, so compile the program again and replace the cache entry.
+    }
+    cl::Program program = cl.createProgram(source, defines);
+    size_t binarySize;
+    if (clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL) == CL_SUCCESS && binarySize > 0) {
+        vector<unsigned char> binary(binarySize);
+        unsigned char* binaryData = binary.data();
+        if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binaryData, NULL) == CL_SUCCESS)
+            programBinaries.push_back(BinaryCache::save(programCacheDirectory, "opencl", cacheKey, binary.data(), binary.size()));
+    }
+    return program;
+}
+
+void OpenCLCalcSlicedPmeForceKernel::setRecordSliceEnergies(bool record) {
+    recordSliceEnergies = record;
+}
+
+string OpenCLCalcSlicedPmeForceKernel::getFFTBackend() const {
+    if (pmeio != NULL)
+        return "CPU";
+    return fftBackend;
+}
+
 void OpenCLCalcSlicedPmeForceKernel::getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const {
     if (cl.getPlatformData().useCpuPme)
         cpuPme.getAs<CalcPmeReciprocalForceKernel>().getPMEParameters(alpha, nx, ny, nz);
@@ -917,3 +1490,38 @@ void OpenCLCalcSlicedPmeForceKernel::getPMEParameters(double& alpha, int& nx, in
         nz = gridSizeZ;
     }
 }
+
+void OpenCLCalcSlicedPmeForceKernel::getSliceEnergies(vector<vector<double> >& energies) {
+    if (pmeio != NULL)
+        throw OpenMMException("getSliceEnergies: Slice energies are not available when reciprocal space is computed on the CPU");
+    cl.clearBuffer(sliceEnergies);
+    reduceSliceEnergiesKernel.setArg<cl::Buffer>(0, sliceEnergyBuffer.getDeviceBuffer());
+    reduceSliceEnergiesKernel.setArg<cl::Buffer>(1, sliceEnergies.getDeviceBuffer());
+    reduceSliceEnergiesKernel.setArg<cl_int>(2, sliceEnergyBuffer.getSize()/numSlices);
+    cl.executeKernel(reduceSliceEnergiesKernel, numSlices*OpenCLContext::ThreadBlockSize, OpenCLContext::ThreadBlockSize);
+    bool anyReciprocal = (find(sliceEnergyRecipSlices.begin(), sliceEnergyRecipSlices.end(), true) != sliceEnergyRecipSlices.end());
+    if (anyReciprocal && pmeSliceEnergyBuffer.isInitialized()) {
+        reduceSliceEnergiesKernel.setArg<cl::Buffer>(0, pmeSliceEnergyBuffer.getDeviceBuffer());
+        reduceSliceEnergiesKernel.setArg<cl_int>(2, pmeSliceEnergyBuffer.getSize()/numSlices);
+        cl.executeKernel(reduceSliceEnergiesKernel, numSlices*OpenCLContext::ThreadBlockSize, OpenCLContext::ThreadBlockSize);
+    }
+    vector<double> sliceEnergyVec;
+    if (sliceEnergies.getElementSize() == sizeof(double))
+        sliceEnergies.download(sliceEnergyVec);
+    else {
+        vector<float> sliceEnergyVecFloat;
+        sliceEnergies.download(sliceEnergyVecFloat);
+        sliceEnergyVec.assign(sliceEnergyVecFloat.begin(), sliceEnergyVecFloat.end());
+    }
+
+    // When there are no parameter offsets, the self energy is computed on the host.
+
+    energies.assign(numSubsets, vector<double>(numSubsets, 0.0));
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++) {
+            double energy = sliceEnergyVec[getSliceIndex(i, j)];
+            if (i == j && anyReciprocal && sliceEnergyRecipSlices[getSliceIndex(i, i)] && !hasOffsets)
+                energy += subsetSelfEnergy[i];
+            energies[i][j] = energies[j][i] = energy;
+        }
+}
@@ -33,11 +33,12 @@
  * -------------------------------------------------------------------------- */
 
 #include "PmeSlicingKernels.h"
+#include "internal/OpenCLNativeFFT3D.h"
 #include "internal/OpenCLVkFFT3D.h"
 #include "openmm/internal/ContextImpl.h"
 #include "openmm/opencl/OpenCLContext.h"
 #include "openmm/opencl/OpenCLArray.h"
-#include "openmm/opencl/OpenCLSort.h"
+#include <memory>
 #include <vector>
 
 namespace PmeSlicing {
@@ -48,7 +49,7 @@ namespace PmeSlicing {
 class OpenCLCalcSlicedPmeForceKernel : public CalcSlicedPmeForceKernel {
 public:
     OpenCLCalcSlicedPmeForceKernel(std::string name, const Platform& platform, OpenCLContext& cl, const System& system) : CalcSlicedPmeForceKernel(name, platform),
-            hasInitializedKernel(false), cl(cl), sort(NULL), fft(NULL), pmeio(NULL), usePmeQueue(false) {
+            hasInitializedKernel(false), cl(cl), fft(NULL), pmeio(NULL), usePmeQueue(false), recordSliceEnergies(false), deviceRecordSliceEnergies(false) {
     }
     ~OpenCLCalcSlicedPmeForceKernel();
     /**
@@ -64,11 +65,11 @@ public:
      * @param context        the context in which to execute this kernel
      * @param includeForces  true if forces should be calculated
      * @param includeEnergy  true if the energy should be calculated
-     * @param includeDirect  true if direct space interactions should be included
-     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param includeDirect  for each slice, whether its direct space interactions should be included
+     * @param includeReciprocal  for each slice, whether its reciprocal space interactions should be included
      * @return the potential energy due to the force
      */
-    double execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal);
+    double execute(ContextImpl& context, bool includeForces, bool includeEnergy, const std::vector<bool>& includeDirect, const std::vector<bool>& includeReciprocal);
     /**
      * Copy changed parameters over to a context.
      *
@@ -85,21 +86,40 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     void getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
+    /**
+     * Get the name of the FFT backend used for reciprocal space calculations.
+     */
+    std::string getFFTBackend() const;
+    /**
+     * Set whether subsequent calls to execute() should record the energy of each slice.
+     *
+     * @param record   true if slice energies should be recorded
+     */
+    void setRecordSliceEnergies(bool record);
+    /**
+     * Get the unscaled energies of all slices computed in the most recent call to execute()
+     * in which the energy was requested and slice energies were being recorded.  They are not
+     * multiplied by the slice scaling parameters.
+     *
+     * @param energies   on exit, a symmetric numSubsets x numSubsets matrix whose element [I][J]
+     *                   is the energy of slice[I,J]
+     */
+    void getSliceEnergies(std::vector<std::vector<double> >& energies);
 private:
-    class SortTrait : public OpenCLSort::SortTrait {
-        int getDataSize() const {return 8;}
-        int getKeySize() const {return 4;}
-        const char* getDataType() const {return "int2";}
-        const char* getKeyType() const {return "int";}
-        const char* getMinKey() const {return "INT_MIN";}
-        const char* getMaxKey() const {return "INT_MAX";}
-        const char* getMaxValue() const {return "(int2) (INT_MAX, INT_MAX)";}
-        const char* getSortKey() const {return "value.y";}
-    };
     class ForceInfo;
     class PmeIO;
     class PmePreComputation;
     class PmePostComputation;
+    /**
+     * Time each of the available FFT backends on the PME grids, and return the fastest one.
+     */
+    OpenCLFFT3D* createFastestFFT();
+    /**
+     * Compile a program with OpenCLContext::createProgram(), or load its binary if another kernel
+     * in this process or a previous run with the same program cache directory compiled it for the
+     * same device and precision.
+     */
+    cl::Program createProgram(const std::string& source, const std::map<std::string, std::string>& defines);
     class SyncQueuePreComputation;
     class SyncQueuePostComputation;
     OpenCLContext& cl;
@@ -110,6 +130,8 @@ private:
     OpenCLArray exceptionChargeProds;
     OpenCLArray exclusionAtoms;
     OpenCLArray exclusionChargeProds;
+    OpenCLArray exceptionSlices;
+    OpenCLArray exclusionSlices;
     OpenCLArray baseParticleCharges;
     OpenCLArray baseExceptionChargeProds;
     OpenCLArray particleParamOffsets;
@@ -123,36 +145,65 @@ private:
     OpenCLArray pmeBsplineModuliY;
     OpenCLArray pmeBsplineModuliZ;
     OpenCLArray pmeBsplineTheta;
-    OpenCLArray pmeAtomRange;
     OpenCLArray pmeAtomGridIndex;
+    OpenCLArray pmeUnsortedAtomGridIndex;
+    OpenCLArray pmeCellStart;
+    OpenCLArray pmeCellBlockOffsets;
+    OpenCLArray pmeCellRank;
+    OpenCLArray pmeSortedAtomCell;
+    OpenCLArray pmeNumMovedAtoms;
+    OpenCLArray pmeCachedTheta;
+    OpenCLArray pmeCachedDTheta;
+    OpenCLArray pmeCachedGridIndex;
     OpenCLArray pmeEnergyBuffer;
-    OpenCLSort* sort;
+    OpenCLArray sliceEnergyBuffer;
+    OpenCLArray pmeSliceEnergyBuffer;
+    OpenCLArray sliceEnergies;
+    OpenCLArray recordSliceEnergiesFlag;
+    OpenCLArray directSliceFlags;
+    OpenCLArray recipSliceWeights;
+    OpenCLArray recipSubsetFlags;
+    OpenCLArray recipSliceFlags;
+    OpenCLArray sliceLambdas;
+    OpenCLArray recipSliceDerivIndices;
     cl::CommandQueue pmeQueue;
     cl::Event pmeSyncEvent;
-    OpenCLVkFFT3D* fft;
+    OpenCLFFT3D* fft;
+    std::string fftBackend, vkfftCacheDirectory, programCacheDirectory;
+    std::vector<std::shared_ptr<const std::vector<char> > > programBinaries;
     Kernel cpuPme;
     PmeIO* pmeio;
     SyncQueuePostComputation* syncQueue;
     cl::Kernel computeParamsKernel, computeExclusionParamsKernel;
     cl::Kernel ewaldSumsKernel;
     cl::Kernel ewaldForcesKernel;
-    cl::Kernel pmeAtomRangeKernel;
     cl::Kernel pmeZIndexKernel;
     cl::Kernel pmeGridIndexKernel;
+    cl::Kernel pmeCountAtomsKernel;
+    cl::Kernel pmeScanCellBlocksKernel;
+    cl::Kernel pmeCellOffsetsKernel;
+    cl::Kernel pmeAddCellOffsetsKernel;
+    cl::Kernel pmeSortAtomsKernel;
     cl::Kernel pmeSpreadChargeKernel;
     cl::Kernel pmeFinishSpreadChargeKernel;
     cl::Kernel pmeConvolutionKernel;
-    cl::Kernel pmeEvalEnergyKernel;
     cl::Kernel pmeInterpolateForceKernel;
-    cl::Kernel pmeCollapseGridKernel;
+    cl::Kernel pmeInterpolateChunkKernel;
+    cl::Kernel reduceSliceEnergiesKernel;
     std::map<std::string, std::string> pmeDefines;
-    std::vector<std::pair<int, int> > exceptionAtoms;
+    std::vector<std::pair<int, int> > exceptionAtoms, exclusionAtomPairs;
     std::vector<std::string> paramNames;
     std::vector<double> paramValues;
-    double ewaldSelfEnergy, alpha;
-    int gridSizeX, gridSizeY, gridSizeZ;
-    bool usePmeQueue, usePosqCharges, recomputeParams, hasOffsets;
-    static const int PmeOrder = 5;
+    std::vector<double> subsetSelfEnergy;
+    std::vector<bool> includedRecipSlices, sliceEnergyRecipSlices;
+    std::vector<std::string> sliceScalingParams, derivParams;
+    std::vector<double> sliceLambdaValues;
+    std::vector<int> directSliceGroups, directSliceFlagsVec;
+    double alpha;
+    int gridSizeX, gridSizeY, gridSizeZ, numSubsets, numSlices, pmeOrder, subsetChunkSize, convolutionBlockSize;
+    bool usePmeQueue, usePosqCharges, recomputeParams, hasOffsets, hasDerivatives, cacheBsplines, streamSubsetChunks;
+    bool recordSliceEnergies, deviceRecordSliceEnergies;
+    static const int CellScanSize = 256;
 };
 
 } // namespace PmeSlicing
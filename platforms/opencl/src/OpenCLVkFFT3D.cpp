@@ -25,14 +25,18 @@
  * -------------------------------------------------------------------------- */
 
 #include "internal/OpenCLVkFFT3D.h"
+#include "BinaryCache.h"
 #include "openmm/opencl/OpenCLContext.h"
+#include <sstream>
 #include <string>
+#include <vector>
 
 using namespace PmeSlicing;
 using namespace OpenMM;
 using namespace std;
 
-OpenCLVkFFT3D::OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out) {
+OpenCLVkFFT3D::OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out,
+        const string& cacheDirectory) {
     device = context.getDevice().get();
     cl = context.getContext().get();
     inputBuffer = in.getDeviceBuffer().get();
@@ -71,9 +75,36 @@ OpenCLVkFFT3D::OpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int z
     config.bufferStride[1] = outputZSize*ysize;
     config.bufferStride[2] = outputZSize*ysize*xsize;
 
+    // Reuse the binaries compiled by another object in this process or by an earlier run with the
+    // same device and configuration if possible.
+
+    cl::Device clDevice = context.getDevice();
+    cl::Platform platform(clDevice.getInfo<CL_DEVICE_PLATFORM>());
+    stringstream key;
+    key<<"OpenCL;VkFFT "<<VkFFTGetVersion()<<";"<<platform.getInfo<CL_PLATFORM_NAME>()<<";"<<clDevice.getInfo<CL_DEVICE_NAME>()<<";"<<clDevice.getInfo<CL_DRIVER_VERSION>();
+    key<<";"<<(doublePrecision ? "double" : "single")<<";"<<(realToComplex ? "r2c" : "c2c")<<";"<<xsize<<"x"<<ysize<<"x"<<zsize<<";batch "<<batch;
+    string cacheKey = key.str();
+    binaries = BinaryCache::load(cacheDirectory, "vkfft", cacheKey);
+    if (binaries) {
+        config.loadApplicationFromString = 1;
+        config.loadApplicationString = (void*) binaries->data();
+    }
+    else
+        config.saveApplicationToString = 1;
     VkFFTResult result = initializeVkFFT(&app, config);
+    if (result != VKFFT_SUCCESS && config.loadApplicationFromString) {
+        // The cached binaries could not be used, so generate them again and replace the cache entry.
+
+        app = {};
+        config.loadApplicationFromString = 0;
+        config.loadApplicationString = NULL;
+        config.saveApplicationToString = 1;
+        result = initializeVkFFT(&app, config);
+    }
     if (result != VKFFT_SUCCESS)
         throw OpenMMException("Error initializing VkFFT: "+to_string(result));
+    if (config.saveApplicationToString)
+        binaries = BinaryCache::save(cacheDirectory, "vkfft", cacheKey, app.saveApplicationString, app.applicationStringSize);
 }
 
 OpenCLVkFFT3D::~OpenCLVkFFT3D() {
@@ -26,11 +26,14 @@ __kernel void execFFT(__global const INPUT_TYPE* restrict in, __global OUTPUT_TY
         w[i] = (real2) (cos(-(SIGN)*i*2*M_PI/ZSIZE), sin(-(SIGN)*i*2*M_PI/ZSIZE));
     barrier(CLK_LOCAL_MEM_FENCE);
 
-#if INPUT_IS_REAL
+#if INPUT_IS_PACKED
+    const int idist = XSIZE*YSIZE*(ZSIZE/2+1);
+#else
     const int idist = XSIZE*YSIZE*ZSIZE;
-    const int odist = XSIZE*YSIZE*(ZSIZE/2+1);
+#endif
+#if OUTPUT_IS_PACKED
+    const int odist = (XSIZE/2+1)*YSIZE*ZSIZE;
 #else
-    const int idist = XSIZE*YSIZE*(ZSIZE/2+1);
     const int odist = XSIZE*YSIZE*ZSIZE;
 #endif
 
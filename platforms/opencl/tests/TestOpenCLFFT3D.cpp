@@ -33,6 +33,7 @@
  * This tests the OpenCL implementation of FFT3D.
  */
 
+#include "internal/OpenCLNativeFFT3D.h"
 #include "internal/OpenCLVkFFT3D.h"
 #include "openmm/internal/AssertionUtilities.h"
 #include "openmm/opencl/OpenCLArray.h"
@@ -50,6 +51,17 @@ using namespace std;
 
 static OpenCLPlatform platform;
 
+/**
+ * VkFFT with the compiled binaries cached in the current directory.  Running the same tests twice
+ * with it exercises both saving and loading the cache.
+ */
+class CachedOpenCLVkFFT3D : public OpenCLVkFFT3D {
+public:
+    CachedOpenCLVkFFT3D(OpenCLContext& context, int xsize, int ysize, int zsize, int batch, bool realToComplex, OpenCLArray& in, OpenCLArray& out) :
+            OpenCLVkFFT3D(context, xsize, ysize, zsize, batch, realToComplex, in, out, ".") {
+    }
+};
+
 template <class FFT3D, typename Real, class Real2>
 void testTransform(bool realToComplex, int xsize, int ysize, int zsize, int batch) {
     System system;
@@ -141,19 +153,70 @@ void executeTests(int batch) {
     testTransform<FFT3D, Real, Real2>(true, 21, 25, 27, batch);
 }
 
+void testFindFastestDimensions() {
+    // The selected dimensions must be legal, no smaller than the minimum, and no more costly than
+    // the smallest legal dimensions.
+
+    int minimum[][3] = {{45, 45, 45}, {49, 50, 51}, {97, 97, 97}, {60, 61, 62}, {11, 13, 17}, {1, 1, 1}};
+    for (int maxPrimeFactor : {7, 13})
+        for (auto& sizes : minimum) {
+            int xsize = sizes[0], ysize = sizes[1], zsize = sizes[2];
+            FFTDimensions::findFastestDimensions(xsize, ysize, zsize, 2, 1000, 5, 16.0, 0.0, maxPrimeFactor);
+            ASSERT(xsize >= sizes[0] && ysize >= sizes[1] && zsize >= sizes[2]);
+            ASSERT_EQUAL(xsize, FFTDimensions::findLegalDimension(xsize, maxPrimeFactor));
+            ASSERT_EQUAL(ysize, FFTDimensions::findLegalDimension(ysize, maxPrimeFactor));
+            ASSERT_EQUAL(zsize, FFTDimensions::findLegalDimension(zsize, maxPrimeFactor));
+            int xlegal = FFTDimensions::findLegalDimension(sizes[0], maxPrimeFactor);
+            int ylegal = FFTDimensions::findLegalDimension(sizes[1], maxPrimeFactor);
+            int zlegal = FFTDimensions::findLegalDimension(sizes[2], maxPrimeFactor);
+            ASSERT(FFTDimensions::estimateCost(xsize, ysize, zsize, 2, 1000, 5, 16.0, 0.0) <= FFTDimensions::estimateCost(xlegal, ylegal, zlegal, 2, 1000, 5, 16.0, 0.0));
+        }
+
+    // A grid whose dimension is 7*7 costs more than a slightly larger one that factors into smaller primes.
+
+    int xsize = 49, ysize = 50, zsize = 50;
+    FFTDimensions::findFastestDimensions(xsize, ysize, zsize, 1, 1000, 5, 16.0, 0.0);
+    ASSERT_EQUAL(50, xsize);
+
+    // Without a memory limit, 36 points are faster than 35 along each axis.  A limit that just
+    // fits two grids of 35^3 points would need twice as many chunks with the larger grid, so the
+    // smaller one should be chosen instead.
+
+    xsize = ysize = zsize = 33;
+    FFTDimensions::findFastestDimensions(xsize, ysize, zsize, 4, 20000, 5, 16.0, 0.0);
+    ASSERT_EQUAL(36, xsize);
+    ASSERT_EQUAL(2, FFTDimensions::findSubsetChunkSize(35, 35, 35, 4, 5, 16.0, 2*16.0*35*35*35));
+    xsize = ysize = zsize = 33;
+    FFTDimensions::findFastestDimensions(xsize, ysize, zsize, 4, 20000, 5, 16.0, 2*16.0*35*35*35);
+    ASSERT_EQUAL(35, xsize);
+    ASSERT_EQUAL(35, ysize);
+    ASSERT_EQUAL(35, zsize);
+}
+
 int main(int argc, char* argv[]) {
     try {
         if (argc > 1)
             platform.setPropertyDefaultValue("OpenCLPrecision", string(argv[1]));
+        testFindFastestDimensions();
         if (platform.getPropertyDefaultValue("OpenCLPrecision") == "double") {
             executeTests<OpenCLVkFFT3D, double, mm_double2>(1);
             executeTests<OpenCLVkFFT3D, double, mm_double2>(2);
             executeTests<OpenCLVkFFT3D, double, mm_double2>(3);
+            executeTests<OpenCLNativeFFT3D, double, mm_double2>(1);
+            executeTests<OpenCLNativeFFT3D, double, mm_double2>(2);
+            executeTests<OpenCLNativeFFT3D, double, mm_double2>(3);
+            executeTests<CachedOpenCLVkFFT3D, double, mm_double2>(2);
+            executeTests<CachedOpenCLVkFFT3D, double, mm_double2>(2);
         }
         else {
             executeTests<OpenCLVkFFT3D, float, mm_float2>(1);
             executeTests<OpenCLVkFFT3D, float, mm_float2>(2);
             executeTests<OpenCLVkFFT3D, float, mm_float2>(3);
+            executeTests<OpenCLNativeFFT3D, float, mm_float2>(1);
+            executeTests<OpenCLNativeFFT3D, float, mm_float2>(2);
+            executeTests<OpenCLNativeFFT3D, float, mm_float2>(3);
+            executeTests<CachedOpenCLVkFFT3D, float, mm_float2>(2);
+            executeTests<CachedOpenCLVkFFT3D, float, mm_float2>(2);
         }
     }
     catch(const exception& e) {
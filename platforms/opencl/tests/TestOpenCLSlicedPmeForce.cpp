@@ -104,6 +104,76 @@ void testParallelComputation() {
         ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-5);
 }
 
+void testNativeFFT() {
+    // Compare the native FFT implementation against VkFFT.
+
+    const int numParticles = 200;
+    const int numSubsets = 2;
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(4.5, 0, 0), Vec3(0, 5, 0), Vec3(0, 0, 5.5));
+    SlicedPmeForce* force = new SlicedPmeForce(numSubsets);
+    system.addForce(force);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2-0.5);
+        force->setParticleSubset(i, i%numSubsets);
+        positions[i] = Vec3(4.5*genrand_real2(sfmt), 5*genrand_real2(sfmt), 5.5*genrand_real2(sfmt));
+    }
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+    force->setUseNativeOpenCLFFT(true);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-5);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-4);
+    vector<vector<double> > energies1 = force->getSliceEnergies(context1);
+    vector<vector<double> > energies2 = force->getSliceEnergies(context2);
+    for (int i = 0; i < numSubsets; i++)
+        for (int j = i; j < numSubsets; j++)
+            ASSERT_EQUAL_TOL(energies1[i][j], energies2[i][j], 1e-5);
+}
+
+void testProgramCache() {
+    // Create two contexts that cache their programs in the current directory.  The second one
+    // loads the binaries saved by the first, and must give the same results.
+
+    const int numParticles = 200;
+    const int numSubsets = 2;
+    System system;
+    system.setDefaultPeriodicBoxVectors(Vec3(5, 0, 0), Vec3(0, 5, 0), Vec3(0, 0, 5));
+    SlicedPmeForce* force = new SlicedPmeForce(numSubsets);
+    force->setOpenCLProgramCacheDirectory(".");
+    system.addForce(force);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    vector<Vec3> positions(numParticles);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2-0.5);
+        force->setParticleSubset(i, i%numSubsets);
+        positions[i] = Vec3(5*genrand_real2(sfmt), 5*genrand_real2(sfmt), 5*genrand_real2(sfmt));
+    }
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Forces | State::Energy);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), 1e-6);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], 1e-6);
+}
+
 void testReordering() {
     // Check that reordering of atoms doesn't alter their positions.
     
@@ -155,6 +225,8 @@ void testReordering() {
 
 void runPlatformTests() {
     testParallelComputation();
+    testNativeFFT();
+    testProgramCache();
     testReordering();
     // if (canRunHugeTest()) {
     //     double tol = (platform.getPropertyDefaultValue("Precision") == "single" ? 1e-4 : 1e-5);
@@ -44,6 +44,10 @@ extern "C" OPENMM_EXPORT void registerPlatforms() {
 extern "C" OPENMM_EXPORT void registerKernelFactories() {
     for (int i = 0; i < Platform::getNumPlatforms(); i++) {
         Platform& platform = Platform::getPlatform(i);
+        // The CPU platform derives from the reference platform, but has its own implementation.
+
+        if (platform.getName() == "CPU" && platform.supportsKernels({CalcSlicedPmeForceKernel::Name()}))
+            continue;
         if (dynamic_cast<ReferencePlatform*>(&platform) != NULL) {
             ReferencePmeSlicingKernelFactory* factory = new ReferencePmeSlicingKernelFactory();
             platform.registerKernelFactory(CalcSlicedPmeForceKernel::Name(), factory);
@@ -29,21 +29,23 @@
  * USE OR OTHER DEALINGS IN THE SOFTWARE.                                     *
  * -------------------------------------------------------------------------- */
 
+#ifdef WIN32
+  #define _USE_MATH_DEFINES // Needed to get M_PI
+#endif
 #include "ReferencePmeSlicingKernels.h"
 #include "SlicedPmeForce.h"
 #include "internal/SlicedPmeForceImpl.h"
 #include "openmm/OpenMMException.h"
 #include "openmm/internal/ContextImpl.h"
 #include "openmm/reference/RealVec.h"
+#include "openmm/reference/ReferenceForce.h"
 #include "openmm/reference/ReferencePlatform.h"
 #include "openmm/reference/SimTKOpenMMRealType.h"
-#include "openmm/reference/ReferenceBondForce.h"
 #include "openmm/reference/ReferenceNeighborList.h"
+#include <algorithm>
+#include <cmath>
 #include <cstring>
 
-#include "openmm/reference/ReferenceLJCoulombIxn.h"
-#include "openmm/reference/ReferenceLJCoulomb14.h"
-
 using namespace PmeSlicing;
 using namespace OpenMM;
 using namespace std;
@@ -63,9 +65,74 @@ static RealVec* extractBoxVectors(ContextImpl& context) {
     return (RealVec*) data->periodicBoxVectors;
 }
 
+static map<string, double>& extractEnergyParameterDerivatives(ContextImpl& context) {
+    ReferencePlatform::PlatformData* data = reinterpret_cast<ReferencePlatform::PlatformData*>(context.getPlatformData());
+    return *((map<string, double>*) data->energyParameterDerivatives);
+}
+
+/**
+ * Get the index of slice[I,J] in the triangular layout used for slice flags.
+ */
+static int getSliceIndex(int subset1, int subset2) {
+    int i = min(subset1, subset2);
+    int j = max(subset1, subset2);
+    return j*(j+1)/2+i;
+}
+
+/**
+ * Compute the B-spline coefficients (and their derivatives) of the given order at a
+ * fractional grid offset dr.
+ */
+static void computeBSplines(int order, double dr, double* data, double* ddata) {
+    data[order-1] = 0.0;
+    data[1] = dr;
+    data[0] = 1.0-dr;
+    for (int i = 3; i < order; i++) {
+        double div = 1.0/(i-1.0);
+        data[i-1] = div*dr*data[i-2];
+        for (int j = 1; j < i-1; j++)
+            data[i-j-1] = div*((dr+j)*data[i-j-2]+(i-j-dr)*data[i-j-1]);
+        data[0] = div*(1.0-dr)*data[0];
+    }
+    ddata[0] = -data[0];
+    for (int i = 1; i < order; i++)
+        ddata[i] = data[i-1]-data[i];
+    double div = 1.0/(order-1);
+    data[order-1] = div*dr*data[order-2];
+    for (int j = 1; j < order-1; j++)
+        data[order-j-1] = div*((dr+j)*data[order-j-2]+(order-j-dr)*data[order-j-1]);
+    data[0] = div*(1.0-dr)*data[0];
+}
+
+/**
+ * Compute the moduli of the discrete Fourier transform of the B-splines along one axis.
+ */
+static void computeBSplineModuli(int order, int ndata, vector<double>& moduli) {
+    vector<double> data(order), ddata(order), bsplinesData(ndata, 0.0);
+    computeBSplines(order, 0.0, &data[0], &ddata[0]);
+    for (int i = 1; i <= order && i < ndata; i++)
+        bsplinesData[i] = data[i-1];
+    moduli.resize(ndata);
+    for (int i = 0; i < ndata; i++) {
+        double sc = 0.0;
+        double ss = 0.0;
+        for (int j = 0; j < ndata; j++) {
+            double arg = (2.0*M_PI*i*j)/ndata;
+            sc += bsplinesData[j]*cos(arg);
+            ss += bsplinesData[j]*sin(arg);
+        }
+        moduli[i] = sc*sc+ss*ss;
+    }
+    for (int i = 0; i < ndata; i++)
+        if (moduli[i] < 1.0e-7)
+            moduli[i] = (moduli[(i-1+ndata)%ndata]+moduli[(i+1)%ndata])*0.5;
+}
+
 ReferenceCalcSlicedPmeForceKernel::~ReferenceCalcSlicedPmeForceKernel() {
     if (neighborList != NULL)
         delete neighborList;
+    if (fft != NULL)
+        fftpack_destroy(fft);
 }
 
 void ReferenceCalcSlicedPmeForceKernel::initialize(const System& system, const SlicedPmeForce& force) {
@@ -81,6 +148,7 @@ void ReferenceCalcSlicedPmeForceKernel::initialize(const System& system, const S
         exceptionsWithOffsets.insert(exception);
     }
     numParticles = force.getNumParticles();
+    numSubsets = force.getNumSubsets();
     exclusions.resize(numParticles);
     vector<int> nb14s;
     map<int, int> nb14Index;
@@ -100,12 +168,13 @@ void ReferenceCalcSlicedPmeForceKernel::initialize(const System& system, const S
 
     num14 = nb14s.size();
     bonded14IndexArray.resize(num14, vector<int>(2));
-    bonded14ParamArray.resize(num14, vector<double>(3));
-    particleParamArray.resize(numParticles, vector<double>(3));
     particleCharges.resize(numParticles);
+    subsets.resize(numParticles);
     exceptionCharges.resize(num14);
-    for (int i = 0; i < numParticles; ++i)
+    for (int i = 0; i < numParticles; ++i) {
        particleCharges[i] = force.getParticleCharge(i);
+       subsets[i] = force.getParticleSubset(i);
+    }
     for (int i = 0; i < num14; ++i) {
         int particle1, particle2;
         force.getExceptionParameters(nb14s[i], particle1, particle2, exceptionCharges[i]);
@@ -128,40 +197,337 @@ void ReferenceCalcSlicedPmeForceKernel::initialize(const System& system, const S
     }
     nonbondedCutoff = force.getCutoffDistance();
     neighborList = new NeighborList();
+    neighborListPadding = 0.1*nonbondedCutoff;
+    lastNeighborListPadding = 0.0;
     double alpha;
     SlicedPmeForceImpl::calcPMEParameters(system, force, alpha, gridSize[0], gridSize[1], gridSize[2], false);
     ewaldAlpha = alpha;
+    pmeOrder = force.getPMEInterpolationOrder();
     exceptionsArePeriodic = force.getExceptionsUsePeriodicBoundaryConditions();
+    for (int dim = 0; dim < 3; dim++)
+        computeBSplineModuli(pmeOrder, gridSize[dim], bsplineModuli[dim]);
+    fftpack_init_3d(&fft, gridSize[0], gridSize[1], gridSize[2]);
+    sliceEnergies.resize(numSubsets, vector<double>(numSubsets, 0.0));
+    int numSlices = numSubsets*(numSubsets+1)/2;
+    sliceScalingParams.resize(numSlices);
+    sliceLambdas.resize(numSlices, 1.0);
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++)
+            sliceScalingParams[getSliceIndex(i, j)] = force.getSliceScalingParameter(i, j);
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
+        derivParams.push_back(force.getEnergyParameterDerivativeName(i));
 }
 
-double ReferenceCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal) {
+double ReferenceCalcSlicedPmeForceKernel::execute(ContextImpl& context, bool includeForces, bool includeEnergy, const vector<bool>& includeDirect, const vector<bool>& includeReciprocal) {
     computeParameters(context);
+    for (int slice = 0; slice < sliceLambdas.size(); slice++)
+        if (sliceScalingParams[slice] != "")
+            sliceLambdas[slice] = context.getParameter(sliceScalingParams[slice]);
     vector<Vec3>& posData = extractPositions(context);
     vector<Vec3>& forceData = extractForces(context);
-    double energy = 0;
-    ReferenceLJCoulombIxn clj;
-    computeNeighborListVoxelHash(*neighborList, numParticles, posData, exclusions, extractBoxVectors(context), true, nonbondedCutoff, 0.0);
-    clj.setUseCutoff(nonbondedCutoff, *neighborList, 1.0);
     Vec3* boxVectors = extractBoxVectors(context);
     double minAllowedSize = 1.999999*nonbondedCutoff;
     if (boxVectors[0][0] < minAllowedSize || boxVectors[1][1] < minAllowedSize || boxVectors[2][2] < minAllowedSize)
         throw OpenMMException("The periodic box size has decreased to less than twice the nonbonded cutoff.");
-    clj.setPeriodic(boxVectors);
-    clj.setPeriodicExceptions(exceptionsArePeriodic);
-    clj.setUsePME(ewaldAlpha, gridSize);
-    clj.calculatePairIxn(numParticles, posData, particleParamArray, exclusions, forceData, includeEnergy ? &energy : NULL, includeDirect, includeReciprocal);
-    if (includeDirect) {
-        ReferenceBondForce refBondForce;
-        ReferenceLJCoulomb14 nonbonded14;
-        if (exceptionsArePeriodic) {
-            Vec3* boxVectors = extractBoxVectors(context);
-            nonbonded14.setPeriodic(boxVectors);
+
+    // Each contribution is accumulated into the upper triangle of the slice energy matrix before
+    // being scaled, so the derivative with respect to a scaling parameter is the sum of the
+    // unscaled energies of the slices bound to it.
+
+    vector<vector<double> > energies(numSubsets, vector<double>(numSubsets, 0.0));
+    if (find(includeDirect.begin(), includeDirect.end(), true) != includeDirect.end())
+        computeDirect(posData, forceData, boxVectors, includeDirect, energies);
+    if (find(includeReciprocal.begin(), includeReciprocal.end(), true) != includeReciprocal.end())
+        computeReciprocal(posData, forceData, boxVectors, includeForces, includeReciprocal, energies);
+    map<string, double>& energyParamDerivs = extractEnergyParameterDerivatives(context);
+    double energy = 0;
+    for (int i = 0; i < numSubsets; i++)
+        for (int j = i; j < numSubsets; j++) {
+            int slice = getSliceIndex(i, j);
+            energy += sliceLambdas[slice]*energies[i][j];
+            if (includeEnergy)
+                sliceEnergies[i][j] = sliceEnergies[j][i] = energies[i][j];
+            for (auto& param : derivParams)
+                if (sliceScalingParams[slice] == param)
+                    energyParamDerivs[param] += energies[i][j];
         }
-        refBondForce.calculateForce(num14, bonded14IndexArray, posData, bonded14ParamArray, forceData, includeEnergy ? &energy : NULL, nonbonded14);
-    }
     return energy;
 }
 
+void ReferenceCalcSlicedPmeForceKernel::updateNeighborList(const vector<Vec3>& posData, const Vec3* boxVectors) {
+    // The list contains all pairs within the cutoff plus a padding, so it remains valid until
+    // some particle has moved more than half the padding or the periodic box has changed.
+
+    bool rebuild = (lastPositions.size() != numParticles);
+    for (int i = 0; i < 3 && !rebuild; i++)
+        rebuild = (boxVectors[i] != lastBoxVectors[i]);
+    double maxDisplacementSquared = 0.25*lastNeighborListPadding*lastNeighborListPadding;
+    for (int i = 0; i < numParticles && !rebuild; i++) {
+        Vec3 delta = posData[i]-lastPositions[i];
+        rebuild = (delta.dot(delta) > maxDisplacementSquared);
+    }
+    if (!rebuild)
+        return;
+
+    // The padded list must still fit in half the box.
+
+    double minBoxSize = min(boxVectors[0][0], min(boxVectors[1][1], boxVectors[2][2]));
+    lastNeighborListPadding = max(0.0, min(neighborListPadding, 0.4999*minBoxSize-nonbondedCutoff));
+    computeNeighborListVoxelHash(*neighborList, numParticles, posData, exclusions, boxVectors, true, nonbondedCutoff+lastNeighborListPadding, 0.0);
+    lastPositions = posData;
+    for (int i = 0; i < 3; i++)
+        lastBoxVectors[i] = boxVectors[i];
+}
+
+void ReferenceCalcSlicedPmeForceKernel::computeDirect(const vector<Vec3>& posData, vector<Vec3>& forceData, const Vec3* boxVectors, const vector<bool>& includeSlice, vector<vector<double> >& energies) {
+    const double twoOverSqrtPi = 2.0/sqrt(M_PI);
+    double deltaR[ReferenceForce::LastDeltaRIndex];
+
+    // Compute the interactions between pairs of particles within the cutoff.
+
+    updateNeighborList(posData, boxVectors);
+    double cutoffSquared = nonbondedCutoff*nonbondedCutoff;
+    for (auto& pair : *neighborList) {
+        int i = pair.first;
+        int j = pair.second;
+        int slice = getSliceIndex(subsets[i], subsets[j]);
+        if (!includeSlice[slice])
+            continue;
+        ReferenceForce::getDeltaRPeriodic(posData[j], posData[i], boxVectors, deltaR);
+        double r2 = deltaR[ReferenceForce::R2Index];
+        if (r2 >= cutoffSquared)
+            continue;
+        double r = deltaR[ReferenceForce::RIndex];
+        double alphaR = ewaldAlpha*r;
+        double prefactor = ONE_4PI_EPS0*charges[i]*charges[j]/r;
+        double erfcAlphaR = erfc(alphaR);
+        double dEdR = sliceLambdas[slice]*prefactor*(erfcAlphaR+alphaR*exp(-alphaR*alphaR)*twoOverSqrtPi)/r2;
+        for (int k = 0; k < 3; k++) {
+            double force = dEdR*deltaR[k];
+            forceData[i][k] += force;
+            forceData[j][k] -= force;
+        }
+        energies[min(subsets[i], subsets[j])][max(subsets[i], subsets[j])] += prefactor*erfcAlphaR;
+    }
+
+    // Subtract off the reciprocal space part of excluded interactions.
+
+    for (int i = 0; i < numParticles; i++)
+        for (int j : exclusions[i]) {
+            if (j < i || !includeSlice[getSliceIndex(subsets[i], subsets[j])])
+                continue;
+            ReferenceForce::getDeltaRPeriodic(posData[j], posData[i], boxVectors, deltaR);
+            double r = deltaR[ReferenceForce::RIndex];
+            double alphaR = ewaldAlpha*r;
+            double chargeProd = ONE_4PI_EPS0*charges[i]*charges[j];
+            double lambda = sliceLambdas[getSliceIndex(subsets[i], subsets[j])];
+            double energy;
+            if (alphaR > 1e-6) {
+                double erfAlphaR = erf(alphaR);
+                double dEdR = -lambda*chargeProd*(erfAlphaR-alphaR*exp(-alphaR*alphaR)*twoOverSqrtPi)/(r*r*r);
+                for (int k = 0; k < 3; k++) {
+                    double force = dEdR*deltaR[k];
+                    forceData[i][k] += force;
+                    forceData[j][k] -= force;
+                }
+                energy = -chargeProd*erfAlphaR/r;
+            }
+            else
+                energy = -chargeProd*ewaldAlpha*twoOverSqrtPi;
+            energies[min(subsets[i], subsets[j])][max(subsets[i], subsets[j])] += energy;
+        }
+
+    // Compute the exceptions.
+
+    for (int i = 0; i < num14; i++) {
+        int particle1 = bonded14IndexArray[i][0];
+        int particle2 = bonded14IndexArray[i][1];
+        int subset1 = subsets[particle1];
+        int subset2 = subsets[particle2];
+        int slice = getSliceIndex(subset1, subset2);
+        if (!includeSlice[slice])
+            continue;
+        if (exceptionsArePeriodic)
+            ReferenceForce::getDeltaRPeriodic(posData[particle2], posData[particle1], boxVectors, deltaR);
+        else
+            ReferenceForce::getDeltaR(posData[particle2], posData[particle1], deltaR);
+        double r = deltaR[ReferenceForce::RIndex];
+        double energy = ONE_4PI_EPS0*chargeProds[i]/r;
+        double dEdR = sliceLambdas[slice]*energy/(r*r);
+        for (int k = 0; k < 3; k++) {
+            double force = dEdR*deltaR[k];
+            forceData[particle1][k] += force;
+            forceData[particle2][k] -= force;
+        }
+        energies[min(subset1, subset2)][max(subset1, subset2)] += energy;
+    }
+}
+
+void ReferenceCalcSlicedPmeForceKernel::computeReciprocal(const vector<Vec3>& posData, vector<Vec3>& forceData, const Vec3* boxVectors, bool includeForces, const vector<bool>& includeSlice, vector<vector<double> >& energies) {
+    // A subset only needs to be placed on the grid if at least one of its slices is included.
+
+    vector<bool> includeSubset(numSubsets, false);
+    for (int j = 0; j < numSubsets; j++)
+        for (int i = 0; i <= j; i++)
+            if (includeSlice[getSliceIndex(i, j)])
+                includeSubset[i] = includeSubset[j] = true;
+
+    // The self energy of each particle belongs to the diagonal slice of its subset.
+
+    for (int i = 0; i < numParticles; i++)
+        if (includeSlice[getSliceIndex(subsets[i], subsets[i])])
+            energies[subsets[i]][subsets[i]] -= ONE_4PI_EPS0*ewaldAlpha/sqrt(M_PI)*charges[i]*charges[i];
+
+    // Compute the reciprocal box vectors.
+
+    double determinant = boxVectors[0][0]*boxVectors[1][1]*boxVectors[2][2];
+    double scale = 1.0/determinant;
+    Vec3 recipBoxVectors[3];
+    recipBoxVectors[0] = Vec3(boxVectors[1][1]*boxVectors[2][2], 0, 0)*scale;
+    recipBoxVectors[1] = Vec3(-boxVectors[1][0]*boxVectors[2][2], boxVectors[0][0]*boxVectors[2][2], 0)*scale;
+    recipBoxVectors[2] = Vec3(boxVectors[1][0]*boxVectors[2][1]-boxVectors[1][1]*boxVectors[2][0], -boxVectors[0][0]*boxVectors[2][1], boxVectors[0][0]*boxVectors[1][1])*scale;
+
+    // Spread the charges of each subset onto its own grid.
+
+    int gridPoints = gridSize[0]*gridSize[1]*gridSize[2];
+    vector<t_complex> grids(numSubsets*gridPoints);
+    for (auto& value : grids)
+        value.re = value.im = 0.0;
+    vector<int> gridIndex(3*numParticles);
+    vector<double> theta(3*pmeOrder*numParticles), dtheta(3*pmeOrder*numParticles);
+    const double epsilonFactor = sqrt(ONE_4PI_EPS0);
+    for (int i = 0; i < numParticles; i++) {
+        if (!includeSubset[subsets[i]])
+            continue;
+        Vec3 pos = posData[i];
+        double t[3];
+        t[0] = pos[0]*recipBoxVectors[0][0]+pos[1]*recipBoxVectors[1][0]+pos[2]*recipBoxVectors[2][0];
+        t[1] = pos[1]*recipBoxVectors[1][1]+pos[2]*recipBoxVectors[2][1];
+        t[2] = pos[2]*recipBoxVectors[2][2];
+        for (int dim = 0; dim < 3; dim++) {
+            t[dim] = (t[dim]-floor(t[dim]))*gridSize[dim];
+            int ti = (int) t[dim];
+            gridIndex[3*i+dim] = ti;
+            computeBSplines(pmeOrder, t[dim]-ti, &theta[(3*i+dim)*pmeOrder], &dtheta[(3*i+dim)*pmeOrder]);
+        }
+        double q = epsilonFactor*charges[i];
+        if (q == 0.0)
+            continue;
+        t_complex* grid = &grids[subsets[i]*gridPoints];
+        const double* thetaX = &theta[(3*i)*pmeOrder];
+        const double* thetaY = &theta[(3*i+1)*pmeOrder];
+        const double* thetaZ = &theta[(3*i+2)*pmeOrder];
+        for (int ix = 0; ix < pmeOrder; ix++) {
+            int xindex = (gridIndex[3*i]+ix) % gridSize[0];
+            for (int iy = 0; iy < pmeOrder; iy++) {
+                int yindex = (gridIndex[3*i+1]+iy) % gridSize[1];
+                double dxdy = q*thetaX[ix]*thetaY[iy];
+                for (int iz = 0; iz < pmeOrder; iz++) {
+                    int zindex = (gridIndex[3*i+2]+iz) % gridSize[2];
+                    grid[(xindex*gridSize[1]+yindex)*gridSize[2]+zindex].re += dxdy*thetaZ[iz];
+                }
+            }
+        }
+    }
+    for (int subset = 0; subset < numSubsets; subset++)
+        if (includeSubset[subset])
+            fftpack_exec_3d(fft, FFTPACK_FORWARD, &grids[subset*gridPoints], &grids[subset*gridPoints]);
+
+    // Compute the energy of every included slice from the structure factors of its two subsets.
+    // The potential felt by the particles of subset I is the sum of the structure factors of all
+    // subsets J for which slice[I,J] is included, convolved with the reciprocal space kernel.
+
+    const double recipScaleFactor = 1.0/(M_PI*determinant);
+    const double recipExpFactor = M_PI*M_PI/(ewaldAlpha*ewaldAlpha);
+    vector<t_complex> convolved(numSubsets*gridPoints);
+    for (int kx = 0; kx < gridSize[0]; kx++) {
+        int mx = (kx < (gridSize[0]+1)/2) ? kx : (kx-gridSize[0]);
+        double mhx = mx*recipBoxVectors[0][0];
+        double bx = bsplineModuli[0][kx];
+        for (int ky = 0; ky < gridSize[1]; ky++) {
+            int my = (ky < (gridSize[1]+1)/2) ? ky : (ky-gridSize[1]);
+            double mhy = mx*recipBoxVectors[1][0]+my*recipBoxVectors[1][1];
+            double by = bsplineModuli[1][ky];
+            for (int kz = 0; kz < gridSize[2]; kz++) {
+                int index = (kx*gridSize[1]+ky)*gridSize[2]+kz;
+                for (int subset = 0; subset < numSubsets; subset++)
+                    convolved[subset*gridPoints+index].re = convolved[subset*gridPoints+index].im = 0.0;
+                if (kx == 0 && ky == 0 && kz == 0)
+                    continue;
+                int mz = (kz < (gridSize[2]+1)/2) ? kz : (kz-gridSize[2]);
+                double mhz = mx*recipBoxVectors[2][0]+my*recipBoxVectors[2][1]+mz*recipBoxVectors[2][2];
+                double bz = bsplineModuli[2][kz];
+                double m2 = mhx*mhx+mhy*mhy+mhz*mhz;
+                double denom = m2*bx*by*bz;
+                double eterm = recipScaleFactor*exp(-recipExpFactor*m2)/denom;
+                for (int j = 0; j < numSubsets; j++) {
+                    const t_complex& gridj = grids[j*gridPoints+index];
+                    for (int i = 0; i < j; i++) {
+                        if (!includeSlice[getSliceIndex(i, j)])
+                            continue;
+                        const t_complex& gridi = grids[i*gridPoints+index];
+                        double weight = sliceLambdas[getSliceIndex(i, j)]*eterm;
+                        energies[i][j] += eterm*(gridi.re*gridj.re+gridi.im*gridj.im);
+                        convolved[i*gridPoints+index].re += weight*gridj.re;
+                        convolved[i*gridPoints+index].im += weight*gridj.im;
+                        convolved[j*gridPoints+index].re += weight*gridi.re;
+                        convolved[j*gridPoints+index].im += weight*gridi.im;
+                    }
+                    if (includeSlice[getSliceIndex(j, j)]) {
+                        double weight = sliceLambdas[getSliceIndex(j, j)]*eterm;
+                        energies[j][j] += 0.5*eterm*(gridj.re*gridj.re+gridj.im*gridj.im);
+                        convolved[j*gridPoints+index].re += weight*gridj.re;
+                        convolved[j*gridPoints+index].im += weight*gridj.im;
+                    }
+                }
+            }
+        }
+    }
+
+    // The remaining steps only contribute to the forces.
+
+    if (!includeForces)
+        return;
+    for (int subset = 0; subset < numSubsets; subset++)
+        if (includeSubset[subset])
+            fftpack_exec_3d(fft, FFTPACK_BACKWARD, &convolved[subset*gridPoints], &convolved[subset*gridPoints]);
+
+    // Interpolate the forces from the grid.
+
+    for (int i = 0; i < numParticles; i++) {
+        double q = epsilonFactor*charges[i];
+        if (q == 0.0 || !includeSubset[subsets[i]])
+            continue;
+        const t_complex* grid = &convolved[subsets[i]*gridPoints];
+        const double* thetaX = &theta[(3*i)*pmeOrder];
+        const double* thetaY = &theta[(3*i+1)*pmeOrder];
+        const double* thetaZ = &theta[(3*i+2)*pmeOrder];
+        const double* dthetaX = &dtheta[(3*i)*pmeOrder];
+        const double* dthetaY = &dtheta[(3*i+1)*pmeOrder];
+        const double* dthetaZ = &dtheta[(3*i+2)*pmeOrder];
+        double force[3] = {0.0, 0.0, 0.0};
+        for (int ix = 0; ix < pmeOrder; ix++) {
+            int xindex = (gridIndex[3*i]+ix) % gridSize[0];
+            for (int iy = 0; iy < pmeOrder; iy++) {
+                int yindex = (gridIndex[3*i+1]+iy) % gridSize[1];
+                for (int iz = 0; iz < pmeOrder; iz++) {
+                    int zindex = (gridIndex[3*i+2]+iz) % gridSize[2];
+                    double value = grid[(xindex*gridSize[1]+yindex)*gridSize[2]+zindex].re;
+                    force[0] += dthetaX[ix]*thetaY[iy]*thetaZ[iz]*value;
+                    force[1] += thetaX[ix]*dthetaY[iy]*thetaZ[iz]*value;
+                    force[2] += thetaX[ix]*thetaY[iy]*dthetaZ[iz]*value;
+                }
+            }
+        }
+        force[0] *= gridSize[0];
+        force[1] *= gridSize[1];
+        force[2] *= gridSize[2];
+        forceData[i][0] -= q*(force[0]*recipBoxVectors[0][0]);
+        forceData[i][1] -= q*(force[0]*recipBoxVectors[1][0]+force[1]*recipBoxVectors[1][1]);
+        forceData[i][2] -= q*(force[0]*recipBoxVectors[2][0]+force[1]*recipBoxVectors[2][1]+force[2]*recipBoxVectors[2][2]);
+    }
+}
+
 void ReferenceCalcSlicedPmeForceKernel::copyParametersToContext(ContextImpl& context, const SlicedPmeForce& force) {
     if (force.getNumParticles() != numParticles)
         throw OpenMMException("updateParametersInContext: The number of particles has changed");
@@ -189,8 +555,10 @@ void ReferenceCalcSlicedPmeForceKernel::copyParametersToContext(ContextImpl& con
 
     // Record the values.
 
-    for (int i = 0; i < numParticles; ++i)
+    for (int i = 0; i < numParticles; ++i) {
         particleCharges[i] = force.getParticleCharge(i);
+        subsets[i] = force.getParticleSubset(i);
+    }
     for (int i = 0; i < num14; ++i) {
         int particle1, particle2;
         force.getExceptionParameters(nb14s[i], particle1, particle2, exceptionCharges[i]);
@@ -206,10 +574,18 @@ void ReferenceCalcSlicedPmeForceKernel::getPMEParameters(double& alpha, int& nx,
     nz = gridSize[2];
 }
 
+string ReferenceCalcSlicedPmeForceKernel::getFFTBackend() const {
+    return "FFTPACK";
+}
+
+void ReferenceCalcSlicedPmeForceKernel::getSliceEnergies(vector<vector<double> >& energies) {
+    energies = sliceEnergies;
+}
+
 void ReferenceCalcSlicedPmeForceKernel::computeParameters(ContextImpl& context) {
     // Compute particle parameters.
 
-    vector<double> charges(numParticles);
+    charges.resize(numParticles);
     for (int i = 0; i < numParticles; i++)
         charges[i] = particleCharges[i];
     for (auto& offset : particleParamOffsets) {
@@ -217,25 +593,15 @@ void ReferenceCalcSlicedPmeForceKernel::computeParameters(ContextImpl& context)
         int index = offset.first.second;
         charges[index] += value*offset.second;
     }
-    for (int i = 0; i < numParticles; i++) {
-        particleParamArray[i][0] = 0.5;
-        particleParamArray[i][1] = 0.0;
-        particleParamArray[i][2] = charges[i];
-    }
 
     // Compute exception parameters.
 
-    charges.resize(num14);
+    chargeProds.resize(num14);
     for (int i = 0; i < num14; i++)
-        charges[i] = exceptionCharges[i];
+        chargeProds[i] = exceptionCharges[i];
     for (auto& offset : exceptionParamOffsets) {
         double value = context.getParameter(offset.first.first);
         int index = offset.first.second;
-        charges[index] += value*offset.second;
-    }
-    for (int i = 0; i < num14; i++) {
-        bonded14ParamArray[i][0] = 1.0;
-        bonded14ParamArray[i][1] = 0.0;
-        bonded14ParamArray[i][2] = charges[i];
+        chargeProds[index] += value*offset.second;
     }
-}
\ No newline at end of file
+}
@@ -35,8 +35,10 @@
 #include "PmeSlicingKernels.h"
 #include "openmm/Platform.h"
 #include "openmm/reference/ReferenceNeighborList.h"
+#include "openmm/reference/fftpack.h"
 #include <vector>
 #include <array>
+#include <set>
 #include <map>
 
 namespace PmeSlicing {
@@ -46,7 +48,8 @@ namespace PmeSlicing {
  */
 class ReferenceCalcSlicedPmeForceKernel : public CalcSlicedPmeForceKernel {
 public:
-    ReferenceCalcSlicedPmeForceKernel(std::string name, const OpenMM::Platform& platform) : CalcSlicedPmeForceKernel(name, platform) {
+    ReferenceCalcSlicedPmeForceKernel(std::string name, const OpenMM::Platform& platform) : CalcSlicedPmeForceKernel(name, platform),
+            neighborList(NULL), fft(NULL) {
     }
     ~ReferenceCalcSlicedPmeForceKernel();
     /**
@@ -62,10 +65,11 @@ public:
      * @param context        the context in which to execute this kernel
      * @param includeForces  true if forces should be calculated
      * @param includeEnergy  true if the energy should be calculated
-     * @param includeReciprocal  true if reciprocal space interactions should be included
+     * @param includeDirect  for each slice, whether its direct space interactions should be included
+     * @param includeReciprocal  for each slice, whether its reciprocal space interactions should be included
      * @return the potential energy due to the force
      */
-    double execute(OpenMM::ContextImpl& context, bool includeForces, bool includeEnergy, bool includeDirect, bool includeReciprocal);
+    double execute(OpenMM::ContextImpl& context, bool includeForces, bool includeEnergy, const std::vector<bool>& includeDirect, const std::vector<bool>& includeReciprocal);
     /**
      * Copy changed parameters over to a context.
      *
@@ -82,18 +86,40 @@ public:
      * @param nz      the number of grid points along the Z axis
      */
     void getPMEParameters(double& alpha, int& nx, int& ny, int& nz) const;
-private:
+    /**
+     * Get the name of the FFT backend used for reciprocal space calculations.
+     */
+    std::string getFFTBackend() const;
+    /**
+     * Get the unscaled energies of all slices computed in the most recent call to execute()
+     * in which the energy was requested.  They are not multiplied by the slice scaling parameters.
+     *
+     * @param energies   on exit, a symmetric numSubsets x numSubsets matrix whose element [I][J]
+     *                   is the energy of slice[I,J]
+     */
+    void getSliceEnergies(std::vector<std::vector<double> >& energies);
+protected:
     void computeParameters(OpenMM::ContextImpl& context);
-    int numParticles, num14;
+    void updateNeighborList(const std::vector<OpenMM::Vec3>& posData, const OpenMM::Vec3* boxVectors);
+    virtual void computeDirect(const std::vector<OpenMM::Vec3>& posData, std::vector<OpenMM::Vec3>& forceData, const OpenMM::Vec3* boxVectors, const std::vector<bool>& includeSlice, std::vector<std::vector<double> >& energies);
+    virtual void computeReciprocal(const std::vector<OpenMM::Vec3>& posData, std::vector<OpenMM::Vec3>& forceData, const OpenMM::Vec3* boxVectors, bool includeForces, const std::vector<bool>& includeSlice, std::vector<std::vector<double> >& energies);
+    int numParticles, num14, numSubsets, pmeOrder;
     std::vector<std::vector<int> >bonded14IndexArray;
-    std::vector<std::vector<double> > particleParamArray, bonded14ParamArray;
-    std::vector<double> particleCharges, exceptionCharges;
+    std::vector<int> subsets;
+    std::vector<double> particleCharges, exceptionCharges, charges, chargeProds;
+    std::vector<double> bsplineModuli[3];
+    std::vector<std::vector<double> > sliceEnergies;
+    std::vector<std::string> sliceScalingParams, derivParams;
+    std::vector<double> sliceLambdas;
     std::map<std::pair<std::string, int>, double> particleParamOffsets, exceptionParamOffsets;
-    double nonbondedCutoff, ewaldAlpha;
+    double nonbondedCutoff, ewaldAlpha, neighborListPadding, lastNeighborListPadding;
+    std::vector<OpenMM::Vec3> lastPositions;
+    OpenMM::Vec3 lastBoxVectors[3];
     int gridSize[3];
     bool exceptionsArePeriodic;
     std::vector<std::set<int> > exclusions;
     OpenMM::NeighborList* neighborList;
+    fftpack_t fft;
 };
 
 } // namespace PmeSlicing
@@ -37,6 +37,14 @@ from openmm import unit
     val[3] = unit.Quantity(val[3], unit.elementary_charge**2)
 %}
 
+%pythonappend PmeSlicing::SlicedPmeForce::getSliceEnergies(OpenMM::Context& context) %{
+    val = [[unit.Quantity(energy, unit.kilojoules_per_mole) for energy in row] for row in val]
+%}
+
+%pythonappend PmeSlicing::SlicedPmeForce::getStateEnergies(OpenMM::Context& context, PyObject* states) %{
+    val = [unit.Quantity(energy, unit.kilojoules_per_mole) for energy in val]
+%}
+
 /*
  * Convert C++ exceptions to Python exceptions.
 */
@@ -62,6 +70,7 @@ public:
     int getNumGlobalParameters() const;
     int getNumParticleParameterOffsets() const;
     int getNumExceptionParameterOffsets() const;
+    int getNumEnergyParameterDerivatives() const;
     double getCutoffDistance() const;
     void setCutoffDistance(double distance);
     double getEwaldErrorTolerance() const;
@@ -78,6 +87,10 @@ public:
     %clear int& nz;
 
     void setPMEParameters(double alpha, int nx, int ny, int nz);
+    int getPMEInterpolationOrder() const;
+    void setPMEInterpolationOrder(int order);
+    double getPMEGridMemoryLimit() const;
+    void setPMEGridMemoryLimit(double limit);
 
     %apply double& OUTPUT {double& alpha};
     %apply int& OUTPUT {int& nx};
@@ -89,6 +102,8 @@ public:
     %clear int& ny;
     %clear int& nz;
 
+    void tunePMEParameters(Context& context, int numEvaluations=10);
+
     int addParticle(double charge, int subset=0);
     int getParticleSubset(int index);
     void setParticleSubset(int index, int subset);
@@ -111,6 +126,8 @@ public:
     void setGlobalParameterName(int index, const std::string& name);
     double getGlobalParameterDefaultValue(int index) const;
     void setGlobalParameterDefaultValue(int index, double defaultValue);
+    void addEnergyParameterDerivative(const std::string& name);
+    const std::string& getEnergyParameterDerivativeName(int index) const;
     int addParticleParameterOffset(const std::string& parameter, int particleIndex, double chargeScale);
 
     %apply std::string& OUTPUT {std::string& parameter};
@@ -142,8 +159,19 @@ public:
     void setExceptionsUsePeriodicBoundaryConditions(bool periodic);
     int getSliceForceGroup(int subset1, int subset2) const;
     void setSliceForceGroup(int subset1, int subset2, int group);
+    const std::string& getSliceScalingParameter(int subset1, int subset2) const;
+    void setSliceScalingParameter(int subset1, int subset2, const std::string& parameter);
     bool getUseCudaFFT() const;
     void setUseCuFFT(bool use);
+    bool getUseNativeOpenCLFFT() const;
+    void setUseNativeOpenCLFFT(bool use);
+    bool getAutotuneFFT() const;
+    void setAutotuneFFT(bool autotune);
+    std::string getFFTBackendInContext(const Context& context) const;
+    const std::string& getVkFFTCacheDirectory() const;
+    void setVkFFTCacheDirectory(const std::string& directory);
+    const std::string& getOpenCLProgramCacheDirectory() const;
+    void setOpenCLProgramCacheDirectory(const std::string& directory);
 
     /*
      * Add methods for casting a Force to a SlicedPmeForce.
@@ -156,6 +184,70 @@ public:
         static bool isinstance(OpenMM::Force& force) {
             return (dynamic_cast<PmeSlicing::SlicedPmeForce*>(&force) != NULL);
         }
+
+        PyObject* getSliceEnergies(OpenMM::Context& context) {
+            std::vector<std::vector<double> > energies = self->getSliceEnergies(context);
+            PyObject* result = PyList_New(energies.size());
+            for (int i = 0; i < energies.size(); i++) {
+                PyObject* row = PyList_New(energies[i].size());
+                for (int j = 0; j < energies[i].size(); j++)
+                    PyList_SET_ITEM(row, j, PyFloat_FromDouble(energies[i][j]));
+                PyList_SET_ITEM(result, i, row);
+            }
+            return result;
+        }
+
+        PyObject* getStateEnergies(OpenMM::Context& context, PyObject* states) {
+            // Errors raised by the Python API are left set, and reported by returning NULL.
+            std::vector<std::map<std::string, double> > stateVec;
+            PyObject* iterator = PyObject_GetIter(states);
+            if (iterator == NULL)
+                throw OpenMM::OpenMMException("getStateEnergies: states must be a sequence of dicts");
+            PyObject* item;
+            bool failed = false;
+            while (!failed && (item = PyIter_Next(iterator)) != NULL) {
+                if (!PyDict_Check(item)) {
+                    PyErr_SetString(PyExc_Exception, "getStateEnergies: states must be a sequence of dicts");
+                    failed = true;
+                }
+                std::map<std::string, double> state;
+                PyObject *key, *value;
+                Py_ssize_t pos = 0;
+                while (!failed && PyDict_Next(item, &pos, &key, &value)) {
+                    PyObject* name = PyObject_Str(key);
+                    const char* nameString = (name == NULL ? NULL : PyUnicode_AsUTF8(name));
+                    if (nameString == NULL)
+                        failed = true;
+                    else {
+                        double parameterValue = PyFloat_AsDouble(value);
+                        if (parameterValue == -1.0 && PyErr_Occurred())
+                            failed = true;
+                        else
+                            state[nameString] = parameterValue;
+                    }
+                    Py_XDECREF(name);
+                }
+                if (!failed)
+                    stateVec.push_back(state);
+                Py_DECREF(item);
+            }
+            Py_DECREF(iterator);
+            if (failed || PyErr_Occurred())
+                return NULL;
+            std::vector<double> energies = self->getStateEnergies(context, stateVec);
+            PyObject* result = PyList_New(energies.size());
+            if (result == NULL)
+                return NULL;
+            for (int i = 0; i < energies.size(); i++) {
+                PyObject* energy = PyFloat_FromDouble(energies[i]);
+                if (energy == NULL) {
+                    Py_DECREF(result);
+                    return NULL;
+                }
+                PyList_SET_ITEM(result, i, energy);
+            }
+            return result;
+        }
     }
 };
 
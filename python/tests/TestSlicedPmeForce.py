@@ -12,6 +12,7 @@ TOL = 1.0E-3
 
 cases = [
     ('Reference', ''),
+    ('CPU', ''),
     ('CUDA', 'single'),
     ('CUDA', 'mixed'),
     ('CUDA', 'double'),
@@ -69,7 +70,7 @@ def testCoulomb(platformName, precision):
 
     integrator = mm.VerletIntegrator(0.01)
     platform = mm.Platform.getPlatformByName(platformName)
-    properties = {} if platformName == 'Reference' else {'Precision': precision}
+    properties = {} if platformName in ('Reference', 'CPU') else {'Precision': precision}
     context = mm.Context(system, integrator, platform, properties)
     positions = [mm.Vec3(0, 0, 0), mm.Vec3(2, 0, 0)]
     context.setPositions(positions)
@@ -129,10 +130,15 @@ def testLargeSystem(platformName, precision):
     assert nonbonded.getSliceForceGroup(0, 0) == -1
     assert nonbonded.getSliceForceGroup(1, 1) == -1
 
+    nonbonded.addGlobalParameter('lambda', 1.0)
+    nonbonded.setSliceScalingParameter(1, 0, 'lambda')
+    assert nonbonded.getSliceScalingParameter(0, 1) == 'lambda'
+    assert nonbonded.getSliceScalingParameter(0, 0) == ''
+
     system.addForce(nonbonded)
     integrator1 = mm.VerletIntegrator(0.01)
     integrator2 = mm.VerletIntegrator(0.01)
-    properties = {} if platformName == 'Reference' else {'Precision': precision}
+    properties = {} if platformName in ('Reference', 'CPU') else {'Precision': precision}
     context = mm.Context(system, integrator1, platform, properties)
     referenceContext = mm.Context(system, integrator2, reference)
     context.setPositions(positions)
@@ -150,3 +156,46 @@ def testLargeSystem(platformName, precision):
         ASSERT_EQUAL_VEC(state.getVelocities()[i], referenceState.getVelocities()[i], tol)
         ASSERT_EQUAL_VEC(state.getForces()[i], referenceState.getForces()[i], tol)
     ASSERT_EQUAL_TOL(state.getPotentialEnergy(), referenceState.getPotentialEnergy(), tol)
+
+
+@pytest.mark.parametrize('platformName, precision', cases, ids=ids)
+def testSliceEnergies(platformName, precision):
+    system = mm.System()
+    system.setDefaultPeriodicBoxVectors(mm.Vec3(4, 0, 0), mm.Vec3(0, 4, 0), mm.Vec3(0, 0, 4))
+    force = plugin.SlicedPmeForce(2)
+    for i, (charge, subset) in enumerate([(1.0, 0), (-1.0, 0), (0.5, 1), (-0.5, 1)]):
+        system.addParticle(1.0)
+        force.addParticle(charge, subset)
+    system.addForce(force)
+    integrator = mm.VerletIntegrator(0.01)
+    platform = mm.Platform.getPlatformByName(platformName)
+    properties = {} if platformName in ('Reference', 'CPU') else {'Precision': precision}
+    context = mm.Context(system, integrator, platform, properties)
+    context.setPositions([mm.Vec3(0, 0, 0), mm.Vec3(1, 0, 0), mm.Vec3(0, 1, 0), mm.Vec3(0, 0, 1.5)])
+    energies = force.getSliceEnergies(context)
+    ASSERT_EQUAL_TOL(energies[0][1], energies[1][0], TOL)
+    total = energies[0][0] + energies[0][1] + energies[1][1]
+    ASSERT_EQUAL_TOL(context.getState(getEnergy=True).getPotentialEnergy(), total, TOL)
+
+
+@pytest.mark.parametrize('platformName, precision', cases, ids=ids)
+def testStateEnergies(platformName, precision):
+    system = mm.System()
+    system.setDefaultPeriodicBoxVectors(mm.Vec3(4, 0, 0), mm.Vec3(0, 4, 0), mm.Vec3(0, 0, 4))
+    force = plugin.SlicedPmeForce(2)
+    for i, (charge, subset) in enumerate([(1.0, 0), (-1.0, 0), (0.5, 1), (-0.5, 1)]):
+        system.addParticle(1.0)
+        force.addParticle(charge, subset)
+    force.addGlobalParameter('lambda', 1.0)
+    force.setSliceScalingParameter(0, 1, 'lambda')
+    system.addForce(force)
+    integrator = mm.VerletIntegrator(0.01)
+    platform = mm.Platform.getPlatformByName(platformName)
+    properties = {} if platformName in ('Reference', 'CPU') else {'Precision': precision}
+    context = mm.Context(system, integrator, platform, properties)
+    context.setPositions([mm.Vec3(0, 0, 0), mm.Vec3(1, 0, 0), mm.Vec3(0, 1, 0), mm.Vec3(0, 0, 1.5)])
+    lambdas = [0.0, 0.5, 1.0]
+    energies = force.getStateEnergies(context, [{'lambda': value} for value in lambdas])
+    for value, energy in zip(lambdas, energies):
+        context.setParameter('lambda', value)
+        ASSERT_EQUAL_TOL(context.getState(getEnergy=True).getPotentialEnergy(), energy, TOL)
@@ -68,6 +68,8 @@ void SlicedPmeForceProxy::serialize(const void* object, SerializationNode& node)
     node.setIntProperty("nx", nx);
     node.setIntProperty("ny", ny);
     node.setIntProperty("nz", nz);
+    node.setIntProperty("pmeOrder", force.getPMEInterpolationOrder());
+    node.setDoubleProperty("pmeGridMemoryLimit", force.getPMEGridMemoryLimit());
     node.setDoubleProperty("ljAlpha", alpha);
     node.setIntProperty("ljnx", nx);
     node.setIntProperty("ljny", ny);
@@ -105,6 +107,16 @@ void SlicedPmeForceProxy::serialize(const void* object, SerializationNode& node)
         force.getExceptionParameters(i, particle1, particle2, chargeProd);
         exceptions.createChildNode("Exception").setIntProperty("p1", particle1).setIntProperty("p2", particle2).setDoubleProperty("q", chargeProd);
     }
+    SerializationNode& energyDerivs = node.createChildNode("EnergyParameterDerivatives");
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
+        energyDerivs.createChildNode("Parameter").setStringProperty("name", force.getEnergyParameterDerivativeName(i));
+    SerializationNode& sliceScalingParameters = node.createChildNode("sliceScalingParameters");
+    for (int i = 0; i < numSubsets; i++)
+        for (int j = i; j < numSubsets; j++) {
+            const string& parameter = force.getSliceScalingParameter(i, j);
+            if (parameter != "")
+                sliceScalingParameters.createChildNode("sliceScalingParameter").setIntProperty("subset1", i).setIntProperty("subset2", j).setStringProperty("parameter", parameter);
+        }
 }
 
 void* SlicedPmeForceProxy::deserialize(const SerializationNode& node) const {
@@ -127,6 +139,8 @@ void* SlicedPmeForceProxy::deserialize(const SerializationNode& node) const {
         int ny = node.getIntProperty("ny", 0);
         int nz = node.getIntProperty("nz", 0);
         force->setPMEParameters(alpha, nx, ny, nz);
+        force->setPMEInterpolationOrder(node.getIntProperty("pmeOrder", 5));
+        force->setPMEGridMemoryLimit(node.getDoubleProperty("pmeGridMemoryLimit", 0.0));
         alpha = node.getDoubleProperty("ljAlpha", 0.0);
         nx = node.getIntProperty("ljnx", 0);
         ny = node.getIntProperty("ljny", 0);
@@ -148,6 +162,14 @@ void* SlicedPmeForceProxy::deserialize(const SerializationNode& node) const {
         const SerializationNode& exceptions = node.getChildNode("Exceptions");
         for (auto& exception : exceptions.getChildren())
             force->addException(exception.getIntProperty("p1"), exception.getIntProperty("p2"), exception.getDoubleProperty("q"));
+        for (auto& child : node.getChildren()) {
+            if (child.getName() == "sliceScalingParameters")
+                for (auto& sliceScalingParameter : child.getChildren())
+                    force->setSliceScalingParameter(sliceScalingParameter.getIntProperty("subset1"), sliceScalingParameter.getIntProperty("subset2"), sliceScalingParameter.getStringProperty("parameter"));
+            if (child.getName() == "EnergyParameterDerivatives")
+                for (auto& parameter : child.getChildren())
+                    force->addEnergyParameterDerivative(parameter.getStringProperty("name"));
+        }
     }
     catch (...) {
         delete force;
@@ -53,6 +53,8 @@ void testSerialization() {
     double alpha = 0.5;
     int nx = 3, ny = 5, nz = 7;
     force.setPMEParameters(alpha, nx, ny, nz);
+    force.setPMEInterpolationOrder(6);
+    force.setPMEGridMemoryLimit(256.0);
     force.addParticle(1, 0);
     force.addParticle(0.5, 0);
     force.addParticle(-0.5, 1);
@@ -62,6 +64,8 @@ void testSerialization() {
     force.addGlobalParameter("scale2", 2.0);
     force.addParticleParameterOffset("scale1", 2, 1.5);
     force.addExceptionParameterOffset("scale2", 1, -0.1);
+    force.setSliceScalingParameter(0, 1, "scale1");
+    force.addEnergyParameterDerivative("scale1");
 
     // Serialize and then deserialize it.
 
@@ -75,8 +79,10 @@ void testSerialization() {
     ASSERT_EQUAL(force.getNumSubsets(), force2.getNumSubsets());
     ASSERT_EQUAL(force.getForceGroup(), force2.getForceGroup());
     for (int i = 0; i < force.getNumSubsets(); i++)
-        for (int j = 0; j < force.getNumSubsets(); j++)
+        for (int j = 0; j < force.getNumSubsets(); j++) {
             ASSERT_EQUAL(force.getSliceForceGroup(i,j), force2.getSliceForceGroup(i, j));
+            ASSERT_EQUAL(force.getSliceScalingParameter(i, j), force2.getSliceScalingParameter(i, j));
+        }
     ASSERT_EQUAL(force.getName(), force2.getName());
     ASSERT_EQUAL(force.getCutoffDistance(), force2.getCutoffDistance());
     ASSERT_EQUAL(force.getEwaldErrorTolerance(), force2.getEwaldErrorTolerance());
@@ -93,7 +99,12 @@ void testSerialization() {
     ASSERT_EQUAL(alpha, alpha2);
     ASSERT_EQUAL(nx, nx2);
     ASSERT_EQUAL(ny, ny2);
-    ASSERT_EQUAL(nz, nz2);    
+    ASSERT_EQUAL(nz, nz2);
+    ASSERT_EQUAL(force.getPMEInterpolationOrder(), force2.getPMEInterpolationOrder());
+    ASSERT_EQUAL(force.getPMEGridMemoryLimit(), force2.getPMEGridMemoryLimit());
+    ASSERT_EQUAL(force.getNumEnergyParameterDerivatives(), force2.getNumEnergyParameterDerivatives());
+    for (int i = 0; i < force.getNumEnergyParameterDerivatives(); i++)
+        ASSERT_EQUAL(force.getEnergyParameterDerivativeName(i), force2.getEnergyParameterDerivativeName(i));
     for (int i = 0; i < force.getNumGlobalParameters(); i++) {
         ASSERT_EQUAL(force.getGlobalParameterName(i), force2.getGlobalParameterName(i));
         ASSERT_EQUAL(force.getGlobalParameterDefaultValue(i), force2.getGlobalParameterDefaultValue(i));
@@ -41,6 +41,7 @@
 #include "sfmt/SFMT.h"
 #include <iostream>
 #include <iomanip>
+#include <set>
 #include <vector>
 
 using namespace PmeSlicing;
@@ -59,6 +60,84 @@ const double TOL = 1e-3;
         ASSERT_EQUAL_VEC(forces0[i], forces1[i], TOL); \
 }
 
+/**
+ * Build a cubic periodic system of alternating unit charges at random positions, assigned to the
+ * subsets in turn, and return its SlicedPmeForce.
+ */
+SlicedPmeForce* buildRandomSystem(System& system, vector<Vec3>& positions, int numParticles, int numSubsets, double L) {
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedPmeForce* force = new SlicedPmeForce(numSubsets);
+    force->setCutoffDistance(1.0);
+    positions.resize(numParticles);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numParticles; i++) {
+        system.addParticle(1.0);
+        force->addParticle(i%2 == 0 ? 1.0 : -1.0, i%numSubsets);
+        positions[i] = L*Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+    }
+    system.addForce(force);
+    return force;
+}
+
+/**
+ * Build a cubic periodic system of 150 neutral pairs of particles with random charges, and return
+ * its SlicedPmeForce.  The pairs are assigned to the subsets in turn.  If splitPairs is true, the
+ * second particle of each pair belongs to the next subset.  If chargedExceptions is true, every
+ * other pair has an exception with a nonzero charge product instead of an exclusion.
+ */
+SlicedPmeForce* buildDipoleSystem(System& system, vector<Vec3>& positions, int numSubsets, bool splitPairs, bool chargedExceptions) {
+    const int numMolecules = 150;
+    const double L = 5.0;
+    system.setDefaultPeriodicBoxVectors(Vec3(L, 0, 0), Vec3(0, L, 0), Vec3(0, 0, L));
+    SlicedPmeForce* force = new SlicedPmeForce(numSubsets);
+    force->setCutoffDistance(1.0);
+    positions.resize(2*numMolecules);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(0, sfmt);
+    for (int i = 0; i < numMolecules; i++) {
+        int subset = i%numSubsets;
+        double charge = 2*genrand_real2(sfmt)-1;
+        system.addParticle(1.0);
+        system.addParticle(1.0);
+        force->addParticle(charge, subset);
+        force->addParticle(-charge, splitPairs ? (subset+1)%numSubsets : subset);
+        force->addException(2*i, 2*i+1, chargedExceptions && i%2 == 1 ? -0.5*charge*charge : 0.0);
+        positions[2*i] = L*Vec3(genrand_real2(sfmt), genrand_real2(sfmt), genrand_real2(sfmt));
+        positions[2*i+1] = positions[2*i]+Vec3(0.1, 0, 0);
+    }
+    system.addForce(force);
+    return force;
+}
+
+/**
+ * Compute the forces and energy of a system in a newly created Context.
+ */
+State getStateInNewContext(const System& system, const vector<Vec3>& positions, Platform& platform) {
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    return context.getState(State::Forces | State::Energy);
+}
+
+/**
+ * Assert that two States agree to within a tolerance on the energy, and that every force differs from
+ * the expected one by less than a fraction of the RMS force.
+ */
+void assertStatesWithinRMS(const State& expected, const State& found, double energyTol, double forceTol) {
+    const vector<Vec3>& expectedForces = expected.getForces();
+    const vector<Vec3>& foundForces = found.getForces();
+    ASSERT_EQUAL_TOL(expected.getPotentialEnergy(), found.getPotentialEnergy(), energyTol);
+    double norm = 0.0;
+    for (int i = 0; i < expectedForces.size(); i++)
+        norm += expectedForces[i].dot(expectedForces[i]);
+    norm = sqrt(norm/expectedForces.size());
+    for (int i = 0; i < expectedForces.size(); i++) {
+        Vec3 delta = expectedForces[i]-foundForces[i];
+        ASSERT(sqrt(delta.dot(delta)) < forceTol*norm);
+    }
+}
+
 void testInstantiateFromNonbondedForce(Platform& platform) {
     NonbondedForce* force = new NonbondedForce();
     force->setNonbondedMethod(NonbondedForce::PME);
@@ -553,6 +632,403 @@ void testDirectAndReciprocal(Platform& platform) {
     ASSERT_EQUAL_TOL(e3, e4, 1e-5);
 }
 
+void testSliceEnergies(Platform& platform) {
+    const int numSubsets = 3;
+    System system;
+    vector<Vec3> positions;
+    SlicedPmeForce* force = buildDipoleSystem(system, positions, numSubsets, false, false);
+    const int numParticles = system.getNumParticles();
+    vector<double> charges(numParticles);
+    for (int i = 0; i < numParticles; i++)
+        charges[i] = force->getParticleCharge(i);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+
+    // The slice energies should form a symmetric matrix whose upper triangle adds up to the total energy.
+
+    vector<vector<double> > energies = force->getSliceEnergies(context);
+    ASSERT_EQUAL(numSubsets, energies.size());
+    double total = 0.0;
+    for (int i = 0; i < numSubsets; i++) {
+        ASSERT_EQUAL(numSubsets, energies[i].size());
+        for (int j = i; j < numSubsets; j++) {
+            ASSERT_EQUAL_TOL(energies[i][j], energies[j][i], 1e-6);
+            total += energies[i][j];
+        }
+    }
+    ASSERT_EQUAL_TOL(context.getState(State::Energy).getPotentialEnergy(), total, TOL);
+
+    // Switching off the charges of all but two subsets should leave only the slices between them.
+
+    for (int i = 0; i < numSubsets; i++)
+        for (int j = i; j < numSubsets; j++) {
+            for (int k = 0; k < numParticles; k++) {
+                int subset = force->getParticleSubset(k);
+                force->setParticleCharge(k, subset == i || subset == j ? charges[k] : 0.0);
+            }
+            force->updateParametersInContext(context);
+            double expected = energies[i][i];
+            if (j != i)
+                expected += energies[j][j]+energies[i][j];
+            ASSERT_EQUAL_TOL(expected, context.getState(State::Energy).getPotentialEnergy(), TOL);
+        }
+}
+
+void testSliceForceGroups(Platform& platform) {
+    const int numSubsets = 3;
+    System system;
+    vector<Vec3> positions;
+    SlicedPmeForce* force = buildDipoleSystem(system, positions, numSubsets, true, true);
+    const int numParticles = system.getNumParticles();
+    force->setSliceForceGroup(0, 1, 1);
+    force->setSliceForceGroup(1, 2, 2);
+    force->setSliceForceGroup(2, 2, 2);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+
+    // The energy of each force group should be the sum of the energies of its slices.
+
+    vector<vector<double> > energies = force->getSliceEnergies(context);
+    double expected[] = {energies[0][0]+energies[0][2], energies[0][1], energies[1][2]+energies[2][2]};
+    for (int group = 0; group < 3; group++)
+        ASSERT_EQUAL_TOL(expected[group], context.getState(State::Energy, false, 1<<group).getPotentialEnergy(), TOL);
+
+    // The forces of all groups should add up to the total force.
+
+    State state = context.getState(State::Energy | State::Forces);
+    vector<Vec3> forces(numParticles, Vec3());
+    double energy = 0.0;
+    for (int group = 0; group < 3; group++) {
+        State groupState = context.getState(State::Energy | State::Forces, false, 1<<group);
+        energy += groupState.getPotentialEnergy();
+        for (int i = 0; i < numParticles; i++)
+            forces[i] += groupState.getForces()[i];
+    }
+    ASSERT_EQUAL_TOL(state.getPotentialEnergy(), energy, TOL);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state.getForces()[i], forces[i], TOL);
+}
+
+void testSliceScalingParameters(Platform& platform) {
+    const int numSubsets = 3;
+    System system;
+    vector<Vec3> positions;
+    SlicedPmeForce* force = buildDipoleSystem(system, positions, numSubsets, true, true);
+    const int numParticles = system.getNumParticles();
+    force->addGlobalParameter("lambda01", 1.0);
+    force->addGlobalParameter("lambda22", 1.0);
+    force->setSliceScalingParameter(1, 0, "lambda01");
+    force->setSliceScalingParameter(2, 2, "lambda22");
+    ASSERT_EQUAL("lambda01", force->getSliceScalingParameter(0, 1));
+    ASSERT_EQUAL("", force->getSliceScalingParameter(1, 2));
+    force->setSliceForceGroup(0, 1, 1);
+    force->setSliceForceGroup(2, 2, 2);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    vector<vector<double> > energies1 = force->getSliceEnergies(context);
+    vector<State> states1;
+    for (int group = 0; group < 3; group++)
+        states1.push_back(context.getState(State::Energy | State::Forces, false, 1<<group));
+
+    // Changing the parameters should scale the energies and forces of the slices bound to them.
+
+    const double lambda[] = {1.0, 0.4, 0.7};
+    context.setParameter("lambda01", lambda[1]);
+    context.setParameter("lambda22", lambda[2]);
+    vector<vector<double> > energies2 = force->getSliceEnergies(context);
+    for (int i = 0; i < numSubsets; i++)
+        for (int j = 0; j < numSubsets; j++) {
+            double scale = (min(i, j) == 0 && max(i, j) == 1 ? lambda[1] : i == 2 && j == 2 ? lambda[2] : 1.0);
+            ASSERT_EQUAL_TOL(scale*energies1[i][j], energies2[i][j], TOL);
+        }
+    for (int group = 0; group < 3; group++) {
+        State state = context.getState(State::Energy | State::Forces, false, 1<<group);
+        ASSERT_EQUAL_TOL(lambda[group]*states1[group].getPotentialEnergy(), state.getPotentialEnergy(), TOL);
+        for (int i = 0; i < numParticles; i++)
+            ASSERT_EQUAL_VEC(states1[group].getForces()[i]*lambda[group], state.getForces()[i], TOL);
+    }
+}
+
+void testEnergyParameterDerivatives(Platform& platform) {
+    const int numSubsets = 3;
+    System system;
+    vector<Vec3> positions;
+    SlicedPmeForce* force = buildDipoleSystem(system, positions, numSubsets, true, true);
+    force->addGlobalParameter("lambda1", 1.0);
+    force->addGlobalParameter("lambda2", 1.0);
+    force->setSliceScalingParameter(0, 1, "lambda1");
+    force->setSliceScalingParameter(1, 2, "lambda1");
+    force->setSliceScalingParameter(2, 2, "lambda2");
+    force->addEnergyParameterDerivative("lambda1");
+    force->addEnergyParameterDerivative("lambda2");
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    vector<vector<double> > energies = force->getSliceEnergies(context);
+
+    // The energy is linear in the scaling parameters, so each derivative is the sum of the
+    // unscaled energies of the slices bound to the parameter, regardless of its value.
+
+    for (double lambda : {1.0, 0.3, 0.0}) {
+        context.setParameter("lambda1", lambda);
+        context.setParameter("lambda2", 1.0-lambda);
+        map<string, double> derivs = context.getState(State::ParameterDerivatives).getEnergyParameterDerivatives();
+        ASSERT_EQUAL_TOL(energies[0][1]+energies[1][2], derivs["lambda1"], TOL);
+        ASSERT_EQUAL_TOL(energies[2][2], derivs["lambda2"], TOL);
+    }
+}
+
+void testStateEnergies(Platform& platform) {
+    const int numSubsets = 3;
+    System system;
+    vector<Vec3> positions;
+    SlicedPmeForce* force = buildDipoleSystem(system, positions, numSubsets, true, true);
+    force->addGlobalParameter("lambda1", 0.5);
+    force->addGlobalParameter("lambda2", 1.0);
+    force->addGlobalParameter("charge", 0.0);
+    force->setSliceScalingParameter(0, 1, "lambda1");
+    force->setSliceScalingParameter(1, 2, "lambda1");
+    force->setSliceScalingParameter(2, 2, "lambda2");
+    force->addParticleParameterOffset("charge", 0, 0.5);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    vector<map<string, double> > states(4);
+    states[1]["lambda1"] = 0.0;
+    states[2]["lambda1"] = 1.0;
+    states[2]["lambda2"] = 0.25;
+    states[3]["lambda2"] = 0.0;
+    vector<double> stateEnergies = force->getStateEnergies(context, states);
+    ASSERT_EQUAL(states.size(), stateEnergies.size());
+
+    // Evaluating a state must not change the Context.
+
+    ASSERT_EQUAL(0.5, context.getParameter("lambda1"));
+    ASSERT_EQUAL(1.0, context.getParameter("lambda2"));
+
+    // Compare against setting each state in the Context and computing its energy directly.
+
+    for (int k = 0; k < states.size(); k++) {
+        context.setParameter("lambda1", states[k].count("lambda1") ? states[k]["lambda1"] : 0.5);
+        context.setParameter("lambda2", states[k].count("lambda2") ? states[k]["lambda2"] : 1.0);
+        double energy = context.getState(State::Energy).getPotentialEnergy();
+        ASSERT_EQUAL_TOL(energy, stateEnergies[k], TOL);
+    }
+
+    // A state cannot change a parameter used in parameter offsets.
+
+    states.assign(1, map<string, double>());
+    states[0]["charge"] = 1.0;
+    bool threwException = false;
+    try {
+        force->getStateEnergies(context, states);
+    }
+    catch (const exception& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+}
+
+void testEnergyOnly(Platform& platform) {
+    const int numSubsets = 2;
+    const int numParticles = 200;
+    const double L = 4.0;
+    System system;
+    vector<Vec3> positions;
+    SlicedPmeForce* force = buildRandomSystem(system, positions, numParticles, numSubsets, L);
+    force->addGlobalParameter("lambda", 0.5);
+    force->setSliceScalingParameter(0, 1, "lambda");
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+
+    // Skipping the forces must not change the energy, nor the forces computed afterward.
+
+    State state1 = context.getState(State::Forces | State::Energy);
+    double energy = context.getState(State::Energy).getPotentialEnergy();
+    State state2 = context.getState(State::Forces | State::Energy);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), energy, TOL);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], TOL);
+}
+
+void testMovingParticles(Platform& platform) {
+    // Move the particles by small and large amounts, and verify that the forces agree with
+    // those computed from scratch in a new Context.
+
+    const int numParticles = 300;
+    const double L = 3.0;
+    System system;
+    vector<Vec3> positions;
+    buildRandomSystem(system, positions, numParticles, 2, L);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    OpenMM_SFMT::SFMT sfmt;
+    init_gen_rand(1, sfmt);
+    for (double step : {0.0, 0.01, 0.01, 0.2, 0.01}) {
+        for (int i = 0; i < numParticles; i++)
+            positions[i] += step*Vec3(genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5, genrand_real2(sfmt)-0.5);
+        context.setPositions(positions);
+        State state = context.getState(State::Forces | State::Energy);
+        State state2 = getStateInNewContext(system, positions, platform);
+        ASSERT_EQUAL_TOL(state2.getPotentialEnergy(), state.getPotentialEnergy(), TOL);
+        for (int i = 0; i < numParticles; i++)
+            ASSERT_EQUAL_VEC(state2.getForces()[i], state.getForces()[i], TOL);
+    }
+}
+
+void testAutotuneFFT(Platform& platform) {
+    // Whichever FFT backend is chosen, the results must agree with those of the default one.
+
+    const int numSubsets = 2;
+    const int numParticles = 200;
+    const double L = 4.0;
+    System system;
+    vector<Vec3> positions;
+    SlicedPmeForce* force = buildRandomSystem(system, positions, numParticles, numSubsets, L);
+    State state1 = getStateInNewContext(system, positions, platform);
+    force->setAutotuneFFT(true);
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Forces | State::Energy);
+    set<string> backends = {"VkFFT", "cuFFT", "native", "FFTPACK", "CPU"};
+    ASSERT(backends.find(force->getFFTBackendInContext(context2)) != backends.end());
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), TOL);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], TOL);
+}
+
+void testTunePMEParameters(Platform& platform) {
+    // Tuning changes the cutoff and the PME parameters, but the results must still agree within
+    // the accuracy given by the error tolerance.
+
+    const int numSubsets = 3;
+    const int numParticles = 300;
+    const double L = 4.0;
+    System system;
+    vector<Vec3> positions;
+    SlicedPmeForce* force = buildRandomSystem(system, positions, numParticles, numSubsets, L);
+    force->setEwaldErrorTolerance(1e-4);
+    force->addGlobalParameter("lambda", 0.5);
+    force->setSliceScalingParameter(0, 1, "lambda");
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    context.setParameter("lambda", 0.7);
+    State state1 = context.getState(State::Forces | State::Energy);
+    force->tunePMEParameters(context, 2);
+    ASSERT(force->getCutoffDistance() >= 0.8-1e-10 && force->getCutoffDistance() <= 0.5*L+1e-10);
+    double alpha;
+    int nx, ny, nz;
+    force->getPMEParameters(alpha, nx, ny, nz);
+    ASSERT(alpha > 0.0);
+    ASSERT_EQUAL(0.7, context.getParameter("lambda"));
+    State state2 = context.getState(State::Forces | State::Energy);
+    assertStatesWithinRMS(state1, state2, 1e-3, 1e-2);
+}
+
+void testPMEInterpolationOrder(Platform& platform) {
+    // Every interpolation order must give results within the accuracy of the error tolerance,
+    // and the highest order must allow a coarser grid than the lowest one.
+
+    const int numSubsets = 2;
+    const int numParticles = 200;
+    const double L = 4.0;
+    System system;
+    vector<Vec3> positions;
+    SlicedPmeForce* force = buildRandomSystem(system, positions, numParticles, numSubsets, L);
+    force->setEwaldErrorTolerance(1e-4);
+    ASSERT_EQUAL(5, force->getPMEInterpolationOrder());
+    bool threwException = false;
+    try {
+        force->setPMEInterpolationOrder(9);
+    }
+    catch (const OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+    State state1 = getStateInNewContext(system, positions, platform);
+    int gridPoints[9];
+    for (int order = 4; order <= 8; order++) {
+        force->setPMEInterpolationOrder(order);
+        VerletIntegrator integrator2(0.001);
+        Context context2(system, integrator2, platform);
+        context2.setPositions(positions);
+        State state2 = context2.getState(State::Forces | State::Energy);
+        assertStatesWithinRMS(state1, state2, 1e-3, 1e-2);
+        double alpha;
+        int nx, ny, nz;
+        force->getPMEParametersInContext(context2, alpha, nx, ny, nz);
+        gridPoints[order] = nx*ny*nz;
+    }
+    ASSERT(gridPoints[8] < gridPoints[4]);
+}
+
+void testExplicitPMEParameters(Platform& platform) {
+    // Grid dimensions that were set explicitly and are already legal must be used unchanged, even
+    // where a slightly larger grid would be faster.
+
+    System system;
+    vector<Vec3> positions;
+    SlicedPmeForce* force = buildRandomSystem(system, positions, 100, 2, 4.0);
+    force->setPMEParameters(3.0, 49, 45, 48);
+    VerletIntegrator integrator(0.001);
+    Context context(system, integrator, platform);
+    double alpha;
+    int nx, ny, nz;
+    force->getPMEParametersInContext(context, alpha, nx, ny, nz);
+    ASSERT_EQUAL_TOL(3.0, alpha, 1e-6);
+    ASSERT_EQUAL(49, nx);
+    ASSERT_EQUAL(45, ny);
+    ASSERT_EQUAL(48, nz);
+}
+
+void testPMEGridMemoryLimit(Platform& platform) {
+    // A memory limit too small for even two subset grids forces the subsets to be processed one
+    // at a time, which must not change the energies, forces, or parameter derivatives.
+
+    const int numSubsets = 4;
+    System system;
+    vector<Vec3> positions;
+    SlicedPmeForce* force = buildDipoleSystem(system, positions, numSubsets, true, false);
+    const int numParticles = system.getNumParticles();
+    force->addGlobalParameter("lambda", 0.6);
+    force->setSliceScalingParameter(1, 3, "lambda");
+    force->addEnergyParameterDerivative("lambda");
+    ASSERT_EQUAL(0.0, force->getPMEGridMemoryLimit());
+    bool threwException = false;
+    try {
+        force->setPMEGridMemoryLimit(-1.0);
+    }
+    catch (const OpenMMException& ex) {
+        threwException = true;
+    }
+    ASSERT(threwException);
+    VerletIntegrator integrator1(0.001);
+    Context context1(system, integrator1, platform);
+    context1.setPositions(positions);
+    State state1 = context1.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+    vector<vector<double> > energies1 = force->getSliceEnergies(context1);
+    force->setPMEGridMemoryLimit(1e-6);
+    ASSERT_EQUAL(1e-6, force->getPMEGridMemoryLimit());
+    VerletIntegrator integrator2(0.001);
+    Context context2(system, integrator2, platform);
+    context2.setPositions(positions);
+    State state2 = context2.getState(State::Energy | State::Forces | State::ParameterDerivatives);
+    vector<vector<double> > energies2 = force->getSliceEnergies(context2);
+    ASSERT_EQUAL_TOL(state1.getPotentialEnergy(), state2.getPotentialEnergy(), TOL);
+    for (int i = 0; i < numParticles; i++)
+        ASSERT_EQUAL_VEC(state1.getForces()[i], state2.getForces()[i], TOL);
+    ASSERT_EQUAL_TOL(state1.getEnergyParameterDerivatives().at("lambda"), state2.getEnergyParameterDerivatives().at("lambda"), TOL);
+    for (int i = 0; i < numSubsets; i++)
+        for (int j = 0; j < numSubsets; j++)
+            ASSERT_EQUAL_TOL(energies1[i][j], energies2[i][j], TOL);
+}
+
 void runPlatformTests();
 
 extern "C" OPENMM_EXPORT void registerPmeSlicingReferenceKernelFactories();
@@ -571,6 +1047,18 @@ int main(int argc, char* argv[]) {
         testParameterOffsets(platform);
         testEwaldExceptions(platform);
         testDirectAndReciprocal(platform);
+        testSliceEnergies(platform);
+        testSliceForceGroups(platform);
+        testSliceScalingParameters(platform);
+        testEnergyParameterDerivatives(platform);
+        testStateEnergies(platform);
+        testEnergyOnly(platform);
+        testMovingParticles(platform);
+        testAutotuneFFT(platform);
+        testTunePMEParameters(platform);
+        testPMEInterpolationOrder(platform);
+        testExplicitPMEParameters(platform);
+        testPMEGridMemoryLimit(platform);
         runPlatformTests();
     }
     catch(const exception& e) {